@@ -237,6 +237,8 @@ struct apic_dev {
     uint64_t cycles_per_tick;
     uint8_t  timer_set;
     uint32_t current_ticks; // timeout currently being computed
+    uint8_t  tsc_deadline;  // timer is in TSC-deadline mode
+    uint64_t current_deadline; // cycle count it is armed for, 0 if none
     uint64_t timer_count;
     int      in_timer_interrupt;
     int      in_kick_interrupt;
@@ -376,6 +378,12 @@ void     apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks);
 typedef enum {UNCOND, IF_EARLIER, IF_LATER} nk_timer_condition_t;
 void     apic_update_oneshot_timer(struct apic_dev *apic,  uint32_t ticks, 
 				   nk_timer_condition_t cond);
+
+// as above, but for a timeout ns from now, which is exact in
+// TSC-deadline mode; -1 means no timeout is needed, which
+// disarms the timer in TSC-deadline mode
+void     apic_update_oneshot_timer_ns(struct apic_dev *apic, uint64_t ns,
+				      nk_timer_condition_t cond);
 			       
 
 
@@ -31,7 +31,7 @@
 #include <dev/virtqueue.h>
 #include <nautilus/nautilus.h>
 
-#define MAX_VIRTQS 4
+#define MAX_VIRTQS 64
 #define VIRTIO_MSI_NO_VECTOR 0xffff
 
 enum virtio_pci_dev_model {
@@ -38,6 +38,16 @@ struct nk_gc_pdsgc_stats
     uint64_t total_bytes;
     uint64_t min_block;
     uint64_t max_block;
+    // the world is stopped for pause_ns, which is mostly
+    // clear_ns + mark_ns + sweep_ns
+    uint64_t pause_ns;
+    uint64_t clear_ns;
+    uint64_t mark_ns;
+    uint64_t sweep_ns;
+    uint64_t num_cpus;          // cores that marked and swept
+    uint64_t blocks_marked;
+    uint64_t blocks_stolen;     // marked blocks scanned by another core
+    uint64_t mark_overflows;    // rescans due to full mark stacks
 };
 
 // Note that all the following functions stop the world
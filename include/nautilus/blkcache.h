@@ -0,0 +1,71 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __BLK_CACHE
+#define __BLK_CACHE
+
+// The block cache sits underneath nk_block_dev_read/write for
+// blocking requests on devices that do not opt out with
+// NK_BLOCK_DEV_FLAG_NO_CACHE.   Blocks are keyed by (device, block),
+// evicted by CLOCK, written back lazily, and sequential reads
+// trigger readahead.
+
+struct nk_block_dev;
+
+struct nk_block_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;       // blocks fetched ahead of use
+    uint64_t readahead_hits;  // ... that were later used
+    uint64_t writebacks;      // blocks written back to devices
+    uint64_t evictions;
+    uint64_t cached;          // valid blocks now
+    uint64_t dirty;           // dirty blocks now
+    uint64_t capacity;
+};
+
+int  nk_block_cache_init();
+
+// these follow the semantics of blocking nk_block_dev_read/write
+int  nk_block_cache_read(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *dest);
+int  nk_block_cache_write(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *src);
+
+// write back dirty blocks of the device (of all devices if dev is null)
+int  nk_block_cache_sync(struct nk_block_dev *dev);
+
+// write back dirty blocks in the range (count==0 => to end of device)
+int  nk_block_cache_sync_range(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count);
+
+// forget blocks in the range, dirty or not (count==0 => nothing)
+// used when a request bypasses the cache
+void nk_block_cache_discard(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count);
+// forget every block of the device (of all devices if dev is null)
+void nk_block_cache_discard_all(struct nk_block_dev *dev);
+
+// sync and forget everything about the device (it is going away)
+void nk_block_cache_detach(struct nk_block_dev *dev);
+
+void nk_block_cache_get_stats(struct nk_block_cache_stats *s);
+void nk_block_cache_reset_stats();
+
+#endif
@@ -26,9 +26,16 @@
 
 #include <nautilus/dev.h>
 
+// capabilities reported in characteristics
+#define NK_BLOCK_DEV_CAP_FLUSH    0x1   // FLUSH requests reach stable storage
+#define NK_BLOCK_DEV_CAP_DISCARD  0x2   // DISCARD requests are understood
+#define NK_BLOCK_DEV_CAP_DAX      0x4   // blocks are directly addressable (map)
+
 struct nk_block_dev_characteristics {
     uint64_t block_size;
     uint64_t num_blocks;
+    uint64_t caps;        // NK_BLOCK_DEV_CAP_*
+    uint64_t max_iov;     // most segments in one request, 0 => 1
 };
 
 
@@ -37,6 +44,32 @@ typedef enum {
     NK_BLOCK_DEV_STATUS_ERROR
 } nk_block_dev_status_t;
 
+typedef enum {
+    NK_BLOCK_DEV_OP_READ=0,
+    NK_BLOCK_DEV_OP_WRITE,
+    NK_BLOCK_DEV_OP_FLUSH,     // no blocks or segments
+    NK_BLOCK_DEV_OP_DISCARD,   // blocks, no segments
+} nk_block_dev_op_t;
+
+#define NK_BLOCK_DEV_MAX_IOV 16
+
+struct nk_block_dev_iov {
+    void     *addr;
+    uint64_t  len;       // a multiple of the block size
+};
+
+// A vectored request.  For reads and writes, the segments together
+// cover count blocks starting at blocknum
+struct nk_block_dev_req {
+    nk_block_dev_op_t        op;
+    uint64_t                 blocknum;
+    uint64_t                 count;
+    struct nk_block_dev_iov *iov;
+    uint64_t                 iovcnt;
+    void (*callback)(nk_block_dev_status_t status, void *context);
+    void                    *context;
+};
+
 struct nk_block_dev_int {
     // this must be first so it derives cleanly
     // from nk_dev_int
@@ -48,9 +81,30 @@ struct nk_block_dev_int {
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
     int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
     int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
+
+    // post requests in order, stopping when the device is full, and
+    // return how many were posted, or -1 on error if none were
+    int (*submit)(void *state, struct nk_block_dev_req *reqs, uint64_t count);
+    // the device may hold back requests posted by a plugged thread
+    // (get_cur_thread()->blk_plug is nonzero) so that they reach the
+    // hardware together; unplug must push out anything held back, and
+    // is called on every device at the thread's outermost unplug and
+    // whenever a plugged thread is about to wait for a request
+    void (*plug)(void *state);
+    void (*unplug)(void *state);
+    // complete whatever the device has finished, without waiting
+    // for its interrupt
+    void (*poll)(void *state);
+    // direct access - the address at which count blocks starting at
+    // blocknum can be read (and written) in place, valid for as long
+    // as the device exists
+    int (*map)(void *state, uint64_t blocknum, uint64_t count, void **addr);
 };
 
 
+// flags passed to nk_block_dev_register
+#define NK_BLOCK_DEV_FLAG_NO_CACHE 0x1   // do not put the block cache in front of this device
+
 struct nk_block_dev {
     // must be first member 
     struct nk_dev dev;
@@ -84,6 +138,50 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       void *state);
 
 
+// these bypass the block cache
+int nk_block_dev_read_uncached(struct nk_block_dev *dev, 
+			       uint64_t blocknum, 
+			       uint64_t count, 
+			       void   *dest, 
+			       nk_dev_request_type_t type,
+			       void (*callback)(nk_block_dev_status_t status, void *state), 
+			       void *state);
+
+int nk_block_dev_write_uncached(struct nk_block_dev *dev, 
+				uint64_t blocknum, 
+				uint64_t count, 
+				void   *src,  
+				nk_dev_request_type_t type,
+				void (*callback)(nk_block_dev_status_t status, void *state), 
+				void *state);
+
+
+// Vectored, callback-driven requests, bypassing the block cache.
+// Returns the number of requests posted (they are posted in order),
+// or -1 if none could be.   For devices without a submit interface,
+// requests are carried out with read_blocks/write_blocks.
+int nk_block_dev_submit(struct nk_block_dev *dev, struct nk_block_dev_req *reqs, uint64_t count);
+
+// hold back / release the calling thread's submissions for
+// batching; these nest, and must not be called from interrupt
+// context.  The plug covers all devices, not just dev, and the
+// blocking calls below release it before they wait
+void nk_block_dev_plug(struct nk_block_dev *dev);
+void nk_block_dev_unplug(struct nk_block_dev *dev);
+// push out whatever the calling thread's plug has held back, for
+// anyone about to wait for its own requests while plugged
+void nk_block_dev_flush_plug(void);
+
+// run completions the device has ready (for callers that poll)
+void nk_block_dev_poll(struct nk_block_dev *dev);
+
+// direct access to memory-backed devices (NK_BLOCK_DEV_CAP_DAX),
+// bypassing the block cache; -1 if the device cannot do it
+int nk_block_dev_map(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void **addr);
+
+// blocking conveniences
+int nk_block_dev_flush(struct nk_block_dev *dev);
+int nk_block_dev_discard(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count);
 
 #endif
 
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __BLK_RING
+#define __BLK_RING
+
+#include <nautilus/blkdev.h>
+
+// A block ring is an asynchronous interface to one block device,
+// owned by one thread.  The owner fills submission entries and hands
+// them to the device in batches; as requests finish, completion
+// entries carrying each request's tag appear on the completion
+// queue.  Completions can be waited for by sleeping, or, for
+// latency-critical callers (NK_BLOCK_RING_POLL), by polling the
+// device.   Requests go straight to the device, bypassing the
+// block cache (as nk_block_dev_submit does).
+
+#define NK_BLOCK_RING_POLL 0x1
+
+struct nk_block_ring;
+
+struct nk_block_ring_sqe {
+    nk_block_dev_op_t        op;
+    uint64_t                 blocknum;
+    uint64_t                 count;
+    struct nk_block_dev_iov *iov;      // need only be valid until submitted
+    uint64_t                 iovcnt;
+    uint64_t                 tag;      // returned in the completion
+};
+
+struct nk_block_ring_cqe {
+    uint64_t              tag;
+    nk_block_dev_status_t status;
+};
+
+// entries is rounded up to a power of two, and bounds both the
+// queued submissions and the requests in flight
+struct nk_block_ring *nk_block_ring_create(struct nk_block_dev *dev, uint32_t entries, uint64_t flags);
+// fails if requests are still in flight or unreaped
+int                   nk_block_ring_destroy(struct nk_block_ring *r);
+
+// next free submission entry, or null if the submission queue is full
+struct nk_block_ring_sqe *nk_block_ring_get_sqe(struct nk_block_ring *r);
+
+// fill out a submission entry; -1 if the submission queue is full
+int nk_block_ring_prep_readv(struct nk_block_ring *r, uint64_t blocknum, uint64_t count,
+			     struct nk_block_dev_iov *iov, uint64_t iovcnt, uint64_t tag);
+int nk_block_ring_prep_writev(struct nk_block_ring *r, uint64_t blocknum, uint64_t count,
+			      struct nk_block_dev_iov *iov, uint64_t iovcnt, uint64_t tag);
+int nk_block_ring_prep_flush(struct nk_block_ring *r, uint64_t tag);
+
+// hand queued submission entries to the device as one batch;
+// returns how many it took (entries it did not take stay queued),
+// or -1 if it failed the first one
+int nk_block_ring_submit(struct nk_block_ring *r);
+
+// take up to max completions, without waiting
+uint64_t nk_block_ring_reap(struct nk_block_ring *r, struct nk_block_ring_cqe *cqes, uint64_t max);
+
+// wait until at least min completions are available, then take up
+// to max of them; returns how many were taken, or -1 if fewer than
+// min requests are in flight
+int nk_block_ring_wait(struct nk_block_ring *r, struct nk_block_ring_cqe *cqes, uint64_t min, uint64_t max);
+
+// requests submitted whose completions have not been taken
+uint64_t nk_block_ring_inflight(struct nk_block_ring *r);
+
+#endif
@@ -31,6 +31,7 @@ uint32_t cpuid_ext_leaf_max(void);
 uint8_t cpuid_get_family(void);
 uint8_t cpuid_get_model(void);
 uint8_t cpuid_get_step(void);
+uint64_t cpuid_get_llc_size(void);
 void detect_cpu(void);
 
 #define CPUID_BASIC_INFO            0x0
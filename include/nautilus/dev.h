@@ -77,6 +77,7 @@ struct nk_dev *nk_dev_register(char *name, nk_dev_type_t type, uint64_t flags, s
 int            nk_dev_unregister(struct nk_dev *);
 
 struct nk_dev *nk_dev_find(char *name);
+void           nk_dev_for_each(nk_dev_type_t type, void (*func)(struct nk_dev *d, void *state), void *state);
 
 void nk_dev_wait(struct nk_dev*, int (*cond_check)(void *state), void *state);
 void nk_dev_signal(struct nk_dev *);
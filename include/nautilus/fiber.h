@@ -101,6 +101,7 @@ typedef struct nk_fiber {
   
   struct list_head sched_node; // sched queue node
   int curr_cpu;  // current cpu the fiber is on
+  int bound_cpu; // cpu it was explicitly placed on, never stolen from it (-1 => none)
 
   nk_fiber_fun_t fun; // routine the fiber will execute
   void *input;  // input for the fiber's routine
@@ -43,6 +43,12 @@ struct nk_fs_stat {
     uint64_t st_size;
 };
 
+// A piece of a file that can be accessed in place (see nk_fs_map)
+struct nk_fs_extent {
+    void     *addr;
+    uint64_t  len;
+};
+
 // Abstract base class for a filesystem interface
 struct nk_fs_int {
     int   (*stat_path)(void *state, char *path, struct nk_fs_stat *st);
@@ -56,6 +62,9 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    // fill in up to max extents covering n bytes from offset (or to the
+    // end of file), returning how many, or -1 if not directly accessible
+    ssize_t  (*map_file)(void *state, void *file, off_t offset, size_t n, struct nk_fs_extent *ext, uint64_t max);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -118,6 +127,16 @@ ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
 int        nk_fs_close(nk_fs_fd_t fd);
 
+// Direct access to a file on a memory-backed device (a ramdisk):
+// fills in up to max extents, in file order, that together cover
+// the file from offset for len bytes, or to the end of file, and
+// returns how many, or -1 if the file cannot be accessed in place.
+// The extents point into the device and stay valid while the
+// filesystem is attached.   Writing through them bypasses the
+// filesystem, and cannot grow the file.   Does not move the
+// file position.
+ssize_t    nk_fs_map(nk_fs_fd_t fd, off_t offset, size_t len, struct nk_fs_extent *ext, uint64_t max);
+
 
 void test_fs(void);
 void init_fs(void);
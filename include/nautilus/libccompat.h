@@ -52,7 +52,7 @@ typedef int clockid_t;
 #define CLOCK_TAI                       11
 
 //lua - ignore for now
-#define EOF 				0
+#define EOF 				(-1)
 #define EXIT_FAILURE			0
 #define EXIT_SUCCESS			1
 
@@ -180,6 +180,8 @@ int printf(const char *, ...);
 void *realloc(void *ptr, size_t size);
 int feof(FILE*);
 int getc(FILE*);
+int fgetc(FILE*);
+int putc(int, FILE*);
 
 
 int fileno(FILE*);
@@ -295,7 +297,7 @@ GEN_HDR(wmemset)
 //GEN_HDR(stdin)
 //GEN_HDR(fileno)
 GEN_HDR(__fxstat64)
-GEN_HDR(putc)
+//GEN_HDR(putc)
 GEN_HDR(__wcscoll_l)
 GEN_HDR(__towlower_l)
 GEN_HDR(wctob)
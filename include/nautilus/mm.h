@@ -81,8 +81,15 @@ void mm_boot_free(void *addr, ulong_t size);
 
 /* KMEM FUNCTIONS */
 
+struct kmem_cache_magazine;
+
 struct kmem_data {
     struct list_head ordered_regions;
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    // per-size-class magazines of free blocks owned by this CPU
+    // only ever touched by the owning CPU with interrupts off
+    struct kmem_cache_magazine *cache;
+#endif
 };
 
 int nk_kmem_init(void);
@@ -116,6 +123,10 @@ void   kmem_free(void * addr);
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags);
 // set the flags of an allocated block
 int  kmem_set_block_flags(void *block_addr, uint64_t flags);
+// find the block containing addr and atomically or flag into its flags
+// returns -1 if there is no such block, 1 if flag was already set, 0 if
+// we set it, and so is safe for concurrent markers
+int  kmem_find_and_mark_block(void *any_addr, uint64_t flag, void **block_addr, uint64_t *block_size);
 // apply an mask to all the blocks (and mask unless or=1)
 int  kmem_mask_all_blocks_flags(uint64_t mask, int ormask);
 
@@ -125,6 +136,9 @@ void kmem_get_internal_pointer_range(void **start, void **end);
 
 // check to see if the masked flags match the given flags
 int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state);
+// the same, restricted to part (0..num_parts-1) of the blocks, so that
+// num_parts cores can cover all blocks in parallel
+int  kmem_apply_to_matching_blocks_part(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state, uint64_t part, uint64_t num_parts);
 
 int  kmem_sanity_check();
 
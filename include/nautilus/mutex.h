@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+
+// An adaptive sleeping lock for threads.  A contender spins for as
+// long as the owner is running on another cpu (it is likely to
+// release the lock soon), and otherwise sleeps on the mutex's wait
+// queue.   An uncontended lock or unlock is a single atomic.
+//
+// From interrupt context, or with preemption disabled, a contender
+// can only spin.
+
+typedef struct nk_mutex {
+    // 0 => unlocked, 1 => locked, 2 => locked and may have sleepers
+    volatile uint32_t           state;
+    struct nk_thread * volatile owner;
+    nk_wait_queue_t            *wait_queue;
+} nk_mutex_t;
+
+int  nk_mutex_init(nk_mutex_t *m);
+int  nk_mutex_deinit(nk_mutex_t *m);
+
+void nk_mutex_lock(nk_mutex_t *m);
+// 0 if acquired, nonzero if not
+int  nk_mutex_try_lock(nk_mutex_t *m);
+void nk_mutex_unlock(nk_mutex_t *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -65,8 +65,27 @@ nk_mwait (uint32_t eax, uint32_t ecx)
                     
 }
 
+/*
+ * as above, but enables interrupts first; the sti shadow assures
+ * that an interrupt cannot arrive between the two, so an interrupt
+ * that becomes pending after the caller last checked for work
+ * ends the mwait instead of being handled before it
+ */
+static inline void 
+nk_sti_mwait (uint32_t eax, uint32_t ecx)
+{
+    asm volatile ("sti; mwait"
+                  : /* no outputs */
+                  : "a" (eax),
+                    "c" (ecx)
+                  : "memory");
+}
+
 int nk_mwait_init(void);
 
+// nonzero if monitor/mwait can be used
+int nk_mwait_available(void);
+
 
 #ifdef __cplusplus
 }
@@ -207,6 +207,9 @@ void *nk_low_level_memset_word(void *dest, short data, size_t count);
 void *nk_low_level_memcpy(void *dest, char *src, size_t count);
 void *nk_low_level_memcpy_word(void *dest, short *src, size_t count);
 
+// select memcpy/memset/etc strategies based on cpu features
+void nk_string_init(void);
+
 			  
 #ifdef __cplusplus
 }
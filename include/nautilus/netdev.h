@@ -41,6 +41,24 @@ typedef enum {
     NK_NET_DEV_STATUS_ERROR
 } nk_net_dev_status_t;
 
+// one piece of a packet that is gathered from several buffers
+struct nk_net_dev_sg {
+    uint8_t  *addr;
+    uint64_t  len;
+};
+
+// most pieces a gathered send may have
+#define NK_NET_DEV_MAX_SG 16
+
+// one buffer of a burst of sends or receives, each with its own
+// completion callback
+struct nk_net_dev_burst {
+    uint8_t  *buf;
+    uint64_t  len;
+    void     (*callback)(nk_net_dev_status_t status, void *context);
+    void     *context;
+};
+
 struct nk_net_dev_int {
     // this must be first so it derives cleanly
     // from nk_dev_int
@@ -53,6 +71,12 @@ struct nk_net_dev_int {
     // callback can be null
     int (*post_receive)(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
     int (*post_send)(void *state, uint8_t *src, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // gathered send - the buffers must remain untouched until the callback
+    int (*post_send_sg)(void *state, struct nk_net_dev_sg *sg, uint64_t count, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // bursts post count buffers with a single notification of the device
+    // returns the number actually posted (fewer if the device is full), -1 on error
+    int (*post_send_burst)(void *state, struct nk_net_dev_burst *b, uint64_t count);
+    int (*post_receive_burst)(void *state, struct nk_net_dev_burst *b, uint64_t count);
 };
 
 
@@ -88,6 +112,29 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
                                             void *state),  // for callback reqs
 			   void *state);                  // for callback reqs
 
+// send a packet gathered from count buffers (at most NK_NET_DEV_MAX_SG)
+// for nonblocking and callback requests, the buffers must be left
+// alone until the send completes
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev, 
+			      struct nk_net_dev_sg *sg,
+			      uint64_t count,
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status, 
+					       void *state),  // for callback reqs
+			      void *state);                  // for callback reqs
+
+// post a burst of sends or receives, each completing via its callback
+// returns the number of buffers posted, which may be fewer than count
+// (even zero) if the device runs out of room, or -1 on error
+// devices without burst support get one post per buffer
+int nk_net_dev_send_burst(struct nk_net_dev *dev,
+			  struct nk_net_dev_burst *b,
+			  uint64_t count);
+
+int nk_net_dev_receive_burst(struct nk_net_dev *dev,
+			     struct nk_net_dev_burst *b,
+			     uint64_t count);
+
 
 #endif
 
@@ -66,6 +66,7 @@ struct mem_region {
 
     /* used by the kernel memory allocator */
     struct buddy_mempool * mm_state;
+    struct kmem_zone_map * kmem_map;
 
     struct list_head entry;
 
@@ -46,6 +46,43 @@ int nk_rwlock_wr_unlock_irq_restore(nk_rwlock_t * l, uint8_t flags);
 
 void nk_rwlock_test(void);
 
+
+// A reader-biased ("big reader") rwlock after BRAVO.  While the lock
+// is biased toward readers, a reader only increments a counter in a
+// cache line of its own cpu.  A writer revokes the bias and drains
+// those counters, and readers then use the central lock until the
+// bias is restored, which is held off for a multiple of what the
+// revocation cost, so write-heavy use degrades gracefully to an
+// ordinary rwlock.  Writers are preferred over slow-path readers.
+//
+// Read lock returns a ticket that must be handed to the read unlock.
+// This may be done on a different cpu.
+
+struct nk_brwlock_slot {
+    volatile uint64_t readers;
+} __attribute__((aligned(64)));
+
+struct nk_brwlock {
+    volatile int            rbias;
+    uint64_t                inhibit_until;   // cycle count
+
+    spinlock_t              lock;
+    volatile int            writer;
+    volatile uint64_t       readers;         // on the slow path
+
+    uint64_t                nslots;
+    struct nk_brwlock_slot *slots;           // one per cpu
+};
+
+typedef struct nk_brwlock nk_brwlock_t;
+
+int  nk_brwlock_init(nk_brwlock_t * l);
+int  nk_brwlock_deinit(nk_brwlock_t * l);
+int  nk_brwlock_rd_lock(nk_brwlock_t * l);
+void nk_brwlock_rd_unlock(nk_brwlock_t * l, int ticket);
+void nk_brwlock_wr_lock(nk_brwlock_t * l);
+void nk_brwlock_wr_unlock(nk_brwlock_t * l);
+
 #ifdef __cplusplus
 }
 #endif
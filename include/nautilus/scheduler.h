@@ -139,6 +139,13 @@ int    nk_sched_make_runnable(struct nk_thread *thread, int cpu, int admit);
 
 // force a scheduling event on the CPU
 void   nk_sched_kick_cpu(int cpu);
+void   nk_sched_kick_others();
+
+// Called by the idle thread: wait in mwait until this CPU has
+// something to run, or an interrupt arrives.  A kick to a CPU that
+// is waiting this way is a memory write instead of an IPI.
+// nonzero return => mwait is not available, and nothing was done
+int    nk_sched_idle_wait(void);
 
 // Put the thread to sleep / awaken it
 // these signal the scheduler that the thread is now on a 
@@ -203,6 +210,12 @@ void nk_sched_stop_world();
 struct nk_thread *nk_sched_get_cur_thread_on_cpu(int cpu);
 void nk_sched_start_world();
 
+// While the caller has the world stopped, run func on all cores
+// (including the caller) and wait for all of them to finish.  The
+// other cores run it in interrupt context with interrupts off.
+// Returns -1 (and runs nothing) if the caller has not stopped the world
+int  nk_sched_stopped_world_run(void (*func)(void *state), void *state);
+
 
 // Invoked by interrupt handler wrapper and other code
 // to cause thread context switches
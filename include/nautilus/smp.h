@@ -58,14 +58,51 @@ typedef void (*nk_xcall_func_t)(void * arg);
 typedef uint32_t cpu_id_t;
 
 
+// xcalls to a cpu are queued on its ring, which any number of
+// cpus may post to concurrently
+#define NK_XCALL_RING_SIZE 128 // must be a power of two
+
 struct nk_xcall {
-    nk_queue_entry_t xcall_node;
-    void * data;
+    volatile uint64_t seq;          // ring slot state
     nk_xcall_func_t fun;
-    uint8_t xcall_done;
-    uint8_t has_waiter;
+    void * data;
+    volatile uint64_t * done;       // completion counter, if waited on
 };
 
+struct nk_xcall_ring {
+    volatile uint64_t head __attribute__((aligned(64)));
+    volatile uint64_t tail __attribute__((aligned(64)));
+    volatile uint64_t kicked __attribute__((aligned(64))); // IPI is in flight
+    struct nk_xcall   slot[NK_XCALL_RING_SIZE] __attribute__((aligned(64)));
+};
+
+typedef struct nk_cpu_mask {
+    uint64_t bits[(NAUT_CONFIG_MAX_CPUS+63)/64];
+} nk_cpu_mask_t;
+
+static inline void nk_cpu_mask_zero(nk_cpu_mask_t *m)
+{
+    int i;
+    for (i=0;i<sizeof(m->bits)/sizeof(m->bits[0]);i++) {
+        m->bits[i] = 0;
+    }
+}
+
+static inline void nk_cpu_mask_set(nk_cpu_mask_t *m, cpu_id_t cpu)
+{
+    m->bits[cpu/64] |= 1ULL << (cpu%64);
+}
+
+static inline void nk_cpu_mask_clear(nk_cpu_mask_t *m, cpu_id_t cpu)
+{
+    m->bits[cpu/64] &= ~(1ULL << (cpu%64));
+}
+
+static inline int nk_cpu_mask_test(nk_cpu_mask_t *m, cpu_id_t cpu)
+{
+    return !!(m->bits[cpu/64] & (1ULL << (cpu%64)));
+}
+
 
 #ifdef NAUT_CONFIG_PROFILE
     struct nk_instr_data;
@@ -113,8 +150,7 @@ struct cpu {
 
     struct nk_sched_percpu_state *sched_state;
 
-    nk_queue_t * xcall_q;
-    struct nk_xcall xcall_nowait_info;
+    struct nk_xcall_ring * xcall_ring;
 
     ulong_t cpu_khz; 
     
@@ -156,6 +192,10 @@ struct ap_init_area {
 int smp_early_init(struct naut_info * naut);
 int smp_bringup_aps(struct naut_info * naut);
 int smp_xcall(cpu_id_t cpu_id, nk_xcall_func_t fun, void * arg, uint8_t wait);
+// run on every cpu in the mask (including the caller if it is set)
+int smp_xcall_mask(nk_cpu_mask_t * mask, nk_xcall_func_t fun, void * arg, uint8_t wait);
+// run on every cpu except the caller
+int smp_xcall_broadcast(nk_xcall_func_t fun, void * arg, uint8_t wait);
 void smp_ap_entry (struct cpu * core);
 int smp_setup_xcall_bsp (struct cpu * core);
 
@@ -65,14 +65,16 @@ struct nk_task {
 
 
 // create and queue a task
-// cpu == -1 => any cpu
+// cpu == -1 => this cpu, other cpus will steal it if they are idle
 // size == 0 => unknown size, otherwise worst case run time in ns
 // null return indicated the task cannot be queued
 struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void * (*f)(void*), void *input, uint64_t flags);
 
 // dequeue a task, typically used internally
 // dequeuing a task does not execute it.
-// cpu = -1 => any cpu
+// cpu = -1 => steal from the closest cpu that has work
+//             (unsized tasks only; sized tasks come from a random cpu)
+// cpu = my cpu => newest task first
 // size = 0 => unsized first, then sized
 // size > 0 => search sized queue for up to search_limit steps
 struct nk_task *nk_task_consume(int cpu, uint64_t size, uint64_t search_limit);
@@ -209,6 +209,8 @@ struct nk_thread {
 
     uint8_t is_idle;
 
+    uint32_t blk_plug;  // nesting depth of nk_block_dev_plug calls
+
     void **output_loc;  // where the thread should write output
     void * output;      // our capture of the thread output (from exit)
     void * input;
@@ -47,7 +47,10 @@ typedef struct nk_timer {
     void              (*callback)(void *priv);
     void              *priv;
     struct list_head  node;            // global list of all timers
-    struct list_head  active_node;     // global list of active timers
+    struct list_head  active_node;     // slot in a cpu's timer wheel
+    uint32_t          wheel_cpu;       // cpu whose wheel holds us when active
+    uint16_t          wheel_level;
+    uint16_t          wheel_slot;
 } nk_timer_t;
 
 nk_timer_t *nk_timer_create(char *name);
@@ -106,4 +109,9 @@ void nk_timer_dump_timers();
 // called again at the latest.
 uint64_t nk_timer_handler(void);
 
+// Earliest time (ns, absolute) at which this cpu's timers need
+// attention, or -1 if none.   The scheduler folds this into its
+// one-shot timer so that it never sleeps past a timer.
+uint64_t nk_timer_next_deadline(void);
+
 #endif
@@ -0,0 +1,139 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __NK_WSDEQUE
+#define __NK_WSDEQUE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+//
+// Fixed-size Chase-Lev work-stealing deque
+//
+// A single owner pushes and pops at the bottom (LIFO), while any
+// number of thieves steal from the top (FIFO).  Owner operations
+// must never run concurrently with each other - if the owner is a cpu
+// rather than a thread, do them with interrupts off.
+//
+// This relies on x64 ordering (TSO): stores are not reordered with
+// stores, and loads are not reordered with loads, so only the owner's
+// pop needs a full fence.
+//
+
+#define NK_WSDEQUE_SIZE 1024   // must be a power of two
+#define NK_WSDEQUE_MASK (NK_WSDEQUE_SIZE-1)
+
+typedef struct nk_wsdeque {
+    volatile sint64_t  top      __attribute__((aligned(64)));
+    volatile sint64_t  bottom   __attribute__((aligned(64)));
+    void *volatile     items[NK_WSDEQUE_SIZE] __attribute__((aligned(64)));
+} nk_wsdeque_t;
+
+
+static inline void nk_wsdeque_init(nk_wsdeque_t *d)
+{
+    d->top = d->bottom = 0;
+}
+
+// approximate when not called by the owner
+static inline sint64_t nk_wsdeque_size(nk_wsdeque_t *d)
+{
+    sint64_t n = d->bottom - d->top;
+    return n < 0 ? 0 : n;
+}
+
+// owner only; returns nonzero if the deque is full
+static inline int nk_wsdeque_push(nk_wsdeque_t *d, void *item)
+{
+    sint64_t b = d->bottom;
+    sint64_t t = d->top;
+
+    if (b - t >= NK_WSDEQUE_SIZE) {
+	return -1;
+    }
+
+    d->items[b & NK_WSDEQUE_MASK] = item;
+    __asm__ __volatile__ ("" : : : "memory");
+    d->bottom = b + 1;
+
+    return 0;
+}
+
+// owner only; newest item first, or null if empty
+static inline void *nk_wsdeque_pop(nk_wsdeque_t *d)
+{
+    sint64_t b = d->bottom - 1;
+    sint64_t t;
+    void *item;
+
+    d->bottom = b;
+    // the store to bottom must be visible before we read top
+    __sync_synchronize();
+    t = d->top;
+
+    if (t > b) {
+	// empty
+	d->bottom = b + 1;
+	return 0;
+    }
+
+    item = d->items[b & NK_WSDEQUE_MASK];
+
+    if (t == b) {
+	// last one, so race with thieves for it
+	if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+	    item = 0;
+	}
+	d->bottom = b + 1;
+    }
+
+    return item;
+}
+
+// anyone; oldest item first, or null if empty or we lost a race
+static inline void *nk_wsdeque_steal(nk_wsdeque_t *d)
+{
+    sint64_t t = d->top;
+    __asm__ __volatile__ ("" : : : "memory");
+    sint64_t b = d->bottom;
+    void *item;
+
+    if (t >= b) {
+	return 0;
+    }
+
+    item = d->items[t & NK_WSDEQUE_MASK];
+
+    if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+	return 0;
+    }
+
+    return item;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -77,6 +77,13 @@ int nk_net_ethernet_agent_device_receive_packet(struct nk_net_dev *dev,
 
 struct nk_net_dev *nk_net_ethernet_agent_get_underlying_device(struct nk_net_ethernet_agent *agent);
 
+// the agent device a received packet would be delivered to, if any
+// devices registered for the packet's type take precedence over
+// custom filters
+struct nk_net_dev *nk_net_ethernet_agent_match(struct nk_net_ethernet_agent *agent, nk_ethernet_packet_t *packet);
+
+void nk_net_ethernet_agent_dump_stats(struct nk_net_ethernet_agent *agent);
+
 
 int  nk_net_ethernet_agent_init();
 void nk_net_ethernet_agent_deinit();
@@ -74,6 +74,8 @@ typedef struct nk_ethernet_packet {
 #define htonl(x) ntohl(x)
 
 // allocate a packet with an affinity for the given cpu (-1 => any)
+// the packet comes from the calling cpu's cache, and the affinity
+// decides where new packets are allocated when the pool must grow
 // allocating a packet will also acquire it (refcount => 1 ).
 // until the packet is released for the final time, the node field can be used
 // by the caller
@@ -84,6 +86,22 @@ void nk_net_ethernet_acquire_packet(nk_ethernet_packet_t *packet);
 // the final release will free the packet
 void nk_net_ethernet_release_packet(nk_ethernet_packet_t *packet);
 
+struct nk_net_ethernet_packet_stats {
+    uint64_t total;       // packets that exist
+    uint64_t in_use;      // ... allocated and not yet released
+    uint64_t depot;       // ... in the shared depot
+    uint64_t cached;      // ... in per-cpu caches
+    uint64_t allocs;
+    uint64_t releases;
+    uint64_t depot_gets;  // batches moved from depot to a cpu
+    uint64_t depot_puts;  // batches moved from a cpu to the depot
+    uint64_t grows;       // packets ever allocated from memory
+    uint64_t shrinks;     // packets ever freed back to memory
+};
+
+void nk_net_ethernet_packet_get_stats(struct nk_net_ethernet_packet_stats *stats);
+void nk_net_ethernet_packet_dump_stats();
+
 // called by BSP at bootstrap *after* kmem setup is done
 int  nk_net_ethernet_packet_init();
 
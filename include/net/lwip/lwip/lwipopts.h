@@ -35,4 +35,12 @@
 #define DEFAULT_UDP_RECVMBOX_SIZE 128
 #define DEFAULT_TCP_RECVMBOX_SIZE 128
 #define DEFAULT_ACCEPTMBOX_SIZE   128
+
+// received ethernet packets are handed to the stack as custom
+// pbufs that refer to the packet instead of being copied
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+// number of received packets that can be in the stack at once
+// without being copied
+#define ETHERNETIF_RX_PBUFS 256
 #endif
@@ -347,6 +347,8 @@ init (unsigned long mbd,
     
     detect_cpu();
 
+    nk_string_init();
+
     /* setup the temporary boot-time allocator */
     mm_boot_init(mbd);
 
@@ -69,6 +69,8 @@ nk_mwait_init (void)
 {
     cpuid_ret_t ret;
 
+    memset(&mwait, 0, sizeof(mwait));
+
     if (has_mwait()) {
         printk("Processor supports MONITOR/MWAIT extensions\n");
         mwait.available = 1;
@@ -77,8 +79,6 @@ nk_mwait_init (void)
         return 0;
     }
 
-    memset(&mwait, 0, sizeof(mwait));
-
     cpuid(0x5, &ret);
 
     mwait.min_line_size = ret.a & 0xffff;
@@ -97,3 +97,10 @@ nk_mwait_init (void)
 
     return 0;
 }
+
+
+int
+nk_mwait_available (void)
+{
+    return mwait.available;
+}
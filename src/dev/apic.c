@@ -486,6 +486,16 @@ apic_timer_setup (struct apic_dev * apic, uint32_t quantum_ms)
 
     calibrate_apic_timer(apic);
 
+#ifdef NAUT_CONFIG_APIC_TSC_DEADLINE
+    if (tscdeadline) {
+	APIC_DEBUG("Using TSC-deadline mode for APIC 0x%x\n", apic->id);
+	apic->tsc_deadline = 1;
+	apic_write(apic, APIC_REG_LVTT, APIC_TIMER_TSCDLINE | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
+	// the mode change must land before the first deadline is written
+	mbarrier();
+    }
+#endif
+
     apic_set_oneshot_timer(apic,apic_realtime_to_ticks(apic,quantum_ms*1000000ULL));
 }
 
@@ -959,8 +969,70 @@ apic_init (struct cpu * core)
 
 
 
+//
+// In TSC-deadline mode, the timer is armed with an absolute cycle
+// count instead of a count of bus ticks, which takes one MSR write,
+// is exact, and can be disarmed entirely (deadline of zero)
+//
+static void apic_set_deadline(struct apic_dev *apic, uint64_t deadline)
+{
+    msr_write(IA32_MSR_TSC_DEADLINE, deadline);
+    apic->timer_set = 1;
+    apic->current_deadline = deadline;
+}
+
+// no deadline (zero) is later than any other
+#define DEADLINE_KEY(d) ((d) ? (d) : -1ULL)
+
+static void apic_update_deadline(struct apic_dev *apic, uint64_t deadline,
+				 nk_timer_condition_t cond)
+{
+    if (!apic->timer_set || cond==UNCOND ||
+	(cond==IF_EARLIER && DEADLINE_KEY(deadline) < DEADLINE_KEY(apic->current_deadline)) ||
+	(cond==IF_LATER && DEADLINE_KEY(deadline) > DEADLINE_KEY(apic->current_deadline))) {
+	apic_set_deadline(apic,deadline);
+    }
+}
+
+static inline uint64_t ticks_to_deadline(struct apic_dev *apic, uint32_t ticks)
+{
+    return rdtsc() + (ticks ? ticks : 1) * apic->cycles_per_tick;
+}
+
+static inline uint64_t ns_to_deadline(struct apic_dev *apic, uint64_t ns)
+{
+    if (ns >= -1ULL / apic->cycles_per_us) {
+	// includes -1, and is as good as never anyway
+	return 0;
+    }
+    return rdtsc() + apic_realtime_to_cycles(apic,ns);
+}
+
+static inline uint32_t ns_to_ticks(struct apic_dev *apic, uint64_t ns)
+{
+    if (ns >= (0xffffffffULL * apic->ps_per_tick) / 1000ULL) {
+	// the longest count stands in for no timeout
+	return -1;
+    }
+    return apic_realtime_to_ticks(apic,ns);
+}
+
+static void apic_set_oneshot_timer_ns(struct apic_dev *apic, uint64_t ns)
+{
+    if (apic->tsc_deadline) {
+	apic_set_deadline(apic,ns_to_deadline(apic,ns));
+    } else {
+	apic_set_oneshot_timer(apic,ns_to_ticks(apic,ns));
+    }
+}
+
 void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks) 
 {
+    if (apic->tsc_deadline) {
+	apic_set_deadline(apic,ticks_to_deadline(apic,ticks));
+	return;
+    }
+
     apic_write(apic, APIC_REG_LVTT, APIC_TIMER_ONESHOT | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
     apic_write(apic, APIC_REG_TMDCR, APIC_TIMER_DIVCODE);
 
@@ -975,7 +1047,9 @@ void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks)
 void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
 			       nk_timer_condition_t cond)
 {
-    if (!apic->timer_set) { 
+    if (apic->tsc_deadline) {
+	apic_update_deadline(apic,ticks_to_deadline(apic,ticks),cond);
+    } else if (!apic->timer_set) { 
 	apic_set_oneshot_timer(apic,ticks);
     } else {
 	switch (cond) { 
@@ -995,6 +1069,18 @@ void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
     // note that this is set at the entry to null_kick
     apic->in_kick_interrupt=0;
 }
+
+void apic_update_oneshot_timer_ns(struct apic_dev *apic, uint64_t ns,
+				  nk_timer_condition_t cond)
+{
+    if (apic->tsc_deadline) {
+	apic_update_deadline(apic,ns_to_deadline(apic,ns),cond);
+	apic->in_timer_interrupt=0;
+	apic->in_kick_interrupt=0;
+    } else {
+	apic_update_oneshot_timer(apic,ns_to_ticks(apic,ns),cond);
+    }
+}
 	    
 
 
@@ -1379,12 +1465,9 @@ static int apic_timer_handler(excp_entry_t * excp, excp_vec_t vec, void *state)
     // as far as the next interrupt or cooperative rescheduling request,
     // breaking real-time semantics.  
 
-    if (time_to_next_ns == -1) { 
-	// indicates "infinite", which we turn into the maximum timer count
-	apic_set_oneshot_timer(apic,-1);
-    } else {
-	apic_set_oneshot_timer(apic,apic_realtime_to_ticks(apic,time_to_next_ns));
-    }
+    // -1 indicates "infinite", which disarms the timer in TSC-deadline
+    // mode, and otherwise becomes the maximum timer count
+    apic_set_oneshot_timer_ns(apic,time_to_next_ns);
 
     IRQ_HANDLER_END();
 
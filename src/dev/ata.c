@@ -364,7 +364,7 @@ static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *
 	  s->blkdev->dev.name, blocknum, count);
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	STATE_UNLOCK(s);
 	ERROR("Illegal access past end of disk\n");
 	return -1;
@@ -387,7 +387,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 	  s->blkdev->dev.name, blocknum, count);
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	STATE_UNLOCK(s);
 	ERROR("Illegal access past end of disk\n");
 	return -1;
@@ -401,6 +401,91 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
     }
 }
 
+static int ata_flush(struct ata_blkdev_state *s)
+{
+    uint8_t devnum = s->channel * 2 + s->id;
+
+    DEBUG("flush on device %u\n",devnum);
+
+    if (ata_wait(s,0)) { 
+	ERROR("Wait failed - resetting drive\n");
+	ata_reset(s);
+	return -1;
+    }
+
+    outb(0x40 | (s->id << 4), DRIVEHEAD(devnum));
+    outb(0xea,CMDSTATUS(devnum)); // FLUSH CACHE EXT
+
+    if (ata_wait(s,0)) { 
+	ERROR("Flush failed - resetting drive\n");
+	ata_reset(s);
+	return -1;
+    }
+
+    return 0;
+}
+
+// carry out one request, segment by segment, with the lock held
+static int do_request(struct ata_blkdev_state *s, struct nk_block_dev_req *r)
+{
+    uint64_t i, block, n, left;
+    uint8_t *buf;
+
+    switch (r->op) {
+    case NK_BLOCK_DEV_OP_FLUSH:
+	return ata_flush(s);
+    case NK_BLOCK_DEV_OP_DISCARD:
+	return r->blocknum+r->count > s->num_blocks ? -1 : 0;
+    default:
+	break;
+    }
+
+    if (r->blocknum+r->count > s->num_blocks) {
+	ERROR("Illegal access past end of disk\n");
+	return -1;
+    }
+
+    for (i=0, block=r->blocknum; i<r->iovcnt; i++) {
+	buf = r->iov[i].addr;
+	for (left = r->iov[i].len/s->block_size; left; left -= n) {
+	    // a command moves at most 64K sectors
+	    n = left > 65536 ? 65536 : left;
+	    if (ata_lba48_read_write(s, block, n, buf, r->op==NK_BLOCK_DEV_OP_WRITE)) {
+		return -1;
+	    }
+	    block += n;
+	    buf += n*s->block_size;
+	}
+    }
+
+    return 0;
+}
+
+// requests complete as they are submitted
+static int submit(void *state, struct nk_block_dev_req *reqs, uint64_t count)
+{
+    STATE_LOCK_CONF;
+    struct ata_blkdev_state *s = (struct ata_blkdev_state *)state;
+    uint64_t i;
+    int rc;
+
+    DEBUG("submit of %lu requests on device %s\n", count, s->blkdev->dev.name);
+
+    for (i=0;i<count;i++) {
+	STATE_LOCK(s);
+	rc = do_request(s,&reqs[i]);
+	STATE_UNLOCK(s);
+	if (rc) {
+	    return i ? i : -1;
+	}
+	if (reqs[i].callback) {
+	    reqs[i].callback(NK_BLOCK_DEV_STATUS_SUCCESS,reqs[i].context);
+	}
+    }
+
+    return count;
+}
+
 static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
 {
     STATE_LOCK_CONF;
@@ -409,6 +494,7 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
     STATE_LOCK(s);
     c->block_size = s->block_size;
     c->num_blocks = s->num_blocks;
+    c->caps = NK_BLOCK_DEV_CAP_FLUSH;
     STATE_UNLOCK(s);
     return 0;
 }
@@ -419,6 +505,7 @@ static struct nk_block_dev_int inter =
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .submit = submit,
 };
 
 static void discover_device(int channel, int id)
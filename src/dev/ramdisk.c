@@ -39,9 +39,13 @@
 #define STATE_LOCK(state) _state_lock_flags = spin_lock_irq_save(&state->lock)
 #define STATE_UNLOCK(state) spin_unlock_irq_restore(&(state->lock), _state_lock_flags)
 
+// The geometry and the image never move once the disk is registered,
+// so reads (and maps) need no lock and run concurrently.  The lock
+// only keeps writes from interleaving with each other.
+
 struct ramdisk_state {
     struct nk_block_dev *blkdev;
-    spinlock_t lock;
+    spinlock_t lock;      // serializes writers
     uint64_t len;
     uint64_t block_size;
     uint64_t num_blocks;
@@ -51,32 +55,26 @@ struct ramdisk_state {
 
 static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
 {
-    STATE_LOCK_CONF;
     struct ramdisk_state *s = (struct ramdisk_state *)state;
     
-    STATE_LOCK(s);
     c->block_size = s->block_size;
     c->num_blocks = s->num_blocks;
-    STATE_UNLOCK(s);
+    c->caps = NK_BLOCK_DEV_CAP_DAX;
     return 0;
 }
 
 static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(nk_block_dev_status_t, void *), void *context)
 {
-    STATE_LOCK_CONF;
     struct ramdisk_state *s = (struct ramdisk_state *)state;
 
     DEBUG("read_blocks on device %s starting at %lu for %lu blocks\n",
 	  s->blkdev->dev.name, blocknum, count);
 
-    STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
-	STATE_UNLOCK(s);
+    if (blocknum+count > s->num_blocks) { 
 	ERROR("Illegal access past end of disk\n");
 	return -1;
     } else {
 	memcpy(dest,s->data+blocknum*s->block_size,s->block_size*count);
-	STATE_UNLOCK(s);
 	//nk_dump_mem(dest,s->block_size*count);
 	if (callback) {
 	    callback(NK_BLOCK_DEV_STATUS_SUCCESS,context);
@@ -94,7 +92,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 	  s->blkdev->dev.name, blocknum, count);
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	STATE_UNLOCK(s);
 	ERROR("Illegal access past end of disk\n");
 	return -1;
@@ -110,11 +108,94 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 
 
 
+// copy between the disk and the request's segments
+static int do_request(struct ramdisk_state *s, struct nk_block_dev_req *r)
+{
+    STATE_LOCK_CONF;
+    uint64_t i, off, len = 0;
+
+    if (r->op == NK_BLOCK_DEV_OP_FLUSH) {
+	return 0;
+    }
+
+    if (r->blocknum+r->count > s->num_blocks) {
+	ERROR("Illegal access past end of disk\n");
+	return -1;
+    }
+
+    if (r->op == NK_BLOCK_DEV_OP_DISCARD) {
+	return 0;
+    }
+
+    for (i=0;i<r->iovcnt;i++) {
+	len += r->iov[i].len;
+    }
+
+    if (len != r->count*s->block_size) {
+	ERROR("Segments do not match request size\n");
+	return -1;
+    }
+
+    off = r->blocknum*s->block_size;
+
+    if (r->op == NK_BLOCK_DEV_OP_READ) {
+	for (i=0;i<r->iovcnt;i++) {
+	    memcpy(r->iov[i].addr,s->data+off,r->iov[i].len);
+	    off += r->iov[i].len;
+	}
+    } else {
+	STATE_LOCK(s);
+	for (i=0;i<r->iovcnt;i++) {
+	    memcpy(s->data+off,r->iov[i].addr,r->iov[i].len);
+	    off += r->iov[i].len;
+	}
+	STATE_UNLOCK(s);
+    }
+
+    return 0;
+}
+
+// requests complete as they are submitted
+static int submit(void *state, struct nk_block_dev_req *reqs, uint64_t count)
+{
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+    uint64_t i;
+
+    DEBUG("submit of %lu requests on device %s\n", count, s->blkdev->dev.name);
+
+    for (i=0;i<count;i++) {
+	if (do_request(s,&reqs[i])) {
+	    return i ? i : -1;
+	}
+	if (reqs[i].callback) {
+	    reqs[i].callback(NK_BLOCK_DEV_STATUS_SUCCESS,reqs[i].context);
+	}
+    }
+
+    return count;
+}
+
+static int map(void *state, uint64_t blocknum, uint64_t count, void **addr)
+{
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+
+    if (blocknum+count > s->num_blocks) { 
+	ERROR("Illegal map past end of disk\n");
+	return -1;
+    }
+
+    *addr = s->data+blocknum*s->block_size;
+
+    return 0;
+}
+
 static struct nk_block_dev_int inter = 
 {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .submit = submit,
+    .map = map,
 };
 
 static int discover_ramdisks()
@@ -142,7 +223,7 @@ static int discover_ramdisks()
     s->num_blocks = s->len / s->block_size;
     s->data = &__RAMDISK_START;
 
-    s->blkdev = nk_block_dev_register("ramdisk0", 0, &inter, s);
+    s->blkdev = nk_block_dev_register("ramdisk0", NK_BLOCK_DEV_FLAG_NO_CACHE, &inter, s);
 
     if (!s->blkdev) {
 	ERROR("Failed to register ramdisk\n");
@@ -52,19 +52,25 @@
 
 #define VIRTIO_BLK_OFF_CONFIG(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 
-#define VIRTIO_BLK_REQUEST_QUEUE  0 // virtqueue index 
-
 #define VIRTIO_BLK_T_IN           0 // read request
 #define VIRTIO_BLK_T_OUT          1 // write request
 #define VIRTIO_BLK_T_FLUSH        4 // flush request
+#define VIRTIO_BLK_T_DISCARD      11 // discard request
 
 #define VIRTIO_BLK_S_OK           0 // success
 #define VIRTIO_BLK_S_IOERR        1 // host or guest error
 #define VIRTIO_BLK_S_UNSUPP       2 // unsupported by host
 
-#define HEADER_DESC_LEN           16  // header descriptor length
-#define STATUS_DESC_LEN           1   // status descriptor length
+#define SECTOR_SIZE               512 // unit of request addresses
 
+// legacy config space offsets
+#define VIRTIO_BLK_CONFIG_CAPACITY      0
+#define VIRTIO_BLK_CONFIG_SIZE_MAX      8
+#define VIRTIO_BLK_CONFIG_SEG_MAX       12
+#define VIRTIO_BLK_CONFIG_GEOMETRY      16
+#define VIRTIO_BLK_CONFIG_BLK_SIZE      20
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES    34
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD   36
 
 
 /* Maximum size of any single segment is in "size_max" */
@@ -91,6 +97,12 @@
 /* Device can toggle its cache between writeback andw ritethrough modes. */
 #define VIRTIO_BLK_F_CONFIG_WCE  	11   
 
+/* Device supports multiple request queues, number in "num_queues" */
+#define VIRTIO_BLK_F_MQ         	12
+
+/* Device supports discard, limits in "max_discard_sectors" */
+#define VIRTIO_BLK_F_DISCARD    	13
+
 /* Legacy Interface: Feature bits */
 
 /* Host supports request barriers */ 
@@ -102,15 +114,11 @@
 
 static uint64_t num_devs = 0;
 
-struct virtio_blk_dev {
-    struct nk_block_dev         *blk_dev;     // nautilus block device
-    struct virtio_pci_dev       *virtio_dev;  // nautilus pci device
-    struct virtio_blk_config    *blk_config;  // virtio blk configuration
-    struct virtio_blk_callb     *blk_callb;   // virtio blk callbacks
-};
+// completions reaped under the queue lock before their callbacks run
+#define REAP_BATCH 32
 
 struct virtio_blk_config {
-    uint64_t capacity;  // device size
+    uint64_t capacity;  // device size in sectors
     uint32_t size_max;  // max size of any single descriptor 
     uint32_t seg_max;   // total number of descriptors 
     struct virtio_blk_geometry {
@@ -119,21 +127,71 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;         // device geometry 
     uint32_t blk_size;  // optimal sector size
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
 };
 
-struct virtio_blk_req {
-    uint32_t type;      // read or write request
-    uint32_t reserved;  // write back feature
+// device-readable header that starts every request
+struct virtio_blk_req_hdr {
+    uint32_t type;      // read, write, flush, discard
+    uint32_t ioprio;
     uint64_t sector;    // offset for read or write to occur
-    uint8_t *data;      // ... not used
-    uint8_t status;     // written by device
 };
 
-struct virtio_blk_callb {
+// the payload of a discard request
+struct virtio_blk_discard {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+struct callback_info {
     void *context;
     void (*callback)(nk_block_dev_status_t, void *);
 };
 
+// a request is a chain of its header, its data segments, and the
+// status byte the device writes.  Headers, status bytes and discard
+// payloads are indexed by the head descriptor of the chain, so a
+// request in flight never needs an allocation
+struct virtio_blk_queue {
+    spinlock_t                 lock;
+    struct virtio_blk_dev     *dev;
+    uint16_t                   qidx;
+    uint16_t                   outstanding;  // chains the device holds
+    uint16_t                   kick_idx;     // avail idx when we last considered notifying
+    int                        held;         // published without a kick by a plugged thread
+
+    struct virtio_blk_req_hdr *hdrs;
+    uint8_t                   *status;
+    struct virtio_blk_discard *discards;
+    struct callback_info      *callbacks;
+
+    uint64_t                   requests;
+    uint64_t                   kicks;
+};
+
+struct virtio_blk_dev {
+    struct nk_block_dev         *blk_dev;     // nautilus block device
+    struct virtio_pci_dev       *virtio_dev;  // nautilus pci device
+    struct virtio_blk_config     blk_config;  // virtio blk configuration
+
+    uint64_t sectors_per_block;
+    uint64_t num_blocks;
+    uint64_t max_iov;
+    int      event_idx;      // VIRTIO_F_EVENT_IDX negotiated
+    int      flush;          // VIRTIO_BLK_F_FLUSH negotiated
+    int      discard;        // VIRTIO_BLK_F_DISCARD negotiated
+    int      read_only;
+
+    uint16_t num_queues;     // request queues in use
+    struct virtio_blk_queue queues[MAX_VIRTQS];
+};
+
+#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
+#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
+#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags)
+
 /************************************************************
  ****************** block ops for kernel ********************
  ************************************************************/
@@ -145,120 +203,286 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
     }
 
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
-    c->block_size = dev->blk_config->blk_size;
-    c->num_blocks = dev->blk_config->capacity; 
+    c->block_size = dev->sectors_per_block * SECTOR_SIZE;
+    c->num_blocks = dev->num_blocks;
+    c->caps = (dev->flush ? NK_BLOCK_DEV_CAP_FLUSH : 0) | (dev->discard ? NK_BLOCK_DEV_CAP_DISCARD : 0);
+    c->max_iov = dev->max_iov;
 
     return 0;
 }
 
-static void fill_hdr_desc(struct virtq *vq, struct virtio_blk_req *hdr, uint16_t hdr_index, uint16_t buf_index)
+// requests that need no trip to the device: the device has no
+// volatile cache to flush, or does not understand discards (which
+// are only advice)
+static inline int trivial(struct virtio_blk_dev *d, struct nk_block_dev_req *r)
 {
-    struct virtq_desc *hdr_desc = &vq->desc[hdr_index];
-
-    hdr_desc->addr = (uint64_t) hdr;
-    hdr_desc->len = HEADER_DESC_LEN;
-    hdr_desc->flags = 0;
-    hdr_desc->next = buf_index;
-    hdr_desc->flags |= VIRTQ_DESC_F_NEXT;
+    return (r->op == NK_BLOCK_DEV_OP_FLUSH && !d->flush) ||
+	(r->op == NK_BLOCK_DEV_OP_DISCARD && !d->discard);
 }
 
-static void fill_buf_desc(struct virtq *vq, uint32_t size, uint64_t count, uint8_t *dest, uint16_t buf_index, uint16_t stat_index, uint8_t write)
+static int check_req(struct virtio_blk_dev *d, struct nk_block_dev_req *r)
 {
-    struct virtq_desc *buf_desc = &vq->desc[buf_index];
+    uint64_t i, len = 0;
+
+    switch (r->op) {
+    case NK_BLOCK_DEV_OP_FLUSH:
+	return 0;
+    case NK_BLOCK_DEV_OP_DISCARD:
+	if (!r->count || r->blocknum + r->count > d->num_blocks ||
+	    r->count * d->sectors_per_block > d->blk_config.max_discard_sectors) {
+	    ERROR("bad discard of %lu blocks at %lu\n", r->count, r->blocknum);
+	    return -1;
+	}
+	return 0;
+    case NK_BLOCK_DEV_OP_WRITE:
+	if (d->read_only) {
+	    ERROR("attempt to write read-only device\n");
+	    return -1;
+	}
+	// fall through
+    case NK_BLOCK_DEV_OP_READ:
+	if (!r->count || r->blocknum + r->count > d->num_blocks) {
+	    ERROR("request goes beyond device capacity\n");
+	    return -1;
+	}
+	if (!r->iovcnt || r->iovcnt > d->max_iov) {
+	    ERROR("unsupported segment count %lu\n", r->iovcnt);
+	    return -1;
+	}
+	for (i=0;i<r->iovcnt;i++) {
+	    len += r->iov[i].len;
+	}
+	if (len != r->count * d->sectors_per_block * SECTOR_SIZE) {
+	    ERROR("segments cover %lu bytes, not %lu blocks\n", len, r->count);
+	    return -1;
+	}
+	return 0;
+    }
 
-    buf_desc->addr = (uint64_t) dest;
-    buf_desc->len = size * count;
-    buf_desc->flags |= write ? 0 : VIRTQ_DESC_F_WRITE;
-    buf_desc->next = stat_index;
-    buf_desc->flags |= VIRTQ_DESC_F_NEXT;
+    ERROR("unknown operation %d\n", r->op);
+    return -1;
 }
 
-static void fill_stat_desc(struct virtq *vq, uint8_t *status, uint16_t stat_index)
+// put the request's chain into the avail ring, but not yet where the
+// device can see it (see publish())
+// called with the queue lock held
+static int enqueue(struct virtio_blk_queue *q, struct nk_block_dev_req *r, uint16_t *avail_idx)
 {
-    struct virtq_desc *stat_desc = &vq->desc[stat_index];
+    struct virtio_blk_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    uint16_t desc_idx[NK_BLOCK_DEV_MAX_IOV+2];
+    uint16_t ndata, head, i;
+
+    switch (r->op) {
+    case NK_BLOCK_DEV_OP_FLUSH:   ndata = 0; break;
+    case NK_BLOCK_DEV_OP_DISCARD: ndata = 1; break;
+    default:                      ndata = r->iovcnt; break;
+    }
+
+    if (virtio_pci_desc_chain_alloc(d->virtio_dev, q->qidx, desc_idx, ndata+2)) {
+	DEBUG("descriptor alloc failed on virtq %u\n", q->qidx);
+	return -1;
+    }
 
-    stat_desc->addr = (uint64_t) status;  
-    stat_desc->flags = 0;
-    stat_desc->flags |= VIRTQ_DESC_F_WRITE;
-    stat_desc->len = STATUS_DESC_LEN;
-    stat_desc->next = 0;
+    head = desc_idx[0];
+
+    // header (chain alloc has linked the chain)
+    struct virtio_blk_req_hdr *hdr = &q->hdrs[head];
+    hdr->ioprio = 0;
+    hdr->sector = r->blocknum * d->sectors_per_block;
+    vq->desc[head].addr = (uint64_t) hdr;
+    vq->desc[head].len = sizeof(*hdr);
+
+    switch (r->op) {
+    case NK_BLOCK_DEV_OP_READ:
+	hdr->type = VIRTIO_BLK_T_IN;
+	break;
+    case NK_BLOCK_DEV_OP_WRITE:
+	hdr->type = VIRTIO_BLK_T_OUT;
+	break;
+    case NK_BLOCK_DEV_OP_FLUSH:
+	hdr->type = VIRTIO_BLK_T_FLUSH;
+	hdr->sector = 0;
+	break;
+    case NK_BLOCK_DEV_OP_DISCARD:
+	hdr->type = VIRTIO_BLK_T_DISCARD;
+	hdr->sector = 0;
+	q->discards[head].sector = r->blocknum * d->sectors_per_block;
+	q->discards[head].num_sectors = r->count * d->sectors_per_block;
+	q->discards[head].flags = 0;
+	break;
+    }
+
+    // data
+    for (i=0;i<ndata;i++) {
+	struct virtq_desc *desc = &vq->desc[desc_idx[i+1]];
+	if (r->op == NK_BLOCK_DEV_OP_DISCARD) {
+	    desc->addr = (uint64_t) &q->discards[head];
+	    desc->len = sizeof(struct virtio_blk_discard);
+	} else {
+	    desc->addr = (uint64_t) r->iov[i].addr;
+	    desc->len = r->iov[i].len;
+	    if (r->op == NK_BLOCK_DEV_OP_READ) {
+		desc->flags |= VIRTQ_DESC_F_WRITE;
+	    }
+	}
+    }
+
+    // status
+    q->status[head] = 0xff;
+    vq->desc[desc_idx[ndata+1]].addr = (uint64_t) &q->status[head];
+    vq->desc[desc_idx[ndata+1]].len = 1;
+    vq->desc[desc_idx[ndata+1]].flags = VIRTQ_DESC_F_WRITE;
+
+    q->callbacks[head].callback = r->callback;
+    q->callbacks[head].context = r->context;
+
+    vq->avail->ring[(*avail_idx)++ % vq->qsz] = head;
+    q->outstanding++;
+    q->requests++;
+
+    DEBUG("request op %d block %lu count %lu at head %u on virtq %u\n", r->op, r->blocknum, r->count, head, q->qidx);
+
+    return 0;
 }
 
-static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint64_t count, uint8_t *src_dest, void (*callback)(nk_block_dev_status_t, void *), void *context, uint8_t write) 
+// notify the device of everything published since we last did, if
+// it asked to be
+// called with the queue lock held
+static void kick(struct virtio_blk_queue *q)
 {
-    DEBUG("%s blocknum = %lu count = %lu buf = %p callback = %p context = %p\n", write ? "write" : "read", blocknum, count, src_dest, callback, context);
-    
-    if (blocknum + count > dev->blk_config->capacity) {
-        ERROR("request goes beyond device capacity\n");
-        return -1;
-    }
+    struct virtio_blk_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    uint16_t new_idx = vq->avail->idx;
+    int need;
 
-    if (write && (FBIT_ISSET(dev->virtio_dev->feat_accepted,VIRTIO_BLK_F_RO))) {
-	ERROR("attempt to write read-only device\n");
-	return -1;
+    if (q->kick_idx == new_idx) {
+	return;
     }
 
-    DEBUG("[build request header]\n");
+    mbarrier();
+
+    if (d->event_idx) {
+	need = virtq_need_event(*virtq_avail_event(vq), new_idx, q->kick_idx);
+    } else {
+	need = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
 
-    struct virtio_blk_req *hdr = malloc(sizeof(struct virtio_blk_req));
+    q->kick_idx = new_idx;
 
-    if (!hdr) {
-	ERROR("Failed to allocate request header\n");
-	return -1;
+    if (need) {
+	virtio_pci_virtqueue_notify(d->virtio_dev, q->qidx);
+	q->kicks++;
     }
-    
-    memset(hdr, 0, sizeof(struct virtio_blk_req));
+}
 
-    hdr->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    hdr->sector = blocknum;
-    hdr->reserved = 0;
-    hdr->status = 0;
+// make chains enqueued up to new_idx visible to the device, and
+// kick it unless the submitting thread is plugged
+// called with the queue lock held
+static void publish(struct virtio_blk_queue *q, uint16_t new_idx)
+{
+    struct virtio_blk_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
 
-    DEBUG("[allocate descriptors]\n");
+    if (vq->avail->idx == new_idx) {
+	return;
+    }
 
-    uint16_t desc[3];
+    mbarrier();
+    vq->avail->idx = new_idx;
+    mbarrier();
 
-    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,VIRTIO_BLK_REQUEST_QUEUE,desc,3)) {
-	ERROR("Failed to allocate descriptor chain\n");
-	free(hdr);
-	return -1;
+    if (in_interrupt_context() || !get_cur_thread()->blk_plug) {
+	kick(q);
+	q->held = 0;
+    } else {
+	q->held = 1;
     }
-    
-    uint16_t hdr_index = desc[0];
-    uint16_t buf_index = desc[1];
-    uint16_t stat_index = desc[2];
+}
 
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+// requests go to the queue of the submitting cpu, whose interrupt
+// is also steered to that cpu
+static inline struct virtio_blk_queue *submit_queue(struct virtio_blk_dev *d)
+{
+    return &d->queues[my_cpu_id() % d->num_queues];
+}
 
-    DEBUG("[create descriptors]\n");
+static int submit(void *state, struct nk_block_dev_req *reqs, uint64_t count)
+{
+    struct virtio_blk_dev *d = (struct virtio_blk_dev *) state;
+    struct virtio_blk_queue *q = submit_queue(d);
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    uint64_t i = 0;
+    uint16_t idx;
+    int err = 0;
+    QUEUE_LOCK_CONF;
+
+    while (i < count) {
+	if (trivial(d,&reqs[i])) {
+	    if (reqs[i].callback) {
+		reqs[i].callback(NK_BLOCK_DEV_STATUS_SUCCESS, reqs[i].context);
+	    }
+	    i++;
+	    continue;
+	}
 
-    DEBUG("[create header descriptor]\n");
-    fill_hdr_desc(vq, hdr, hdr_index, buf_index);
+	QUEUE_LOCK(q);
+	idx = vq->avail->idx;
+	while (i < count && !trivial(d,&reqs[i])) {
+	    if (check_req(d,&reqs[i])) {
+		err = 1;
+		break;
+	    }
+	    if (enqueue(q,&reqs[i],&idx)) {
+		// full
+		break;
+	    }
+	    i++;
+	}
+	publish(q,idx);
+	QUEUE_UNLOCK(q);
 
-    DEBUG("[create buffer descriptor]\n");
-    fill_buf_desc(vq, dev->blk_config->blk_size, count, src_dest, buf_index, stat_index, write);
+	if (i < count && !trivial(d,&reqs[i])) {
+	    break;
+	}
+    }
 
-    DEBUG("[create status descriptor]\n");
-    fill_stat_desc(vq, &hdr->status, stat_index);
+    return (err && !i) ? -1 : i;
+}
 
-    dev->blk_callb[hdr_index].callback = callback;
-    dev->blk_callb[hdr_index].context = context;
+// the plug itself is the thread's (see publish), so only the
+// queues that held requests back need attention; a kick covers
+// whatever else was published meanwhile
+static void unplug(void *state)
+{
+    struct virtio_blk_dev *d = (struct virtio_blk_dev *) state;
+    uint16_t i;
+    QUEUE_LOCK_CONF;
 
-    DEBUG("request in indexes: header = %d, buffer = %d, status = %d\n", hdr_index, buf_index, stat_index);
+    for (i=0;i<d->num_queues;i++) {
+	if (!d->queues[i].held) {
+	    continue;
+	}
+	QUEUE_LOCK(&d->queues[i]);
+	if (d->queues[i].held) {
+	    kick(&d->queues[i]);
+	    d->queues[i].held = 0;
+	}
+	QUEUE_UNLOCK(&d->queues[i]);
+    }
+}
 
-    // update avail ring
-    vq->avail->ring[vq->avail->idx % vq->qsz] = hdr_index;
-    mbarrier();
-    vq->avail->idx++;
-    mbarrier();
-    
-    DEBUG("available ring's hdr index = %d, at ring index %d\n", hdr_index, vq->avail->idx - 1);
-    DEBUG("available ring's ring index for next hdr = %u\n", vq->avail->idx);
+static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint64_t count, uint8_t *src_dest, void (*callback)(nk_block_dev_status_t, void *), void *context, uint8_t write) 
+{
+    struct nk_block_dev_iov iov = { .addr = src_dest, .len = count * dev->sectors_per_block * SECTOR_SIZE };
+    struct nk_block_dev_req r = { .op = write ? NK_BLOCK_DEV_OP_WRITE : NK_BLOCK_DEV_OP_READ,
+				  .blocknum = blocknum, .count = count,
+				  .iov = &iov, .iovcnt = 1,
+				  .callback = callback, .context = context };
 
-    DEBUG("[notify device]\n");
-    virtio_pci_write_regw(dev->virtio_dev, QUEUE_NOTIFY, VIRTIO_BLK_REQUEST_QUEUE);
-    
-    return 0;
+    DEBUG("%s blocknum = %lu count = %lu buf = %p callback = %p context = %p\n", write ? "write" : "read", blocknum, count, src_dest, callback, context);
+
+    return submit(dev,&r,1)==1 ? 0 : -1;
 }
 
 static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t, void *), void *context)
@@ -275,10 +499,29 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
     return read_write_blocks(dev, blocknum, count, src, callback, context, 1);
 }
 
+static void reap(struct virtio_blk_queue *q);
+
+// pick up completions without waiting for the interrupt
+static void poll(void *state)
+{
+    struct virtio_blk_dev *d = (struct virtio_blk_dev *) state;
+    uint16_t i;
+
+    for (i=0;i<d->num_queues;i++) {
+	struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[d->queues[i].qidx];
+	if (virtq->last_seen_used != virtq->vq.used->idx) {
+	    reap(&d->queues[i]);
+	}
+    }
+}
+
 static struct nk_block_dev_int ops = {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .submit = submit,
+    .unplug = unplug,
+    .poll = poll,
 };
 
 /************************************************************
@@ -290,64 +533,82 @@ static void teardown(struct virtio_pci_dev *dev)
     virtio_pci_virtqueue_deinit(dev);
 }
 
-static int process_used_ring(struct virtio_blk_dev *dev) 
+static void reap(struct virtio_blk_queue *q) 
 {
-    uint16_t hdr_desc_idx; 
-    void (*callback)(nk_block_dev_status_t, void *);
-    void *context;
-    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE];
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
-     
-    DEBUG("[processing used ring]\n");
-    DEBUG("current virtq used index = %d\n", virtq->vq.used->idx);
-    DEBUG("last seen used index = %d\n", virtq->last_seen_used);
-     
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
-	
-	// grab the head of used descriptor chain
-	hdr_desc_idx = vq->used->ring[virtq->last_seen_used % virtq->vq.qsz].id;
-	 
-	if (vq->desc[hdr_desc_idx].flags != VIRTQ_DESC_F_NEXT)  {
-	    ERROR("Huh? head in the used ring is not a header descriptor\n");
-	    return -1;
+    struct virtio_blk_dev *d = q->dev;
+    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[q->qidx];
+    struct virtq *vq = &virtq->vq;
+    struct {
+	void (*callback)(nk_block_dev_status_t, void *);
+	void *context;
+	nk_block_dev_status_t status;
+    } done[REAP_BATCH];
+    uint16_t head, n, i;
+    QUEUE_LOCK_CONF;
+
+    do {
+	n = 0;
+
+	QUEUE_LOCK(q);
+
+	mbarrier();
+
+	DEBUG("processing used ring for virtq %u: used idx = %u, last seen used = %u\n",
+	      q->qidx, vq->used->idx, virtq->last_seen_used);
+
+	while (n<REAP_BATCH && virtq->last_seen_used != vq->used->idx) {
+	    // grab the head of used descriptor chain
+	    head = vq->used->ring[virtq->last_seen_used % vq->qsz].id;
+
+	    done[n].callback = q->callbacks[head].callback;
+	    done[n].context = q->callbacks[head].context;
+	    done[n].status = q->status[head] == VIRTIO_BLK_S_OK ?
+		NK_BLOCK_DEV_STATUS_SUCCESS : NK_BLOCK_DEV_STATUS_ERROR;
+
+	    if (q->status[head] != VIRTIO_BLK_S_OK) {
+		ERROR("request type %u at sector %lu failed with status %u\n",
+		      q->hdrs[head].type, q->hdrs[head].sector, q->status[head]);
+	    }
+
+	    memset(&q->callbacks[head],0,sizeof(struct callback_info));
+
+	    if (virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, head)) {
+		ERROR("error freeing descriptors\n");
+	    }
+
+	    q->outstanding--;
+	    virtq->last_seen_used++;
+	    n++;
 	}
-	 
-	struct virtq_desc *hdr_desc = &vq->desc[hdr_desc_idx];
-	struct virtio_blk_req *hdr = (struct virtio_blk_req *)hdr_desc->addr;
-	uint8_t status = hdr->status;
-	 
-	DEBUG("completion for descriptor at index %d with status: %d\n", hdr_desc_idx, status);
-	 
-	// grab corresponding callback
-	callback = dev->blk_callb[hdr_desc_idx].callback;
-	context = dev->blk_callb[hdr_desc_idx].context;
-	 
-	memset(&dev->blk_callb[hdr_desc_idx],0,sizeof(dev->blk_callb[hdr_desc_idx]));
-	 
-	free(hdr);
-
-	DEBUG("descriptor hdr index = %u, callback = %p, context = %p\n", hdr_desc_idx, callback, context);
-	 
-	DEBUG("free used descriptors\n");
-
-	if (virtio_pci_desc_chain_free(dev->virtio_dev, VIRTIO_BLK_REQUEST_QUEUE, hdr_desc_idx)) {
-	    ERROR("error freeing descriptors\n");
-	    return -1;
+
+	if (d->event_idx) {
+	    // interrupt us again on the next completion
+	    *virtq_used_event(vq) = virtq->last_seen_used;
+	    mbarrier();
 	}
-	 
-	if (callback) {
-	    DEBUG("[issuing callback]\n");
-	    callback(status ? NK_BLOCK_DEV_STATUS_ERROR : NK_BLOCK_DEV_STATUS_SUCCESS,context);
+
+	QUEUE_UNLOCK(q);
+
+	// call the corresponding callbacks, which may submit again
+	for (i=0;i<n;i++) {
+	    if (done[i].callback) {
+		done[i].callback(done[i].status, done[i].context);
+	    }
 	}
-    }
-     
-    return 0;
+
+	// a completion that raced with the used event update would
+	// not interrupt us, so look again
+	mbarrier();
+
+    } while (virtq->last_seen_used != vq->used->idx);
 }
 
+// legacy interrupts and MSI-X entries that do not belong to a queue
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     DEBUG("[received an interrupt!]\n");
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) priv_data;
+    uint16_t i;
     
     // only for legacy style interrupt
     if (dev->virtio_dev->itype == VIRTIO_PCI_LEGACY_INTERRUPT) {
@@ -362,23 +623,29 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 	    return 0;
         }
     }
-    
-    if (process_used_ring(dev)) {
-	ERROR("failed to process used ring\n");
-	IRQ_HANDLER_END();
-	return -1;
-    } 
 
-    // print used for test
-    //DEBUG("free count after = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
-    //uint8_t used_index = dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq.used->idx;
-    //DEBUG("used ring next index = %d\n", used_index);
+    for (i=0;i<dev->num_queues;i++) {
+	reap(&dev->queues[i]);
+    }
 
     DEBUG("[interrupt handler finished]\n");
     IRQ_HANDLER_END();
     return 0;
 }
 
+// MSI-X entry of a single queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    struct virtio_blk_queue *q = (struct virtio_blk_queue *) priv_data;
+
+    DEBUG("interrupt for virtq %u\n", q->qidx);
+
+    reap(q);
+
+    IRQ_HANDLER_END();
+    return 0;
+}
+
 /*************************************************
  ******************** tests **********************
  *************************************************/
@@ -396,7 +663,7 @@ static int test_read(struct virtio_blk_dev *dev)
     DEBUG("testing read...\n");
     uint64_t blocknum = 0;
     uint64_t count = 1;
-    uint32_t blk_size = dev->blk_config->blk_size;
+    uint32_t blk_size = dev->sectors_per_block * SECTOR_SIZE;
     uint8_t *src = malloc(count * blk_size); 
 
     if (!src) {
@@ -404,7 +671,7 @@ static int test_read(struct virtio_blk_dev *dev)
 	return -1;
     }
     
-    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
+    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[0].nfree);
     
     uint16_t i;
     for (i = 0; i < 16; i++) {
@@ -435,7 +702,7 @@ static int test_write(struct virtio_blk_dev *dev)
     DEBUG("testing write...\n");
     uint64_t blocknum = 512;
     uint64_t count = 1;
-    uint32_t blk_size = dev->blk_config->blk_size;
+    uint32_t blk_size = dev->sectors_per_block * SECTOR_SIZE;
     uint8_t *src = malloc(count * blk_size); 
     
     if (!src) {
@@ -443,7 +710,7 @@ static int test_write(struct virtio_blk_dev *dev)
 	return -1;
     }
     
-    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
+    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[0].nfree);
     
     memset(src, 1, count * blk_size);
 
@@ -473,7 +740,7 @@ static int test_write(struct virtio_blk_dev *dev)
 /************************************************************
  ****************** device initialization *******************
  ************************************************************/
-uint64_t select_features(uint64_t features) 
+static uint64_t select_features(uint64_t features) 
 {
     DEBUG("device features: 0x%0lx\n",features);
     DEBUG_FBIT(features, VIRTIO_BLK_F_SIZE_MAX);
@@ -484,6 +751,8 @@ uint64_t select_features(uint64_t features)
     DEBUG_FBIT(features, VIRTIO_BLK_F_FLUSH);
     DEBUG_FBIT(features, VIRTIO_BLK_F_TOPOLOGY);
     DEBUG_FBIT(features, VIRTIO_BLK_F_CONFIG_WCE);
+    DEBUG_FBIT(features, VIRTIO_BLK_F_MQ);
+    DEBUG_FBIT(features, VIRTIO_BLK_F_DISCARD);
     DEBUG_FBIT(features, VIRTIO_BLK_F_BARRIER);
     DEBUG_FBIT(features, VIRTIO_BLK_F_SCSI);
     DEBUG_FBIT(features, VIRTIO_F_NOTIFY_ON_EMPTY);
@@ -499,6 +768,10 @@ uint64_t select_features(uint64_t features)
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_GEOMETRY);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_RO);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_BLK_SIZE);
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_FLUSH);
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_MQ);
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_DISCARD);
+    FBIT_SETIF(accepted,features,VIRTIO_F_EVENT_IDX);
     
     DEBUG("features accepted: 0x%0lx\n", accepted);
     return accepted;
@@ -507,41 +780,98 @@ uint64_t select_features(uint64_t features)
 static void parse_config(struct virtio_blk_dev *d)
 {
     struct virtio_pci_dev *dev = d->virtio_dev;
+    struct virtio_blk_config *c = &d->blk_config;
+    uint32_t base = VIRTIO_BLK_OFF_CONFIG(dev);
     
-    memset(d->blk_config,0,sizeof(*(d->blk_config)));
+    memset(c,0,sizeof(*c));
     
     // must have capacity...
-    d->blk_config->capacity = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 0);
-    if (dev->feat_accepted & VIRTIO_BLK_F_SIZE_MAX) { 
-	d->blk_config->size_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 8);
+    c->capacity = virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_CAPACITY) |
+	((uint64_t)virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32);
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SIZE_MAX)) { 
+	c->size_max = virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_SIZE_MAX);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_SEG_MAX) { 
-	d->blk_config->seg_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 12);
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SEG_MAX)) { 
+	c->seg_max = virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_SEG_MAX);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_GEOMETRY) { 
-	d->blk_config->geometry.cylinders = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 16);
-	d->blk_config->geometry.heads = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 18);
-	d->blk_config->geometry.sectors = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 19);
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_GEOMETRY)) { 
+	c->geometry.cylinders = virtio_pci_read_regw(dev, base + VIRTIO_BLK_CONFIG_GEOMETRY);
+	c->geometry.heads = virtio_pci_read_regb(dev, base + VIRTIO_BLK_CONFIG_GEOMETRY + 2);
+	c->geometry.sectors = virtio_pci_read_regb(dev, base + VIRTIO_BLK_CONFIG_GEOMETRY + 3);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_BLK_SIZE) { 
-	d->blk_config->blk_size = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 20);
-    } else {
-	d->blk_config->blk_size = 512; // presumably...
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_BLK_SIZE)) { 
+	c->blk_size = virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_BLK_SIZE);
+    }
+    if (c->blk_size < SECTOR_SIZE || c->blk_size % SECTOR_SIZE) {
+	c->blk_size = SECTOR_SIZE; // presumably...
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_MQ)) {
+	c->num_queues = virtio_pci_read_regw(dev, base + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_DISCARD)) {
+	c->max_discard_sectors = virtio_pci_read_regl(dev, base + VIRTIO_BLK_CONFIG_MAX_DISCARD);
     }
     
     DEBUG("block device configuration layout\n");
-    DEBUG("capacity           = %d\n", d->blk_config->capacity);
-    DEBUG("size_max           = %d\n", d->blk_config->size_max);
-    DEBUG("seg_max            = %d\n", d->blk_config->seg_max);
-    DEBUG("geometry_cylinders = %d\n", d->blk_config->geometry.cylinders);
-    DEBUG("geometry_heads     = %d\n", d->blk_config->geometry.heads);
-    DEBUG("geometry_sectors   = %d\n", d->blk_config->geometry.sectors);
-    DEBUG("blk_size           = %d\n", d->blk_config->blk_size);
+    DEBUG("capacity           = %lu\n", c->capacity);
+    DEBUG("size_max           = %u\n", c->size_max);
+    DEBUG("seg_max            = %u\n", c->seg_max);
+    DEBUG("geometry_cylinders = %u\n", c->geometry.cylinders);
+    DEBUG("geometry_heads     = %u\n", c->geometry.heads);
+    DEBUG("geometry_sectors   = %u\n", c->geometry.sectors);
+    DEBUG("blk_size           = %u\n", c->blk_size);
+    DEBUG("num_queues         = %u\n", c->num_queues);
+    DEBUG("max_discard        = %u\n", c->max_discard_sectors);
+}
+
+static int queue_init(struct virtio_blk_dev *d, uint16_t qidx)
+{
+    struct virtio_blk_queue *q = &d->queues[qidx];
+    uint16_t qsz = d->virtio_dev->virtq[qidx].vq.qsz;
+
+    spinlock_init(&q->lock);
+    q->dev = d;
+    q->qidx = qidx;
+
+    q->hdrs = malloc(sizeof(struct virtio_blk_req_hdr) * qsz);
+    q->status = malloc(qsz);
+    q->discards = malloc(sizeof(struct virtio_blk_discard) * qsz);
+    q->callbacks = malloc(sizeof(struct callback_info) * qsz);
+
+    if (!q->hdrs || !q->status || !q->discards || !q->callbacks) {
+	ERROR("can't allocate request state for virtq %u\n", qidx);
+	free(q->hdrs);
+	free(q->status);
+	free(q->discards);
+	free(q->callbacks);
+	memset(q,0,sizeof(*q));
+	return -1;
+    }
+
+    memset(q->hdrs, 0, sizeof(struct virtio_blk_req_hdr) * qsz);
+    memset(q->status, 0, qsz);
+    memset(q->discards, 0, sizeof(struct virtio_blk_discard) * qsz);
+    memset(q->callbacks, 0, sizeof(struct callback_info) * qsz);
+
+    return 0;
+}
+
+static void queues_deinit(struct virtio_blk_dev *d)
+{
+    uint16_t i;
+
+    for (i=0;i<MAX_VIRTQS;i++) {
+	free(d->queues[i].hdrs);
+	free(d->queues[i].status);
+	free(d->queues[i].discards);
+	free(d->queues[i].callbacks);
+    }
 }
 
 int virtio_blk_init(struct virtio_pci_dev *dev)
 {
     char buf[DEV_NAME_LEN];
+    uint16_t i;
 
     if (!(dev->model==VIRTIO_PCI_LEGACY_MODEL)) {
 	ERROR("currently only supported with legacy model\n");
@@ -586,36 +916,49 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	return -1;
     }
     
-    dev->state = d;
-    dev->teardown = teardown;
     d->virtio_dev = dev;
     
-    // allocate callback array
-    d->blk_callb = malloc(dev->virtq[0].vq.qsz * sizeof(struct virtio_blk_callb));
-    
-    DEBUG("allocated %d callbacks at %p\n", dev->virtq[0].vq.qsz, d->blk_callb);
-    
-    if (!d->blk_callb) {
-	ERROR("failed to allocate callback array\n");
-	virtio_pci_virtqueue_deinit(dev);
-	free(d);
-	return -1;
+    parse_config(d);
+
+    d->sectors_per_block = d->blk_config.blk_size / SECTOR_SIZE;
+    d->num_blocks = d->blk_config.capacity / d->sectors_per_block;
+    d->event_idx = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_F_EVENT_IDX);
+    d->flush = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_FLUSH);
+    d->discard = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_DISCARD) && d->blk_config.max_discard_sectors;
+    d->read_only = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_RO);
+
+    // a request needs a header and a status descriptor besides its data
+    d->max_iov = NK_BLOCK_DEV_MAX_IOV;
+    if (d->blk_config.seg_max && d->blk_config.seg_max < d->max_iov) {
+	d->max_iov = d->blk_config.seg_max;
     }
-    
-    // allocate virtio block configuration
-    d->blk_config = malloc(sizeof(struct virtio_blk_config));
-    
-    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_callb, sizeof(struct virtio_blk_config));
-    
-    if (!d->blk_config) {
-	ERROR("failed to allocate virtio block config struct\n");
-	virtio_pci_virtqueue_deinit(dev);
-	free(d->blk_callb);
-	free(d);
-	return -1;
+    if (d->max_iov + 2 > dev->virtq[0].vq.qsz) {
+	d->max_iov = dev->virtq[0].vq.qsz - 2;
     }
-    
-    parse_config(d);
+
+    // one request queue per cpu, if the device has enough
+    d->num_queues = 1;
+    if (d->blk_config.num_queues > 1) {
+	d->num_queues = d->blk_config.num_queues;
+	if (d->num_queues > dev->num_virtqs) {
+	    d->num_queues = dev->num_virtqs;
+	}
+	if (d->num_queues > nk_get_num_cpus()) {
+	    d->num_queues = nk_get_num_cpus();
+	}
+    }
+
+    for (i=0;i<d->num_queues;i++) {
+	if (queue_init(d,i)) {
+	    queues_deinit(d);
+	    virtio_pci_virtqueue_deinit(dev);
+	    free(d);
+	    return -1;
+	}
+    }
+
+    dev->state = d;
+    dev->teardown = teardown;
     
     // register virtio block device
     snprintf(buf,DEV_NAME_LEN,"virtio-blk%u",__sync_fetch_and_add(&num_devs,1));
@@ -624,8 +967,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     if (!d->blk_dev) {
 	ERROR("failed to register block device\n");
 	virtio_pci_virtqueue_deinit(dev);
-	free(d->blk_config);
-	free(d->blk_callb);
+	queues_deinit(d);
 	free(d);
 	return -1;
     }
@@ -634,7 +976,6 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     // if we do fail, the rest of this code will leak
     
     struct pci_dev *p = dev->pci_dev;
-    uint8_t i;
     ulong_t vec;
     
     if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
@@ -651,9 +992,6 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	    // return -1;
 	}
 	
-	// this should really go by virtqueue, not entry
-	// and ideally pulled into a per-queue setup routine
-	// in virtio_pci...
 	uint16_t num_vec = p->msix.size;
         
 	// now fill out the device's MSI-X table
@@ -664,14 +1002,19 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		ERROR("cannot get vector...\n");
 		return -1;
 	    }
+	    // the entry of request queue k goes to cpu k, where its
+	    // requests come from, everything else goes to cpu 0
+	    int cpu = i<d->num_queues ? i : 0;
 	    // register your handler for that vector
-	    if (register_int_handler(vec, handler, d)) {
+	    if (i<d->num_queues ?
+		register_int_handler(vec, queue_handler, &d->queues[i]) :
+		register_int_handler(vec, handler, d)) {
 		ERROR("failed to register int handler\n");
 		return -1;
 		// failed....
 	    }
 	    // set the table entry to point to your handler
-	    if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+	    if (pci_dev_set_msi_x_entry(p,i,vec,cpu)) {
 		ERROR("failed to set MSI-X entry\n");
 		return -1;
 	    }
@@ -680,7 +1023,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		ERROR("failed to unmask entry\n");
 		return -1;
 	    }
-	    DEBUG("finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+	    DEBUG("finished setting up entry %d for vector %u on cpu %d\n",i,vec,cpu);
 	}
 	
 	// unmask entire function
@@ -709,7 +1052,20 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
         pci_dev_cfg_writew(p,0x4,cmd);
 	
     }
+
+    // start device
+    if (virtio_pci_start_device(dev)) {
+	ERROR("failed to start device\n");
+	return -1;
+    }
     
+    INFO("%s: %lu blocks of %lu bytes, %u request queue(s), %lu segments%s%s%s%s\n",
+	 buf, d->num_blocks, d->sectors_per_block*SECTOR_SIZE, d->num_queues, d->max_iov,
+	 d->event_idx ? ", event idx" : "",
+	 d->flush ? ", flush" : "",
+	 d->discard ? ", discard" : "",
+	 d->read_only ? ", read-only" : "");
+
     DEBUG("device inited\n");
     
     /*************************************************
@@ -718,14 +1074,6 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     // DEBUG("******* Running read_blocks or write_blocks *******\n");
     // test_read(d);
     // test_write(d);
-    
-    // DEBUG("******* Running descriptor chain test *******\n");
-    // struct virtio_pci_virtq *virtq = &dev->virtq[0];
-    // struct virtq *vq = &virtq->vq;
-    // uint64_t qsz = vq->num;
-    // for (i = 0; i < qsz; i++) {
-    //   DEBUG("Next pointer of descriptor %d is %d\n", i, vq->desc[i].next);
-    // }
    
     return 0;
 }
@@ -62,6 +62,7 @@
 // legacy register offsets
 #define VIRTIO_NET_OFF_MAC(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 #define VIRTIO_NET_OFF_STATUS(v)  (virtio_pci_device_regs_start_legacy(v) + 6)
+#define VIRTIO_NET_OFF_MAX_PAIRS(v) (virtio_pci_device_regs_start_legacy(v) + 8)
 
 // feature bits
 
@@ -141,23 +142,83 @@ struct virtio_net_hdr {
 } __packed;
 
 
+// header when VIRTIO_NET_F_MRG_RXBUF is negotiated
+// (legacy devices use it in both directions)
+struct virtio_net_hdr_mrg {
+    struct virtio_net_hdr hdr;
+    uint16_t num_buffers;
+} __packed;
+
+// header flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+// control virtqueue
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __packed;
+
+#define VIRTIO_NET_OK                    0
+#define VIRTIO_NET_CTRL_MQ               4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET  0
+
+// in units of 10 us
+#define CTRL_TIMEOUT 100000
+
+
 // our state
 
 static uint64_t num_devs=0;
 
+// most queue pairs we will drive
+#define MAX_PAIRS ((MAX_VIRTQS-1)/2)
+
+// completions reaped under the queue lock before their callbacks run
+#define REAP_BATCH 32
+
 struct callback_info {
     void *context;
     void (*callback)(nk_net_dev_status_t status, void *context);
 };
 
+// receive queue k is virtqueue 2k, send queue k is virtqueue 2k+1
+struct virtio_net_queue {
+    spinlock_t                 lock;
+    struct virtio_net_dev     *dev;
+    uint16_t                   qidx;
+    uint16_t                   outstanding;  // chains the device holds
+
+    // both indexed by the head descriptor of a chain, so a
+    // packet in flight never needs an allocation
+    struct virtio_net_hdr_mrg *hdrs;
+    struct callback_info      *callbacks;
+
+    uint64_t                   packets;
+    uint64_t                   kicks;
+};
+
 struct virtio_net_dev {
     struct nk_net_dev     *net_dev;
     struct virtio_pci_dev *virtio_dev;
 
     uint8_t mac[ETHER_MAC_LEN];
-    struct callback_info *callbacks[2];
+
+    uint16_t hdr_len;       // 10, or 12 with mergeable receive buffers
+    int      event_idx;     // VIRTIO_F_EVENT_IDX negotiated
+    uint16_t num_pairs;     // queue pairs in use
+    uint16_t ctrl_qidx;
+
+    struct virtio_net_queue queues[2*MAX_PAIRS];
 };
 
+#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
+#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
+#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags)
+
+#define RECVQ(d,k) (&(d)->queues[2*(k)])
+#define SENDQ(d,k) (&(d)->queues[2*(k)+1])
+
 
 // interface to kernel
 
@@ -189,73 +250,165 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
     return 0;
 }
 
-static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+// a packet is a descriptor chain of the virtio-net header followed by
+// one descriptor for each buffer of the packet.  The chain goes into
+// the avail ring but is not visible to the device until publish()
+// called with the queue lock held
+static int enqueue(struct virtio_net_queue *q, struct nk_net_dev_sg *sg, uint64_t count, void (*callback)(nk_net_dev_status_t status, void *context), void *context, uint16_t *avail_idx)
 {
-    uint16_t qidx = send ? VIRTIO_NET_SENDQ_IDX : VIRTIO_NET_RECVQ_IDX;
-    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
-    struct virtq *vq = &d->virtio_dev->virtq[qidx].vq;
-
-    // alloc descriptor for header
-    uint16_t header_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &header_idx)) {
-        ERROR("descriptor alloc failed\n");
-        return -1;
-    }
-    DEBUG("allocated descriptor %d\n", header_idx);
-
-    // alloc descriptor for packet
-    uint16_t packet_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &packet_idx)) {
-        ERROR("descriptor alloc failed\n");
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
+    struct virtio_net_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    int send = q->qidx & 0x1;
+    uint16_t desc_idx[NK_NET_DEV_MAX_SG+1];
+    uint64_t i;
+
+    if (!count || count > NK_NET_DEV_MAX_SG) {
+        ERROR("unsupported buffer count %lu\n", count);
         return -1;
     }
-    DEBUG("allocated descriptor %d\n", packet_idx);
 
-    // create buffer for header
-    uint8_t *header = malloc(sizeof(struct virtio_net_hdr));
-    if (!header) {
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        virtio_pci_desc_free(d->virtio_dev, qidx, packet_idx);
-        ERROR("couldn't allocate buffer for virtio-net header\n");
+    // alloc descriptors for header and packet
+    if (virtio_pci_desc_chain_alloc(d->virtio_dev, q->qidx, desc_idx, count+1)) {
+        DEBUG("descriptor alloc failed on virtq %u\n", q->qidx);
         return -1;
     }
-    memset(header, 0, sizeof(struct virtio_net_hdr));
-    DEBUG("malloc header %x\n", (uint64_t) header);
+    DEBUG("allocated descriptor chain at %d (%lu buffers)\n", desc_idx[0], count);
 
-    // setup header descriptor
-    struct virtq_desc *header_desc = &vq->desc[header_idx];
-    header_desc->addr = (uint64_t) header;
-    header_desc->len = sizeof(struct virtio_net_hdr);
-    header_desc->flags = VIRTQ_DESC_F_NEXT;
+    // setup header descriptor (chain alloc has linked the chain)
+    // send headers are always zero, receive headers are written by the device
+    struct virtq_desc *header_desc = &vq->desc[desc_idx[0]];
+    header_desc->addr = (uint64_t) &q->hdrs[desc_idx[0]];
+    header_desc->len = d->hdr_len;
     if (!send) {
         header_desc->flags |= VIRTQ_DESC_F_WRITE;
     }
-    header_desc->next = packet_idx;
 
-    // setup packet descriptor
-    struct virtq_desc *packet_desc = &vq->desc[packet_idx];
-    packet_desc->addr = (uint64_t) buf;
-    packet_desc->len = len;
-    if (!send) {
-        packet_desc->flags = VIRTQ_DESC_F_WRITE;
+    // setup packet descriptors
+    for (i=0;i<count;i++) {
+        struct virtq_desc *packet_desc = &vq->desc[desc_idx[i+1]];
+        packet_desc->addr = (uint64_t) sg[i].addr;
+        packet_desc->len = sg[i].len;
+        if (!send) {
+            packet_desc->flags |= VIRTQ_DESC_F_WRITE;
+        }
     }
-    packet_desc->next = 0;
 
     // stash the callback and context
-    d->callbacks[qidx][header_idx].callback = callback;
-    d->callbacks[qidx][header_idx].context = context;
-    
-    // put header descriptor in virtq
-    vq->avail->ring[vq->avail->idx % vq->qsz] = header_idx;
+    q->callbacks[desc_idx[0]].callback = callback;
+    q->callbacks[desc_idx[0]].context = context;
+
+    vq->avail->ring[(*avail_idx)++ % vq->qsz] = desc_idx[0];
+    q->outstanding++;
+    q->packets++;
+
+    return 0;
+}
+
+// make chains queued since old_idx visible to the device, and
+// notify it only if it asked to be
+// called with the queue lock held
+static void publish(struct virtio_net_queue *q, uint16_t old_idx, uint16_t new_idx)
+{
+    struct virtio_net_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    int kick;
+
+    if (old_idx == new_idx) {
+        return;
+    }
+
     mbarrier();
-    vq->avail->idx++;
+    vq->avail->idx = new_idx;
     mbarrier();
 
-    // notify device (needs to be turned off for recv?)
-    virtio_pci_write_regw(d->virtio_dev, QUEUE_NOTIFY, qidx);
+    if (d->event_idx) {
+        kick = virtq_need_event(*virtq_avail_event(vq), new_idx, old_idx);
+    } else {
+        kick = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
 
-    return 0;
+    if (kick) {
+        virtio_pci_virtqueue_notify(d->virtio_dev, q->qidx);
+        q->kicks++;
+    }
+}
+
+static inline struct virtio_net_queue *send_queue(struct virtio_net_dev *d)
+{
+    return SENDQ(d, my_cpu_id() % d->num_pairs);
+}
+
+// receive buffers go to whichever queue the device is shortest on
+static inline struct virtio_net_queue *recv_queue(struct virtio_net_dev *d)
+{
+    struct virtio_net_queue *q = RECVQ(d,0);
+    uint16_t k;
+
+    for (k=1;k<d->num_pairs;k++) {
+        if (RECVQ(d,k)->outstanding < q->outstanding) {
+            q = RECVQ(d,k);
+        }
+    }
+
+    return q;
+}
+
+static int post_sg(void *state, struct nk_net_dev_sg *sg, uint64_t count, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    struct virtio_net_queue *q = send ? send_queue(d) : recv_queue(d);
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    uint16_t old_idx, new_idx;
+    int rc;
+    QUEUE_LOCK_CONF;
+
+    QUEUE_LOCK(q);
+    old_idx = new_idx = vq->avail->idx;
+    rc = enqueue(q, sg, count, callback, context, &new_idx);
+    publish(q, old_idx, new_idx);
+    QUEUE_UNLOCK(q);
+
+    return rc;
+}
+
+static int post_burst(void *state, struct nk_net_dev_burst *b, uint64_t count, int send)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    struct virtio_net_queue *q;
+    struct virtq *vq;
+    struct nk_net_dev_sg sg;
+    uint16_t old_idx, new_idx, tries;
+    uint64_t n = 0;
+    QUEUE_LOCK_CONF;
+
+    // a receive burst that fills one queue spills into the others
+    for (tries=0; n<count && tries<(send ? 1 : d->num_pairs); tries++) {
+        q = send ? send_queue(d) : recv_queue(d);
+        vq = &d->virtio_dev->virtq[q->qidx].vq;
+
+        QUEUE_LOCK(q);
+        old_idx = new_idx = vq->avail->idx;
+        for (; n<count; n++) {
+            sg.addr = b[n].buf;
+            sg.len = b[n].len;
+            if (enqueue(q, &sg, 1, b[n].callback, b[n].context, &new_idx)) {
+                break;
+            }
+        }
+        publish(q, old_idx, new_idx);
+        QUEUE_UNLOCK(q);
+    }
+
+    DEBUG("posted %lu of %lu %s buffers\n", n, count, send ? "send" : "receive");
+
+    return n;
+}
+
+static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+{
+    struct nk_net_dev_sg sg = { .addr = buf, .len = len };
+
+    return post_sg(state, &sg, 1, callback, context, send);
 }
 
 static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
@@ -280,79 +433,179 @@ static int post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(n
     return 0;
 }
 
+static int post_send_sg(void *state, struct nk_net_dev_sg *sg, uint64_t count, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_send_sg\n");
+
+    if (post_sg(state, sg, count, callback, context, 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int post_send_burst(void *state, struct nk_net_dev_burst *b, uint64_t count)
+{
+    DEBUG("post_send_burst\n");
+
+    return post_burst(state, b, count, 1);
+}
+
+static int post_receive_burst(void *state, struct nk_net_dev_burst *b, uint64_t count)
+{
+    DEBUG("post_receive_burst\n");
+
+    return post_burst(state, b, count, 0);
+}
+
 static struct nk_net_dev_int ops =  {
     .get_characteristics = get_characteristics,
     .post_receive = post_receive,
     .post_send = post_send,
+    .post_send_sg = post_send_sg,
+    .post_send_burst = post_send_burst,
+    .post_receive_burst = post_receive_burst,
 };
 
 
 // interrupt handling
 
-static int process_used_ring(struct virtio_net_dev *d, int qidx)
+// the device left the checksum of a received packet partial
+// (VIRTIO_NET_F_GUEST_CSUM) - the pseudo-header sum is already
+// in place, so fold in the rest of the packet
+static int complete_csum(struct virtio_net_hdr *h, uint8_t *buf, uint64_t len)
 {
-    uint16_t curr_idx, desc_idx, len;
-    uint32_t i;
-    uint8_t *header;
-    struct virtq_desc *head, *body;
-    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[qidx];
+    uint64_t start = h->csum_start;
+    uint64_t off = start + h->csum_offset;
+    uint32_t sum = 0;
+    uint64_t i;
 
-    mbarrier();
+    if (start >= len || off + 2 > len) {
+        ERROR("bogus partial checksum (start=%lu offset=%u len=%lu)\n", start, h->csum_offset, len);
+        return -1;
+    }
 
-    DEBUG("processing used ring for virtq %d\n", qidx);
-    DEBUG("used idx = %d\n", virtq->vq.used->idx);
-    DEBUG("last seen used = %d\n", virtq->last_seen_used);
+    for (i=start; i+1<len; i+=2) {
+        sum += ((uint32_t)buf[i] << 8) | buf[i+1];
+    }
+    if (i<len) {
+        sum += (uint32_t)buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    sum = ~sum & 0xffff;
 
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
-        curr_idx = virtq->last_seen_used % virtq->vq.qsz;
-        desc_idx = (uint16_t) virtq->vq.used->ring[curr_idx].id;
-        len = (uint16_t) virtq->vq.used->ring[curr_idx].len;
+    // zero means "no checksum" to UDP; for TCP 0xffff is the same value
+    if (!sum) {
+        sum = 0xffff;
+    }
 
-        head = &virtq->vq.desc[desc_idx];
-        header = (uint8_t *) head->addr;
-        if (!(head->flags & VIRTQ_DESC_F_NEXT)) {
-            ERROR("head in used ring does not have next flag\n");
-            return -1;
-        }
-        body = &virtq->vq.desc[head->next];
+    buf[off] = sum >> 8;
+    buf[off+1] = sum & 0xff;
 
-        DEBUG("head = %d\n", desc_idx);
-        DEBUG("body = %d\n", head->next);
-        DEBUG("len = %d\n", len);
-#ifdef NAUT_CONFIG_DEBUG_VIRTIO_NET
-        //nk_dump_mem((uint8_t *) body->addr, len - sizeof(struct virtio_net_hdr));
-#endif
-        // free the header buffer (this is the only buffer we allocated)
-        free(header);
+    return 0;
+}
 
-	// grab the callback info
-        void (*callback)(nk_net_dev_status_t, void *) = d->callbacks[qidx][desc_idx].callback;
-        void *context = d->callbacks[qidx][desc_idx].context;
+static void reap(struct virtio_net_queue *q)
+{
+    struct virtio_net_dev *d = q->dev;
+    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[q->qidx];
+    struct virtq *vq = &virtq->vq;
+    int send = q->qidx & 0x1;
+    struct {
+        void (*callback)(nk_net_dev_status_t, void *);
+        void *context;
+        nk_net_dev_status_t status;
+    } done[REAP_BATCH];
+    uint16_t curr_idx, desc_idx, n, i;
+    uint32_t len;
+    QUEUE_LOCK_CONF;
+
+    do {
+        n = 0;
+
+        QUEUE_LOCK(q);
+
+        mbarrier();
+
+        DEBUG("processing used ring for virtq %d\n", q->qidx);
+        DEBUG("used idx = %d\n", vq->used->idx);
+        DEBUG("last seen used = %d\n", virtq->last_seen_used);
+
+        while (n<REAP_BATCH && virtq->last_seen_used != vq->used->idx) {
+            curr_idx = virtq->last_seen_used % vq->qsz;
+            desc_idx = (uint16_t) vq->used->ring[curr_idx].id;
+            len = vq->used->ring[curr_idx].len;
+
+            struct virtq_desc *head = &vq->desc[desc_idx];
+            struct virtio_net_hdr_mrg *h = &q->hdrs[desc_idx];
+
+            done[n].callback = q->callbacks[desc_idx].callback;
+            done[n].context = q->callbacks[desc_idx].context;
+            done[n].status = NK_NET_DEV_STATUS_SUCCESS;
+
+            if (!(head->flags & VIRTQ_DESC_F_NEXT)) {
+                ERROR("head in used ring does not have next flag\n");
+                done[n].status = NK_NET_DEV_STATUS_ERROR;
+            } else if (!send) {
+                struct virtq_desc *body = &vq->desc[head->next];
+                DEBUG("head = %d body = %d len = %d\n", desc_idx, head->next, len);
+                if (len < d->hdr_len) {
+                    ERROR("short receive (%u bytes)\n", len);
+                    done[n].status = NK_NET_DEV_STATUS_ERROR;
+                } else if (d->hdr_len == sizeof(struct virtio_net_hdr_mrg) && h->num_buffers != 1) {
+                    // our buffers hold a whole frame and we do not take
+                    // large receives, so the device should never merge
+                    ERROR("packet spans %u receive buffers, dropping\n", h->num_buffers);
+                    done[n].status = NK_NET_DEV_STATUS_ERROR;
+                } else if ((h->hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+                           complete_csum(&h->hdr, (uint8_t *) body->addr, len - d->hdr_len)) {
+                    done[n].status = NK_NET_DEV_STATUS_ERROR;
+                }
+            }
 
-        memset(&d->callbacks[qidx][desc_idx], 0, sizeof(struct callback_info));
+            memset(&q->callbacks[desc_idx], 0, sizeof(struct callback_info));
 
-        // free the descriptor chain
-        if (virtio_pci_desc_chain_free(d->virtio_dev, qidx, desc_idx)) {
-            ERROR("error freeing descriptors\n");
-            return -1;
+            // free the descriptor chain
+            if (virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, desc_idx)) {
+                ERROR("error freeing descriptors\n");
+            }
+
+            q->outstanding--;
+            virtq->last_seen_used++;
+            n++;
         }
 
-        // call the corresponding callback
-        if (callback) {
-            callback(NK_NET_DEV_STATUS_SUCCESS, context);
+        if (d->event_idx) {
+            // interrupt us again on the next completion
+            *virtq_used_event(vq) = virtq->last_seen_used;
+            mbarrier();
         }
-    }
 
-    return 0;
+        QUEUE_UNLOCK(q);
+
+        // call the corresponding callbacks, which may post again
+        for (i=0;i<n;i++) {
+            if (done[i].callback) {
+                done[i].callback(done[i].status, done[i].context);
+            }
+        }
+
+        // a completion that raced with the used event update would
+        // not interrupt us, so look again
+        mbarrier();
+
+    } while (virtq->last_seen_used != vq->used->idx);
 }
 
+// legacy interrupts and MSI-X entries that do not belong to a queue
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
-    int rc = 0;
-    
-    DEBUG("interrupt\n");
-
     struct virtio_net_dev *d = (struct virtio_net_dev *) priv_data;
+    uint16_t i;
+
+    DEBUG("interrupt\n");
 
     if (d->virtio_dev->itype == VIRTIO_PCI_LEGACY_INTERRUPT) {
         // read ISR status field
@@ -369,18 +622,26 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
     }
 
     // scan used rings
-    if (process_used_ring(d, VIRTIO_NET_RECVQ_IDX)) {
-        ERROR("error processing used ring for recvq\n");
-	rc = -1;
-    }
-    if (process_used_ring(d, VIRTIO_NET_SENDQ_IDX)) {
-        ERROR("error processing used ring for sendq\n");
-	rc = -1;
+    for (i=0;i<2*d->num_pairs;i++) {
+        reap(&d->queues[i]);
     }
 
     DEBUG("interrupt done\n");
     IRQ_HANDLER_END();
-    return rc;
+    return 0;
+}
+
+// MSI-X entry of a single queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *) priv_data;
+
+    DEBUG("interrupt for virtq %u\n", q->qidx);
+
+    reap(q);
+
+    IRQ_HANDLER_END();
+    return 0;
 }
 
 
@@ -427,12 +688,131 @@ static uint64_t select_features(uint64_t features)
     uint64_t accepted = 0;
 
     FBIT_SETIF(accepted,features,VIRTIO_NET_F_MAC);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_GUEST_CSUM);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_MRG_RXBUF);
+    FBIT_SETIF(accepted,features,VIRTIO_F_EVENT_IDX);
+
+    // multiqueue is configured over the control virtqueue
+    if (FBIT_ISSET(features,VIRTIO_NET_F_MQ) && FBIT_ISSET(features,VIRTIO_NET_F_CTRL_VQ)) {
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_CTRL_VQ);
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_MQ);
+    }
 
     DEBUG("features accepted: 0x%0lx\n", accepted);
 
     return accepted;
 }
 
+// issue a command on the control virtqueue and wait for the device
+// to acknowledge it - only used at init, so we simply poll
+static int ctrl_cmd(struct virtio_net_dev *d, uint8_t class, uint8_t cmd, void *data, uint16_t len)
+{
+    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[d->ctrl_qidx];
+    struct virtq *vq = &virtq->vq;
+    uint16_t desc_idx[3];
+    uint64_t i;
+    struct {
+        struct virtio_net_ctrl_hdr hdr;
+        uint8_t data[16];
+        uint8_t ack;
+    } __packed *c;
+
+    if (len > sizeof(c->data)) {
+        ERROR("control command too large\n");
+        return -1;
+    }
+
+    if (!(c = malloc(sizeof(*c)))) {
+        ERROR("cannot allocate control command\n");
+        return -1;
+    }
+    c->hdr.class = class;
+    c->hdr.cmd = cmd;
+    memcpy(c->data, data, len);
+    c->ack = 0xff;
+
+    if (virtio_pci_desc_chain_alloc(d->virtio_dev, d->ctrl_qidx, desc_idx, 3)) {
+        ERROR("descriptor alloc failed on control queue\n");
+        free(c);
+        return -1;
+    }
+
+    vq->desc[desc_idx[0]].addr = (uint64_t) &c->hdr;
+    vq->desc[desc_idx[0]].len = sizeof(c->hdr);
+    vq->desc[desc_idx[1]].addr = (uint64_t) c->data;
+    vq->desc[desc_idx[1]].len = len;
+    vq->desc[desc_idx[2]].addr = (uint64_t) &c->ack;
+    vq->desc[desc_idx[2]].len = 1;
+    vq->desc[desc_idx[2]].flags |= VIRTQ_DESC_F_WRITE;
+
+    vq->avail->ring[vq->avail->idx % vq->qsz] = desc_idx[0];
+    mbarrier();
+    vq->avail->idx++;
+    mbarrier();
+
+    virtio_pci_virtqueue_notify(d->virtio_dev, d->ctrl_qidx);
+
+    for (i=0; i<CTRL_TIMEOUT && virtq->last_seen_used == *(volatile uint16_t *)&vq->used->idx; i++) {
+        udelay(10);
+    }
+
+    if (i==CTRL_TIMEOUT) {
+        // the device may still write the ack, so c leaks
+        ERROR("control command %u/%u timed out\n", class, cmd);
+        return -1;
+    }
+
+    virtq->last_seen_used++;
+    virtio_pci_desc_chain_free(d->virtio_dev, d->ctrl_qidx, desc_idx[0]);
+
+    i = c->ack;
+    free(c);
+
+    if (i != VIRTIO_NET_OK) {
+        ERROR("control command %u/%u failed\n", class, cmd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int queue_init(struct virtio_net_dev *d, uint16_t qidx)
+{
+    struct virtio_net_queue *q = &d->queues[qidx];
+    uint16_t qsz = d->virtio_dev->virtq[qidx].vq.qsz;
+
+    spinlock_init(&q->lock);
+    q->dev = d;
+    q->qidx = qidx;
+
+    q->hdrs = malloc(sizeof(struct virtio_net_hdr_mrg) * qsz);
+    q->callbacks = malloc(sizeof(struct callback_info) * qsz);
+
+    if (!q->hdrs || !q->callbacks) {
+        ERROR("can't allocate headers and callbacks for virtq %u\n", qidx);
+        free(q->hdrs);
+        free(q->callbacks);
+        q->hdrs = 0;
+        q->callbacks = 0;
+        return -1;
+    }
+
+    memset(q->hdrs, 0, sizeof(struct virtio_net_hdr_mrg) * qsz);
+    memset(q->callbacks, 0, sizeof(struct callback_info) * qsz);
+
+    return 0;
+}
+
+static void queues_deinit(struct virtio_net_dev *d)
+{
+    uint16_t i;
+
+    for (i=0;i<2*MAX_PAIRS;i++) {
+        free(d->queues[i].hdrs);
+        free(d->queues[i].callbacks);
+    }
+}
+
 static void test_callback(nk_net_dev_status_t status, void *context)
 {
     DEBUG("callback called: status=%d, context=%s\n", status, (const char *) context);
@@ -546,6 +926,7 @@ static int check_int(struct virtio_net_dev *d)
 int virtio_net_init(struct virtio_pci_dev *dev)
 {
     char buf[DEV_NAME_LEN];
+    uint16_t i;
 
     if (!(dev->model==VIRTIO_PCI_LEGACY_MODEL)) {
 	ERROR("currently only supported with legacy model\n");
@@ -590,36 +971,47 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
-    // allocate memory for callbacks (this memory leaks, needs to be freed)
-    uint32_t send_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_SENDQ_IDX].vq.qsz;
-    uint32_t recv_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_RECVQ_IDX].vq.qsz;
+    d->virtio_dev = dev;
 
-    d->callbacks[VIRTIO_NET_SENDQ_IDX] = malloc(send_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_SENDQ_IDX]) {
-        ERROR("can't allocate send callbacks\n");
-	virtio_pci_virtqueue_deinit(dev);
-        free(d);
-        return -1;
+    d->hdr_len = FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MRG_RXBUF) ?
+        sizeof(struct virtio_net_hdr_mrg) : sizeof(struct virtio_net_hdr);
+    d->event_idx = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_F_EVENT_IDX);
+
+    // one queue pair per cpu, if the device has enough
+    uint16_t max_pairs = 1;
+    uint16_t want_pairs = 1;
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MQ)) {
+        max_pairs = virtio_pci_read_regw(dev, VIRTIO_NET_OFF_MAX_PAIRS(dev));
+        if (!max_pairs || 2*max_pairs >= dev->num_virtqs) {
+            ERROR("device claims %u queue pairs but has %u virtqs\n", max_pairs, dev->num_virtqs);
+            virtio_pci_virtqueue_deinit(dev);
+            free(d);
+            return -1;
+        }
+        d->ctrl_qidx = 2*max_pairs;
+        want_pairs = max_pairs < nk_get_num_cpus() ? max_pairs : nk_get_num_cpus();
+        if (want_pairs > MAX_PAIRS) {
+            want_pairs = MAX_PAIRS;
+        }
     }
 
-    d->callbacks[VIRTIO_NET_RECVQ_IDX] = malloc(recv_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_RECVQ_IDX]) {
-        ERROR("can't allocate recv callbacks\n");
-	virtio_pci_virtqueue_deinit(dev);
-        free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
-        free(d);
-        return -1;
+    for (i=0;i<2*want_pairs;i++) {
+        if (queue_init(d,i)) {
+            queues_deinit(d);
+            virtio_pci_virtqueue_deinit(dev);
+            free(d);
+            return -1;
+        }
     }
 
-    memset(d->callbacks[VIRTIO_NET_SENDQ_IDX], 0, send_callbacks_size);
-    memset(d->callbacks[VIRTIO_NET_RECVQ_IDX], 0, recv_callbacks_size);
+    // the device uses only the first pair until told otherwise
+    d->num_pairs = 1;
 
     // fill out pci dev state
     dev->state = d;
     dev->teardown = teardown;
 
-    d->virtio_dev = dev;
-
     // register net dev
     snprintf(buf,DEV_NAME_LEN,"virtio-net%u",__sync_fetch_and_add(&num_devs,1));
     d->net_dev = nk_net_dev_register(buf,0,&ops,d);
@@ -627,8 +1019,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     if (!d->net_dev) {
         ERROR("Failed to register network device\n");
         virtio_pci_virtqueue_deinit(dev);
-	free(d->callbacks[VIRTIO_NET_RECVQ_IDX]);
-	free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
+        queues_deinit(d);
         free(d);
         return -1;
     }
@@ -639,7 +1030,6 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     struct pci_dev *p = dev->pci_dev;
     uint16_t num_vec = p->msix.size;
     ulong_t vec;
-    uint16_t i;
 
     // now set up interrupts
     if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
@@ -666,14 +1056,19 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 ERROR("Cannot get vector...\n");
                 return -1;
             }
+            // the entries of queue pair k go to cpu k, everything
+            // else (control queue, config changes) goes to cpu 0
+            int cpu = i<2*want_pairs ? (i/2) % nk_get_num_cpus() : 0;
             // register your handler for that vector
-            if (register_int_handler(vec, handler, d)) {
+            if (i<2*want_pairs ?
+                register_int_handler(vec, queue_handler, &d->queues[i]) :
+                register_int_handler(vec, handler, d)) {
                 ERROR("Failed to register int handler\n");
                 return -1;
                 // failed....
             }
             // set the table entry to point to your handler
-            if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+            if (pci_dev_set_msi_x_entry(p,i,vec,cpu)) {
                 ERROR("Failed to set MSI-X entry\n");
                 return -1;
             }
@@ -682,7 +1077,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 ERROR("Failed to unmask entry\n");
                 return -1;
             }
-            DEBUG("Finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+            DEBUG("Finished setting up entry %d for vector %u on cpu %d\n",i,vec,cpu);
         }
 
         // unmask entire function
@@ -728,6 +1123,21 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
+    // spread the traffic over more queue pairs
+    if (want_pairs > 1) {
+        uint16_t pairs = want_pairs;
+        if (ctrl_cmd(d, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs))) {
+            ERROR("Failed to enable %u queue pairs, using one\n", want_pairs);
+        } else {
+            d->num_pairs = want_pairs;
+        }
+    }
+
+    INFO("%s: %u queue pair(s)%s%s%s\n", buf, d->num_pairs,
+         d->event_idx ? ", event idx" : "",
+         FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_GUEST_CSUM) ? ", rx csum offload" : "",
+         FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MRG_RXBUF) ? ", mergeable rx buffers" : "");
+
     // now try to poke device
     // test_send(d);
     // for (i = 0; i < 128; i++) {
@@ -26,7 +26,9 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
 #include <nautilus/fs.h>
+#include <nautilus/list.h>
 
 #include <fs/ext2/ext2.h>
 #include "ext2fs.h"
@@ -36,6 +38,7 @@
 #define BLOCK_SIZE 1024
 #define DENTRY_ALIGN 4
 #define NUM_DIRECT_DATA_BLOCKS 12
+#define MAX_IO_BLOCKS 1024     // largest single request for file data
 #define ENDFILE 0xa0
 
 #define INFO(fmt, args...)  INFO_PRINT("ext2: " fmt, ##args)
@@ -48,13 +51,51 @@
 #endif
 
 
+// in-memory inode cache, write-through
+#define ICACHE_ENTRIES 256
+#define ICACHE_BUCKETS 64
+
+struct icache_entry {
+    struct list_head  chain;   // hash bucket, if valid
+    struct list_head  lru;     // always on the lru list
+    uint32_t          inum;    // 0 => invalid
+    struct ext2_inode inode;
+};
+
+// directory lookup cache, (directory, name) => inode number; an
+// inode number of 0 is a negative entry (name known not to exist)
+#define DCACHE_ENTRIES 512
+#define DCACHE_BUCKETS 128
+
+struct dcache_entry {
+    struct list_head chain;
+    struct list_head lru;
+    uint32_t         dir;      // 0 => invalid
+    uint32_t         inum;
+    uint32_t         hash;
+    uint8_t          name_len;
+    char             name[EXT2_NAME_LEN];
+};
+
 struct ext2_state {
     struct nk_block_dev_characteristics chars; 
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
     struct ext2_super_block super;
+
+    spinlock_t           cache_lock;   // protects both caches
+    struct list_head     icache_lru;   // most recently used first
+    struct list_head     icache_hash[ICACHE_BUCKETS];
+    struct icache_entry *icache;
+    struct list_head     dcache_lru;
+    struct list_head     dcache_hash[DCACHE_BUCKETS];
+    struct dcache_entry *dcache;
 };
 
+#define CACHE_LOCK_CONF uint8_t _cache_lock_flags
+#define CACHE_LOCK(fs) _cache_lock_flags = spin_lock_irq_save(&(fs)->cache_lock)
+#define CACHE_UNLOCK(fs) spin_unlock_irq_restore(&(fs)->cache_lock, _cache_lock_flags)
+
 #include "ext2_access.c"
 
 static size_t get_file_size(struct ext2_state *fs, struct ext2_inode *inode) 
@@ -374,6 +415,133 @@ static int map_logical_to_physical_get_put(struct ext2_state *fs, uint32_t inode
 #define map_logical_to_physical_put(fs,inode_num,inode,logical_block,physical_block) \
     map_logical_to_physical_get_put(fs,inode_num,inode,logical_block,&physical_block,1)
 
+/*
+ * Run mapping
+ *
+ * Maps a range of logical blocks to runs of contiguous physical
+ * blocks, so that a file's data can be moved in as few device
+ * requests as its layout allows.   The cursor remembers the last
+ * block of pointers reached, so a walk over a file reads each
+ * indirect block once rather than once per data block.
+ */
+
+struct map_cursor {
+    uint64_t  base;   // first logical block the cached pointers map, or -1
+    uint32_t *ptrs;   // a block's worth of pointers
+};
+
+#define MAP_CURSOR_INIT(c,buf) ((c)->base = -1ULL, (c)->ptrs = (uint32_t *)(buf))
+
+// extend a run over the following entries of a pointer array; a run
+// of holes (zero pointers) is also a run
+static uint32_t run_length(uint32_t *ptrs, uint32_t avail)
+{
+    uint32_t n;
+
+    for (n=1; n<avail; n++) {
+	if (ptrs[0] ? ptrs[n]!=ptrs[0]+n : ptrs[n]!=0) {
+	    break;
+	}
+    }
+    return n;
+}
+
+// map logical_block and as many of the following (up to max) as are
+// contiguous with it, without leaving the direct blocks or the
+// current block of pointers
+static int map_segment(struct ext2_state *fs, struct ext2_inode *inode, struct map_cursor *c,
+		       uint64_t logical_block, uint64_t max, uint32_t *physical_block, uint32_t *len)
+{
+    uint64_t ptrs_per_block = get_block_size(fs)/4;
+    uint64_t num_direct = NUM_DIRECT_DATA_BLOCKS;
+    uint64_t num_single = ptrs_per_block;
+    uint64_t num_double = ptrs_per_block*ptrs_per_block;
+    uint64_t num_triple = ptrs_per_block*ptrs_per_block*ptrs_per_block;
+    uint64_t left = logical_block;
+    uint64_t base, idx[3];
+    int levels, i;
+    uint32_t next;
+
+    if (left < num_direct) {
+	*physical_block = inode->i_block[left];
+	*len = run_length(&inode->i_block[left],MIN(max,num_direct-left));
+	return 0;
+    }
+
+    left -= num_direct;
+    base = num_direct;
+
+    if (left < num_single) {
+	levels = 1;
+	idx[0] = left;
+    } else if ((left -= num_single) < num_double) {
+	levels = 2;
+	base += num_single;
+	idx[0] = left/num_single;
+	idx[1] = left%num_single;
+    } else if ((left -= num_double) < num_triple) {
+	levels = 3;
+	base += num_single + num_double;
+	idx[0] = left/num_double;
+	idx[1] = (left%num_double)/num_single;
+	idx[2] = left%num_single;
+    } else {
+	ERROR("ext2 only goes up to 3-indirect\n");
+	return -1;
+    }
+
+    // first logical block mapped by the last level of pointers
+    base = logical_block - idx[levels-1];
+
+    if (c->base != base) {
+	next = inode->i_block[num_direct+levels-1];
+	for (i=0; i<levels && next; i++) {
+	    if (read_block(fs,next,c->ptrs)) {
+		ERROR("Cannot read %d-indirect block (level %d)\n",levels,i+1);
+		c->base = -1ULL;
+		return -1;
+	    }
+	    if (i<levels-1) {
+		next = c->ptrs[idx[i]];
+	    }
+	}
+	if (i<levels) {
+	    // a missing block of pointers - all of it is a hole
+	    memset(c->ptrs,0,ptrs_per_block*4);
+	}
+	c->base = base;
+    }
+
+    *physical_block = c->ptrs[idx[levels-1]];
+    *len = run_length(&c->ptrs[idx[levels-1]],MIN(max,ptrs_per_block-idx[levels-1]));
+
+    return 0;
+}
+
+// map logical_block and as many of the following (up to max) as are
+// contiguous with it
+static int map_run(struct ext2_state *fs, struct ext2_inode *inode, struct map_cursor *c,
+		   uint64_t logical_block, uint64_t max, uint32_t *physical_block, uint32_t *len)
+{
+    uint32_t next, n;
+
+    if (map_segment(fs,inode,c,logical_block,max,physical_block,len)) {
+	return -1;
+    }
+
+    while (*len < max) {
+	if (map_segment(fs,inode,c,logical_block+*len,max-*len,&next,&n)) {
+	    return -1;
+	}
+	if (*physical_block ? next!=*physical_block+*len : next!=0) {
+	    break;
+	}
+	*len += n;
+    }
+
+    return 0;
+}
+
 
 static int ext2_truncate(void *state, void *file, off_t len)
 { 
@@ -439,7 +607,7 @@ static int ext2_truncate(void *state, void *file, off_t len)
     }
 
     set_file_size(fs, &inode, new_file_size_bytes);
-    inode.i_blocks = new_file_size_blocks;
+    inode.i_blocks = new_file_size_blocks*(block_size/512);   // in sectors
 
     if (write_inode(fs,inode_num,&inode)) { 
 	ERROR("Failed to update inode with new sizes\n");
@@ -459,6 +627,10 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     size_t file_size_bytes, file_size_blocks;
 
     DEBUG("%sing inode %u %lu bytes at offset %lu\n",rw[write], inode_num, num_bytes, offset);
+
+    if (!num_bytes) {
+	return 0;
+    }
   
     if (read_inode(fs,inode_num,&inode)) { 
 	ERROR("Failed to read inode %u\n",inode_num);
@@ -478,7 +650,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	} else {
 	    // expand and zero fill if needed
 	    DEBUG("Writing starts past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
+	    if (ext2_truncate(fs,file,offset+num_bytes)) { 
 		ERROR("file expansion failed\n");
 		return -1;
 	    } else {
@@ -490,7 +662,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     if (write) { 
 	if (offset+num_bytes > file_size_bytes) { 
 	    DEBUG("Writing continues past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
+	    if (ext2_truncate(fs,file,offset+num_bytes)) { 
 		ERROR("file expansion failed\n");
 		return -1;
 	    } else {
@@ -513,29 +685,67 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     uint64_t num_blocks = have_first_block + num_middle_blocks + have_last_block;
 
     uint64_t logical_block_start = FLOOR_DIV(offset,block_size);
+    uint64_t logical_block_end = logical_block_start + num_blocks;
 	
     uint8_t buf[block_size];
-    uint32_t cur_logical_block;
+    uint8_t ptrs[block_size];
+    struct map_cursor cursor;
+    uint64_t cur_logical_block;
     uint32_t cur_physical_block;
+    uint32_t run;
+
+    MAP_CURSOR_INIT(&cursor,ptrs);
 
     DEBUG("logical blocks [%lu,%lu), first_offset=%lu first=%lu middle=%lu, last=%lu\n",
-	  logical_block_start, logical_block_start+num_blocks,
-	  offset_into_first_block, bytes_from_last_block);
+	  logical_block_start, logical_block_end,
+	  offset_into_first_block, bytes_from_first_block, bytes_from_middle_blocks, bytes_from_last_block);
 
     uint64_t bytes=0;
 
     for (cur_logical_block = logical_block_start;
-	 cur_logical_block < logical_block_start + num_blocks;
-	 cur_logical_block++) {
-	
-	if (map_logical_to_physical_get(fs,inode_num,&inode,cur_logical_block,&cur_physical_block)) { 
+	 cur_logical_block < logical_block_end;
+	 cur_logical_block += run) {
+
+	// a first block that is covered completely is just part of the run
+	int first = have_first_block && cur_logical_block==logical_block_start &&
+	    (offset_into_first_block || bytes_from_first_block<block_size);
+	int last = have_last_block && cur_logical_block==logical_block_end-1;
+
+	// the partial first and last blocks are mapped alone, complete
+	// blocks in between as physically contiguous runs
+	if (map_run(fs,&inode,&cursor,cur_logical_block,
+		    (first || last) ? 1 : logical_block_end - cur_logical_block - have_last_block,
+		    &cur_physical_block,&run)) { 
 	    ERROR("Unable to map logical block %lu\n", cur_logical_block);
 	    return -1;
 	}
+
+	run = MIN(run,MAX_IO_BLOCKS);
+
+	DEBUG("mapped logical blocks [%lu,%lu) to physical blocks starting at %u\n",
+	      cur_logical_block, cur_logical_block+run, cur_physical_block);
+
+	if (!cur_physical_block) {
+	    // hole - reads as zeros, and should not exist on a write
+	    // as the file has been extended with allocated blocks
+	    if (write) {
+		ERROR("Unexpected hole at logical block %lu\n",cur_logical_block);
+		return -1;
+	    }
+	    if (first) {
+		memset(srcdest+bytes,0,bytes_from_first_block);
+		bytes += bytes_from_first_block;
+	    } else if (last) {
+		memset(srcdest+bytes,0,bytes_from_last_block);
+		bytes += bytes_from_last_block;
+	    } else {
+		memset(srcdest+bytes,0,run*block_size);
+		bytes += run*block_size;
+	    }
+	    continue;
+	}
 	
-	DEBUG("mapped logical block %lu to physical block %lu\n", cur_logical_block, cur_physical_block);
-	
-	if (have_first_block && cur_logical_block==logical_block_start) {
+	if (first) {
 	    // first block (partial)
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read first partial physical block %lu\n",cur_physical_block);
@@ -556,7 +766,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    continue;
 	}
 
-	if (have_last_block && cur_logical_block==(logical_block_start+num_blocks-1)) {
+	if (last) {
 	    // last block (partial)
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read last partial physical block %lu\n",cur_physical_block);
@@ -569,7 +779,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 		// write - copy-in and flush
 		memcpy(buf,srcdest+bytes,bytes_from_last_block);
 		if (write_block(fs,cur_physical_block,buf)) { 
-		    ERROR("Failed to write first partial physical block %lu\n",cur_physical_block);
+		    ERROR("Failed to write last partial physical block %lu\n",cur_physical_block);
 		    return -1;
 		}
 	    }
@@ -577,24 +787,12 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    continue;
 	}
 	
-	// common case - r/w complete blocks
-	if (!write) {
-	    if (read_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to read middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
-	    }
-	} else {
-	    if (write_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to write middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
-	    }
+	// common case - r/w a run of complete blocks in one request
+	if (read_write_blocks(fs,cur_physical_block,run,srcdest+bytes,write)) { 
+	    ERROR("Failed to %s %u middle blocks at %lu\n",rw[write],run,cur_physical_block);
+	    return -1;
 	}
+	bytes += run*block_size;
     }
 
     if (bytes != num_bytes) { 
@@ -608,6 +806,82 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 }
 
 
+// add [addr,addr+len) to the extents, extending the last if it ends at addr
+static void add_extent(struct nk_fs_extent *ext, uint64_t *n, void *addr, uint64_t len)
+{
+    if (*n && ext[*n-1].addr+ext[*n-1].len == addr) {
+	ext[*n-1].len += len;
+    } else {
+	ext[*n].addr = addr;
+	ext[*n].len = len;
+	(*n)++;
+    }
+}
+
+static ssize_t ext2_map(void *state, void *file, off_t offset, size_t num_bytes, struct nk_fs_extent *ext, uint64_t max)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+    uint64_t block_size = get_block_size(fs);
+    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_inode inode;
+    size_t file_size_bytes;
+    uint8_t ptrs[block_size];
+    struct map_cursor cursor;
+    uint64_t logical_block, within, done, len, n = 0;
+    uint32_t physical_block, run;
+    void *addr;
+
+    DEBUG("mapping inode %u %lu bytes at offset %lu\n", inode_num, num_bytes, offset);
+
+    if (!(fs->chars.caps & NK_BLOCK_DEV_CAP_DAX)) {
+	DEBUG("device %s is not directly accessible\n", fs->dev->dev.name);
+	return -1;
+    }
+
+    if (read_inode(fs,inode_num,&inode)) { 
+	ERROR("Failed to read inode %u\n",inode_num);
+	return -1;
+    }
+
+    file_size_bytes = get_file_size(fs,&inode);
+
+    if (offset>=file_size_bytes) {
+	return 0;
+    }
+
+    num_bytes = MIN(file_size_bytes-offset,num_bytes);
+
+    MAP_CURSOR_INIT(&cursor,ptrs);
+
+    logical_block = offset / block_size;
+    within = offset % block_size;
+
+    for (done=0; done<num_bytes && n<max; done+=len, logical_block+=run, within=0) {
+	if (map_run(fs,&inode,&cursor,logical_block,CEIL_DIV(within+num_bytes-done,block_size),
+		    &physical_block,&run)) {
+	    ERROR("Unable to map logical block %lu\n", logical_block);
+	    return -1;
+	}
+	if (!physical_block) {
+	    DEBUG("Cannot map hole at logical block %lu\n", logical_block);
+	    return -1;
+	}
+	if (nk_block_dev_map(fs->dev,
+			     FLOOR_DIV((uint64_t)physical_block*block_size,fs->chars.block_size),
+			     FLOOR_DIV((uint64_t)run*block_size,fs->chars.block_size),
+			     &addr)) {
+	    ERROR("Unable to map physical blocks %u..%u\n", physical_block, physical_block+run-1);
+	    return -1;
+	}
+	len = MIN(run*block_size - within, num_bytes - done);
+	add_extent(ext,&n,addr+within,len);
+    }
+
+    DEBUG("mapped %lu bytes as %lu extents\n", done, n);
+
+    return n;
+}
+
 static ssize_t ext2_read(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes)
 {
     return ext2_read_write(state,file,srcdest,offset,num_bytes,0);
@@ -659,9 +933,10 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	inode = their_inode;
     }
     
-    // i_blocks counts in sectors, not fs blocks....
+    // i_blocks counts in sectors, not fs blocks, and includes
+    // indirect blocks, so the size is what tells us the extent
     num_sects = inode->i_blocks;
-    num_blocks = CEIL_DIV(num_sects,block_size);
+    num_blocks = CEIL_DIV(get_file_size(fs,inode),block_size);
 
     DEBUG("Directory has %u sectors / %u blocks\n",num_sects, num_blocks);
 
@@ -701,11 +976,16 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 			    ERROR("Cannot write updated directory block\n");
 			    return -1;
 			} else {
+			    dcache_put(fs,inode_num,dentry->name,dentry->name_len,dentry->inode);
 			    return 0;
 			}
 		    }
 		} 
 	    } else {
+		if (op==GET) {
+		    // we have read the entry anyway, so remember it
+		    dcache_put(fs,inode_num,de->name,de->name_len,de->inode);
+		}
 		if (op==GET || op==DEL_BY_NAME || op==DEL_BY_INODE) { 
 		    if (((op==GET || op==DEL_BY_NAME) 
 			 && de->name_len==dentry->name_len && !strncmp(de->name,dentry->name,de->name_len))
@@ -734,6 +1014,7 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 				ERROR("Cannot write updated directory block after del\n");
 				return -1;
 			    } else {
+				dcache_put(fs,inode_num,de->name,de->name_len,0);
 				// we should free the block here and update the inode 
 				// if there are now no non-empty entries on it.
 				return 0;
@@ -747,7 +1028,7 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	
     // reached end of line...
     if (op!=PUT) { 
-	return -1;
+	return 1;
     }
     
     // We are now in an add, so we need allocate new block and put
@@ -773,6 +1054,16 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	ERROR("Unable to map new directory block %u\n",logical_block);
 	return -1;
     }
+
+    set_file_size(fs,inode,(uint64_t)(logical_block+1)*block_size);
+    inode->i_blocks += block_size/512;
+
+    if (write_inode(fs,inode_num,inode)) { 
+	ERROR("Unable to update directory inode for new block\n");
+	return -1;
+    }
+
+    dcache_put(fs,inode_num,dentry->name,dentry->name_len,dentry->inode);
     
     return 0;
 }
@@ -1084,9 +1375,11 @@ static void *ext2_create(void *state, char *path, int dir)
 
     strcpy(dirname, path);
 
+    // strip the last component
     for (int i=strlen(dirname); i>=0; i--) {
 	if (dirname[i]=='/') {
 	    dirname[i] = 0;
+	    break;
 	}
     }
 
@@ -1201,9 +1494,11 @@ int ext2_remove(void *state, char *path)
 
     strcpy(dirname, path);
 
+    // strip the last component
     for (int i=strlen(dirname); i>=0; i--) {
 	if (dirname[i]=='/') {
 	    dirname[i] = 0;
+	    break;
 	}
     }
 
@@ -1283,6 +1578,7 @@ static struct nk_fs_int ext2_inter = {
     .close_file = ext2_close,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .map_file = ext2_map,
 };
 
 
@@ -1322,10 +1618,17 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 	return -1;
     }
     
+    if (cache_init(s)) {
+	ERROR("Cannot create caches for fs %s\n", fsname);
+	free(s);
+	return -1;
+    }
+    
     s->fs = nk_fs_register(fsname, flags, &ext2_inter, s);
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	cache_deinit(s);
 	free(s);
 	return -1;
     }
@@ -1338,10 +1641,20 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 int nk_fs_ext2_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct ext2_state *s;
     if (!fs) { 
 	return -1;
     } else {
-	return nk_fs_unregister(fs);
+	s = (struct ext2_state *)fs->state;
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+	nk_block_cache_sync(s->dev);
+#endif
+	if (nk_fs_unregister(fs)) {
+	    return -1;
+	}
+	cache_deinit(s);
+	free(s);
+	return 0;
     }
 }
 
@@ -103,17 +103,17 @@ static uint32_t get_block_size(struct ext2_state *fs)
     return (1024 << shift);
 }
 
-static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *srcdest, int write) 
+static int read_write_blocks(struct ext2_state * fs, uint32_t block_num, uint32_t count, void *srcdest, int write) 
 {
     uint32_t block_size = get_block_size(fs);
-    uint64_t dev_offset = FLOOR_DIV(block_num*block_size,fs->chars.block_size);
-    uint64_t dev_num    = FLOOR_DIV(block_size,fs->chars.block_size);
+    uint64_t dev_offset = FLOOR_DIV((uint64_t)block_num*block_size,fs->chars.block_size);
+    uint64_t dev_num    = FLOOR_DIV((uint64_t)count*block_size,fs->chars.block_size);
     int rc;
 
     write &= 0x1;
 
-    DEBUG("%sing block %u on fs %s / dev %s, bs=%u, dev_off=%lu, dev_num=%lu\n",
-	  rw[write], block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
+    DEBUG("%sing %u blocks at %u on fs %s / dev %s, bs=%u, dev_off=%lu, dev_num=%lu\n",
+	  rw[write], count, block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
 
     if (write) { 
 	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0); 
@@ -122,7 +122,7 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
     }
     
     if (rc) { 
-	ERROR("Failed to %s block %lu due to device error\n",rw[write],block_num);
+	ERROR("Failed to %s %u blocks at %u due to device error\n",rw[write],count,block_num);
 	return -1;
     }
 
@@ -130,8 +130,11 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
 
 }
 
+#define read_write_block(fs,block_num,srcdest,write) read_write_blocks(fs,block_num,1,srcdest,write)
 #define read_block(fs,block_num,dest)  read_write_block(fs,block_num,dest,0)
 #define write_block(fs,block_num,src)  read_write_block(fs,block_num,src,1)
+#define read_blocks(fs,block_num,count,dest)  read_write_blocks(fs,block_num,count,dest,0)
+#define write_blocks(fs,block_num,count,src)  read_write_blocks(fs,block_num,count,src,1)
 
 
 #define blocks_per_group(sb) ((sb)->s_blocks_per_group)
@@ -187,19 +190,102 @@ static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_nu
 #define read_block_group(fs,block_group_num,dest)  read_write_block_group(fs,block_group_num,dest,0)
 #define write_block_group(fs,block_group_num,src)  read_write_block_group(fs,block_group_num,src,1)
 
+/*
+ * Inode cache
+ *
+ * Inodes are cached write-through: a write goes to disk and then
+ * updates the cached copy, so the cache never holds dirty state.
+ * Entries live on one lru list (least recently used last), and
+ * valid ones also on a hash chain by inode number.
+ */
+
+static inline uint32_t icache_bucket(uint32_t inum)
+{
+    return (inum * 2654435761U) % ICACHE_BUCKETS;
+}
+
+// must hold cache lock
+static struct icache_entry *icache_find(struct ext2_state *fs, uint32_t inum)
+{
+    struct icache_entry *e;
+
+    list_for_each_entry(e,&fs->icache_hash[icache_bucket(inum)],chain) {
+	if (e->inum==inum) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+static int icache_get(struct ext2_state *fs, uint32_t inum, struct ext2_inode *dest)
+{
+    struct icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    CACHE_LOCK(fs);
+    if ((e = icache_find(fs,inum))) {
+	*dest = e->inode;
+	list_move(&e->lru,&fs->icache_lru);
+    }
+    CACHE_UNLOCK(fs);
+
+    return e ? 0 : -1;
+}
+
+static void icache_put(struct ext2_state *fs, uint32_t inum, struct ext2_inode *src)
+{
+    struct icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    CACHE_LOCK(fs);
+    if (!(e = icache_find(fs,inum))) {
+	// recycle the least recently used entry
+	e = list_entry(fs->icache_lru.prev,struct icache_entry,lru);
+	if (e->inum) {
+	    list_del_init(&e->chain);
+	}
+	e->inum = inum;
+	list_add(&e->chain,&fs->icache_hash[icache_bucket(inum)]);
+    }
+    e->inode = *src;
+    list_move(&e->lru,&fs->icache_lru);
+    CACHE_UNLOCK(fs);
+}
+
+static void icache_invalidate(struct ext2_state *fs, uint32_t inum)
+{
+    struct icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    CACHE_LOCK(fs);
+    if ((e = icache_find(fs,inum))) {
+	list_del_init(&e->chain);
+	e->inum = 0;
+	list_move_tail(&e->lru,&fs->icache_lru);
+    }
+    CACHE_UNLOCK(fs);
+}
+
 static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *srcdest, int write) 
 {
     struct ext2_group_desc bg;
     uint32_t inode_block;
     uint64_t inode_offset;
     uint32_t block_size = get_block_size(fs);
-    uint64_t inodes_per_block = FLOOR_DIV(block_size,sizeof(struct ext2_inode));
+    uint32_t inode_size = EXT2_INODE_SIZE(&fs->super);
+    uint64_t inodes_per_block = FLOOR_DIV(block_size,inode_size);
+    uint32_t index = (inode_num - 1) % inodes_per_group(&fs->super);
     uint8_t buf[block_size];
-    struct ext2_inode* inode_table = (struct ext2_inode *)buf;
+    struct ext2_inode* inode = 0;
 
     write &= 0x1;
 
-    if (read_block_group(fs,inode_num/inodes_per_group(&fs->super),&bg)) { 
+    if (!write && !icache_get(fs,inode_num,srcdest)) {
+	DEBUG("inode %u found in cache\n", inode_num);
+	return 0;
+    }
+
+    if (read_block_group(fs,(inode_num - 1)/inodes_per_group(&fs->super),&bg)) { 
 	ERROR("Cannot read block group\n");
 	return -1;
     }
@@ -207,12 +293,12 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
     DEBUG("block group:  bbitmap=%u ibitmap=%u, itable=%u\n", 
 	  bg.bg_block_bitmap, bg.bg_inode_bitmap, bg.bg_inode_table);
 
-    //get index into inode table
-    inode_block  = bg.bg_inode_table + FLOOR_DIV(inode_num - 1, inodes_per_block);
-    inode_offset = (inode_num - 1) % inodes_per_block;
+    //get index into this group's inode table
+    inode_block  = bg.bg_inode_table + FLOOR_DIV(index, inodes_per_block);
+    inode_offset = (index % inodes_per_block) * inode_size;
 
     DEBUG("%sing inode %u (block %u, offset %u) inode_size=%u  on fs %s\n", 
-	  rw[write], inode_num, inode_block, inode_offset, sizeof(struct ext2_inode), fs->fs->name);
+	  rw[write], inode_num, inode_block, inode_offset, inode_size, fs->fs->name);
 
     //gets pointer to block where inodes are located 
     if (read_block(fs,inode_block,buf)) { 
@@ -220,18 +306,22 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
 	return -1;
     }
 
+    inode = (struct ext2_inode *)(buf + inode_offset);
+
     if (write) { 
-	inode_table[inode_offset] = *srcdest;
+	*inode = *srcdest;
 	if (write_block(fs,inode_block,buf)) { 
 	    ERROR("Cannot write inode block\n");
+	    icache_invalidate(fs,inode_num);
 	    return -1;
-	} else {
-	    return 0;
 	}
     } else {
-	*srcdest = inode_table[inode_offset];
-	return 0;
+	*srcdest = *inode;
     }
+
+    icache_put(fs,inode_num,srcdest);
+
+    return 0;
 }
 
 #define read_inode(fs,inode_num,dest)  read_write_inode(fs,inode_num,dest,0)
@@ -297,146 +387,232 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 			      struct ext2_dir_entry_2 *dentry,
 			      enum dentry_op           op);
 
-/* get_inode_num_from_dir
+/*
+ * Directory entry cache
  *
- * searches a directory for a file by name
- * returns the inode number of the file if found, or 0
+ * Maps (directory inode, name) to an inode number, hashed on both.
+ * An inode number of zero is a negative entry, recording that the
+ * name is known not to exist, so repeated lookups of missing files
+ * do not rescan the directory either.   Entries are added as
+ * directories are scanned and updated as entries are added and
+ * removed, so they never go stale.
  */
-static uint32_t get_inode_num_from_dir(struct ext2_state *fs, 
-				       uint32_t           inode_num,
-				       struct ext2_inode *dir, 
-				       char *name) 
+
+static uint32_t dcache_hash(uint32_t dir, char *name, uint32_t len)
 {
-    struct ext2_dir_entry_2 dentry;
-    uint32_t inum;
+    uint32_t h = 2166136261U ^ dir;   // FNV-1a
+    uint32_t i;
 
-    DEBUG("get_inode_num_from_dir on %s, inode_num=%u, dir=%p, search=%s\n",
-	  fs->fs->name,inode_num,dir,name);
+    for (i=0;i<len;i++) {
+	h ^= (uint8_t)name[i];
+	h *= 16777619U;
+    }
+    return h;
+}
 
-    strcpy(dentry.name,name);
-    dentry.name_len=strlen(name);
-    dentry.rec_len=EXT2_DIR_REC_LEN(dentry.name_len);
-    
-    if (dentry_get_put_del(fs,inode_num,dir,&dentry,GET)) { 
-	ERROR("Failed to get directory entry for %s\n",name);
-	return 0;
-    } else {
-	return dentry.inode;
+// must hold cache lock
+static struct dcache_entry *dcache_find(struct ext2_state *fs, uint32_t dir, char *name, uint32_t len, uint32_t hash)
+{
+    struct dcache_entry *e;
+
+    list_for_each_entry(e,&fs->dcache_hash[hash % DCACHE_BUCKETS],chain) {
+	if (e->hash==hash && e->dir==dir && e->name_len==len && !memcmp(e->name,name,len)) {
+	    return e;
+	}
     }
+    return 0;
+}
 
-    /*
-    uint32_t block_size = get_block_size(fs);
-    uint8_t buf[block_size];
+// 0 on hit, with *inum zero for a negative entry
+static int dcache_get(struct ext2_state *fs, uint32_t dir, char *name, uint32_t len, uint32_t *inum)
+{
+    uint32_t hash = dcache_hash(dir,name,len);
+    struct dcache_entry *e;
+    CACHE_LOCK_CONF;
+
+    CACHE_LOCK(fs);
+    if ((e = dcache_find(fs,dir,name,len,hash))) {
+	*inum = e->inum;
+	list_move(&e->lru,&fs->dcache_lru);
+    }
+    CACHE_UNLOCK(fs);
 
-    DEBUG("get_inode_num_from_dir(%s, %p, %s)\n", fs->fs->name, dir, name);
+    return e ? 0 : -1;
+}
 
-    DEBUG("directory inode has i_block[0]=%lu\n",dir->i_block[0]);
+static void dcache_put(struct ext2_state *fs, uint32_t dir, char *name, uint32_t len, uint32_t inum)
+{
+    uint32_t hash = dcache_hash(dir,name,len);
+    struct dcache_entry *e;
+    CACHE_LOCK_CONF;
 
-    if (!dir->i_block[0]) {
-	return 0;
+    if (len > EXT2_NAME_LEN) {
+	return;
     }
 
-    //get pointer to block where directory entries reside using inode of directory
-    if (read_block(fs,dir->i_block[0],buf)) { 
-	ERROR("Cannot read block for directory inode\n");
-	return 0;
+    CACHE_LOCK(fs);
+    if (!(e = dcache_find(fs,dir,name,len,hash))) {
+	// recycle the least recently used entry
+	e = list_entry(fs->dcache_lru.prev,struct dcache_entry,lru);
+	if (e->dir) {
+	    list_del_init(&e->chain);
+	}
+	e->dir = dir;
+	e->hash = hash;
+	e->name_len = len;
+	memcpy(e->name,name,len);
+	list_add(&e->chain,&fs->dcache_hash[hash % DCACHE_BUCKETS]);
     }
+    e->inum = inum;
+    list_move(&e->lru,&fs->dcache_lru);
+    CACHE_UNLOCK(fs);
+}
 
-    DEBUG("Block read\n");
+static int cache_init(struct ext2_state *fs)
+{
+    uint32_t i;
 
-    struct ext2_dir_entry_2* dentry = (struct ext2_dir_entry_2*)buf;
+    spinlock_init(&fs->cache_lock);
 
-    //scan only valid files in dentry
-    //while(dentry->inode){
-    //ssize_t left = block_size - dentry->rec_len;  // huh?  PAD
-    ssize_t left = block_size;  // huh?  PAD
-    int count = 0;
-    while (left > 0 && dentry->rec_len!=0 ) {
-	//while(++count < 20) {
-	//DEBUG("malloc %d", dentry->name_len);
-	char tempname[dentry->name_len+1];
+    INIT_LIST_HEAD(&fs->icache_lru);
+    INIT_LIST_HEAD(&fs->dcache_lru);
+    for (i=0;i<ICACHE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&fs->icache_hash[i]);
+    }
+    for (i=0;i<DCACHE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&fs->dcache_hash[i]);
+    }
 
-	DEBUG("Entry has length %lu\n",dentry->name_len);
+    fs->icache = malloc(sizeof(struct icache_entry)*ICACHE_ENTRIES);
+    fs->dcache = malloc(sizeof(struct dcache_entry)*DCACHE_ENTRIES);
 
-	//copy file name to temp name, then null terminate it
-	memcpy(tempname,dentry->name,dentry->name_len);
-	tempname[dentry->name_len] = 0;
+    if (!fs->icache || !fs->dcache) {
+	ERROR("Cannot allocate inode and directory caches\n");
+	free(fs->icache);
+	free(fs->dcache);
+	return -1;
+    }
 
-	//if there is a match, return the inode number
-	//DEBUG("INODE DIR: name %s, tempname %s", name, tempname);
-	//DEBUG("INODE DIR: blocksize %d, reclen %d", blocksize, dentry->rec_len);
-	
-	if (!strcmp(name,tempname)) {
-	    return dentry->inode;
-	}
+    memset(fs->icache,0,sizeof(struct icache_entry)*ICACHE_ENTRIES);
+    memset(fs->dcache,0,sizeof(struct dcache_entry)*DCACHE_ENTRIES);
 
-	dentry = (struct ext2_dir_entry_2*)((void*)dentry+dentry->rec_len);
-	left -= dentry->rec_len;
+    for (i=0;i<ICACHE_ENTRIES;i++) {
+	INIT_LIST_HEAD(&fs->icache[i].chain);
+	list_add_tail(&fs->icache[i].lru,&fs->icache_lru);
     }
+    for (i=0;i<DCACHE_ENTRIES;i++) {
+	INIT_LIST_HEAD(&fs->dcache[i].chain);
+	list_add_tail(&fs->dcache[i].lru,&fs->dcache_lru);
+    }
+
     return 0;
-    */
+}
+
+static void cache_deinit(struct ext2_state *fs)
+{
+    free(fs->icache);
+    free(fs->dcache);
+}
+
+
+/* get_inode_num_from_dir
+ *
+ * searches a directory for a file by name
+ * returns the inode number of the file if found, or 0
+ */
+static uint32_t get_inode_num_from_dir(struct ext2_state *fs, 
+				       uint32_t           inode_num,
+				       struct ext2_inode *dir, 
+				       char *name,
+				       uint32_t len) 
+{
+    struct ext2_dir_entry_2 dentry;
+    int rc;
+
+    DEBUG("get_inode_num_from_dir on %s, inode_num=%u, dir=%p, search=%.*s\n",
+	  fs->fs->name,inode_num,dir,len,name);
+
+    memset(&dentry,0,sizeof(dentry));
+    memcpy(dentry.name,name,len);
+    dentry.name_len=len;
+    dentry.rec_len=EXT2_DIR_REC_LEN(dentry.name_len);
+
+    rc = dentry_get_put_del(fs,inode_num,dir,&dentry,GET);
+
+    if (rc<0) {
+	ERROR("Failed to get directory entry for %.*s\n",len,name);
+	return 0;
+    } else if (rc>0) {
+	DEBUG("No entry for %.*s\n",len,name);
+	dcache_put(fs,inode_num,name,len,0);
+	return 0;
+    } else {
+	return dentry.inode;
+    }
 }
 
 /* get_inode_by_path
  *
  * given a path to a file, tries to find the inode number of the file
  * returns inode number of file if found, or 0
+ *
+ * Each component is looked up in the directory entry cache first,
+ * so only components not seen before touch the directory.
  */
 static uint32_t get_inode_num_by_path(struct ext2_state *fs, char *path) 
 {
-    int num_parts = 0;
+    uint32_t cur_inode_num = EXT2_ROOT_INO;
+    uint32_t new_inode_num;
+    struct ext2_inode cur_inode;
+    char *part, *end;
+    uint32_t len;
 
     DEBUG("get_inode_num_by_path(%s,%s)\n",fs->fs->name, path);
 
-    if (!strcmp(path, "/")) {
-	DEBUG("root dir\n");
-	return EXT2_ROOT_INO;
-    }
-
-    char **parts = split_path(path, &num_parts);
-    char *cur_part = *parts;
+    for (part=path; *part; part=end) {
+	while (*part=='/') {
+	    part++;
+	}
+	if (!*part) {
+	    break;
+	}
+	for (end=part; *end && *end!='/'; end++) {
+	}
+	len = end - part;
 
-    int i;
-    struct ext2_inode cur_inode;
-    uint32_t new_inode_num = 0;
-    uint32_t cur_inode_num;
+	if (len > EXT2_NAME_LEN) {
+	    ERROR("Path component too long in %s\n",path);
+	    return 0;
+	}
 
-    if (get_root_dir_inode(fs,&cur_inode)) { 
-	ERROR("Cannot get root directory inode\n");
-	free_split_path(parts,num_parts);
-	return 0;
-    }
-    cur_inode_num=EXT2_ROOT_INO;
+	DEBUG("Considering part %.*s\n",len,part);
 
-    DEBUG("Root inode fetched has mode %u, uid %u, size %u, blocks %u\n",
-	  cur_inode.i_mode, cur_inode.i_uid, cur_inode.i_size, cur_inode.i_blocks);
+	if (dcache_get(fs,cur_inode_num,part,len,&new_inode_num)) {
+	    //treat current inode as directory, and search for inode of next part
+	    if (read_inode(fs, cur_inode_num, &cur_inode)) { 
+		ERROR("Failed to read inode...\n");
+		return 0;
+	    }
+	    if ((cur_inode.i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
+		DEBUG("%.*s is not in a directory\n",len,part);
+		return 0;
+	    }
+	    new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, &cur_inode, part, len);
+	}
 
-    DEBUG("%s has %d parts\n", path, num_parts);
-    
-    for(i = 1; i <= num_parts; i++) {   // HUH?  PAD (<=)
-	//treat current inode as directory, and search for inode of next part
-	DEBUG("Considering part %s\n",cur_part);
-	new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, &cur_inode, cur_part);
 	if (!new_inode_num) {
-	    ERROR("Finished search and did not find element %s\n",cur_part);
-	    free_split_path(parts,num_parts);
-	    return 0;
-	}
-	DEBUG("GET INODE found: %d, %s\n", new_inode_num, cur_part);
-	if (read_inode(fs, new_inode_num, &cur_inode)) { 
-	    ERROR("Failed to read inode...\n");
-	    free_split_path(parts,num_parts);
+	    DEBUG("Finished search and did not find element %.*s\n",len,part);
 	    return 0;
 	}
+
+	DEBUG("GET INODE found: %u, %.*s\n", new_inode_num, len, part);
 	cur_inode_num = new_inode_num;
-	cur_part = *(parts+i);
     }
 
     //final inode is the requested file. return its number
-    DEBUG("Found inode: %u\n", new_inode_num);
-    free_split_path(parts,num_parts);
+    DEBUG("Found inode: %u\n", cur_inode_num);
 
-    return new_inode_num;
+    return cur_inode_num;
 }
 
 static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
@@ -480,6 +656,7 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 	    byte = actual/8;
 	    bit = actual%8;
 	    buf[byte] &= ~(0x1<<bit);
+	    icache_invalidate(fs,*num);
 	} else {
 	    for (byte=0; byte<block_size; byte++) {
 		cur_byte = buf[byte];
@@ -27,6 +27,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
 #include <nautilus/fs.h>
 
 #include <fs/fat32/fat32.h>
@@ -646,6 +647,85 @@ static void fat32_close(void *state, void *file)
     }
 }
 
+static ssize_t fat32_map(void *state, void *file, off_t offset, size_t num_bytes, struct nk_fs_extent *ext, uint64_t max)
+{
+    struct fat32_state *fs = (struct fat32_state *) state;
+    uint32_t dir_cluster_num;
+    dir_entry dir_ent;
+    uint64_t done, len, n = 0;
+    void *addr;
+
+    DEBUG("map from fs %s file %s offset %lu %lu bytes\n", fs->fs->name, (char*) file, offset, num_bytes);
+
+    if (!(fs->chars.caps & NK_BLOCK_DEV_CAP_DAX)) {
+	DEBUG("device %s is not directly accessible\n", fs->dev->dev.name);
+	return -1;
+    }
+
+    if (path_lookup(fs, (char*) file, &dir_cluster_num, &dir_ent, 0) == -1) {
+	DEBUG("Directory entry does not exist\n");
+	return -1;
+    }
+
+    off_t file_size = (off_t)dir_ent.size;
+
+    if (offset >= file_size) {
+	return 0;
+    }
+
+    num_bytes = MIN(num_bytes, file_size - offset);
+
+    uint32_t cluster_size = get_cluster_size(fs); // in bytes
+    uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    uint32_t cluster_min = fs->bootrecord.rootdir_cluster; // min valid cluster number
+    uint32_t cluster_max = fs->table_chars.data_end - fs->table_chars.data_start; // max valid cluster number
+    off_t remainder = offset;
+
+#define NEXT_CLUSTER()							\
+    do {								\
+	uint32_t next = fs->table_chars.FAT32_begin[cluster_num];	\
+	if (next < cluster_min || next > cluster_max) {			\
+	    DEBUG("Bogus next cluster value (%x)\n",next);		\
+	    return -1;							\
+	}								\
+	cluster_num = next;						\
+    } while (0)
+
+    // scan the FAT chain until we find the relevant cluster
+    while (remainder >= cluster_size) {
+	NEXT_CLUSTER();
+	remainder -= cluster_size;
+    }
+
+    // each cluster is mapped on its own; clusters that follow each
+    // other on the disk end up in the same extent
+    for (done=0; done<num_bytes && n<max; ) {
+	if (nk_block_dev_map(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, &addr)) {
+	    ERROR("Unable to map cluster %u\n", cluster_num);
+	    return -1;
+	}
+	len = MIN(cluster_size - remainder, num_bytes - done);
+	if (n && ext[n-1].addr+ext[n-1].len == addr+remainder) {
+	    ext[n-1].len += len;
+	} else {
+	    ext[n].addr = addr+remainder;
+	    ext[n].len = len;
+	    n++;
+	}
+	done += len;
+	remainder = 0;
+	if (done < num_bytes) {
+	    NEXT_CLUSTER();
+	}
+    }
+
+    DEBUG("mapped %lu bytes as %lu extents\n", done, n);
+
+    return n;
+
+#undef NEXT_CLUSTER
+}
+
 static struct nk_fs_int fat32_inter = {
     .stat_path = fat32_stat_path,
     .create_file = fat32_create_file,
@@ -658,6 +738,7 @@ static struct nk_fs_int fat32_inter = {
     .close_file = fat32_close,
     .read_file = fat32_read,
     .write_file = fat32_write,
+    .map_file = fat32_map,
 };
 
 static void fat32_demo(struct fat32_state *s)
@@ -760,6 +841,9 @@ int nk_fs_fat32_detach(char *fsname)
     if (!fs) {
         return -1;
     } else {
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+        nk_block_cache_sync(((struct fat32_state *)fs->state)->dev);
+#endif
         return nk_fs_unregister(fs);
     }
 }
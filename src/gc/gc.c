@@ -49,6 +49,10 @@ handle_collect (char * buf, void * priv)
 		 s.num_blocks, s.total_bytes);
     nk_vc_printf("smallest freed block: %lu bytes, largest freed block: %lu bytes\n",
 		 s.min_block, s.max_block);
+    nk_vc_printf("pause: %lu ns (clear %lu ns, mark %lu ns, sweep %lu ns) on %lu cpus\n",
+		 s.pause_ns, s.clear_ns, s.mark_ns, s.sweep_ns, s.num_cpus);
+    nk_vc_printf("%lu blocks marked, %lu stolen, %lu mark stack overflows\n",
+		 s.blocks_marked, s.blocks_stolen, s.mark_overflows);
     return 0;
 #else 
     nk_vc_printf("No garbage collector is enabled...\n");
@@ -74,6 +78,10 @@ handle_leaks (char * buf, void * priv)
 		 s.num_blocks, s.total_bytes);
     nk_vc_printf("smallest leaked block: %lu bytes, largest leaked block: %lu bytes\n",
 		 s.min_block, s.max_block);
+    nk_vc_printf("pause: %lu ns (clear %lu ns, mark %lu ns, sweep %lu ns) on %lu cpus\n",
+		 s.pause_ns, s.clear_ns, s.mark_ns, s.sweep_ns, s.num_cpus);
+    nk_vc_printf("%lu blocks marked, %lu stolen, %lu mark stack overflows\n",
+		 s.blocks_marked, s.blocks_stolen, s.mark_overflows);
     return 0;
 #else 
     nk_vc_printf("No garbage collector is enabled...\n");
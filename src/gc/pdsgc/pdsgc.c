@@ -30,12 +30,17 @@
 #include <nautilus/thread.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/backtrace.h>
+#include <nautilus/barrier.h>
+#include <nautilus/wsdeque.h>
 #include <gc/pdsgc/pdsgc.h>
 
 #define VISITED 0x1
 
-#define GC_STACK_SIZE (4*1024*1024)
+// the collector no longer recurses, so its own stack can be modest
+#define GC_STACK_SIZE (256*1024)
 #define GC_MAX_THREADS (NAUT_CONFIG_MAX_THREADS*16)
+// per-core private mark stack (entries)
+#define GC_MARK_STACK_ENTRIES (16*1024)
 
 #ifndef NAUT_CONFIG_DEBUG_PDSGC
 #define DEBUG(fmt, args...)
@@ -68,8 +73,51 @@ static struct thread_stack_limits {
 
 static void *kmem_internal_start, *kmem_internal_end;
 
+//
+// Marking is done by all cores while the world is stopped.  Each core
+// has a private mark stack and a work-stealing deque of blocks still
+// to be scanned.  Newly marked blocks go on the deque, and onto the
+// private stack only if the deque is full.  A core that runs out of
+// work steals from the others, nearest cpu id first.   If a private
+// stack overflows, the block stays marked but unscanned, and once
+// marking terminates, all marked blocks are rescanned in parallel.
+//
+// An entry is a block address with its order in the top byte
+//
+#define GC_ENTRY(addr,order)  ((uint64_t)(addr) | ((uint64_t)(order)<<56))
+#define GC_ENTRY_ADDR(e)      ((void*)((e) & ((1ULL<<56)-1)))
+#define GC_ENTRY_SIZE(e)      (1ULL<<((e)>>56))
+
+struct gc_worker {
+    nk_wsdeque_t  shared;         // blocks others may take
+    uint64_t     *stack;          // private mark stack
+    uint64_t      top;
+    uint64_t      marked;
+    uint64_t      stolen;
+    int           rc;
+    // sweep results of this core
+    struct nk_gc_pdsgc_stats sweep;
+} __attribute__((aligned(64)));
+
+static struct gc_worker *gc_workers=0;
+static uint64_t gc_num_workers;              // participating in this pass
+static uint64_t gc_max_workers;              // allocated
+
+static volatile uint64_t gc_next_root;
+static volatile uint64_t gc_idle;
+static volatile uint64_t gc_overflow;
+static uint64_t gc_overflows;
+static nk_counting_barrier_t gc_barrier;
+static int (*gc_handle_unvisited)(void *block, void *state);
+
+static uint64_t gc_time_mark_start;
+static uint64_t gc_time_mark_end;
+static uint64_t gc_time_sweep_end;
+
 int  nk_gc_pdsgc_init()
 {
+    uint64_t i;
+
     gc_stack = kmem_mallocz(GC_STACK_SIZE);
     if (!gc_stack) {
 	ERROR("Failed to allocate GC stack\n");
@@ -80,12 +128,30 @@ int  nk_gc_pdsgc_init()
 	ERROR("Failed to allocate GC thread stack limits array\n");
 	return -1;
     } 
-    INFO("init\n");
+    gc_max_workers = nk_get_num_cpus();
+    gc_workers = kmem_mallocz(sizeof(struct gc_worker)*gc_max_workers);
+    if (!gc_workers) {
+	ERROR("Failed to allocate GC workers\n");
+	return -1;
+    }
+    for (i=0;i<gc_max_workers;i++) {
+	gc_workers[i].stack = kmem_mallocz(sizeof(uint64_t)*GC_MARK_STACK_ENTRIES);
+	if (!gc_workers[i].stack) {
+	    ERROR("Failed to allocate GC mark stack\n");
+	    return -1;
+	}
+    }
+    INFO("init (%lu mark workers)\n", gc_max_workers);
     return 0;
 }
 
 void nk_gc_bdsgc_deinit()
 {
+    uint64_t i;
+    for (i=0;i<gc_max_workers;i++) {
+	kmem_free(gc_workers[i].stack);
+    }
+    kmem_free(gc_workers);
     kmem_free(gc_stack);
     kmem_free(gc_thread_stack_limits);
     INFO("deinit\n");
@@ -206,47 +272,91 @@ static int capture_thread_stack_limits()
     }
 }
 
-static inline int handle_block(void *start, void *end);
+static inline struct gc_worker *gc_me()
+{
+    return &gc_workers[gc_num_workers==1 ? 0 : my_cpu_id()];
+}
+
+static inline int handle_block(struct gc_worker *w, void *start, void *end);
+
+// queue a newly marked block for scanning
+static inline int push_block(struct gc_worker *w, void *block_addr, uint64_t block_size)
+{
+    if (block_size & (block_size-1)) {
+	// only the boot block is not a power of two, and it is
+	// marked only once, so scanning it now is bounded
+	return handle_block(w,block_addr,block_addr+block_size);
+    }
+
+    uint64_t e = GC_ENTRY(block_addr,__builtin_ctzl(block_size));
+
+    if (nk_wsdeque_push(&w->shared,(void*)e)) {
+	if (w->top < GC_MARK_STACK_ENTRIES) {
+	    w->stack[w->top++] = e;
+	} else {
+	    // leave it marked; it will be scanned in the rescan
+	    gc_overflow = 1;
+	}
+    }
+
+    return 0;
+}
+
+static inline uint64_t pop_block(struct gc_worker *w)
+{
+    if (w->top) {
+	return w->stack[--w->top];
+    }
+    return (uint64_t)nk_wsdeque_pop(&w->shared);
+}
+
+static uint64_t steal_block(struct gc_worker *w)
+{
+    uint64_t i, e;
+    uint64_t me = w - gc_workers;
+
+    for (i=1;i<gc_num_workers;i++) {
+	struct gc_worker *v = &gc_workers[(me+i) % gc_num_workers];
+	if (nk_wsdeque_size(&v->shared) && (e = (uint64_t)nk_wsdeque_steal(&v->shared))) {
+	    w->stolen++;
+	    return e;
+	}
+    }
+    return 0;
+}
 
-static inline int handle_address(void *start)
+static inline int handle_address(struct gc_worker *w, void *start)
 {
     void *block_addr;
-    uint64_t block_size, flags;
-    void *approx_rsp = &approx_rsp;
+    uint64_t block_size;
+    int rc;
 
     // short circuit 0 
     if (!start) { 
 	return 0;
     }
 
-    if ((addr_t)approx_rsp < (addr_t)(gc_stack+4096)) { 
-	ERROR("Ran out of room in the GC stack!\n");
-	return -1;
-    }
+    rc = kmem_find_and_mark_block(start,VISITED,&block_addr,&block_size);
 
-    if (kmem_find_block(start,&block_addr,&block_size,&flags)) { 
-	//DEBUG("Skipping address %p as it is non-heap\n",start);
+    if (rc<0) { 
 	// not a valid block - skip
 	return 0;
     }
 
-    if (flags & VISITED) { 
+    if (rc>0) { 
 	DEBUG("Skipping address %p (block %p) as it is already marked\n", start, block_addr);
 	return 0;
     }
 
-    if (kmem_set_block_flags(block_addr, flags | VISITED)) {
-	ERROR("Failed to set visited on block %p\n", block_addr);
-	return -1;
-    }
+    DEBUG("Visited block %p via address %p - now queueing it for scanning\n", block_addr, start);
 
-    DEBUG("Visited block %p via address %p - now visiting its children\n", block_addr, start);
+    w->marked++;
 
-    return handle_block(block_addr,block_addr+block_size);
+    return push_block(w,block_addr,block_size);
 }
     
 
-static inline int handle_block(void *start, void *end)
+static inline int handle_block(struct gc_worker *w, void *start, void *end)
 {
     void *cur;
 
@@ -263,7 +373,7 @@ static inline int handle_block(void *start, void *end)
     }
 
     if ((addr_t)start%8 || (addr_t)end%8) { 
-	ERROR("Block %p-%p is not aligned to a pointer\n");
+	ERROR("Block %p-%p is not aligned to a pointer\n",start,end);
 	return -1;
     }
     
@@ -278,14 +388,14 @@ static inline int handle_block(void *start, void *end)
 	      start,end,kmem_internal_start,kmem_internal_end);
 	
 	for (cur=start;cur<kmem_internal_start;cur+=sizeof(addr_t)) { 
-	    if (handle_address(*(void**)cur)) { 
+	    if (handle_address(w,*(void**)cur)) { 
 		ERROR("Failed to handle address %p - failing block\n", cur);
 		return -1;
 	    }
 	}
 	
 	for (cur=kmem_internal_end;cur<end;cur+=sizeof(addr_t)) { 
-	    if (handle_address(*(void**)cur)) { 
+	    if (handle_address(w,*(void**)cur)) { 
 		ERROR("Failed to handle address %p - failing block\n", cur);
 		return -1;
 	    }
@@ -294,7 +404,7 @@ static inline int handle_block(void *start, void *end)
     } else {
 	
 	for (cur=start;cur<end;cur+=sizeof(addr_t)) { 
-	    if (handle_address(*(void**)cur)) { 
+	    if (handle_address(w,*(void**)cur)) { 
 		ERROR("Failed to handle address %p - failing block\n", cur);
 		return -1;
 	    }
@@ -304,84 +414,211 @@ static inline int handle_block(void *start, void *end)
     return 0;
 }
 
-static int mark_gc_state()
+static inline int scan_entry(struct gc_worker *w, uint64_t e)
 {
-    void *block_addr;
-    uint64_t block_size, flags;
+    void *addr = GC_ENTRY_ADDR(e);
+    return handle_block(w,addr,addr+GC_ENTRY_SIZE(e));
+}
 
-    if (kmem_find_block(gc_stack,&block_addr,&block_size,&flags)) { 
-	ERROR("Could not find GC stack?!\n");
-	return -1;
+// scan everything this core has queued, without looking elsewhere
+static int drain_local(struct gc_worker *w)
+{
+    uint64_t e;
+
+    while ((e = pop_block(w))) {
+	if (scan_entry(w,e)) {
+	    return -1;
+	}
     }
+    return 0;
+}
 
-    if (kmem_set_block_flags(block_addr, flags | VISITED)) {
-	ERROR("Failed to set visited on GC stack\n");
-	return -1;
+// scan until every core has run out of work
+static void drain_all(struct gc_worker *w)
+{
+    uint64_t e, i;
+
+    while (1) {
+	e = pop_block(w);
+	if (!e) {
+	    e = steal_block(w);
+	}
+	if (e) {
+	    if (scan_entry(w,e)) {
+		w->rc = -1;
+	    }
+	    continue;
+	}
+
+	// we have nothing; wait for more or for everyone else to run out
+	__sync_fetch_and_add(&gc_idle,1);
+	while (1) {
+	    if (gc_idle == gc_num_workers) {
+		return;
+	    }
+	    for (i=0;i<gc_num_workers;i++) {
+		if (nk_wsdeque_size(&gc_workers[i].shared)) {
+		    break;
+		}
+	    }
+	    if (i<gc_num_workers) {
+		__sync_fetch_and_sub(&gc_idle,1);
+		break;
+	    }
+	    __asm__ __volatile__ ("pause");
+	}
     }
+}
 
-    if (kmem_find_block(gc_thread_stack_limits,&block_addr,&block_size,&flags)) { 
-	ERROR("Could not find GC thread stack limits?!\n");
+static int mark_gc_block(void *p)
+{
+    void *block_addr;
+    uint64_t block_size;
+
+    if (kmem_find_and_mark_block(p,VISITED,&block_addr,&block_size)<0) {
+	ERROR("Could not find GC state block %p?!\n",p);
 	return -1;
     }
+    return 0;
+}
+
+static int mark_gc_state()
+{
+    uint64_t i;
 
-    if (kmem_set_block_flags(block_addr, flags | VISITED)) {
-	ERROR("Failed to set visited on GC thread stack limits\n");
+    if (mark_gc_block(gc_stack) ||
+	mark_gc_block(gc_thread_stack_limits) ||
+	mark_gc_block(gc_workers)) {
 	return -1;
     }
 
+    for (i=0;i<gc_max_workers;i++) {
+	if (mark_gc_block(gc_workers[i].stack)) {
+	    return -1;
+	}
+    }
+
     return 0;
 }
 
 extern int _data_start, _data_end;
 
-static int handle_data_roots()
+// roots are the data segment (0) and the thread stacks (1..)
+static int handle_root(struct gc_worker *w, uint64_t i)
 {
-    DEBUG("***Handling data roots %p-%p\n",&_data_start,&_data_end);
-    int rc = handle_block(&_data_start, &_data_end);
-    if (rc) {
-	ERROR("***Handling data roots failed\n");
+    int rc;
+
+    if (!i) {
+	DEBUG("***Handling data roots %p-%p\n",&_data_start,&_data_end);
+	rc = handle_block(w, &_data_start, &_data_end);
+	if (rc) {
+	    ERROR("***Handling data roots failed\n");
+	}
+    } else {
+	struct thread_stack_limits *t = &gc_thread_stack_limits[i-1];
+	DEBUG("***Handling thread stack %p-%p\n",t->top,t->end);
+	rc = handle_block(w, t->top, t->end);
+	if (rc) {
+	    ERROR("***Handling thread stack failed\n");
+	}
     }
+
     return rc;
 }
 
-// we need to handle our thread stack separately
-static void handle_thread_stack(nk_thread_t *t, void *state)
+static int rescan(void *block, void *state)
 {
-    void *start = PDSGC_SPECIFIC_STACK_TOP(t);
-    void *end = PDSGC_SPECIFIC_STACK_BOTTOM(t);
-  
-    DEBUG("***Handling thread stack for thread %lu (%s) - %p-%p\n",
-	  t->tid,t->is_idle ? "(*idle*)" : !t->name[0] ? "*unnamed*" : t->name,start,end);
+    struct gc_worker *w = (struct gc_worker *)state;
+    void *block_addr;
+    uint64_t block_size, flags;
 
-    int rc =  handle_block(start,end);
+    if (kmem_find_block(block,&block_addr,&block_size,&flags)) {
+	return 0;
+    }
 
-    if (rc) { 
-	ERROR("***Handling thread stack failed\n");
+    if (handle_block(w,block_addr,block_addr+block_size)) {
+	return -1;
+    }
+
+    // keep the private stack from overflowing again
+    if (w->top > GC_MARK_STACK_ENTRIES/2) {
+	return drain_local(w);
     }
 
-    *(int *)state |= rc;
+    return 0;
 }
 
-static int handle_thread_stack_roots()
+// Run by every core while the world is stopped
+static void gc_work(void *state)
 {
-    int rc = 0;
+    struct gc_worker *w = gc_me();
+    uint64_t i, part, overflowed;
 
-    DEBUG("***Handling thread stacks\n");
+    part = w - gc_workers;
 
-    nk_sched_map_threads(-1,handle_thread_stack,&rc);
+    // mark from roots, handing them out one at a time
+    while ((i = __sync_fetch_and_add(&gc_next_root,1)) < num_thread_stack_limits+1) {
+	if (handle_root(w,i) || drain_local(w)) {
+	    w->rc = -1;
+	}
+    }
 
-    if (rc) { 
-	ERROR("***Failed to handle some thread stack rc=%d!\n",rc);
-	return -1;
-    } else {
-	return 0;
+    while (1) {
+	drain_all(w);
+
+	nk_counting_barrier(&gc_barrier);
+	overflowed = gc_overflow;
+	nk_counting_barrier(&gc_barrier);
+	if (!part) {
+	    gc_idle = 0;
+	    gc_overflow = 0;
+	    if (overflowed) {
+		gc_overflows++;
+	    }
+	}
+	nk_counting_barrier(&gc_barrier);
+
+	if (!overflowed) {
+	    break;
+	}
+
+	DEBUG("Mark stack overflowed - rescanning marked blocks\n");
+	if (kmem_apply_to_matching_blocks_part(VISITED,VISITED,rescan,w,part,gc_num_workers)) {
+	    w->rc = -1;
+	}
+    }
+
+    if (!part) {
+	gc_time_mark_end = nk_sched_get_realtime();
+    }
+
+    // no core reaches this point until all marking is done, so
+    // anything unvisited is garbage
+    if (!w->rc) {
+	if (kmem_apply_to_matching_blocks_part(VISITED,0,gc_handle_unvisited,w,part,gc_num_workers)) {
+	    ERROR("Failed to complete applying dealloc/leak function\n");
+	    w->rc = -1;
+	}
+    }
+
+    nk_counting_barrier(&gc_barrier);
+
+    if (!part) {
+	gc_time_sweep_end = nk_sched_get_realtime();
     }
 }
 
 static uint64_t num_gc=0;
-static uint64_t blocks_freed=0;
 static struct nk_gc_pdsgc_stats *stats=0;
 
+static void count_block(struct gc_worker *w, uint64_t block_size)
+{
+    w->sweep.num_blocks++;
+    w->sweep.total_bytes += block_size;
+    if (block_size < w->sweep.min_block) { w->sweep.min_block=block_size; }
+    if (block_size > w->sweep.max_block) { w->sweep.max_block=block_size; }
+}
+
 static int dealloc(void *block, void *state)
 {
     void *block_addr;
@@ -401,14 +638,8 @@ static int dealloc(void *block, void *state)
     }
 
     kmem_free(block);
-    blocks_freed++;
 
-    if (stats) { 
-	stats->num_blocks++;
-	stats->total_bytes += block_size;
-	if (block_size < stats->min_block) { stats->min_block=block_size; }
-	if (block_size > stats->max_block) { stats->max_block=block_size; }
-    }
+    count_block((struct gc_worker *)state, block_size);
 
     return 0;
 }
@@ -432,23 +663,21 @@ static int leak(void *block, void *state)
 
 
     INFO("leaked block %p (%lu bytes, flags=0x%lx)\n",block_addr,block_size,flags);
-    blocks_freed++;
 
-    if (stats) { 
-	stats->num_blocks++;
-	stats->total_bytes += block_size;
-	if (block_size < stats->min_block) { stats->min_block=block_size; }
-	if (block_size > stats->max_block) { stats->max_block=block_size; }
-    }
+    count_block((struct gc_worker *)state, block_size);
 
     return 0;
 }
 
-static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state), void *state)
+static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state))
 {
+    uint64_t i, start, clear_end;
+    uint64_t freed = 0;
+    int rc = 0;
+
     nk_sched_stop_world();
 
-    blocks_freed=0;
+    start = nk_sched_get_realtime();
 
     kmem_get_internal_pointer_range(&kmem_internal_start,&kmem_internal_end);
 
@@ -461,33 +690,78 @@ static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state
     
     // Do not revisit the GC's own state
     if (mark_gc_state()) { 
-	ERROR("Failed to mark GC stack....\n");
-	return -1;
+	ERROR("Failed to mark GC state....\n");
+	goto out_bad;
     }
 
     if (capture_thread_stack_limits()) { 
 	ERROR("Cannot capture thread stack limits\n");
-	return -1;
-    }
-    
-    if (handle_data_roots()) {
-	ERROR("Failed to handle data segment roots\n");
 	goto out_bad;
     }
 
-    if (handle_thread_stack_roots()) { 
-	ERROR("Failed to handle thread stack roots\n");
-	goto out_bad;
+    clear_end = nk_sched_get_realtime();
+
+    // everyone (if they are stopped) or just us
+    gc_num_workers = nk_get_num_cpus();
+    if (gc_num_workers > gc_max_workers) {
+	gc_num_workers = 1;
+    }
+
+    for (i=0;i<gc_max_workers;i++) {
+	struct gc_worker *w = &gc_workers[i];
+	nk_wsdeque_init(&w->shared);
+	w->top = 0;
+	w->marked = 0;
+	w->stolen = 0;
+	w->rc = 0;
+	memset(&w->sweep,0,sizeof(w->sweep));
+	w->sweep.min_block = -1;
+    }
+
+    gc_next_root = 0;
+    gc_idle = 0;
+    gc_overflow = 0;
+    gc_overflows = 0;
+    gc_handle_unvisited = handle_unvisited;
+    gc_time_mark_start = clear_end;
+    nk_counting_barrier_init(&gc_barrier,gc_num_workers);
+
+    if (gc_num_workers==1 || nk_sched_stopped_world_run(gc_work,0)) {
+	// scheduler is not up, so we are on our own
+	gc_num_workers = 1;
+	nk_counting_barrier_init(&gc_barrier,1);
+	gc_work(0);
+    }
+
+    for (i=0;i<gc_num_workers;i++) {
+	struct gc_worker *w = &gc_workers[i];
+	rc |= w->rc;
+	freed += w->sweep.num_blocks;
+	if (stats) {
+	    stats->num_blocks += w->sweep.num_blocks;
+	    stats->total_bytes += w->sweep.total_bytes;
+	    if (w->sweep.min_block < stats->min_block) { stats->min_block = w->sweep.min_block; }
+	    if (w->sweep.max_block > stats->max_block) { stats->max_block = w->sweep.max_block; }
+	    stats->blocks_marked += w->marked;
+	    stats->blocks_stolen += w->stolen;
+	}
+    }
+
+    if (stats) {
+	stats->num_cpus = gc_num_workers;
+	stats->mark_overflows = gc_overflows;
+	stats->clear_ns = clear_end - start;
+	stats->mark_ns = gc_time_mark_end - gc_time_mark_start;
+	stats->sweep_ns = gc_time_sweep_end - gc_time_mark_end;
+	stats->pause_ns = nk_sched_get_realtime() - start;
     }
 
-    DEBUG("Now applying dealloc or leak to unvisited blocks\n");
-    if (kmem_apply_to_matching_blocks(VISITED,0,handle_unvisited,state)) { 
-	ERROR("Failed to complete applying dealloc/leak function\n");
+    if (rc) {
 	goto out_bad;
     }
 
 // out_good:
-    DEBUG("Pass succeeded - pass %lu freed/detected %lu blocks\n", num_gc, blocks_freed);
+    DEBUG("Pass succeeded - pass %lu freed/detected %lu blocks\n", num_gc, freed);
     num_gc++;
     nk_sched_start_world();
     return 0;
@@ -502,12 +776,12 @@ static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state
 
 int  _nk_gc_pdsgc_collect()
 {
-    return _nk_gc_pdsgc_handle(dealloc,0);
+    return _nk_gc_pdsgc_handle(dealloc);
 }
 
 int  _nk_gc_pdsgc_leak_detect()
 {
-    return _nk_gc_pdsgc_handle(leak,0);
+    return _nk_gc_pdsgc_handle(leak);
 }
 
 
@@ -204,7 +204,6 @@ nk_core_barrier_raise (void)
     nk_barrier_t * barrier = per_cpu_get(system)->core_barrier;
     uint8_t iownit = 0;
     uint8_t flags;
-    unsigned i;
     int res = 0;
 
     DEBUG_PRINT("Core %u raising core barrier\n", my_cpu_id());
@@ -226,24 +225,13 @@ nk_core_barrier_raise (void)
         // decrement the waiting count
         atomic_dec(barrier->remaining);
 
-        cpu_id_t me = my_cpu_id();
-
         // force other cores to wait at the barrier
-        for (i = 0; i < per_cpu_get(system)->num_cpus; i++) {
-
-            if (i == me) {
-                continue;
-            }
-
-            if (smp_xcall(i,
-                        barrier_xcall_handler,
-                        NULL, // no need for args
-                        0)    // blocking would be catastrophic here
-                    != 0) {
-                ERROR_PRINT("Could not force cpu %u to wait at barrier\n", i);
-                return -EINVAL;
-            }
-
+        if (smp_xcall_broadcast(barrier_xcall_handler,
+                                NULL, // no need for args
+                                0)    // blocking would be catastrophic here
+                != 0) {
+            ERROR_PRINT("Could not force other cpus to wait at barrier\n");
+            return -EINVAL;
         }
 
     } else {
@@ -0,0 +1,681 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/dev.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/thread.h>
+#include <nautilus/shell.h>
+
+#ifndef NAUT_CONFIG_DEBUG_BLOCK_CACHE
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("blkcache: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("blkcache: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("blkcache: " fmt, ##args)
+
+#define NUM_ENTRIES NAUT_CONFIG_BLOCK_CACHE_BLOCKS
+#define READAHEAD   NAUT_CONFIG_BLOCK_CACHE_READAHEAD
+#define NUM_BUCKETS 1024     // power of two
+#define MAX_RUN     64       // most blocks moved by one device request
+#define MAX_DEVS    16
+
+#define BC_VALID 0x1
+#define BC_DIRTY 0x2
+#define BC_BUSY  0x4   // claimed by a thread, which may be doing I/O on it
+#define BC_REF   0x8   // recently used (CLOCK)
+#define BC_AHEAD 0x10  // read ahead and not yet used
+
+//
+// An entry in the hash (dev!=0) that is not busy is valid.   A thread
+// that claims an entry (sets BUSY) owns its data and key until it
+// releases it, so device I/O happens without the lock held.
+//
+struct bc_entry {
+    struct nk_block_dev *dev;
+    uint64_t             block;
+    uint64_t             size;    // of data
+    uint8_t             *data;
+    uint32_t             flags;
+    struct bc_entry     *next;    // hash chain
+};
+
+struct bc_dev {
+    struct nk_block_dev *dev;
+    uint64_t             block_size;
+    uint64_t             num_blocks;
+    uint64_t             next_seq;  // block following the last read
+};
+
+static spinlock_t      state_lock;
+static struct bc_entry entries[NUM_ENTRIES];
+static struct bc_entry *buckets[NUM_BUCKETS];
+static struct bc_dev   devs[MAX_DEVS];
+static uint64_t        hand;
+static struct nk_block_cache_stats stats;
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
+#define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
+
+static inline uint64_t hash(struct nk_block_dev *dev, uint64_t block)
+{
+    // consecutive blocks land in consecutive buckets
+    return (block + (((uint64_t)dev)>>4)*0x9e3779b97f4a7c15ULL) & (NUM_BUCKETS-1);
+}
+
+static struct bc_entry *hash_find(struct nk_block_dev *dev, uint64_t block)
+{
+    struct bc_entry *e;
+
+    for (e=buckets[hash(dev,block)]; e; e=e->next) {
+	if (e->dev==dev && e->block==block) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+static void hash_insert(struct bc_entry *e)
+{
+    uint64_t h = hash(e->dev,e->block);
+    e->next = buckets[h];
+    buckets[h] = e;
+}
+
+static void hash_remove(struct bc_entry *e)
+{
+    struct bc_entry **p;
+
+    for (p=&buckets[hash(e->dev,e->block)]; *p; p=&(*p)->next) {
+	if (*p==e) {
+	    *p = e->next;
+	    break;
+	}
+    }
+    e->next = 0;
+    e->dev = 0;
+}
+
+static struct bc_dev *find_dev(struct nk_block_dev *dev)
+{
+    struct nk_block_dev_characteristics c;
+    int i;
+    STATE_LOCK_CONF;
+
+    for (i=0;i<MAX_DEVS;i++) {
+	if (devs[i].dev==dev) {
+	    return &devs[i];
+	}
+    }
+
+    if (nk_block_dev_get_characteristics(dev,&c) || !c.block_size) {
+	ERROR("Cannot get characteristics of %s\n",dev->dev.name);
+	return 0;
+    }
+
+    STATE_LOCK();
+    for (i=0;i<MAX_DEVS;i++) {
+	if (devs[i].dev==dev) {
+	    STATE_UNLOCK();
+	    return &devs[i];
+	}
+    }
+    for (i=0;i<MAX_DEVS;i++) {
+	if (!devs[i].dev) {
+	    devs[i].block_size = c.block_size;
+	    devs[i].num_blocks = c.num_blocks;
+	    devs[i].next_seq = -1;
+	    __sync_synchronize();
+	    devs[i].dev = dev;
+	    STATE_UNLOCK();
+	    DEBUG("caching %s (%lu blocks of %lu bytes)\n",dev->dev.name,c.num_blocks,c.block_size);
+	    return &devs[i];
+	}
+    }
+    STATE_UNLOCK();
+
+    DEBUG("no room to cache %s\n",dev->dev.name);
+    return 0;
+}
+
+// CLOCK - lock must be held
+static struct bc_entry *victim()
+{
+    struct bc_entry *e;
+    uint64_t i;
+
+    for (i=0;i<2*NUM_ENTRIES;i++) {
+	e = &entries[hand];
+	hand = (hand+1) % NUM_ENTRIES;
+	if (e->flags & BC_BUSY) {
+	    continue;
+	}
+	if (e->flags & BC_REF) {
+	    e->flags &= ~BC_REF;
+	    continue;
+	}
+	return e;
+    }
+    return 0;
+}
+
+static void release(struct bc_entry *e, uint32_t set, uint32_t clear)
+{
+    STATE_LOCK_CONF;
+
+    STATE_LOCK();
+    if ((set & BC_VALID) && !(e->flags & BC_VALID)) {
+	stats.cached++;
+    }
+    if ((set & BC_DIRTY) && !(e->flags & BC_DIRTY)) {
+	stats.dirty++;
+    }
+    if ((clear & BC_DIRTY) && (e->flags & BC_DIRTY)) {
+	stats.dirty--;
+	stats.writebacks++;
+    }
+    e->flags = (e->flags | set) & ~(clear | BC_BUSY);
+    STATE_UNLOCK();
+}
+
+// claimed entry whose contents could not be produced
+static void abandon(struct bc_entry *e)
+{
+    STATE_LOCK_CONF;
+
+    STATE_LOCK();
+    if (e->dev) {
+	hash_remove(e);
+    }
+    e->flags = 0;
+    STATE_UNLOCK();
+}
+
+static int ensure_buf(struct bc_entry *e, uint64_t size)
+{
+    if (e->size != size) {
+	free(e->data);
+	e->data = malloc(size);
+	e->size = e->data ? size : 0;
+    }
+    if (!e->data) {
+	ERROR("Cannot allocate %lu byte block buffer\n",size);
+	return -1;
+    }
+    return 0;
+}
+
+// on failure, the block stays dirty, as in nk_block_cache_sync_range
+static int writeback_one(struct bc_entry *e)
+{
+    if (nk_block_dev_write_uncached(e->dev,e->block,1,e->data,NK_DEV_REQ_BLOCKING,0,0)) {
+	ERROR("Failed to write back block %lu of %s - keeping it dirty\n",e->block,e->dev->dev.name);
+	release(e,0,0);
+	return -1;
+    }
+    release(e,0,BC_DIRTY);
+    return 0;
+}
+
+//
+// Claim the entry for the block.  If it is not cached, a victim is
+// recycled for it and returned claimed but not valid.   With
+// absent_only, we only want blocks that are not cached, and
+// return 0 if the block is cached or there is no victim handy.
+// A dirty victim is written back first, and if that fails, it is
+// left in the cache and we return 0, since the caller cannot be
+// served without dropping someone's data.
+//
+static struct bc_entry *claim(struct nk_block_dev *dev, uint64_t block, int absent_only)
+{
+    struct bc_entry *e;
+    STATE_LOCK_CONF;
+
+    while (1) {
+	STATE_LOCK();
+	e = hash_find(dev,block);
+	if (e) {
+	    if (absent_only) {
+		STATE_UNLOCK();
+		return 0;
+	    }
+	    if (e->flags & BC_BUSY) {
+		STATE_UNLOCK();
+		nk_yield();
+		continue;
+	    }
+	    e->flags |= BC_BUSY | BC_REF;
+	    STATE_UNLOCK();
+	    return e;
+	}
+
+	e = victim();
+
+	if (!e) {
+	    STATE_UNLOCK();
+	    if (absent_only) {
+		return 0;
+	    }
+	    nk_yield();
+	    continue;
+	}
+
+	if (e->flags & BC_DIRTY) {
+	    // clean it, then look again
+	    e->flags |= BC_BUSY;
+	    STATE_UNLOCK();
+	    if (writeback_one(e) || absent_only) {
+		return 0;
+	    }
+	    continue;
+	}
+
+	if (e->dev) {
+	    hash_remove(e);
+	    stats.evictions++;
+	    stats.cached--;
+	}
+
+	e->dev = dev;
+	e->block = block;
+	e->flags = BC_BUSY | BC_REF;
+	hash_insert(e);
+	STATE_UNLOCK();
+	return e;
+    }
+}
+
+// read a run of consecutive claimed entries from the device
+static int fetch(struct nk_block_dev *dev, struct bc_entry **run, uint64_t n, uint64_t bs)
+{
+    uint8_t *buf;
+    uint64_t j;
+    int rc;
+
+    for (j=0;j<n;j++) {
+	if (ensure_buf(run[j],bs)) {
+	    return -1;
+	}
+    }
+
+    if (n==1 || !(buf = malloc(n*bs))) {
+	for (j=0;j<n;j++) {
+	    if (nk_block_dev_read_uncached(dev,run[j]->block,1,run[j]->data,NK_DEV_REQ_BLOCKING,0,0)) {
+		return -1;
+	    }
+	}
+	return 0;
+    }
+
+    rc = nk_block_dev_read_uncached(dev,run[0]->block,n,buf,NK_DEV_REQ_BLOCKING,0,0);
+
+    if (!rc) {
+	for (j=0;j<n;j++) {
+	    memcpy(run[j]->data,buf+j*bs,bs);
+	}
+    }
+
+    free(buf);
+
+    return rc;
+}
+
+int nk_block_cache_read(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *dest)
+{
+    struct bc_dev *d = find_dev(dev);
+    struct bc_entry *run[MAX_RUN];
+    struct bc_entry *e;
+    uint64_t i, j, n, want, used, bs;
+    int seq;
+    STATE_LOCK_CONF;
+
+    if (!d) {
+	return nk_block_dev_read_uncached(dev,blocknum,count,dest,NK_DEV_REQ_BLOCKING,0,0);
+    }
+
+    DEBUG("read %s (start=%lu, count=%lu)\n",dev->dev.name,blocknum,count);
+
+    bs = d->block_size;
+    seq = blocknum == d->next_seq;
+    d->next_seq = blocknum + count;
+
+    i = 0;
+    while (i<count) {
+	if (!(e = claim(dev,blocknum+i,0))) {
+	    ERROR("No room to read block %lu of %s\n",blocknum+i,dev->dev.name);
+	    return -1;
+	}
+
+	if (e->flags & BC_VALID) {
+	    memcpy(dest+i*bs,e->data,bs);
+	    STATE_LOCK();
+	    stats.hits++;
+	    if (e->flags & BC_AHEAD) {
+		stats.readahead_hits++;
+	    }
+	    STATE_UNLOCK();
+	    release(e,0,BC_AHEAD);
+	    i++;
+	    continue;
+	}
+
+	// miss - fetch the following uncached blocks of the request
+	// in the same device request, and go beyond the request if
+	// we are reading sequentially
+	want = count - i + (seq ? READAHEAD : 0);
+	if (want > MAX_RUN) {
+	    want = MAX_RUN;
+	}
+	if (blocknum + i + want > d->num_blocks) {
+	    want = blocknum + i < d->num_blocks ? d->num_blocks - (blocknum + i) : 1;
+	}
+
+	run[0] = e;
+	for (n=1; n<want && (run[n]=claim(dev,blocknum+i+n,1)); n++) {
+	}
+
+	if (fetch(dev,run,n,bs)) {
+	    ERROR("Failed to read %lu blocks at %lu from %s\n",n,blocknum+i,dev->dev.name);
+	    for (j=0;j<n;j++) {
+		abandon(run[j]);
+	    }
+	    return -1;
+	}
+
+	used = n < count - i ? n : count - i;
+
+	for (j=0;j<n;j++) {
+	    if (j<used) {
+		memcpy(dest+(i+j)*bs,run[j]->data,bs);
+		release(run[j],BC_VALID,0);
+	    } else {
+		release(run[j],BC_VALID|BC_AHEAD,0);
+	    }
+	}
+
+	STATE_LOCK();
+	stats.misses += used;
+	stats.readahead += n - used;
+	STATE_UNLOCK();
+
+	i += used;
+    }
+
+    return 0;
+}
+
+int nk_block_cache_write(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *src)
+{
+    struct bc_dev *d = find_dev(dev);
+    struct bc_entry *e;
+    uint64_t i, bs;
+
+    if (!d) {
+	return nk_block_dev_write_uncached(dev,blocknum,count,src,NK_DEV_REQ_BLOCKING,0,0);
+    }
+
+    DEBUG("write %s (start=%lu, count=%lu)\n",dev->dev.name,blocknum,count);
+
+    bs = d->block_size;
+
+    for (i=0;i<count;i++) {
+	if (!(e = claim(dev,blocknum+i,0))) {
+	    ERROR("No room to write block %lu of %s\n",blocknum+i,dev->dev.name);
+	    return -1;
+	}
+	if (ensure_buf(e,bs)) {
+	    abandon(e);
+	    return -1;
+	}
+	memcpy(e->data,src+i*bs,bs);
+	release(e,BC_VALID|BC_DIRTY,BC_AHEAD);
+    }
+
+    // do not let dirty data crowd out everything else
+    if (stats.dirty > NUM_ENTRIES/2) {
+	return nk_block_cache_sync(dev);
+    }
+
+    return 0;
+}
+
+// lock must be held
+static inline int matches(struct bc_entry *e, struct nk_block_dev *dev, uint64_t start, uint64_t end)
+{
+    return e->dev && (!dev || e->dev==dev) && e->block>=start && e->block<end;
+}
+
+int nk_block_cache_sync_range(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count)
+{
+    struct bc_entry *run[MAX_RUN];
+    struct bc_entry *e, *f;
+    uint64_t end = count ? blocknum+count : -1;
+    uint64_t k, j, n, bs;
+    uint8_t *buf;
+    int rc = 0;
+    STATE_LOCK_CONF;
+
+    for (k=0;k<NUM_ENTRIES;k++) {
+	e = &entries[k];
+
+	STATE_LOCK();
+	while ((e->flags & BC_DIRTY) && (e->flags & BC_BUSY) && matches(e,dev,blocknum,end)) {
+	    STATE_UNLOCK();
+	    nk_yield();
+	    STATE_LOCK();
+	}
+	if (!(e->flags & BC_DIRTY) || !matches(e,dev,blocknum,end)) {
+	    STATE_UNLOCK();
+	    continue;
+	}
+	e->flags |= BC_BUSY;
+	// gather dirty blocks that follow so they go out in one request
+	run[0] = e;
+	for (n=1;n<MAX_RUN;n++) {
+	    f = hash_find(e->dev,e->block+n);
+	    if (!f || !(f->flags & BC_DIRTY) || (f->flags & BC_BUSY) || f->size!=e->size) {
+		break;
+	    }
+	    f->flags |= BC_BUSY;
+	    run[n] = f;
+	}
+	STATE_UNLOCK();
+
+	bs = e->size;
+
+	if (n==1 || !(buf = malloc(n*bs))) {
+	    for (j=0;j<n;j++) {
+		if (nk_block_dev_write_uncached(run[j]->dev,run[j]->block,1,run[j]->data,NK_DEV_REQ_BLOCKING,0,0)) {
+		    ERROR("Failed to write back block %lu of %s\n",run[j]->block,run[j]->dev->dev.name);
+		    rc = -1;
+		    release(run[j],0,0);
+		} else {
+		    release(run[j],0,BC_DIRTY);
+		}
+	    }
+	    continue;
+	}
+
+	for (j=0;j<n;j++) {
+	    memcpy(buf+j*bs,run[j]->data,bs);
+	}
+
+	if (nk_block_dev_write_uncached(e->dev,e->block,n,buf,NK_DEV_REQ_BLOCKING,0,0)) {
+	    ERROR("Failed to write back %lu blocks at %lu of %s\n",n,e->block,e->dev->dev.name);
+	    rc = -1;
+	    for (j=0;j<n;j++) {
+		release(run[j],0,0);
+	    }
+	} else {
+	    for (j=0;j<n;j++) {
+		release(run[j],0,BC_DIRTY);
+	    }
+	}
+
+	free(buf);
+    }
+
+    return rc;
+}
+
+int nk_block_cache_sync(struct nk_block_dev *dev)
+{
+    DEBUG("sync %s\n", dev ? dev->dev.name : "all devices");
+    return nk_block_cache_sync_range(dev,0,0);
+}
+
+static void discard(struct nk_block_dev *dev, uint64_t blocknum, uint64_t end)
+{
+    struct bc_entry *e;
+    uint64_t k;
+    STATE_LOCK_CONF;
+
+    for (k=0;k<NUM_ENTRIES;k++) {
+	e = &entries[k];
+	STATE_LOCK();
+	while ((e->flags & BC_BUSY) && matches(e,dev,blocknum,end)) {
+	    STATE_UNLOCK();
+	    nk_yield();
+	    STATE_LOCK();
+	}
+	if (matches(e,dev,blocknum,end)) {
+	    if (e->flags & BC_VALID) {
+		stats.cached--;
+	    }
+	    if (e->flags & BC_DIRTY) {
+		stats.dirty--;
+	    }
+	    hash_remove(e);
+	    e->flags = 0;
+	}
+	STATE_UNLOCK();
+    }
+}
+
+void nk_block_cache_discard(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count)
+{
+    if (count) {
+	discard(dev,blocknum,blocknum+count);
+    }
+}
+
+void nk_block_cache_discard_all(struct nk_block_dev *dev)
+{
+    discard(dev,0,-1);
+}
+
+void nk_block_cache_detach(struct nk_block_dev *dev)
+{
+    int i;
+    STATE_LOCK_CONF;
+
+    nk_block_cache_sync(dev);
+    nk_block_cache_discard_all(dev);
+
+    STATE_LOCK();
+    for (i=0;i<MAX_DEVS;i++) {
+	if (devs[i].dev==dev) {
+	    devs[i].dev = 0;
+	}
+    }
+    STATE_UNLOCK();
+}
+
+void nk_block_cache_get_stats(struct nk_block_cache_stats *s)
+{
+    STATE_LOCK_CONF;
+
+    STATE_LOCK();
+    *s = stats;
+    STATE_UNLOCK();
+    s->capacity = NUM_ENTRIES;
+}
+
+void nk_block_cache_reset_stats()
+{
+    STATE_LOCK_CONF;
+
+    STATE_LOCK();
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.readahead = 0;
+    stats.readahead_hits = 0;
+    stats.writebacks = 0;
+    stats.evictions = 0;
+    STATE_UNLOCK();
+}
+
+int nk_block_cache_init()
+{
+    spinlock_init(&state_lock);
+    INFO("init (%lu blocks, readahead %lu)\n", (uint64_t)NUM_ENTRIES, (uint64_t)READAHEAD);
+    return 0;
+}
+
+static int
+handle_blkcache (char * buf, void * priv)
+{
+    struct nk_block_cache_stats s;
+    char what[16];
+
+    if (sscanf(buf,"blkcache %15s",what)==1) {
+	if (!strcmp(what,"sync")) {
+	    nk_vc_printf("sync %s\n", nk_block_cache_sync(0) ? "failed" : "done");
+	    return 0;
+	} else if (!strcmp(what,"drop")) {
+	    nk_block_cache_sync(0);
+	    nk_block_cache_discard_all(0);
+	    nk_vc_printf("dropped\n");
+	    return 0;
+	} else if (!strcmp(what,"reset")) {
+	    nk_block_cache_reset_stats();
+	    return 0;
+	} else {
+	    nk_vc_printf("unknown request %s\n",what);
+	    return 0;
+	}
+    }
+
+    nk_block_cache_get_stats(&s);
+
+    nk_vc_printf("block cache: %lu of %lu blocks cached, %lu dirty\n",
+		 s.cached, s.capacity, s.dirty);
+    nk_vc_printf("  hits %lu misses %lu (hit rate %lu%%)\n",
+		 s.hits, s.misses, (s.hits+s.misses) ? s.hits*100/(s.hits+s.misses) : 0);
+    nk_vc_printf("  readahead %lu (%lu used)  writebacks %lu  evictions %lu\n",
+		 s.readahead, s.readahead_hits, s.writebacks, s.evictions);
+
+    return 0;
+}
+
+static struct shell_cmd_impl blkcache_impl = {
+    .cmd      = "blkcache",
+    .help_str = "blkcache [sync|drop|reset]",
+    .handler  = handle_blkcache,
+};
+nk_register_shell_cmd(blkcache_impl);
@@ -25,6 +25,10 @@
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/shell.h>
+#include <nautilus/scheduler.h>
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+#include <nautilus/blkcache.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_BLKDEV
 #undef DEBUG_PRINT
@@ -47,6 +51,9 @@ static spinlock_t state_lock;
 int nk_block_dev_init()
 {
     INFO("init\n");
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    nk_block_cache_init();
+#endif
     return 0;
 }
 
@@ -66,6 +73,9 @@ struct nk_block_dev * nk_block_dev_register(char *name, uint64_t flags, struct n
 int                   nk_block_dev_unregister(struct nk_block_dev *d)
 {
     INFO("unregister device %s\n", d->dev.name);
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    nk_block_cache_detach(d);
+#endif
     return nk_dev_unregister((struct nk_dev *)d);
 }
 
@@ -73,7 +83,7 @@ struct nk_block_dev * nk_block_dev_find(char *name)
 {
     DEBUG("find %s\n",name);
     struct nk_dev *d = nk_dev_find(name);
-    if (d->type!=NK_DEV_BLK) {
+    if (!d || d->type!=NK_DEV_BLK) {
 	DEBUG("%s not found\n",name);
 	return 0;
     } else {
@@ -88,6 +98,8 @@ int nk_block_dev_get_characteristics(struct nk_block_dev *dev, struct nk_block_d
     struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
 
     DEBUG("get characteristics of %s\n",d->name);
+    // drivers fill in only what they know about
+    memset(c,0,sizeof(*c));
     return di->get_characteristics(d->state,c);
 }
 
@@ -122,8 +134,38 @@ static int generic_cond_check(void* state)
     return o->completed;
 }
 
+static void flush_plug_dev(struct nk_dev *d, void *state)
+{
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
 
-int nk_block_dev_read(struct nk_block_dev *dev, 
+    if (di->unplug) {
+	di->unplug(d->state);
+    }
+}
+
+// The plug is not tied to a device, and the thread may have
+// submitted to several, so every device gets the chance
+void nk_block_dev_flush_plug(void)
+{
+    nk_dev_for_each(NK_DEV_BLK,flush_plug_dev,0);
+}
+
+// Wait for a request we submitted.  If we are plugged, the request
+// (or one it depends on) may be held back, so it must go out first
+// or we would sleep forever
+static void wait_for_op(struct nk_block_dev *dev, volatile struct op *o)
+{
+    if (get_cur_thread()->blk_plug) {
+	nk_block_dev_flush_plug();
+    }
+
+    while (!o->completed) {
+	nk_dev_wait((struct nk_dev *)dev,generic_cond_check,(void*)o);
+    }
+}
+
+
+int nk_block_dev_read_uncached(struct nk_block_dev *dev, 
 		      uint64_t blocknum, 
 		      uint64_t count, 
 		      void *dest, 
@@ -169,9 +211,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		    return -1;
 		} else {
 		    DEBUG("readblocks started, waiting for completion\n");
-		    while (!o.completed) { 
-			nk_dev_wait((struct nk_dev *)d,generic_cond_check,(void*)&o);
-		    }
+		    wait_for_op(dev,&o);
 		    return 0;
 		}
 	    }
@@ -184,7 +224,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 }
 
 
-int nk_block_dev_write(struct nk_block_dev *dev, 
+int nk_block_dev_write_uncached(struct nk_block_dev *dev, 
 		       uint64_t blocknum, 
 		       uint64_t count, 
 		       void     *src,  
@@ -230,9 +270,7 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		    return -1;
  		} else {
 		    DEBUG("writeblocks started, waiting for completion\n");
-		    while (!o.completed) { 
-			nk_dev_wait((struct nk_dev *)d, generic_cond_check, (void*)&o);
-		    }
+		    wait_for_op(dev,&o);
 		    return 0;
 		}
 	    }
@@ -245,14 +283,562 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 
 }
 
+//
+// Blocking requests go through the block cache unless the device
+// opts out.   Other requests go straight to the device, so we first
+// make sure that the device and the cache agree on the blocks
+// involved.
+//
+static inline int cacheable(struct nk_block_dev *dev)
+{
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    return !(dev->dev.flags & NK_BLOCK_DEV_FLAG_NO_CACHE);
+#else
+    return 0;
+#endif
+}
+
+int nk_block_dev_read(struct nk_block_dev *dev, 
+		      uint64_t blocknum, 
+		      uint64_t count, 
+		      void *dest, 
+		      nk_dev_request_type_t type,
+		      void (*callback)(nk_block_dev_status_t status, void *state),
+		      void *state)
+{
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    if (cacheable(dev)) {
+	if (type==NK_DEV_REQ_BLOCKING) {
+	    return nk_block_cache_read(dev,blocknum,count,dest);
+	}
+	if (nk_block_cache_sync_range(dev,blocknum,count)) {
+	    return -1;
+	}
+    }
+#endif
+    return nk_block_dev_read_uncached(dev,blocknum,count,dest,type,callback,state);
+}
+
+int nk_block_dev_write(struct nk_block_dev *dev, 
+		       uint64_t blocknum, 
+		       uint64_t count, 
+		       void     *src,  
+		       nk_dev_request_type_t type,
+		       void (*callback)(nk_block_dev_status_t status, void *state),
+		       void *state)
+{
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    if (cacheable(dev)) {
+	if (type==NK_DEV_REQ_BLOCKING) {
+	    return nk_block_cache_write(dev,blocknum,count,src);
+	}
+	nk_block_cache_discard(dev,blocknum,count);
+    }
+#endif
+    return nk_block_dev_write_uncached(dev,blocknum,count,src,type,callback,state);
+}
+
+//
+// Vectored requests.  Like the other non-blocking paths, these bypass
+// the block cache, so the cache is first brought in line with the
+// blocks involved.
+//
+static int cache_prepare(struct nk_block_dev *dev, struct nk_block_dev_req *r)
+{
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    if (cacheable(dev)) {
+	switch (r->op) {
+	case NK_BLOCK_DEV_OP_READ:
+	    return nk_block_cache_sync_range(dev,r->blocknum,r->count);
+	case NK_BLOCK_DEV_OP_WRITE:
+	case NK_BLOCK_DEV_OP_DISCARD:
+	    nk_block_cache_discard(dev,r->blocknum,r->count);
+	    return 0;
+	case NK_BLOCK_DEV_OP_FLUSH:
+	    return nk_block_cache_sync(dev);
+	}
+    }
+#endif
+    return 0;
+}
+
+//
+// Adapter for devices that have only read_blocks/write_blocks.  A
+// vectored request becomes one call per segment, and its callback
+// runs when the last of them completes.
+//
+struct split {
+    uint64_t              remaining;
+    nk_block_dev_status_t status;
+    void (*callback)(nk_block_dev_status_t status, void *context);
+    void                 *context;
+};
+
+static void split_done(struct split *s, uint64_t n, nk_block_dev_status_t status)
+{
+    if (status) {
+	s->status = status;
+    }
+    if (!__sync_sub_and_fetch(&s->remaining,n)) {
+	if (s->callback) {
+	    s->callback(s->status,s->context);
+	}
+	free(s);
+    }
+}
+
+static void split_callback(nk_block_dev_status_t status, void *context)
+{
+    split_done((struct split *)context,1,status);
+}
+
+static int submit_one_legacy(struct nk_dev *d, struct nk_block_dev_int *di, struct nk_block_dev_req *r)
+{
+    int (*op)(void *, uint64_t, uint64_t, uint8_t *, void (*)(nk_block_dev_status_t, void *), void *);
+    struct nk_block_dev_characteristics c;
+    struct split *s;
+    uint64_t i, block;
+
+    switch (r->op) {
+    case NK_BLOCK_DEV_OP_READ:
+    case NK_BLOCK_DEV_OP_WRITE:
+	op = r->op==NK_BLOCK_DEV_OP_READ ? di->read_blocks : di->write_blocks;
+	if (!op || !r->iovcnt) {
+	    return -1;
+	}
+	if (r->iovcnt==1) {
+	    return op(d->state,r->blocknum,r->count,r->iov[0].addr,r->callback,r->context);
+	}
+	if (di->get_characteristics(d->state,&c) || !c.block_size) {
+	    return -1;
+	}
+	if (!(s = malloc(sizeof(*s)))) {
+	    ERROR("cannot allocate split request\n");
+	    return -1;
+	}
+	s->remaining = r->iovcnt;
+	s->status = NK_BLOCK_DEV_STATUS_SUCCESS;
+	s->callback = r->callback;
+	s->context = r->context;
+	for (i=0, block=r->blocknum; i<r->iovcnt; block += r->iov[i].len/c.block_size, i++) {
+	    if (op(d->state,block,r->iov[i].len/c.block_size,r->iov[i].addr,split_callback,s)) {
+		if (!i) {
+		    free(s);
+		    return -1;
+		}
+		// the segments already started complete the request
+		ERROR("failed to start segment %lu of request\n",i);
+		split_done(s,r->iovcnt-i,NK_BLOCK_DEV_STATUS_ERROR);
+		break;
+	    }
+	}
+	return 0;
+    case NK_BLOCK_DEV_OP_FLUSH:
+    case NK_BLOCK_DEV_OP_DISCARD:
+	// nothing to flush or discard that we know of
+	if (r->callback) {
+	    r->callback(NK_BLOCK_DEV_STATUS_SUCCESS,r->context);
+	}
+	return 0;
+    }
+    return -1;
+}
+
+int nk_block_dev_submit(struct nk_block_dev *dev, struct nk_block_dev_req *reqs, uint64_t count)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    uint64_t i;
+
+    DEBUG("submit %lu requests to %s\n",count,d->name);
+
+    for (i=0;i<count;i++) {
+	if (cache_prepare(dev,&reqs[i])) {
+	    ERROR("failed to synchronize cache for request\n");
+	    return i ? i : -1;
+	}
+    }
+
+    if (di->submit) {
+	return di->submit(d->state,reqs,count);
+    }
+
+    for (i=0;i<count;i++) {
+	if (submit_one_legacy(d,di,&reqs[i])) {
+	    return i ? i : -1;
+	}
+    }
+
+    return count;
+}
+
+void nk_block_dev_poll(struct nk_block_dev *dev)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    if (di->poll) {
+	di->poll(d->state);
+    }
+}
+
+int nk_block_dev_map(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void **addr)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    DEBUG("map %s (start=%lu, count=%lu)\n",d->name,blocknum,count);
+
+    if (!di->map) {
+	return -1;
+    }
+
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    // whoever uses the mapping bypasses the cache, so it must not
+    // hold newer data
+    if (cacheable(dev) && nk_block_cache_sync_range(dev,blocknum,count)) {
+	return -1;
+    }
+#endif
+
+    return di->map(d->state,blocknum,count,addr);
+}
+
+// The plug belongs to the calling thread, so only its own
+// submissions are held back, on whichever devices it submits to
+void nk_block_dev_plug(struct nk_block_dev *dev)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    get_cur_thread()->blk_plug++;
+
+    if (di->plug) {
+	di->plug(d->state);
+    }
+}
+
+void nk_block_dev_unplug(struct nk_block_dev *dev)
+{
+    if (!--get_cur_thread()->blk_plug) {
+	nk_block_dev_flush_plug();
+    }
+}
+
+static int submit_and_wait(struct nk_block_dev *dev, struct nk_block_dev_req *r)
+{
+    volatile struct op o;
+
+    o.completed = 0;
+    o.status = 0;
+    o.dev = dev;
+
+    r->callback = generic_write_callback;
+    r->context = (void*)&o;
+
+    if (nk_block_dev_submit(dev,r,1)!=1) {
+	ERROR("failed to submit request\n");
+	return -1;
+    }
+
+    wait_for_op(dev,&o);
+
+    return o.status ? -1 : 0;
+}
+
+int nk_block_dev_flush(struct nk_block_dev *dev)
+{
+    struct nk_block_dev_req r = { .op = NK_BLOCK_DEV_OP_FLUSH };
+
+    DEBUG("flush %s\n",dev->dev.name);
+    return submit_and_wait(dev,&r);
+}
+
+int nk_block_dev_discard(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count)
+{
+    struct nk_block_dev_req r = { .op = NK_BLOCK_DEV_OP_DISCARD, .blocknum = blocknum, .count = count };
+
+    DEBUG("discard %s (start=%lu, count=%lu)\n",dev->dev.name,blocknum,count);
+    return submit_and_wait(dev,&r);
+}
+
+//
+// blktest dev qd r|w seq|rand blocks count
+//
+// Keeps up to qd requests of the given number of blocks in flight,
+// for queue depths 1 through 128, and reports IOPS and bandwidth at
+// each.   Writes overwrite the device.
+//
+#define BLKTEST_MAX_QD 128
+
+struct qd_slot {
+    struct nk_block_dev_iov iov;
+    volatile int            busy;
+    volatile uint64_t      *done;
+    volatile uint64_t      *errors;
+};
+
+static void qd_callback(nk_block_dev_status_t status, void *context)
+{
+    struct qd_slot *s = (struct qd_slot *)context;
+
+    if (status) {
+	__sync_fetch_and_add(s->errors,1);
+    }
+    __sync_fetch_and_add(s->done,1);
+    s->busy = 0;
+}
+
+static int qd_run(struct nk_block_dev *d, struct nk_block_dev_characteristics *c, struct qd_slot *slots,
+		  int write, int rand, uint64_t blocks, uint64_t count, uint64_t qd, uint64_t *ns)
+{
+    struct nk_block_dev_req reqs[BLKTEST_MAX_QD];
+    volatile uint64_t done = 0, errors = 0;
+    uint64_t issued = 0, seed = 0x2545f4914f6cdd1dULL;
+    uint64_t span = c->num_blocks - blocks + 1;
+    uint64_t i, n, start;
+    int rc;
+
+    for (i=0;i<qd;i++) {
+	slots[i].busy = 0;
+	slots[i].done = &done;
+	slots[i].errors = &errors;
+    }
+
+    start = nk_sched_get_realtime();
+
+    while (issued < count) {
+	// refill every free slot in one submission
+	for (i=0, n=0; i<qd && issued+n<count; i++) {
+	    if (!slots[i].busy) {
+		slots[i].busy = 1;
+		if (rand) {
+		    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		}
+		reqs[n].op = write ? NK_BLOCK_DEV_OP_WRITE : NK_BLOCK_DEV_OP_READ;
+		reqs[n].blocknum = rand ? seed % span : ((issued+n)*blocks) % span;
+		reqs[n].count = blocks;
+		reqs[n].iov = &slots[i].iov;
+		reqs[n].iovcnt = 1;
+		reqs[n].callback = qd_callback;
+		reqs[n].context = &slots[i];
+		n++;
+	    }
+	}
+
+	rc = n ? nk_block_dev_submit(d,reqs,n) : 0;
+
+	if (rc < 0) {
+	    nk_vc_printf("Submission failed\n");
+	    errors++;
+	    rc = 0;
+	}
+
+	// give back what the device did not take
+	for (i=rc;i<n;i++) {
+	    ((struct qd_slot *)reqs[i].context)->busy = 0;
+	}
+
+	issued += rc;
+
+	if (errors) {
+	    break;
+	}
+
+	if ((uint64_t)rc < n || !n) {
+	    nk_yield();
+	}
+    }
+
+    while (done < issued) {
+	nk_yield();
+    }
+
+    *ns = nk_sched_get_realtime() - start;
+
+    return errors ? -1 : 0;
+}
+
+static int handle_blktest_qd(struct nk_block_dev *d, char *rw, char *mode, uint64_t blocks, uint64_t count)
+{
+    struct nk_block_dev_characteristics c;
+    struct qd_slot *slots;
+    uint8_t *data;
+    uint64_t qd, i, ns;
+    int write = *rw=='w';
+    int rand = !strcmp(mode,"rand");
+
+    if (nk_block_dev_get_characteristics(d,&c) || !blocks || c.num_blocks<blocks) {
+	nk_vc_printf("Can't get usable characteristics\n");
+	return -1;
+    }
+
+    slots = malloc(sizeof(struct qd_slot)*BLKTEST_MAX_QD);
+    data = malloc(BLKTEST_MAX_QD*blocks*c.block_size);
+
+    if (!slots || !data) {
+	nk_vc_printf("Can't allocate buffers\n");
+	free(slots);
+	free(data);
+	return -1;
+    }
+
+    for (i=0;i<BLKTEST_MAX_QD;i++) {
+	slots[i].iov.addr = data + i*blocks*c.block_size;
+	slots[i].iov.len = blocks*c.block_size;
+	memset(slots[i].iov.addr,(int)i,blocks*c.block_size);
+    }
+
+    for (qd=1;qd<=BLKTEST_MAX_QD;qd*=2) {
+	if (qd_run(d,&c,slots,write,rand,blocks,count,qd,&ns)) {
+	    nk_vc_printf("qd %3lu: failed\n",qd);
+	    break;
+	}
+	nk_vc_printf("qd %3lu: %lu %s of %lu blocks in %lu ns: %lu IOPS, %lu MB/s\n",
+		     qd, count, write ? "writes" : "reads", blocks, ns,
+		     ns ? count*1000000000ULL/ns : 0,
+		     ns ? count*blocks*c.block_size*1000/ns : 0);
+    }
+
+    free(slots);
+    free(data);
+
+    return 0;
+}
+
+//
+// blktest dev plug start count
+//
+// Reads count blocks starting at start as one batch while plugged,
+// and, still plugged, does blocking I/O that must not wait on the
+// held batch: the first block is made dirty in the block cache (by
+// writing back its own contents), so the batch has to write it
+// back first, and a blocking read follows the batch.  Then unplugs
+// and checks that every read completes.
+//
+#define BLKTEST_PLUG_TIMEOUT_NS 1000000000ULL
+
+static int handle_blktest_plug(struct nk_block_dev *d, uint64_t start, uint64_t count)
+{
+    struct nk_block_dev_characteristics c;
+    struct nk_block_dev_req reqs[BLKTEST_MAX_QD];
+    struct qd_slot *slots;
+    volatile uint64_t *done, *errors;
+    uint8_t *data, *block;
+    uint64_t i, t;
+    int rc, bad = 0;
+
+    if (nk_block_dev_get_characteristics(d,&c) || !count || count>BLKTEST_MAX_QD ||
+	start+count>c.num_blocks) {
+	nk_vc_printf("Can't do %lu blocks at %lu\n",count,start);
+	return -1;
+    }
+
+    // the counters live with the slots, which outlive us if the
+    // reads do not complete
+    slots = malloc(sizeof(struct qd_slot)*count + 2*sizeof(uint64_t));
+    data = malloc((count+1)*c.block_size);
+
+    if (!slots || !data) {
+	nk_vc_printf("Can't allocate buffers\n");
+	free(slots);
+	free(data);
+	return -1;
+    }
+
+    done = (volatile uint64_t *)&slots[count];
+    errors = done + 1;
+    *done = *errors = 0;
+    block = data + count*c.block_size;
+
+    if (nk_block_dev_read(d,start,1,block,NK_DEV_REQ_BLOCKING,0,0) ||
+	nk_block_dev_write(d,start,1,block,NK_DEV_REQ_BLOCKING,0,0)) {
+	nk_vc_printf("Can't rewrite block %lu\n",start);
+	bad = 1;
+	goto out;
+    }
+
+    for (i=0;i<count;i++) {
+	slots[i].iov.addr = data + i*c.block_size;
+	slots[i].iov.len = c.block_size;
+	slots[i].busy = 1;
+	slots[i].done = done;
+	slots[i].errors = errors;
+	reqs[i].op = NK_BLOCK_DEV_OP_READ;
+	reqs[i].blocknum = start+i;
+	reqs[i].count = 1;
+	reqs[i].iov = &slots[i].iov;
+	reqs[i].iovcnt = 1;
+	reqs[i].callback = qd_callback;
+	reqs[i].context = &slots[i];
+    }
+
+    nk_block_dev_plug(d);
+    rc = nk_block_dev_submit(d,reqs,count);
+    if (nk_block_dev_read(d,start,1,block,NK_DEV_REQ_BLOCKING,0,0)) {
+	nk_vc_printf("Blocking read while plugged failed\n");
+	bad = 1;
+    }
+    nk_block_dev_unplug(d);
+
+    if (rc < 0) {
+	nk_vc_printf("Submission failed\n");
+	bad = 1;
+	rc = 0;
+    }
+
+    t = nk_sched_get_realtime();
+    while (*done < (uint64_t)rc && nk_sched_get_realtime()-t < BLKTEST_PLUG_TIMEOUT_NS) {
+	nk_yield();
+    }
+
+    if (*done < (uint64_t)rc) {
+	nk_vc_printf("Only %lu of %d reads completed\n",*done,rc);
+	// the reads still in flight refer to our buffers
+	nk_vc_printf("plugged batch of %lu reads: FAILED\n",count);
+	return -1;
+    }
+
+    if (*errors || memcmp(data,block,c.block_size)) {
+	nk_vc_printf("%lu reads failed or returned the wrong data\n",*errors);
+	bad = 1;
+    }
+
+ out:
+    free(slots);
+    free(data);
+    nk_vc_printf("plugged batch of %lu reads: %s\n",count,bad ? "FAILED" : "PASSED");
+    return bad ? -1 : 0;
+}
+
 static int 
 handle_blktest (char * buf, void * priv)
 {
-    char name[32], rw[16];
+    char name[32], rw[16], mode[16];
     uint64_t start, count;
     struct nk_block_dev *d;
     struct nk_block_dev_characteristics c;
 
+    if (sscanf(buf,"blktest %31s qd %15s %15s %lu %lu",name,rw,mode,&start,&count)==5) {
+	if ((*rw!='r' && *rw!='w') || (strcmp(mode,"seq") && strcmp(mode,"rand"))) {
+	    nk_vc_printf("Don't understand %s\n",buf);
+	    return -1;
+	}
+	if (!(d=nk_block_dev_find(name))) {
+	    nk_vc_printf("Can't find %s\n",name);
+	    return -1;
+	}
+	return handle_blktest_qd(d,rw,mode,start,count);
+    }
+
+    if (sscanf(buf,"blktest %31s plug %lu %lu",name,&start,&count)==3) {
+	if (!(d=nk_block_dev_find(name))) {
+	    nk_vc_printf("Can't find %s\n",name);
+	    return -1;
+	}
+	return handle_blktest_plug(d,start,count);
+    }
+
     if ((sscanf(buf,"blktest %s %s %lu %lu",name,rw,&start,&count)!=4)
             || (*rw!='r' && *rw!='w') ) { 
         nk_vc_printf("Don't understand %s\n",buf);
@@ -297,7 +883,7 @@ handle_blktest (char * buf, void * priv)
 
 static struct shell_cmd_impl blktest_impl = {
     .cmd      = "blktest",
-    .help_str = "blktest dev r|w start count",
+    .help_str = "blktest dev r|w start count | blktest dev qd r|w seq|rand blocks count | blktest dev plug start count",
     .handler  = handle_blktest,
 };
 nk_register_shell_cmd(blktest_impl);
@@ -0,0 +1,359 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/blkring.h>
+#include <nautilus/waitqueue.h>
+
+#ifndef NAUT_CONFIG_DEBUG_BLKDEV
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("blkring: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("blkring: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("blkring: " fmt, ##args)
+
+#define MAX_ENTRIES  4096
+
+// submission entries handed to the device per call
+#define SUBMIT_BATCH 32
+
+//
+// Every request in flight holds a slot, which is what the device's
+// completion callback gets as its context.   The slot goes back on
+// the free list only when the owner takes the completion, so there
+// are never more completions pending than the completion queue holds.
+//
+// The submission queue and the slot free list are touched only by
+// the owner.   The completion queue is filled by the device's
+// completion callbacks (possibly on several cpus, in interrupt
+// context) under the completion lock, and drained by the owner
+// without it.
+//
+
+struct slot {
+    struct nk_block_ring *ring;
+    uint64_t              tag;
+};
+
+struct cq_entry {
+    uint64_t              tag;
+    nk_block_dev_status_t status;
+    uint32_t              slot;
+};
+
+struct nk_block_ring {
+    struct nk_block_dev      *dev;
+    uint64_t                  flags;
+    uint32_t                  entries;     // a power of two
+
+    struct nk_block_ring_sqe *sq;
+    uint32_t                  sq_head;
+    uint32_t                  sq_tail;
+
+    struct slot              *slots;
+    uint32_t                 *free_slots;
+    uint32_t                  nfree;
+
+    spinlock_t                cq_lock;
+    struct cq_entry          *cq;
+    volatile uint32_t         cq_head;
+    volatile uint32_t         cq_tail;
+
+    nk_wait_queue_t          *waitq;
+    volatile uint32_t         want;        // completions a sleeping owner needs, or 0
+};
+
+#define CQ_LOCK_CONF uint8_t _cq_lock_flags
+#define CQ_LOCK(r) _cq_lock_flags = spin_lock_irq_save(&(r)->cq_lock)
+#define CQ_UNLOCK(r) spin_unlock_irq_restore(&(r)->cq_lock, _cq_lock_flags)
+
+#define MASK(r) ((r)->entries-1)
+#define CQ_AVAIL(r) ((uint32_t)((r)->cq_tail - (r)->cq_head))
+
+
+struct nk_block_ring *nk_block_ring_create(struct nk_block_dev *dev, uint32_t entries, uint64_t flags)
+{
+    struct nk_block_ring *r;
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
+    uint32_t n, i;
+
+    if (!entries || entries > MAX_ENTRIES) {
+	ERROR("unsupported ring size %u\n", entries);
+	return 0;
+    }
+
+    n = 1;
+    while (n < entries) {
+	n <<= 1;
+    }
+
+    if (!(r = malloc(sizeof(*r)))) {
+	ERROR("cannot allocate ring\n");
+	return 0;
+    }
+
+    memset(r,0,sizeof(*r));
+
+    r->dev = dev;
+    r->flags = flags;
+    r->entries = n;
+    spinlock_init(&r->cq_lock);
+
+    r->sq = malloc(sizeof(struct nk_block_ring_sqe)*n);
+    r->slots = malloc(sizeof(struct slot)*n);
+    r->free_slots = malloc(sizeof(uint32_t)*n);
+    r->cq = malloc(sizeof(struct cq_entry)*n);
+
+    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"blkring-%s",dev->dev.name);
+    r->waitq = nk_wait_queue_create(buf);
+
+    if (!r->sq || !r->slots || !r->free_slots || !r->cq || !r->waitq) {
+	ERROR("cannot allocate ring state\n");
+	goto out_bad;
+    }
+
+    for (i=0;i<n;i++) {
+	r->slots[i].ring = r;
+	r->free_slots[i] = i;
+    }
+    r->nfree = n;
+
+    DEBUG("created ring of %u entries on %s (flags=0x%lx)\n", n, dev->dev.name, flags);
+
+    return r;
+
+ out_bad:
+    if (r->waitq) {
+	nk_wait_queue_destroy(r->waitq);
+    }
+    free(r->sq);
+    free(r->slots);
+    free(r->free_slots);
+    free(r->cq);
+    free(r);
+    return 0;
+}
+
+int nk_block_ring_destroy(struct nk_block_ring *r)
+{
+    if (r->nfree != r->entries) {
+	ERROR("cannot destroy ring with %u requests outstanding\n", r->entries - r->nfree);
+	return -1;
+    }
+
+    DEBUG("destroy ring on %s\n", r->dev->dev.name);
+
+    nk_wait_queue_destroy(r->waitq);
+    free(r->sq);
+    free(r->slots);
+    free(r->free_slots);
+    free(r->cq);
+    free(r);
+
+    return 0;
+}
+
+struct nk_block_ring_sqe *nk_block_ring_get_sqe(struct nk_block_ring *r)
+{
+    if (r->sq_tail - r->sq_head == r->entries) {
+	return 0;
+    }
+    return &r->sq[r->sq_tail++ & MASK(r)];
+}
+
+static int prep(struct nk_block_ring *r, nk_block_dev_op_t op, uint64_t blocknum, uint64_t count,
+		struct nk_block_dev_iov *iov, uint64_t iovcnt, uint64_t tag)
+{
+    struct nk_block_ring_sqe *e = nk_block_ring_get_sqe(r);
+
+    if (!e) {
+	return -1;
+    }
+
+    e->op = op;
+    e->blocknum = blocknum;
+    e->count = count;
+    e->iov = iov;
+    e->iovcnt = iovcnt;
+    e->tag = tag;
+
+    return 0;
+}
+
+int nk_block_ring_prep_readv(struct nk_block_ring *r, uint64_t blocknum, uint64_t count,
+			     struct nk_block_dev_iov *iov, uint64_t iovcnt, uint64_t tag)
+{
+    return prep(r,NK_BLOCK_DEV_OP_READ,blocknum,count,iov,iovcnt,tag);
+}
+
+int nk_block_ring_prep_writev(struct nk_block_ring *r, uint64_t blocknum, uint64_t count,
+			      struct nk_block_dev_iov *iov, uint64_t iovcnt, uint64_t tag)
+{
+    return prep(r,NK_BLOCK_DEV_OP_WRITE,blocknum,count,iov,iovcnt,tag);
+}
+
+int nk_block_ring_prep_flush(struct nk_block_ring *r, uint64_t tag)
+{
+    return prep(r,NK_BLOCK_DEV_OP_FLUSH,0,0,0,0,tag);
+}
+
+// completion callback from the device
+static void complete(nk_block_dev_status_t status, void *context)
+{
+    struct slot *s = (struct slot *)context;
+    struct nk_block_ring *r = s->ring;
+    struct cq_entry *e;
+    int wake;
+    CQ_LOCK_CONF;
+
+    CQ_LOCK(r);
+    e = &r->cq[r->cq_tail & MASK(r)];
+    e->tag = s->tag;
+    e->status = status;
+    e->slot = s - r->slots;
+    __sync_synchronize();
+    r->cq_tail++;
+    wake = r->want && CQ_AVAIL(r) >= r->want;
+    CQ_UNLOCK(r);
+
+    if (wake) {
+	nk_wait_queue_wake_all(r->waitq);
+    }
+}
+
+int nk_block_ring_submit(struct nk_block_ring *r)
+{
+    struct nk_block_dev_req reqs[SUBMIT_BATCH];
+    struct nk_block_ring_sqe *e;
+    struct slot *s;
+    uint32_t n;
+    int rc, total = 0;
+
+    while (r->sq_head != r->sq_tail && r->nfree) {
+
+	// the k-th request of the batch takes the k-th slot from the
+	// top of the free list, so slots of requests the device does
+	// not take are given back just by restoring the count
+	for (n=0; n<SUBMIT_BATCH && r->sq_head+n != r->sq_tail && n<r->nfree; n++) {
+	    e = &r->sq[(r->sq_head+n) & MASK(r)];
+	    s = &r->slots[r->free_slots[r->nfree-1-n]];
+	    s->tag = e->tag;
+	    reqs[n].op = e->op;
+	    reqs[n].blocknum = e->blocknum;
+	    reqs[n].count = e->count;
+	    reqs[n].iov = e->iov;
+	    reqs[n].iovcnt = e->iovcnt;
+	    reqs[n].callback = complete;
+	    reqs[n].context = s;
+	}
+
+	r->nfree -= n;
+
+	rc = nk_block_dev_submit(r->dev,reqs,n);
+
+	if (rc < 0) {
+	    r->nfree += n;
+	    DEBUG("device refused request\n");
+	    return total ? total : -1;
+	}
+
+	r->nfree += n - rc;
+	r->sq_head += rc;
+	total += rc;
+
+	if ((uint32_t)rc < n) {
+	    // device is full
+	    break;
+	}
+    }
+
+    DEBUG("submitted %d requests\n", total);
+
+    return total;
+}
+
+uint64_t nk_block_ring_reap(struct nk_block_ring *r, struct nk_block_ring_cqe *cqes, uint64_t max)
+{
+    uint32_t tail = r->cq_tail;
+    struct cq_entry *e;
+    uint64_t n = 0;
+
+    __sync_synchronize();
+
+    while (n<max && r->cq_head != tail) {
+	e = &r->cq[r->cq_head & MASK(r)];
+	cqes[n].tag = e->tag;
+	cqes[n].status = e->status;
+	r->free_slots[r->nfree++] = e->slot;
+	r->cq_head++;
+	n++;
+    }
+
+    return n;
+}
+
+static int enough(void *state)
+{
+    struct nk_block_ring *r = (struct nk_block_ring *)state;
+
+    return CQ_AVAIL(r) >= r->want;
+}
+
+int nk_block_ring_wait(struct nk_block_ring *r, struct nk_block_ring_cqe *cqes, uint64_t min, uint64_t max)
+{
+    if (min > nk_block_ring_inflight(r)) {
+	ERROR("waiting for %lu completions with only %lu requests in flight\n", min, nk_block_ring_inflight(r));
+	return -1;
+    }
+
+    if (min > max) {
+	min = max;
+    }
+
+    if (get_cur_thread()->blk_plug) {
+	nk_block_dev_flush_plug();
+    }
+
+    if ((r->flags & NK_BLOCK_RING_POLL) || in_interrupt_context()) {
+	while (CQ_AVAIL(r) < min) {
+	    nk_block_dev_poll(r->dev);
+	}
+    } else if (CQ_AVAIL(r) < min) {
+	r->want = min;
+	__sync_synchronize();
+	while (CQ_AVAIL(r) < min) {
+	    nk_wait_queue_sleep_extended(r->waitq, enough, r);
+	}
+	r->want = 0;
+    }
+
+    return nk_block_ring_reap(r,cqes,max);
+}
+
+uint64_t nk_block_ring_inflight(struct nk_block_ring *r)
+{
+    return r->entries - r->nfree;
+}
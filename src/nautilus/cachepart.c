@@ -558,13 +558,12 @@ static int setup_cos_with_length(uint8_t length)
     u.new_bitmask = new_bitmask;
 
     //Write to all the CPUs, including self
+    nk_cpu_mask_t all;
+    nk_cpu_mask_zero(&all);
     for (i = 0; i < nk_get_num_cpus(); i++) {
-        if (i == my_cpu_id()) {
-            cos_update_xcall(&u);
-        } else {
-            smp_xcall(i, cos_update_xcall, &u, 1);
-        }
+        nk_cpu_mask_set(&all, i);
     }
+    smp_xcall_mask(&all, cos_update_xcall, &u, 1);
 
     DEBUG("Set up cur thread\n");
 
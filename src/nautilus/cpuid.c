@@ -75,6 +75,52 @@ cpuid_get_step (void)
 }
 
 
+/*
+ * Size in bytes of the last level cache, from the deterministic
+ * cache parameters leaf.  Returns 0 if the leaf is not supported
+ * (e.g. on AMD parts, which enumerate caches elsewhere)
+ */
+uint64_t
+cpuid_get_llc_size (void)
+{
+    cpuid_ret_t ret;
+    uint64_t size = 0;
+    uint32_t level = 0;
+    uint32_t i;
+
+    if (cpuid_leaf_max() < CPUID_LEAF_CACHE_PARM) {
+        return 0;
+    }
+
+    for (i = 0; i < 16; i++) {
+        cpuid_sub(CPUID_LEAF_CACHE_PARM, i, &ret);
+
+        uint32_t type = ret.a & 0x1f;
+        uint32_t lvl  = (ret.a >> 5) & 0x7;
+
+        if (!type) {
+            break;
+        }
+
+        // skip instruction caches
+        if (type == 2) {
+            continue;
+        }
+
+        if (lvl >= level) {
+            uint64_t ways  = ((ret.b >> 22) & 0x3ff) + 1;
+            uint64_t parts = ((ret.b >> 12) & 0x3ff) + 1;
+            uint64_t line  = (ret.b & 0xfff) + 1;
+            uint64_t sets  = (uint64_t)ret.c + 1;
+            level = lvl;
+            size  = ways * parts * line * sets;
+        }
+    }
+
+    return size;
+}
+
+
 uint32_t 
 cpuid_ext_leaf_max (void)
 {
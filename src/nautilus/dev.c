@@ -136,6 +136,21 @@ struct nk_dev *nk_dev_find(char *name)
 
 
 
+// func is called with the device list locked, so it must not block
+void nk_dev_for_each(nk_dev_type_t type, void (*func)(struct nk_dev *d, void *state), void *state)
+{
+    struct list_head *cur;
+    STATE_LOCK_CONF;
+    STATE_LOCK();
+    list_for_each(cur,&dev_list) {
+	struct nk_dev *d = list_entry(cur,struct nk_dev, dev_list_node);
+	if (d->type==type) {
+	    func(d,state);
+	}
+    }
+    STATE_UNLOCK();
+}
+
 void nk_dev_wait(struct nk_dev *d,
 		 int (*cond_check)(void *state),
 		 void *state)
@@ -42,6 +42,7 @@
 #include <nautilus/random.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/cpu_state.h>
+#include <nautilus/topo.h>
 
 #ifndef NAUT_CONFIG_DEBUG_FIBERS
 #undef  DEBUG_PRINT
@@ -59,6 +60,15 @@
 #define STACK_CLONE_DEPTH 2
 #define GPR_RAX_OFFSET 0x70
 
+/* Recycled fibers are kept per CPU for power-of-two stack sizes from 4KB to 2MB */
+#define FIBER_POOL_MIN_SHIFT 12
+#define FIBER_POOL_CLASSES   10
+#ifdef NAUT_CONFIG_FIBER_POOL_DEPTH
+#define FIBER_POOL_DEPTH NAUT_CONFIG_FIBER_POOL_DEPTH
+#else
+#define FIBER_POOL_DEPTH 0
+#endif
+
 /* Macros for accessing parts of the fiber state */
 #define _GET_FIBER_STATE() get_cpu()->f_state
 #define _NK_IDLE_FIBER() get_cpu()->f_state->idle_fiber
@@ -80,6 +90,13 @@ typedef struct nk_fiber_percpu_state {
     struct list_head f_sched_queue; /* sched queue for fibers on this CPU (can be accessed by other CPUs) */
     struct nk_wait_queue *waitq; /* Wait queue that the fiber thread can sleep on */
     int fork_cpu; /* Determines which CPU forked fibers will be placed on. Default => curr CPU */
+    int cpu; /* CPU this state belongs to */
+    nk_fiber_t *pending; /* fiber that just yielded, queued once we are off its stack */
+    nk_fiber_t *zombie; /* fiber that just exited, recycled once we are off its stack */
+    int *victims; /* other CPUs to steal from, nearest first */
+    uint64_t steals; /* fibers this CPU has taken from others */
+    struct list_head pool[FIBER_POOL_CLASSES]; /* free fibers with their stacks, by stack size */
+    int pool_count[FIBER_POOL_CLASSES];
 } fiber_state;
 
 /* These functions are implemented in assembly. Can be found in src/asm/fiber_lowlevel.S */
@@ -165,6 +182,241 @@ static nk_fiber_t* _rr_policy()
   return fiber_to_schedule;
 }
 
+static int _wake_fiber_thread(fiber_state *state);
+
+// Returns the pool size class for a stack size, or -1 if it is not pooled
+static int _pool_class(nk_stack_size_t size)
+{
+  int shift;
+
+  if (size & (size - 1)) {
+    return -1;
+  }
+
+  shift = __builtin_ctzl(size) - FIBER_POOL_MIN_SHIFT;
+
+  return (shift < 0 || shift >= FIBER_POOL_CLASSES) ? -1 : shift;
+}
+
+// Takes a fiber with a stack of the given size from this CPU's pool
+// Returns NULL if there is none. The pool is only touched with interrupts
+// off by the CPU it belongs to, so no lock is needed.
+static nk_fiber_t *_pool_get(nk_stack_size_t size)
+{
+  int c = _pool_class(size);
+  nk_fiber_t *f = NULL;
+  uint8_t flags;
+
+  if (c < 0 || !FIBER_POOL_DEPTH) {
+    return NULL;
+  }
+
+  flags = irq_disable_save();
+  fiber_state *state = _GET_FIBER_STATE();
+  if (state && state->pool_count[c]) {
+    f = list_first_entry(&(state->pool[c]), nk_fiber_t, sched_node);
+    list_del_init(&(f->sched_node));
+    state->pool_count[c]--;
+  }
+  irq_enable_restore(flags);
+
+  return f;
+}
+
+// Releases a fiber and its stack, keeping it in this CPU's pool if there is room
+static void _fiber_free(nk_fiber_t *f)
+{
+  int c = _pool_class(f->stack_size);
+  uint8_t flags;
+
+  if (c >= 0 && FIBER_POOL_DEPTH) {
+    flags = irq_disable_save();
+    fiber_state *state = _GET_FIBER_STATE();
+    if (state && state->pool_count[c] < FIBER_POOL_DEPTH) {
+      list_add(&(f->sched_node), &(state->pool[c]));
+      state->pool_count[c]++;
+      irq_enable_restore(flags);
+      return;
+    }
+    irq_enable_restore(flags);
+  }
+
+  free(f->stack);
+  free(f);
+}
+
+// Finishes the last switch on this CPU. A fiber that yielded is not made
+// visible on the sched queue (where another CPU could pick it up) and an
+// exited fiber is not recycled until we are running on a different stack.
+// Must be called by the fiber thread.
+static void _settle(fiber_state *state)
+{
+  nk_fiber_t *f;
+
+  if (state->zombie) {
+    _fiber_free(state->zombie);
+    state->zombie = NULL;
+  }
+
+  f = state->pending;
+  if (f) {
+    state->pending = NULL;
+
+    _LOCK_FIBER(f);
+    f->f_status = READY;
+    f->curr_cpu = state->cpu;
+    _UNLOCK_FIBER(f);
+
+    _LOCK_SCHED_QUEUE(state);
+    list_add_tail(&(f->sched_node), &(state->f_sched_queue));
+    _UNLOCK_SCHED_QUEUE(state);
+  }
+}
+
+#ifdef NAUT_CONFIG_FIBER_STEAL
+
+// 0 => same physical core, 1 => same socket, 2 => elsewhere
+static int _topo_distance(struct cpu *a, struct cpu *b)
+{
+  if (!a->coord || !b->coord) {
+    return 2;
+  }
+  if (nk_topo_cpus_share_phys_core(a, b)) {
+    return 0;
+  }
+  if (nk_topo_cpus_share_socket(a, b)) {
+    return 1;
+  }
+  return 2;
+}
+
+// Returns the other CPUs ordered by topological distance from state's CPU,
+// rotated within each distance class so thieves spread out over victims
+static int *_fiber_victims(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int me = state->cpu;
+  int n = sys->num_cpus;
+  int dist, i, j, k = 0;
+  int *v;
+
+  if (state->victims || n < 2) {
+    return state->victims;
+  }
+
+  v = malloc_specific(sizeof(int)*(n-1), me);
+  if (!v) {
+    return NULL;
+  }
+
+  for (dist = 0; dist < 3; dist++) {
+    for (i = 1; i < n; i++) {
+      j = (me + i) % n;
+      if (_topo_distance(sys->cpus[me], sys->cpus[j]) == dist) {
+        v[k++] = j;
+      }
+    }
+  }
+
+  // nk_fiber_run may build it concurrently from another CPU
+  if (!__sync_bool_compare_and_swap(&state->victims, NULL, v)) {
+    free(v);
+  }
+
+  return state->victims;
+}
+
+// Returns nonzero if some other CPU has a queued fiber we could take
+static int _have_victim_work(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int *v = state->victims;
+  int i;
+
+  for (i = 0; v && i < sys->num_cpus - 1; i++) {
+    fiber_state *vs = sys->cpus[v[i]]->f_state;
+    if (vs && !list_empty_careful(&(vs->f_sched_queue))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Takes a ready fiber from the nearest CPU that has one. We take from the
+// tail, away from where the victim's fiber thread is dequeuing, and never
+// wait on a fiber lock since lock order elsewhere is fiber then queue.
+// Fibers placed on a specific CPU stay there.
+static nk_fiber_t *_steal_fiber(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int *v = _fiber_victims(state);
+  nk_fiber_t *f = NULL;
+  int i;
+
+  for (i = 0; v && !f && i < sys->num_cpus - 1; i++) {
+    fiber_state *vs = sys->cpus[v[i]]->f_state;
+
+    if (!vs || list_empty_careful(&(vs->f_sched_queue))) {
+      continue;
+    }
+
+    _LOCK_SCHED_QUEUE(vs);
+    nk_fiber_t *cand;
+    list_for_each_entry_reverse(cand, &(vs->f_sched_queue), sched_node) {
+      if (cand->bound_cpu >= 0) {
+        continue;
+      }
+      if (!spin_try_lock(&(cand->lock))) {
+        if (cand->f_status == READY) {
+          list_del_init(&(cand->sched_node));
+          cand->curr_cpu = state->cpu;
+          f = cand;
+        }
+        _UNLOCK_FIBER(cand);
+      }
+      break;
+    }
+    _UNLOCK_SCHED_QUEUE(vs);
+  }
+
+  if (f) {
+    state->steals++;
+    FIBER_DEBUG("_steal_fiber() : cpu %d stole fiber %p\n", state->cpu, f);
+  }
+
+  return f;
+}
+
+// Nudges the nearest CPU's fiber thread when we have more than we can run
+static void _wake_neighbor(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int *v = _fiber_victims(state);
+
+  if (v && sys->cpus[v[0]]->f_state && sys->cpus[v[0]]->f_state->fiber_thread) {
+    _wake_fiber_thread(sys->cpus[v[0]]->f_state);
+  }
+}
+
+#endif
+
+// Picks the next fiber to run on this CPU: the local queue first, then
+// (if enabled) other CPUs' queues. Returns NULL if there is nothing to run.
+static nk_fiber_t *_pick_next(fiber_state *state)
+{
+  _LOCK_SCHED_QUEUE(state);
+  nk_fiber_t *f = _rr_policy();
+  _UNLOCK_SCHED_QUEUE(state);
+
+#ifdef NAUT_CONFIG_FIBER_STEAL
+  if (!f) {
+    f = _steal_fiber(state);
+  }
+#endif
+
+  return f;
+}
+
 // Cleans up an exiting fiber. Frees fiber struct and fiber's stack, cleans up fiber's wait queue
 // Exiting fiber must be running when this is called because a context switch is performed at the end
 static void _nk_fiber_exit(nk_fiber_t *f)
@@ -199,9 +451,10 @@ static void _nk_fiber_exit(nk_fiber_t *f)
     // DEBUG: Prints out what fibers are in waitq and what the waitq size is
     //FIBER_DEBUG("_nk_fiber_exit() : In waitq loop. Temp is %p and size is %d\n", temp, waitq->size);
     
-    // if temp is a valid fiber, add it to a random sched queue
+    // if temp is a valid fiber, add it to our sched queue (others can steal
+    // it), or back on the CPU it was placed on
     if (temp){
-      nk_fiber_run(temp, F_RAND_CPU);
+      nk_fiber_run(temp, temp->bound_cpu >= 0 ? temp->bound_cpu : F_CURR_CPU);
 
       // DEBUG: prints the number of fibers that temp is waiting on
       FIBER_DEBUG("_nk_fiber_exit() : restarting fiber %p on wait_queue %p\n", temp, waitq);
@@ -211,21 +464,19 @@ static void _nk_fiber_exit(nk_fiber_t *f)
   // Mark the current fiber as done (since we are exiting)
   f->is_done = 1;
 
-  // Picks fiber to switch to and updates fiber state
-  _LOCK_SCHED_QUEUE(state);
-  next = _rr_policy();
+  // Finish the previous switch, then pick fiber to switch to and update fiber state
+  _settle(state);
+  next = _pick_next(state);
   if (!(next)) {
     next = state->idle_fiber;
   }
   state->curr_fiber = next;
-  _UNLOCK_SCHED_QUEUE(state);
   
-  // Unlock the fiber before free (in case we implement reaping)
+  // Unlock the fiber before it is recycled
   _UNLOCK_FIBER(f);
 
-  // Free the current fiber's memory (stack and fiber structure)
-  free(f->stack);
-  free(f);
+  // We are still on f's stack, so it is freed (or pooled) after the switch
+  state->zombie = f;
   
   // Switch back to the idle fiber using special exit function
   // Jumps to exit switch so we avoid pushing return addr to freed stack
@@ -380,23 +631,18 @@ __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, f
     FIBER_INFO("_nk_fiber_yield_helper() : Switched to idle fiber on CPU %d\n", my_cpu_id());
   }*/
   
-  // Enqueue the current fiber (if it is not the idle fiber)
+  // Enqueue the current fiber (if it is not the idle fiber). We are still
+  // running on its stack, so it is only put on the sched queue, where other
+  // CPUs may take it, by _settle() after the switch.
   if (!(f_from->is_idle)) {
-    // Gets the sched queue for the current CPU
-    _LOCK_SCHED_QUEUE(state);
-    struct list_head *fiber_sched_queue = &(state->f_sched_queue);
-     
     // DEBUG: Prints the fiber that's about to be enqueued
     FIBER_DEBUG("_nk_fiber_yield_helper() : About to enqueue fiber: %p \n", f_from);
     
     _LOCK_FIBER(f_from);
-    f_from->f_status = READY;
-    f_from->curr_cpu = my_cpu_id();
+    f_from->f_status = YIELD;
     _UNLOCK_FIBER(f_from);
 
-    // Adds fiber we're switching away from to the current CPU's fiber queue
-    list_add_tail(&(f_from->sched_node), fiber_sched_queue);
-    _UNLOCK_SCHED_QUEUE(state);
+    state->pending = f_from;
   }
   // Begin context switch (register saving and stack switch)
   _nk_fiber_context_switch(f_to);
@@ -419,9 +665,8 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   f_from->rsp = rsp;
 
   // get next fiber to yield to
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  _settle(state);
+  nk_fiber_t *f_to = _pick_next(state);
   if (!(f_to)) { 
     if (f_from->is_idle) {
       // Should never come from the idle fiber
@@ -561,6 +806,13 @@ static struct nk_fiber_percpu_state *init_local_fiber_state()
     state->waitq = nk_wait_queue_create("fib");
     
     state->fork_cpu = F_CURR_CPU;
+
+    state->cpu = my_cpu_id();
+
+    int i;
+    for (i = 0; i < FIBER_POOL_CLASSES; i++) {
+        INIT_LIST_HEAD(&(state->pool[i]));
+    }
  
     return state;
 
@@ -604,9 +856,19 @@ int nk_fiber_init()
 }
 
 // Utility function used to determine if fiber thread should sleep or not
+// A fiber that yielded to the idle fiber, or one that exited, is work
+// that _settle() has not yet finished, so it also counts.
 static int _check_empty(void *s) 
 {
   fiber_state *state = (fiber_state*)s;
+  if (state->pending || state->zombie) {
+    return 1;
+  }
+#ifdef NAUT_CONFIG_FIBER_STEAL
+  if (_have_victim_work(state)) {
+    return 1;
+  }
+#endif
   return (!(list_empty(&(state->f_sched_queue)) && state->curr_fiber->is_idle));
 }
 
@@ -627,6 +889,8 @@ static void __nk_fiber_idle(void *in, void **out)
     // If we have fiber thread sleep enabled
     #ifdef NAUT_CONFIG_FIBER_ENABLE_SLEEP  
     nk_fiber_yield();
+    // requeue a fiber that yielded to us before deciding we have nothing to do
+    _settle(_GET_FIBER_STATE());
     if (list_empty_careful(_GET_SCHED_HEAD())){
       FIBER_DEBUG("nk_fiber_idle() : fiber thread going to sleep\n");
       nk_sleep(NAUT_CONFIG_FIBER_THREAD_SLEEP_TIME);
@@ -640,6 +904,8 @@ static void __nk_fiber_idle(void *in, void **out)
     #ifdef NAUT_CONFIG_FIBER_ENABLE_WAIT
     nk_fiber_yield();
     fiber_state *state = _GET_FIBER_STATE();
+    // requeue a fiber that yielded to us before deciding we have nothing to do
+    _settle(state);
     if (!(_check_empty((void*)state))){
       FIBER_DEBUG("nk_fiber_idle() : fiber thread waiting on more fibers\n");
       nk_wait_queue_sleep_extended(state->waitq, _check_empty, state);
@@ -839,33 +1105,43 @@ int nk_fiber_create(nk_fiber_fun_t fun,
   // Get stack size
   nk_stack_size_t required_stack_size = stack_size ? stack_size: FSTACK_16KB;
 
-  // Allocate space for a fiber
-  fiber = malloc(sizeof(nk_fiber_t));
+  // Reuse a recycled fiber and stack if this CPU has one
+  fiber = _pool_get(required_stack_size);
 
-  // Check if malloc for nk_fiber_t struct failed
-  if (!fiber) {
-    // Print error here
-    return -EINVAL;
-  }
+  if (fiber) {
+    void *stack = fiber->stack;
+    memset(fiber, 0, sizeof(nk_fiber_t));
+    fiber->stack = stack;
+  } else {
+    // Allocate space for a fiber
+    fiber = malloc(sizeof(nk_fiber_t));
 
-  // Initialize the whole struct with zeros
-  memset(fiber, 0, sizeof(nk_fiber_t));
+    // Check if malloc for nk_fiber_t struct failed
+    if (!fiber) {
+      // Print error here
+      return -EINVAL;
+    }
+
+    // Initialize the whole struct with zeros
+    memset(fiber, 0, sizeof(nk_fiber_t));
+
+    // Allocate stack space
+    fiber->stack = (void*) malloc(required_stack_size);
+
+    // Check if malloc for the stack failed
+    if (!fiber->stack){
+      // Free the previously allocated nk_fiber_t
+      free(fiber);
+      return -EINVAL;
+    }
+  }
   
   // Set fiber status to init
   fiber->f_status = INIT;
+  fiber->bound_cpu = -1;
  
   // Set stack size
   fiber->stack_size = required_stack_size;
- 
-  // Allocate stack space
-  fiber->stack = (void*) malloc(required_stack_size);
-
-  // Check if malloc for the stack failed
-  if (!fiber->stack){
-    // Free the previously allocated nk_fiber_t
-    free(fiber);
-    return -EINVAL;
-  }
 
   // Initialize function, input, and output related to the fiber
   fiber->fun = fun;
@@ -907,7 +1183,8 @@ int nk_fiber_create(nk_fiber_fun_t fun,
  *
  * @f: the fiber to add to the sched queue
  * @target_cpu: which CPU to start the fiber on. F_CURR_CPU => run on current CPU,
- *              F_RAND_CPU => run on random CPU. 
+ *              F_RAND_CPU => run on random CPU. A fiber placed on a specific
+ *              CPU stays there; others may be stolen by other CPUs.
  *
  * on error (invalid target_cpu), returns -EINVAL, otherwise 0.
  */
@@ -944,9 +1221,13 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
   _LOCK_FIBER(f);
   f->curr_cpu = t_cpu;
   f->f_status = READY;
+  if (target_cpu > F_CURR_CPU) {
+    f->bound_cpu = t_cpu;
+  }
   
   // Lock the CPU fiber state and enqueue the fiber into sched queue 
   _LOCK_SCHED_QUEUE(state);
+  int was_busy = !list_empty(&(state->f_sched_queue));
   list_add_tail(&(f->sched_node), &(state->f_sched_queue));
   
   // Unlock CPU fiber state and f
@@ -956,6 +1237,15 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
   // Wake up fiber thread for selected CPU (or do nothing if it is already awake)
   _wake_fiber_thread(state); 
 
+#ifdef NAUT_CONFIG_FIBER_STEAL
+  // If that CPU already had work queued, let a neighbor come and take some
+  if (was_busy) {
+    _wake_neighbor(state);
+  }
+#else
+  (void)was_busy;
+#endif
+
   return 0;
 }
 
@@ -1027,11 +1317,11 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
     _nk_fiber_context_switch(curr_fiber);
   }
   
-  // Pick a random fiber to yield to (NULL if no fiber in queue)
+  // Finish the previous switch on this CPU
+  _settle(state);
 
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  // Pick a fiber to yield to (NULL if no fiber in queue or to steal)
+  nk_fiber_t *f_to = _pick_next(state);
   
   #if NAUT_CONFIG_DEBUG_FIBERS
   //_debug_yield(f_to);
@@ -1086,6 +1376,9 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   curr_fiber->fpu_state_offset = offset;
   #endif
 
+  // Finish the previous switch on this CPU
+  _settle(state);
+
   // Locks fiber state
   _LOCK_SCHED_QUEUE(state);
   // Remove f_to from its respective fiber queue (need to check all CPUs)
@@ -1102,9 +1395,9 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
       FIBER_DEBUG("nk_fiber_yield_to() : early ret flag set, returning early\n");
     }
     
-    // early ret flag not set, so we find a random fiber to yield to instead
-    nk_fiber_t *new_to = _rr_policy();
+    // early ret flag not set, so we find another fiber to yield to instead
     _UNLOCK_SCHED_QUEUE(state);
+    nk_fiber_t *new_to = _pick_next(state);
     
     // Checks to see if we received a valid fiber from _rr_policy (NULL = no fibers to schedule)
     if (!(new_to)) { 
@@ -1287,9 +1580,8 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
   FIBER_DEBUG("__nk_fiber_fork() : rbp_stash_addr: %p, rbp1_offset_from_ret0: %p, rbp_stash_offset: %p, rbp_offset_from: %p\n", rbp_stash_addr, rbp1_offset_from_ret0_addr, rbp_stash_offset_from_ret0_addr, rbp_offset_from_ret0_addr);
    
   // Allocate new fiber struct using current fiber's data
-  nk_fiber_t *new;
-  nk_fiber_create(NULL, NULL, 0, alloc_size, &new);
-  if (!new) {
+  nk_fiber_t *new = NULL;
+  if (nk_fiber_create(NULL, NULL, 0, alloc_size, &new) < 0 || !new) {
     //panic("__nk_fiber_fork() : could not allocate new fiber. Fork failed.\n");
     return (nk_fiber_t*)-1;
   }
@@ -1369,8 +1661,7 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
 
   // Add the forked fiber to the sched queue
   if (nk_fiber_run(new, state->fork_cpu) < 0) {
-    free(new->stack);
-    free(new);
+    _fiber_free(new);
     return (nk_fiber_t*)-1;
   } 
 
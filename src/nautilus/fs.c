@@ -164,6 +164,21 @@ static inline ssize_t file_write(nk_fs_fd_t fd, char *buf, size_t num_bytes)
 }
 
 
+static inline ssize_t file_map(nk_fs_fd_t fd, off_t offset, size_t num_bytes, struct nk_fs_extent *ext, uint64_t max)
+{
+    if (!FS_FD_ERR(fd) && fd->fs && fd->fs->interface 
+	&& fd->fs->interface->map_file) {
+	return fd->fs->interface->map_file(fd->fs->state, 
+					   fd->file, 
+					   offset,
+					   num_bytes,
+					   ext,
+					   max);
+    } else {
+	return -1;
+    }
+}
+
 static int exists(struct nk_fs *fs, char *path) 
 {
     //    DEBUG("Exists (%s, %s)\n",fs->name,path);
@@ -454,7 +469,7 @@ ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     }
 
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = file_write(fd, buf, num_bytes);
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
@@ -463,6 +478,18 @@ ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     return n;
 }
 
+ssize_t nk_fs_map(nk_fs_fd_t fd, off_t offset, size_t num_bytes, struct nk_fs_extent *ext, uint64_t max)
+{
+    DEBUG("attempt map of %ld bytes starting at offset %lu\n", num_bytes, offset);
+
+    if (FS_FD_ERR(fd) || !(fd->flags & O_RDONLY)) { // includes RDWR
+	ERROR("Cannot map file not opened for reading\n");
+	return -1;
+    }
+
+    return file_map(fd, offset, num_bytes, ext, max);
+}
+
 int nk_fs_ftruncate(nk_fs_fd_t fd, off_t len)
 {
     FILE_LOCK_CONF;
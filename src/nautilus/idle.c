@@ -67,14 +67,19 @@ idle (void * in, void ** out)
 
 
 #if NAUT_CONFIG_TASK_IN_IDLE
-	// consume our own tasks until there are none left
+	// consume our own tasks, and then stolen ones, until there are none left
 	// we need to assure that if we consume a task, we finish it
 	// hence the preemption disable
 	do {
 #if NAUT_CONFIG_TASK_IN_IDLE_NOPREEMPT
 	    preempt_disable();
 #endif
-	    if ((task = nk_task_try_consume(my_cpu_id(),0,0))) { 
+	    task = nk_task_try_consume(my_cpu_id(),0,0);
+	    if (!task) {
+		// steal from the closest cpu with work
+		task = nk_task_try_consume(-1,0,0);
+	    }
+	    if (task) { 
 		DEBUG_PRINT("idle consuming task %p\n",task);
 		void *output = task->func(task->input);
 		nk_task_complete(task, output);
@@ -100,6 +105,13 @@ idle (void * in, void ** out)
 
         nk_yield();
 
+#if NAUT_CONFIG_IDLE_MWAIT
+        if (!nk_sched_idle_wait()) {
+            // we waited until there was something to do
+            continue;
+        }
+#endif
+
 #ifdef NAUT_CONFIG_XEON_PHI
         udelay(1);
 #else
@@ -36,6 +36,8 @@
 #include <nautilus/thread.h>
 #include <nautilus/errno.h>
 #include <nautilus/random.h>
+#include <nautilus/fs.h>
+#include <nautilus/list.h>
 #include <dev/hpet.h>
 
 
@@ -199,14 +201,6 @@ __assert_fail (const char * assertion, const char * file, unsigned line, const c
 }
 
 
-int 
-vfprintf (FILE * stream, const char * format, va_list arg)
-{
-    UNDEF_FUN_ERR();
-    return -1;
-}
-
-
 int 
 rand (void) {
     int r;
@@ -309,255 +303,830 @@ strerror (int errnum)
     UNDEF_FUN_ERR();
     return NULL;
 }
-FILE *tmpfile(void)
+
+
+//
+// Buffered stdio over nk_fs
+//
+// A FILE is a struct stream.   stdin, stdout, and stderr remain the
+// constants 0, 1, and 2:  writes to stdout and stderr go to printk,
+// and reads from stdin see end of file.  A stream must not be used by
+// several threads at once.   The list of open streams, which exists
+// for fflush(NULL), is protected by its own lock.
+//
+// In read mode, the buffer holds the file's bytes [offset,offset+len)
+// and the stream is at offset+pos.  In write mode, the buffer holds
+// len bytes to be written at offset (or at the end of the file for
+// append streams) and the stream is at offset+len.   When idle, the
+// buffer is empty and the stream is at offset.
+//
+
+#define STREAM_BUFSIZE 4096
+
+#define STREAM_READ   0x1
+#define STREAM_WRITE  0x2
+#define STREAM_APPEND 0x4
+#define STREAM_EOF    0x8
+#define STREAM_ERR    0x10
+
+#define STREAM_IDLE    0
+#define STREAM_READING 1
+#define STREAM_WRITING 2
+
+struct stream {
+    struct list_head node;
+    nk_fs_fd_t       fd;
+    int              flags;
+    int              mode;     // _IOFBF, _IOLBF, or _IONBF
+    int              state;
+    char            *buf;
+    size_t           size;
+    int              own_buf;
+    char             small;    // the buffer of an unbuffered stream
+    size_t           pos;
+    size_t           len;
+    off_t            offset;
+};
+
+static LIST_HEAD(streams);
+static spinlock_t streams_lock = 0;
+
+#define STREAMS_LOCK_CONF uint8_t _streams_lock_flags
+#define STREAMS_LOCK() _streams_lock_flags = spin_lock_irq_save(&streams_lock)
+#define STREAMS_UNLOCK() spin_unlock_irq_restore(&streams_lock, _streams_lock_flags)
+
+#define IS_STD(f) ((uint64_t)(f) <= 2)
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+// write data at the stream's offset, or at the end of the file
+static int stream_write_out(struct stream *s, const char *data, size_t len)
 {
+    ssize_t n;
+    off_t where;
 
-    UNDEF_FUN_ERR();
-    return NULL;
+    if (s->flags & STREAM_APPEND) {
+	where = nk_fs_seek(s->fd,0,2);
+    } else {
+	where = nk_fs_seek(s->fd,s->offset,0);
+    }
 
+    if (where < 0) {
+	s->flags |= STREAM_ERR;
+	return -1;
+    }
+
+    s->offset = where;
+
+    while (len) {
+	n = nk_fs_write(s->fd,(void*)data,len);
+	if (n <= 0) {
+	    s->flags |= STREAM_ERR;
+	    return -1;
+	}
+	data += n;
+	len -= n;
+	s->offset += n;
+    }
+
+    return 0;
 }
-int 
-ferror (FILE * f)
+
+// write out pending data, or drop read-ahead, leaving the stream idle
+static int stream_flush(struct stream *s)
 {
-    UNDEF_FUN_ERR();
-    return -1;
+    int rc = 0;
+
+    if (s->state == STREAM_WRITING && s->len) {
+	rc = stream_write_out(s,s->buf,s->len);
+    } else if (s->state == STREAM_READING) {
+	s->offset += s->pos;
+    }
+
+    s->pos = s->len = 0;
+    s->state = STREAM_IDLE;
+
+    return rc;
 }
-FILE *freopen(const char *fname, const char *mode,FILE *stream)
-{
 
-    UNDEF_FUN_ERR();
-    return NULL;
+static int stream_to_read(struct stream *s)
+{
+    if (!(s->flags & STREAM_READ)) {
+	s->flags |= STREAM_ERR;
+	return -1;
+    }
+    if (s->state == STREAM_WRITING && stream_flush(s)) {
+	return -1;
+    }
+    s->state = STREAM_READING;
+    return 0;
 }
-int 
-fclose (FILE * f)
+
+static int stream_to_write(struct stream *s)
 {
-    UNDEF_FUN_ERR();
-    return -1;
+    if (!(s->flags & STREAM_WRITE)) {
+	s->flags |= STREAM_ERR;
+	return -1;
+    }
+    if (s->state == STREAM_READING) {
+	stream_flush(s);
+    }
+    s->state = STREAM_WRITING;
+    return 0;
 }
 
+// refill an exhausted read buffer; returns bytes now available
+static ssize_t stream_fill(struct stream *s)
+{
+    ssize_t n;
+
+    s->offset += s->len;
+    s->pos = s->len = 0;
 
-FILE * 
-fopen (const char * path, FILE * f)
+    if (nk_fs_seek(s->fd,s->offset,0) < 0 ||
+	(n = nk_fs_read(s->fd,s->buf,s->size)) < 0) {
+	s->flags |= STREAM_ERR;
+	return -1;
+    }
+
+    if (!n) {
+	s->flags |= STREAM_EOF;
+	return 0;
+    }
+
+    s->len = n;
+    return n;
+}
+
+FILE *
+fopen (const char * path, FILE * m)
 {
-    UNDEF_FUN_ERR();
-    return NULL;
+    const char *mode = (const char *)m;
+    struct stream *s;
+    int flags, oflags;
+    STREAMS_LOCK_CONF;
+
+    if (!path || !mode) {
+	return NULL;
+    }
+
+    switch (mode[0]) {
+    case 'r':
+	flags = STREAM_READ;
+	oflags = O_RDONLY;
+	break;
+    case 'w':
+	flags = STREAM_WRITE;
+	oflags = O_WRONLY | O_CREAT | O_TRUNC;
+	break;
+    case 'a':
+	flags = STREAM_WRITE | STREAM_APPEND;
+	oflags = O_WRONLY | O_CREAT;
+	break;
+    default:
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if (strchr(mode,'+')) {
+	flags |= STREAM_READ | STREAM_WRITE;
+	oflags |= O_RDWR;
+    }
+
+    if (!(s = malloc(sizeof(*s)))) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    memset(s,0,sizeof(*s));
+
+    if (!(s->buf = malloc(STREAM_BUFSIZE))) {
+	free(s);
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    s->size = STREAM_BUFSIZE;
+    s->own_buf = 1;
+    s->mode = _IOFBF;
+    s->flags = flags;
+
+    s->fd = nk_fs_open((char*)path,oflags,0);
+
+    if (FS_FD_ERR(s->fd)) {
+	free(s->buf);
+	free(s);
+	errno = ENOENT;
+	return NULL;
+    }
+
+    STREAMS_LOCK();
+    list_add(&s->node,&streams);
+    STREAMS_UNLOCK();
+
+    return (FILE *)s;
 }
 
 
 FILE * 
 fopen64 (const char * path, FILE * f)
 {
-    UNDEF_FUN_ERR();
-    return NULL;
+    return fopen(path,f);
 }
 
 
-FILE * 
-fdopen (int fd, const char * mode)
+int 
+fclose (FILE * f)
 {
-    UNDEF_FUN_ERR();
-    return NULL;
+    struct stream *s = (struct stream *)f;
+    int rc;
+    STREAMS_LOCK_CONF;
+
+    if (IS_STD(f)) {
+	return 0;
+    }
+
+    rc = stream_flush(s);
+
+    STREAMS_LOCK();
+    list_del(&s->node);
+    STREAMS_UNLOCK();
+
+    if (nk_fs_close(s->fd)) {
+	rc = -1;
+    }
+
+    if (s->own_buf) {
+	free(s->buf);
+    }
+    free(s);
+
+    return rc ? EOF : 0;
 }
 
-char *getenv(const char *name)
+
+int fflush (FILE * f)
 {
+    struct stream **all;
+    struct list_head *cur;
+    uint64_t n = 0, i;
+    int rc = 0;
+    STREAMS_LOCK_CONF;
 
-    UNDEF_FUN_ERR();
-    return NULL;
+    if (f) {
+	return IS_STD(f) ? 0 : stream_flush((struct stream *)f) ? EOF : 0;
+    }
+
+    // flushing may block, so do it outside of the lock
+    STREAMS_LOCK();
+    list_for_each(cur,&streams) {
+	n++;
+    }
+    all = n ? malloc(sizeof(struct stream *)*n) : 0;
+    if (all) {
+	i = 0;
+	list_for_each(cur,&streams) {
+	    all[i++] = list_entry(cur,struct stream,node);
+	}
+    }
+    STREAMS_UNLOCK();
+
+    if (n && !all) {
+	return EOF;
+    }
+
+    for (i=0;i<n;i++) {
+	if (stream_flush(all[i])) {
+	    rc = EOF;
+	}
+    }
+
+    free(all);
+
+    return rc;
 }
-//For LUA Support
-clock_t clock()
+
+
+int setvbuf(FILE *restrict stream, char *restrict buf, int type,
+       size_t size)
 {
+    struct stream *s = (struct stream *)stream;
 
-    UNDEF_FUN_ERR();
-    return -1;
+    if (IS_STD(stream)) {
+	return 0;
+    }
+
+    if (type != _IOFBF && type != _IOLBF && type != _IONBF) {
+	return -1;
+    }
+
+    if (stream_flush(s)) {
+	return -1;
+    }
+
+    if (s->own_buf) {
+	free(s->buf);
+	s->own_buf = 0;
+    }
+
+    if (type == _IONBF) {
+	s->buf = &s->small;
+	s->size = 1;
+    } else if (buf && size) {
+	s->buf = buf;
+	s->size = size;
+    } else {
+	if (!size) {
+	    size = STREAM_BUFSIZE;
+	}
+	if (!(s->buf = malloc(size))) {
+	    s->buf = &s->small;
+	    s->size = 1;
+	    s->mode = _IONBF;
+	    return -1;
+	}
+	s->size = size;
+	s->own_buf = 1;
+    }
+
+    s->mode = type;
+
+    return 0;
 }
-//For LUA Support
-char *tmpnam(char *s)
+
+
+size_t 
+fread (void * ptr, size_t size, size_t count, FILE * stream)
 {
+    struct stream *s = (struct stream *)stream;
+    size_t total = size*count, done = 0, n;
+    ssize_t got;
 
-    UNDEF_FUN_ERR();
-    return NULL;
+    if (!total || IS_STD(stream) || stream_to_read(s)) {
+	return 0;
+    }
+
+    while (done < total) {
+	if (s->pos < s->len) {
+	    n = MIN(s->len - s->pos, total - done);
+	    memcpy((char*)ptr + done, s->buf + s->pos, n);
+	    s->pos += n;
+	    done += n;
+	} else if (total - done >= s->size) {
+	    // large reads go straight to the caller's buffer
+	    s->offset += s->len;
+	    s->pos = s->len = 0;
+	    if (nk_fs_seek(s->fd,s->offset,0) < 0 ||
+		(got = nk_fs_read(s->fd,(char*)ptr + done,total - done)) < 0) {
+		s->flags |= STREAM_ERR;
+		break;
+	    }
+	    if (!got) {
+		s->flags |= STREAM_EOF;
+		break;
+	    }
+	    s->offset += got;
+	    done += got;
+	} else if (stream_fill(s) <= 0) {
+	    break;
+	}
+    }
+
+    return done / size;
 }
 
-//For LUA Support
-int remove(const char *path)
+
+size_t fwrite (const void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
+    struct stream *s = (struct stream *)stream;
+    size_t total = size*nmemb;
 
-    UNDEF_FUN_ERR();
-    return -1;
+    if (!total) {
+	return 0;
+    }
+
+    if (IS_STD(stream)) {
+	if (stream == stdin) {
+	    return 0;
+	}
+	printk("%.*s", (int)total, (const char *)ptr);
+	return nmemb;
+    }
+
+    if (stream_to_write(s)) {
+	return 0;
+    }
+
+    if (s->len + total > s->size && stream_flush(s)) {
+	return 0;
+    }
+
+    if (total >= s->size) {
+	// large writes bypass the buffer
+	s->state = STREAM_WRITING;
+	if (stream_write_out(s,ptr,total)) {
+	    return 0;
+	}
+	return nmemb;
+    }
+
+    s->state = STREAM_WRITING;
+    memcpy(s->buf + s->len, ptr, total);
+    s->len += total;
+
+    if (s->mode == _IONBF ||
+	(s->mode == _IOLBF && memchr(ptr,'\n',total))) {
+	if (stream_flush(s)) {
+	    return 0;
+	}
+    }
+
+    return nmemb;
 }
-//For LUA Support
-int rename(const char *old, const char *new)
-{
 
-    UNDEF_FUN_ERR();
-    return -1;
+
+static int stream_getc(struct stream *s)
+{
+    if (stream_to_read(s)) {
+	return EOF;
+    }
+    if (s->pos == s->len && stream_fill(s) <= 0) {
+	return EOF;
+    }
+    return (unsigned char)s->buf[s->pos++];
 }
-//For LUA Support
-int system(const char *command)
+
+int getc(FILE* arg)
 {
+    struct stream *s = (struct stream *)arg;
 
-    UNDEF_FUN_ERR();
-    return -1;
+    if (IS_STD(arg)) {
+	return EOF;
+    }
+
+    if (s->state == STREAM_READING && s->pos < s->len) {
+	return (unsigned char)s->buf[s->pos++];
+    }
+
+    return stream_getc(s);
 }
-//For LUA Support
 
-int fflush (FILE * f)
+int fgetc(FILE* arg)
 {
-    return 0;
+    return getc(arg);
 }
 
-void (*signal(int sig, void (*func)(int)))(int ){
-    //    printk("\nSIGNAL Function:");
-    return 0;
+
+char *fgets(char *str, int n, FILE *stream)
+{
+    struct stream *s = (struct stream *)stream;
+    size_t done = 0, avail;
+    char *nl = 0;
+
+    if (n <= 0 || IS_STD(stream) || stream_to_read(s)) {
+	return NULL;
+    }
+
+    while (done < (size_t)(n-1) && !nl) {
+	if (s->pos == s->len && stream_fill(s) <= 0) {
+	    break;
+	}
+	avail = MIN(s->len - s->pos, (size_t)(n-1) - done);
+	if ((nl = memchr(s->buf + s->pos, '\n', avail))) {
+	    avail = nl - (s->buf + s->pos) + 1;
+	}
+	memcpy(str + done, s->buf + s->pos, avail);
+	s->pos += avail;
+	done += avail;
+    }
+
+    str[done] = 0;
+
+    return (done || n == 1) ? str : NULL;
 }
 
-//For LUA Support
 
 int 
-fprintf (FILE * f, const char * s, ...)
+ungetc (int character, FILE * stream)
 {
-#if 0
-    UNDEF_FUN_ERR();
-    return -1;
-#else
-    va_list arg;
-    va_start(arg,s);
-    vprintk(s, arg);
-    va_end(arg);
-    return 0;
-#endif
+    struct stream *s = (struct stream *)stream;
+
+    if (character == EOF || IS_STD(stream) || stream_to_read(s)) {
+	return EOF;
+    }
+
+    if (!s->pos) {
+	if (s->len == s->size) {
+	    return EOF;
+	}
+	memmove(s->buf + 1, s->buf, s->len);
+	s->len++;
+	s->pos++;
+	s->offset--;
+    }
+
+    s->buf[--s->pos] = (char)character;
+    s->flags &= ~STREAM_EOF;
+
+    return (unsigned char)character;
 }
 
-//For LUA
-int setvbuf(FILE *restrict stream, char *restrict buf, int type,
-       size_t size)
+
+int 
+fputc (int c, FILE * f) 
 {
+    unsigned char ch = (unsigned char)c;
 
-    UNDEF_FUN_ERR();
-    return -1;
+    return fwrite(&ch,1,1,f) == 1 ? ch : EOF;
 }
 
+int putc(int c, FILE *f)
+{
+    return fputc(c,f);
+}
 
-//For LUA
 
-int fscanf(FILE *restrict stream, const char *restrict format, ... )
+int 
+fputs (const char * s, FILE * f)
 {
+    size_t len = strlen(s);
 
-    UNDEF_FUN_ERR();
-    return -1;
+    if (!len) {
+	return 0;
+    }
 
+    return fwrite(s,1,len,f) == len ? 0 : EOF;
 }
-//For LUA
-void clearerr(FILE *stream)
+
+
+int 
+vfprintf (FILE * stream, const char * format, va_list arg)
 {
+    char small[256];
+    char *buf = small;
+    va_list copy;
+    int n;
 
-    UNDEF_FUN_ERR();
-   // return NULL;
+    va_copy(copy,arg);
+    n = vsnprintf(small,sizeof(small),format,arg);
+
+    if (n >= (int)sizeof(small)) {
+	if (!(buf = malloc(n+1))) {
+	    va_end(copy);
+	    return -1;
+	}
+	vsnprintf(buf,n+1,format,copy);
+    }
+    va_end(copy);
+
+    if (n > 0 && fwrite(buf,1,n,stream) != (size_t)n) {
+	n = -1;
+    }
+
+    if (buf != small) {
+	free(buf);
+    }
+
+    return n;
 }
 
-int printf (const char * s, ...)
+
+int 
+fprintf (FILE * f, const char * s, ...)
 {
-#if 0
-    UNDEF_FUN_ERR();
-    return -1;
-#else
     va_list arg;
+    int n;
+
     va_start(arg,s);
-    vprintk(s, arg);
+    n = vfprintf(f,s,arg);
     va_end(arg);
+
+    return n;
+}
+
+
+//For LUA Support
+int fseek(FILE *stream, long offset, int whence)
+{
+    struct stream *s = (struct stream *)stream;
+    off_t where;
+
+    if (IS_STD(stream) || stream_flush(s)) {
+	return -1;
+    }
+
+    // this header's SEEK_* values differ from nk_fs_seek's (SET=0, CUR=1, END=2)
+    switch (whence) {
+    case SEEK_SET:
+	where = offset;
+	break;
+    case SEEK_CUR:
+	where = s->offset + offset;
+	break;
+    case SEEK_END:
+	where = nk_fs_seek(s->fd,offset,2);
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (where < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    s->offset = where;
+    s->flags &= ~STREAM_EOF;
+
     return 0;
-#endif
 }
 
 int 
-fputc (int c, FILE * f) 
+fseeko64 (FILE *fp, uint64_t offset, int whence)
 {
-    printk("%c");
-    return c;
+    return fseek(fp,(long)offset,whence);
 }
 
 
+//For LUA Support
+long ftell(FILE *x)
+{
+    struct stream *s = (struct stream *)x;
+
+    if (IS_STD(x)) {
+	return -1;
+    }
+
+    switch (s->state) {
+    case STREAM_READING:
+	return s->offset + s->pos;
+    case STREAM_WRITING:
+	return s->offset + s->len;
+    default:
+	return s->offset;
+    }
+}
+
+uint64_t 
+ftello64 (FILE *stream)
+{
+    return (uint64_t)ftell(stream);
+}
+
+
+int feof(FILE * x)
+{
+    return IS_STD(x) ? x == stdin : !!(((struct stream *)x)->flags & STREAM_EOF);
+}
+
 int 
-fputs (const char * s, FILE * f)
+ferror (FILE * f)
 {
-    printk("%s\n", s);
-    return 0;
+    return IS_STD(f) ? 0 : !!(((struct stream *)f)->flags & STREAM_ERR);
 }
-size_t fwrite (const void *ptr, size_t size, size_t nmemb, FILE *stream)
+
+//For LUA
+void clearerr(FILE *stream)
+{
+    if (!IS_STD(stream)) {
+	((struct stream *)stream)->flags &= ~(STREAM_EOF | STREAM_ERR);
+    }
+}
+
+
+void *memchr(const void *str, int c, size_t n)
 {
+    const unsigned char *p = (const unsigned char *)str;
+
+    while (n--) {
+	if (*p == (unsigned char)c) {
+	    return (void *)p;
+	}
+	p++;
+    }
 
-   printk("\n %s",ptr); 
-   //UNDEF_FUN_ERR();
-   return (int)size;
+    return NULL;
 }
 
-size_t 
-fread (void * ptr, size_t size, size_t count, FILE * stream)
+FILE *tmpfile(void)
 {
+
     UNDEF_FUN_ERR();
-    return -1;
+    return NULL;
+
 }
+FILE *freopen(const char *fname, const char *mode,FILE *stream)
+{
 
-int
-getwc (FILE * stream)
+    UNDEF_FUN_ERR();
+    return NULL;
+}
+FILE * 
+fdopen (int fd, const char * mode)
 {
     UNDEF_FUN_ERR();
-    return -1;
+    return NULL;
 }
 
+char *getenv(const char *name)
+{
 
+    UNDEF_FUN_ERR();
+    return NULL;
+}
+//For LUA Support
+clock_t clock()
+{
 
-size_t 
-__ctype_get_mb_cur_max (void)
+    UNDEF_FUN_ERR();
+    return -1;
+}
+//For LUA Support
+char *tmpnam(char *s)
 {
+
     UNDEF_FUN_ERR();
-    return 0;
+    return NULL;
 }
+
 //For LUA Support
-int fseek(FILE *stream, long offset, int whence)
+int remove(const char *path)
 {
 
     UNDEF_FUN_ERR();
-    return 1;
+    return -1;
 }
+//For LUA Support
+int rename(const char *old, const char *new)
+{
 
-int 
-fseeko64 (FILE *fp, uint64_t offset, int whence)
+    UNDEF_FUN_ERR();
+    return -1;
+}
+//For LUA Support
+int system(const char *command)
 {
+
     UNDEF_FUN_ERR();
     return -1;
 }
+//For LUA Support
 
+void (*signal(int sig, void (*func)(int)))(int ){
+    //    printk("\nSIGNAL Function:");
+    return 0;
+}
 
-int 
-ungetc (int character, FILE * stream)
+//For LUA Support
+
+//For LUA
+
+int fscanf(FILE *restrict stream, const char *restrict format, ... )
 {
+
     UNDEF_FUN_ERR();
     return -1;
+
 }
- 
 
-uint64_t 
-lseek64 (int fd, uint64_t offset, int whence)
+int printf (const char * s, ...)
 {
+#if 0
     UNDEF_FUN_ERR();
+    return -1;
+#else
+    va_list arg;
+    va_start(arg,s);
+    vprintk(s, arg);
+    va_end(arg);
     return 0;
+#endif
 }
 
-uint64_t 
-ftello64 (FILE *stream)
+int
+getwc (FILE * stream)
+{
+    UNDEF_FUN_ERR();
+    return -1;
+}
+
+
+
+size_t 
+__ctype_get_mb_cur_max (void)
 {
     UNDEF_FUN_ERR();
     return 0;
 }
-//For LUA Support
-long ftell(FILE *x)
+
+uint64_t 
+lseek64 (int fd, uint64_t offset, int whence)
 {
     UNDEF_FUN_ERR();
-    return -1;
+    return 0;
 }
+
 int poll (struct pollfd *fds, nfds_t nfds, int timeout)
 {
     UNDEF_FUN_ERR();
@@ -629,14 +1198,6 @@ gettext (const char * msgid)
     return ret;
 }
 
-int getc(FILE* arg)
-{
-
-    UNDEF_FUN_ERR();
-    return -1;
-
-}
-
 int fileno(FILE* f)
 {
     return 0;
@@ -652,21 +1213,6 @@ size_t strftime(char *str, size_t maxsize, const char *format, const struct tm *
 {
     return 0;
 }
-int feof(FILE * x)
-{
-    UNDEF_FUN_ERR();
-    return 0;
-}
-
-char *fgets(char *str, int n, FILE *stream)
-{
-    UNDEF_FUN_ERR();
-    return NULL;
-}
-void *memchr(const void *str, int c, size_t n)
-{
-    return NULL;
-}
 /*void longjmp(int *x, int __y)
 {
     UNDEF_FUN_ERR();
@@ -827,7 +1373,6 @@ GEN_DEF(wmemset)
 //GEN_DEF(stdin)
 //GEN_DEF(fileno)
 GEN_DEF(__fxstat64)
-GEN_DEF(putc)
 GEN_DEF(__wcscoll_l)
 GEN_DEF(__towlower_l)
 GEN_DEF(wctob)
@@ -354,37 +354,79 @@ parse_multiboot_header (void *data, uint64_t size, mb_data_t *mb)
 
 #define MB_LOAD (2*PAGE_SIZE_4KB)
 
+#define LOAD_EXTENTS 16
+
+// copy len bytes of the file starting at offset to dest, straight
+// out of the device if the file can be accessed in place, and
+// through the filesystem otherwise.  Returns the number of bytes
+// copied (fewer at the end of the file), or -1
+static ssize_t load_bytes(nk_fs_fd_t fd, off_t offset, void *dest, size_t len)
+{
+    struct nk_fs_extent ext[LOAD_EXTENTS];
+    ssize_t n = 0, i;
+    size_t done = 0;
+
+    while (done < len) {
+        if ((n = nk_fs_map(fd,offset+done,len-done,ext,LOAD_EXTENTS)) <= 0) {
+            break;
+        }
+        for (i=0;i<n;i++) {
+            memcpy(dest+done,ext[i].addr,ext[i].len);
+            done += ext[i].len;
+        }
+    }
+
+    if (done < len && n < 0) {
+        DEBUG("Reading the remaining 0x%lx bytes at 0x%lx\n", len-done, offset+done);
+        if (nk_fs_seek(fd,offset+done,0) < 0 || (n = nk_fs_read(fd,dest+done,len-done)) < 0) {
+            return -1;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
 // load executable from file, do not run
 struct nk_exec *nk_load_exec(char *path)
 {
     nk_fs_fd_t fd=FS_BAD_FD;
     void *page = 0;
+    void *header;
+    struct nk_fs_extent ext;
     struct nk_exec *e = 0;
      
     DEBUG("Loading executable at path %s\n", path);
 
-    if (!(page = malloc(MB_LOAD))) { 
-        ERROR("Failed to allocate temporary space for loading file %s\n",path);
-        goto out_bad;
-    }
-
-    memset(page,0,MB_LOAD);
-    
     if (FS_FD_ERR(fd = nk_fs_open(path,O_RDONLY,0666))) { 
         ERROR("Executable file %s could not be opened\n", path);
         goto out_bad;
     }
 
-    if (nk_fs_read(fd,page,MB_LOAD)!=MB_LOAD) { 
-        ERROR("Could not read first page of file %s\n", path);
-        goto out_bad;
+    // the MB header should be in the first 2 pages by construction,
+    // and if the file can be accessed in place, we parse it there
+    if (nk_fs_map(fd,0,MB_LOAD,&ext,1)==1 && ext.len==MB_LOAD) {
+        DEBUG("Parsing header in place at %p\n", ext.addr);
+        header = ext.addr;
+    } else {
+        if (!(page = malloc(MB_LOAD))) { 
+            ERROR("Failed to allocate temporary space for loading file %s\n",path);
+            goto out_bad;
+        }
+
+        memset(page,0,MB_LOAD);
+
+        if (load_bytes(fd,0,page,MB_LOAD)!=MB_LOAD) { 
+            ERROR("Could not read first page of file %s\n", path);
+            goto out_bad;
+        }
+
+        header = page;
     }
 
-    // the MB header should be in the first 2 pages by construction
-
     mb_data_t m;
 
-    if (parse_multiboot_header(page, MB_LOAD, &m)) { 
+    if (parse_multiboot_header(header, MB_LOAD, &m)) { 
         ERROR("Cannot parse multiboot kernel header from first page of %s\n", path);
         goto out_bad;
     }
@@ -444,7 +486,7 @@ struct nk_exec *nk_load_exec(char *path)
     ssize_t n;
     
     
-    if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
+    if ((n = load_bytes(fd,MB_LOAD,e->blob,e->blob_size))<0) {
         ERROR("Unable to read blob from %s\n", path);
         goto out_bad;
     }
@@ -459,7 +501,7 @@ struct nk_exec *nk_load_exec(char *path)
 
     nk_fs_close(fd);
     DEBUG("file closed\n");
-    free(page);
+    if (page) { free(page); }
 
     return e;
 	
@@ -71,10 +71,10 @@
  */
 #define MIN_ORDER   5  /* 32 bytes */
 
-// The factor by which to reduce the hash table size
-// next_prime(total_mem >> 5 / BLOAT) is the maximum number of
+// The factor by which to reduce the number of block headers
+// (total_mem >> MIN_ORDER) / BLOAT is the maximum number of
 // blocks we can allocate with malloc
-#define BLOAT  1024
+#define BLOAT  256
 
 
 /**
@@ -97,146 +97,488 @@ static struct list_head glob_zone_list;
  * Each block of memory allocated from the kernel memory pool has 
  * associated with it one of these structures.   The structure 
  * maps the address handed out by malloc to the order of the block
- * that was allocated and the buddy allocator that provided the
+ * that was allocated and the memory region/zone that provided the
  * block 
  */
 struct kmem_block_hdr {
     void *   addr;   /* address of block */
-    uint64_t order;  /* order of the block allocated from buddy system */
+    struct mem_region * region; /* region (zone) to which this block belongs */
+    uint64_t flags;  /* flags for this allocated block */
+    uint32_t order;  /* order of the block allocated from buddy system */
                      /* order>=MIN_ORDER => in use, safe to examine */
                      /* order==0 => unallocated header */
-                     /* order==1 => allocation in progress, unsafe */
-    struct buddy_mempool * zone; /* zone to which this block belongs */
-    uint64_t flags;  /* flags for this allocated block */
+    uint32_t next;   /* index+1 of the next header on this block's page */
+                     /* chain, or on the zone's free header list, 0 => none */
 } __packed __attribute((aligned(8)));
 
 
-static struct kmem_block_hdr *block_hash_entries=0;
-static uint64_t               block_hash_num_entries=0;
+// kmem's own block flags are allocated from the high bit down
+// (user flags, e.g. the GC's, are allocated from the low bit up)
+
+// block is sitting free in some CPU's magazine - not visible to users
+#define KMEM_FLAG_CACHED   (0x1ULL<<63)
+#define KMEM_FLAGS_INTERNAL (KMEM_FLAG_CACHED)
 
-// roughly power-of-two primes
-static const uint64_t primes[] = 
-{ 
-    53, 97, 193, 389,
-    769, 1543, 3079, 6151,
-    12289, 24593, 49157, 98317,
-    196613, 393241, 786433, 1572869,
-    3145739, 6291469, 12582917, 25165843,
-    50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741 
+
+/*
+ * Per-zone block metadata map
+ *
+ * Every 4 KB page of a zone has an entry in a directly indexed
+ * array.  The entry heads a chain of the headers of the allocated
+ * blocks that start within that page.   Because blocks are
+ * buddy-aligned, a page holds at most KMEM_MAP_MAX_CHAIN block
+ * starts, and a block of order >= KMEM_MAP_PAGE_ORDER is alone on
+ * its page's chain.  Finding the header of a block is therefore a
+ * direct index followed by a short, bounded walk, independent of
+ * how full the heap is.
+ *
+ * Chains and the zone's free header list are only changed with the
+ * zone lock held.   Lookups take no lock.  The upper 32 bits of an
+ * entry are a sequence number bumped by every change to the chain
+ * before any header on it is unlinked, and a reader retries its
+ * walk if the sequence number moved underneath it.
+ */
+#define KMEM_MAP_PAGE_ORDER 12
+#define KMEM_MAP_MAX_CHAIN  (0x1ULL<<(KMEM_MAP_PAGE_ORDER-MIN_ORDER))
+#define KMEM_MAP_SEQ_INC    (0x1ULL<<32)
+#define KMEM_MAP_HEAD(e)    ((uint32_t)(e))
+#define KMEM_MAP_SEQ(e)     ((e) & ~0xffffffffULL)
+
+struct kmem_zone_map {
+    addr_t                  base;       /* zone base address */
+    uint64_t                num_pages;
+    volatile uint64_t      *pages;      /* seq<<32 | index+1 of chain head */
+    struct kmem_block_hdr  *hdrs;       /* this zone's header pool */
+    uint64_t                num_hdrs;
+    uint64_t                used_hdrs;
+    uint32_t                free_hdrs;  /* index+1 of first free header */
+    uint64_t               *live;       /* bitmap of headers in use */
 };
 
-static uint64_t next_prime(uint64_t n)
+#define KMEM_MAP_LIVE_WORDS(map) (((map)->num_hdrs + 63) / 64)
+
+static int kmem_map_init(struct mem_region *region)
 {
-  uint64_t i;
-  for (i=0;i<sizeof(primes)/sizeof(primes[0]);i++) {
-    if (primes[i]>=n) { 
-      return primes[i];
+    struct kmem_zone_map *map;
+    uint64_t i;
+
+    map = mm_boot_alloc(sizeof(*map));
+    if (!map) {
+	KMEM_ERROR("Failed to allocate block map for region %p\n", region->base_addr);
+	return -1;
+    }
+    memset(map,0,sizeof(*map));
+
+    map->base = region->mm_state->base_addr;
+    map->num_pages = (region->len + (1ULL<<KMEM_MAP_PAGE_ORDER) - 1) >> KMEM_MAP_PAGE_ORDER;
+    map->num_hdrs = (region->len >> MIN_ORDER) / BLOAT;
+    if (map->num_hdrs < KMEM_MAP_MAX_CHAIN) {
+	map->num_hdrs = KMEM_MAP_MAX_CHAIN;
     }
-  }
-  KMEM_DEBUG("next_prime: %lu is too big, returning maximum prime in table (%lu)\n",primes[i-1]);
 
-  return primes[i-1];
+    KMEM_DEBUG("block map for region %p: %lu pages, %lu headers (%lu bytes)\n",
+	       region->base_addr, map->num_pages, map->num_hdrs,
+	       map->num_pages*sizeof(uint64_t) + map->num_hdrs*sizeof(struct kmem_block_hdr));
+
+    map->pages = mm_boot_alloc(map->num_pages*sizeof(uint64_t));
+    map->hdrs = mm_boot_alloc(map->num_hdrs*sizeof(struct kmem_block_hdr));
+    map->live = mm_boot_alloc(KMEM_MAP_LIVE_WORDS(map)*sizeof(uint64_t));
+
+    if (!map->pages || !map->hdrs || !map->live) {
+	KMEM_ERROR("Failed to allocate block map for region %p\n", region->base_addr);
+	return -1;
+    }
+
+    memset((void*)map->pages,0,map->num_pages*sizeof(uint64_t));
+    memset(map->hdrs,0,map->num_hdrs*sizeof(struct kmem_block_hdr));
+    memset(map->live,0,KMEM_MAP_LIVE_WORDS(map)*sizeof(uint64_t));
+
+    for (i=0;i<map->num_hdrs;i++) {
+	map->hdrs[i].next = (i+1<map->num_hdrs) ? i+2 : 0;
+    }
+    map->free_hdrs = 1;
+
+    region->kmem_map = map;
+
+    return 0;
 }
 
-static int block_hash_init(uint64_t bytes)
+static inline volatile uint64_t *kmem_map_entry(struct kmem_zone_map *map, addr_t addr)
 {
-  uint64_t num_entries = next_prime((bytes >> MIN_ORDER) / BLOAT);
-  uint64_t entry_size = sizeof(*block_hash_entries);
-  
-  KMEM_DEBUG("block_hash_init with %lu entries each of size %lu bytes (%lu bytes)\n",
-	     num_entries, entry_size, num_entries*entry_size);
+    uint64_t p = (addr - map->base) >> KMEM_MAP_PAGE_ORDER;
+    return p < map->num_pages ? &map->pages[p] : 0;
+}
 
-  block_hash_entries = mm_boot_alloc(num_entries*entry_size);
+// Find the header of the allocated block that starts within addr's 
+// page and either starts at (exact) or contains addr.  Lock-free.
+static inline struct kmem_block_hdr *kmem_map_search(struct kmem_zone_map *map, addr_t addr, int exact)
+{
+    volatile uint64_t *e = kmem_map_entry(map,addr);
+    struct kmem_block_hdr *found;
+    uint64_t s, n;
+    uint32_t cur;
 
-  if (!block_hash_entries) { 
-    KMEM_ERROR("block_hash_init failed\n");
-    return -1;
-  }
+    if (!e) {
+	return 0;
+    }
 
-  memset(block_hash_entries,0,num_entries*entry_size);
-  
-  block_hash_num_entries = num_entries;
+    do {
+	s = *e;
+	__asm__ __volatile__ ("" :::"memory");
+	found = 0;
+	cur = KMEM_MAP_HEAD(s);
+	// bound the walk, since we may wander if the chain changes under us
+	for (n=0; cur && n<=KMEM_MAP_MAX_CHAIN; n++) {
+	    struct kmem_block_hdr *h = &map->hdrs[cur-1];
+	    addr_t a = (addr_t) h->addr;
+	    uint32_t o = h->order;
+	    if (o>=MIN_ORDER && (exact ? a==addr : (addr>=a && addr<a+(0x1ULL<<o)))) {
+		found = h;
+		break;
+	    }
+	    cur = h->next;
+	}
+	__asm__ __volatile__ ("" :::"memory");
+    } while (*e != s);
 
-  return 0;
+    return found;
 }
 
-static inline uint64_t block_hash_hash(const void *ptr)
+// zone lock must be held
+static inline struct kmem_block_hdr *kmem_map_insert(struct mem_region *region, void *block, uint64_t order, uint64_t flags)
 {
-  uint64_t n = ((uint64_t) ptr)>>MIN_ORDER;
+    struct kmem_zone_map *map = region->kmem_map;
+    volatile uint64_t *e = kmem_map_entry(map,(addr_t)block);
+    uint32_t idx = map->free_hdrs;
+    struct kmem_block_hdr *hdr;
 
-  n =  n ^ (n>>1) ^ (n<<2) ^ (n>>3) ^ (n<<5) ^ (n>>7)
-    ^ (n<<11) ^ (n>>13) ^ (n<<17) ^ (n>>19) ^ (n<<23) 
-    ^ (n>>29) ^ (n<<31) ^ (n>>37) ^ (n<<41) ^ (n>>43)
-    ^ (n<<47) ^ (n<<53) ^ (n>>59) ^ (n<<61);
+    if (!idx || !e) {
+	return 0;
+    }
 
-  n = n % block_hash_num_entries;
+    hdr = &map->hdrs[idx-1];
+    map->free_hdrs = hdr->next;
 
-  KMEM_DEBUG("hash of %p returns 0x%lx\n",ptr, n);
-  
-  return n;
+    hdr->addr = block;
+    hdr->region = region;
+    hdr->flags = flags;
+    hdr->order = order;
+    hdr->next = KMEM_MAP_HEAD(*e);
+
+    // publish header and new sequence number with a single write
+    __asm__ __volatile__ ("" :::"memory");
+    *e = (KMEM_MAP_SEQ(*e) + KMEM_MAP_SEQ_INC) | idx;
+
+    map->live[(idx-1)/64] |= 0x1ULL << ((idx-1)%64);
+    map->used_hdrs++;
+
+    return hdr;
 }
-    
-static inline struct kmem_block_hdr * block_hash_find_entry(const void *ptr)
+
+// zone lock must be held
+static inline void kmem_map_remove(struct kmem_block_hdr *hdr)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
-    }
-  }
-  for (i=0;i<start;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
-    }
-  }
-  return 0;
+    struct kmem_zone_map *map = hdr->region->kmem_map;
+    volatile uint64_t *e = kmem_map_entry(map,(addr_t)hdr->addr);
+    uint32_t idx = (hdr - map->hdrs) + 1;
+    uint32_t cur = KMEM_MAP_HEAD(*e);
+
+    if (cur == idx) {
+	*e = (KMEM_MAP_SEQ(*e) + KMEM_MAP_SEQ_INC) | hdr->next;
+    } else {
+	while (cur && map->hdrs[cur-1].next != idx) {
+	    cur = map->hdrs[cur-1].next;
+	}
+	if (!cur) {
+	    KMEM_ERROR("Header for block %p is not on its page chain\n", hdr->addr);
+	    return;
+	}
+	// invalidate concurrent walks before we unlink
+	*e += KMEM_MAP_SEQ_INC;
+	__asm__ __volatile__ ("" :::"memory");
+	map->hdrs[cur-1].next = hdr->next;
+    }
+
+    __asm__ __volatile__ ("" :::"memory");
+
+    hdr->order = 0;
+    hdr->addr = 0;
+    hdr->region = 0;
+    hdr->flags = 0;
+    hdr->next = map->free_hdrs;
+    map->free_hdrs = idx;
+
+    map->live[(idx-1)/64] &= ~(0x1ULL << ((idx-1)%64));
+    map->used_hdrs--;
 }
 
-static inline struct kmem_block_hdr * block_hash_alloc(void *ptr)
+// Find the header of the allocated block starting at ptr.  Lock-free.
+static inline struct kmem_block_hdr * kmem_find_hdr(const void *ptr)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
-    }
-  }
-  for (i=0;i<start;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
-    }
-  }
-  return 0;
+    struct mem_region *reg = kmem_get_region_by_addr((addr_t)ptr);
+
+    if (!reg || !reg->kmem_map) {
+	return 0;
+    }
+
+    return kmem_map_search(reg->kmem_map, (addr_t)ptr, 1);
 }
 
-static inline void block_hash_free_entry(struct kmem_block_hdr *b)
+// Apply func to the headers of allocated blocks (including cached
+// ones) in part of each zone's header pool, so that num_parts callers
+// can cover all of them in parallel.  Only live headers are visited,
+// via the zone's bitmap, so the cost is one word per 64 headers plus
+// the live blocks themselves.   The caller must keep the set of
+// allocated blocks stable for the duration.
+static inline void kmem_map_for_each_hdr_part(void (*func)(struct kmem_block_hdr *hdr, void *state), void *state, uint64_t part, uint64_t num_parts)
 {
-  b->addr = 0;
-  b->zone = 0;
-  b->flags = 0;
-  __sync_fetch_and_and (&b->order,0);
+    struct mem_region *reg;
+    uint64_t i, w, words, start, end;
+    struct kmem_block_hdr *h;
+
+    list_for_each_entry(reg, &glob_zone_list, glob_link) {
+	struct kmem_zone_map *map = reg->kmem_map;
+	if (!map) {
+	    continue;
+	}
+	words = KMEM_MAP_LIVE_WORDS(map);
+	start = (words * part) / num_parts;
+	end = (words * (part+1)) / num_parts;
+	for (i=start;i<end;i++) {
+	    for (w=map->live[i]; w; w &= w-1) {
+		h = &map->hdrs[i*64 + __builtin_ctzll(w)];
+		if (h->order>=MIN_ORDER) {
+		    func(h,state);
+		}
+	    }
+	}
+    }
 }
 
-static inline int block_hash_free(void *ptr)
+// Apply func to all headers of allocated blocks (including cached ones)
+static inline void kmem_map_for_each_hdr(void (*func)(struct kmem_block_hdr *hdr, void *state), void *state)
 {
-  struct kmem_block_hdr *b = block_hash_find_entry(ptr);
+    kmem_map_for_each_hdr_part(func,state,0,1);
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+/*
+ * Per-CPU front-end cache for small allocations
+ *
+ * Each CPU has one magazine per size class (order) from MIN_ORDER
+ * to KMEM_CACHE_MAX_ORDER.   A magazine is a stack of headers of
+ * blocks that are allocated from the buddy system's perspective,
+ * but are free from the user's perspective (KMEM_FLAG_CACHED).
+ * A magazine is only touched by its owning CPU, with interrupts
+ * off, so neither the malloc nor the free fast path takes a lock.
+ * An empty magazine is refilled with a batch of blocks from the
+ * zones (one zone lock acquisition per batch), and a full one
+ * is drained by a batch back to the zones.
+ */
+
+#define KMEM_CACHE_MAX_ORDER   12  /* 4 KB */
+#define KMEM_CACHE_NUM_CLASSES (KMEM_CACHE_MAX_ORDER - MIN_ORDER + 1)
+#define KMEM_CACHE_MAG_SIZE    64
+#define KMEM_CACHE_BATCH       16
+
+struct kmem_cache_magazine {
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+    struct kmem_block_hdr *hdrs[KMEM_CACHE_MAG_SIZE];
+} __attribute__((aligned(64)));
+
+static int kmem_cache_init(void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    uint64_t size = sizeof(struct kmem_cache_magazine)*KMEM_CACHE_NUM_CLASSES;
+    unsigned i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+	// This comes from boot memory, hence falls into the kmem private
+	// range, so the GC will not consider blocks in magazines reachable
+	struct kmem_cache_magazine *m = mm_boot_alloc_aligned(size, 64);
+	if (!m) {
+	    KMEM_ERROR("Could not allocate magazines for CPU %u\n", i);
+	    return -1;
+	}
+	memset(m,0,size);
+	sys->cpus[i]->kmem.cache = m;
+    }
+
+    KMEM_PRINT("Per-CPU cache: %u size classes (%lu-%lu bytes), %u blocks/magazine, batch %u\n",
+	       KMEM_CACHE_NUM_CLASSES, 1UL<<MIN_ORDER, 1UL<<KMEM_CACHE_MAX_ORDER,
+	       KMEM_CACHE_MAG_SIZE, KMEM_CACHE_BATCH);
 
-  if (!b) { 
-    return -1;
-  } else {
-    block_hash_free_entry(b);
     return 0;
-  }
 }
 
+// interrupts must be off
+static void kmem_cache_refill(struct kmem_data *k, struct kmem_cache_magazine *m, ulong_t order)
+{
+    struct mem_reg_entry * reg = NULL;
+
+    m->refills++;
+
+    list_for_each_entry(reg, &(k->ordered_regions), mem_ent) {
+        struct buddy_mempool * zone = reg->mem->mm_state;
+	void *block;
+
+	spin_lock(&zone->lock);
+	while (m->count < KMEM_CACHE_BATCH && (block = buddy_alloc(zone, order))) {
+	    struct kmem_block_hdr *hdr = kmem_map_insert(reg->mem, block, order, KMEM_FLAG_CACHED);
+	    if (!hdr) {
+		KMEM_DEBUG("cache refill cannot allocate header, releasing block\n");
+		buddy_free(zone,block,order);
+		break;
+	    }
+	    kmem_bytes_allocated += (1UL << order);
+	    m->hdrs[m->count++] = hdr;
+	}
+	spin_unlock(&zone->lock);
+
+	if (m->count >= KMEM_CACHE_BATCH) {
+	    break;
+	}
+    }
+}
+
+// interrupts must be off
+static void kmem_cache_drain(struct kmem_cache_magazine *m, uint64_t num)
+{
+    struct buddy_mempool *locked = 0;
+    struct kmem_block_hdr *hdr;
+
+    if (num > m->count) {
+	num = m->count;
+    }
+
+    if (!num) {
+	return;
+    }
+
+    m->drains++;
+
+    // release the oldest blocks, taking each zone lock once per run
+    // of blocks from that zone
+    for (uint64_t i=0; i<num; i++) {
+	hdr = m->hdrs[i];
+	if (hdr->region->mm_state != locked) {
+	    if (locked) {
+		spin_unlock(&locked->lock);
+	    }
+	    locked = hdr->region->mm_state;
+	    spin_lock(&locked->lock);
+	}
+	kmem_bytes_allocated -= (1UL << hdr->order);
+	buddy_free(locked, hdr->addr, hdr->order);
+	kmem_map_remove(hdr);
+    }
+    if (locked) {
+	spin_unlock(&locked->lock);
+    }
+
+    memmove(&m->hdrs[0], &m->hdrs[num], (m->count-num)*sizeof(m->hdrs[0]));
+    m->count -= num;
+}
+
+// The owning CPU must be determined with interrupts off, since
+// otherwise we could be migrated in the middle of the operation
+static inline struct kmem_data *kmem_cache_local(void)
+{
+    return &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem);
+}
+
+// cpu is the affinity cpu of the allocation (-1 => current cpu), and
+// only an allocation for the current cpu can be served from its cache
+static inline struct kmem_block_hdr *kmem_cache_alloc(ulong_t order, int cpu)
+{
+    uint8_t flags = irq_disable_save();
+    struct kmem_data *k = kmem_cache_local();
+    struct kmem_cache_magazine *m;
+    struct kmem_block_hdr *hdr = 0;
+
+    if (!k->cache || (cpu>=0 && cpu!=my_cpu_id())) {
+	irq_enable_restore(flags);
+	return 0;
+    }
+
+    m = &k->cache[order-MIN_ORDER];
+
+    if (!m->count) {
+	m->misses++;
+	kmem_cache_refill(k,m,order);
+    } else {
+	m->hits++;
+    }
+
+    if (m->count) {
+	hdr = m->hdrs[--m->count];
+	hdr->flags = 0;
+    }
+
+    irq_enable_restore(flags);
+
+    return hdr;
+}
+
+// returns nonzero if the block was absorbed by the cache
+static inline int kmem_cache_free(struct kmem_block_hdr *hdr)
+{
+    struct kmem_data *k;
+    struct kmem_cache_magazine *m;
+    uint8_t flags;
+
+    if (hdr->order > KMEM_CACHE_MAX_ORDER) {
+	return 0;
+    }
+
+    flags = irq_disable_save();
+
+    k = kmem_cache_local();
+
+    if (!k->cache) {
+	irq_enable_restore(flags);
+	return 0;
+    }
+
+    m = &k->cache[hdr->order-MIN_ORDER];
+
+    if (m->count == KMEM_CACHE_MAG_SIZE) {
+	kmem_cache_drain(m, KMEM_CACHE_BATCH);
+    }
+
+    hdr->flags = KMEM_FLAG_CACHED;
+    m->hdrs[m->count++] = hdr;
+
+    irq_enable_restore(flags);
+
+    return 1;
+}
+
+// return all of the current CPU's cached blocks to the zones
+static void kmem_cache_flush_local(void)
+{
+    uint8_t flags = irq_disable_save();
+    struct kmem_data *k = kmem_cache_local();
+    int i;
+
+    if (!k->cache) {
+	irq_enable_restore(flags);
+	return;
+    }
+
+    for (i=0;i<KMEM_CACHE_NUM_CLASSES;i++) {
+	kmem_cache_drain(&k->cache[i], k->cache[i].count);
+    }
+    irq_enable_restore(flags);
+}
+
+#endif
+
 
 struct mem_region *
 kmem_get_base_zone (void)
@@ -451,10 +793,19 @@ nk_kmem_init (void)
 
     KMEM_PRINT("Malloc configured to support a maximum of: 0x%lx bytes of physical memory\n", total_phys_mem);
 
-    if (block_hash_init(total_phys_mem)) { 
-      KMEM_ERROR("Failed to initialize block hash\n");
+    list_for_each_entry(ent, &glob_zone_list, glob_link) {
+	if (kmem_map_init(ent)) {
+	    KMEM_ERROR("Failed to initialize block map\n");
+	    return -1;
+	}
+    }
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    if (kmem_cache_init()) {
+      KMEM_ERROR("Failed to initialize per-CPU cache\n");
       return -1;
     }
+#endif
 
 
     // the assumption here is that no further boot_mm allocations will
@@ -468,7 +819,7 @@ nk_kmem_init (void)
 // A fake header representing the boot allocations
 static void     *boot_start;
 static void     *boot_end;
-static uint64_t  boot_flags;
+static volatile uint64_t boot_flags;
 
 void kmem_inform_boot_allocation(void *low, void *high)
 {
@@ -532,6 +883,16 @@ _kmem_malloc (size_t size, int cpu, int zero)
 
  retry:
 
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    if (order <= KMEM_CACHE_MAX_ORDER) {
+	hdr = kmem_cache_alloc(order, cpu<nk_get_num_cpus() ? cpu : -1);
+	if (hdr) {
+	    block = hdr->addr;
+	    goto found;
+	}
+    }
+#endif
+
     /* scan the blocks in order of affinity */
     list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
         struct buddy_mempool * zone = reg->mem->mm_state;
@@ -539,25 +900,17 @@ _kmem_malloc (size_t size, int cpu, int zero)
         /* Allocate memory from the underlying buddy system */
         uint8_t flags = spin_lock_irq_save(&zone->lock);
         block = buddy_alloc(zone, order);
-        spin_unlock_irq_restore(&zone->lock, flags);
-
 	if (block) {
-	  hdr = block_hash_alloc(block);
-	  if (!hdr) {
-            KMEM_DEBUG("malloc cannot allocate header, releasing block\n");
-	    flags = spin_lock_irq_save(&zone->lock);
-	    buddy_free(zone,block,order);
-	    spin_unlock_irq_restore(&zone->lock, flags);
-	    block=0;
-	  }
+	    hdr = kmem_map_insert(reg->mem, block, order, 0);
+	    if (!hdr) {
+		KMEM_DEBUG("malloc cannot allocate header, releasing block\n");
+		buddy_free(zone,block,order);
+		block=0;
+	    }
 	}
+        spin_unlock_irq_restore(&zone->lock, flags);
 
         if (hdr) {
-	    hdr->addr = block;
-            hdr->zone = zone;
-	    // force a software barrier here, since our next write must come last
-	    __asm__ __volatile__ ("" :::"memory");
-	    hdr->order = order; // allocation complete
             break;
         }
         
@@ -569,6 +922,9 @@ _kmem_malloc (size_t size, int cpu, int zero)
 	// attempt to get memory back by reaping threads now...
 	if (first) {
 	    KMEM_DEBUG("malloc initially failed for size %lu order %lu attempting reap\n",size,order);
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+	    kmem_cache_flush_local();
+#endif
 	    nk_sched_reap(1);
 	    first=0;
 	    goto retry;
@@ -578,6 +934,9 @@ _kmem_malloc (size_t size, int cpu, int zero)
         return NULL;
     }
 
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+ found:
+#endif
     KMEM_DEBUG("malloc succeeded: size %lu order %lu -> 0x%lx\n",size, order, block);
  
     if (zero) { 
@@ -650,7 +1009,7 @@ kmem_free (void * addr)
     // that we race on the block hash entry and so could end up invoking
     // the buddy free more than once
 
-    hdr = block_hash_find_entry(addr);
+    hdr = kmem_find_hdr(addr);
 
     if (!hdr) { 
       KMEM_ERROR("Failed to find entry for block %p in kmem_free()\n",addr);
@@ -658,28 +1017,34 @@ kmem_free (void * addr)
       return;
     }
 
-    zone = hdr->zone;
+    zone = hdr->region ? hdr->region->mm_state : 0;
     order = hdr->order;
 
     // Sanity check things here
     // this will in some cases catch a double free that is causing a
     // race on the header
-    if (!zone || order<MIN_ORDER) {
+    if (!zone || order<MIN_ORDER || (hdr->flags & KMEM_FLAG_CACHED)) {
 	KMEM_ERROR("Likely double free ignored- addr=%p, zone=%p order=%lu, hdr=%p, hdr->addr=%p, hdr->order=%lu\n", addr,zone, order, hdr,hdr->addr,hdr->order);
 	BACKTRACE(KMEM_ERROR,3);
 	// avoid freeing the header a second time
-	// block_hash_free_entry(hdr);
+	// kmem_map_remove(hdr);
 	return;
     }
 
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    if (kmem_cache_free(hdr)) {
+	KMEM_DEBUG("free succeeded (cached): addr=0x%lx order=%lu\n",addr,order);
+	return;
+    }
+#endif
     
     /* Return block to the underlying buddy system */
     uint8_t flags = spin_lock_irq_save(&zone->lock);
     kmem_bytes_allocated -= (1UL << order);
     buddy_free(zone, addr, order);
+    kmem_map_remove(hdr);
     spin_unlock_irq_restore(&zone->lock, flags);
     KMEM_DEBUG("free succeeded: addr=0x%lx order=%lu\n",addr,order);
-    block_hash_free_entry(hdr);
 
 #if SANITY_CHECK_PER_OP
     if (kmem_sanity_check()) { 
@@ -709,9 +1074,9 @@ kmem_realloc (void * ptr, size_t size)
 		return kmem_malloc(size);
 	}
 
-	hdr = block_hash_find_entry(ptr);
+	hdr = kmem_find_hdr(ptr);
 
-	if (!hdr) {
+	if (!hdr || (hdr->flags & KMEM_FLAG_CACHED)) {
 		KMEM_DEBUG("Realloc failed to find entry for block %p\n", ptr);
 		return NULL;
 	}
@@ -813,15 +1178,54 @@ void  kmem_get_internal_pointer_range(void **start, void **end)
     *end = kmem_private_end;
 }
 
-int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags)
+// Find the header of the allocated block containing any_addr in reg
+// The caller handles the boot block.  Lock-free.
+static struct kmem_block_hdr *kmem_find_containing_hdr(struct mem_region *reg, void *any_addr)
 {
-    uint64_t i;
     uint64_t order;
     addr_t   zone_base;
-    uint64_t zone_min_order;
     uint64_t zone_max_order;
     addr_t   any_offset;
+    addr_t   last_page;
+    struct kmem_block_hdr *hdr;
+
+    if (!reg->kmem_map) {
+	return 0;
+    }
+
+    zone_base = reg->mm_state->base_addr;
+    zone_max_order = reg->mm_state->pool_order;
+
+    any_offset = (addr_t)any_addr - (addr_t)zone_base;
+
+    // Any block of order < KMEM_MAP_PAGE_ORDER containing the address
+    // starts in the address's page, as does any larger block aligned
+    // to that page, so one chain walk covers all of these
+    hdr = kmem_map_search(reg->kmem_map, (addr_t)any_addr, 0);
+
+    // Larger blocks must start at the correspondingly aligned page
+    last_page = any_offset >> KMEM_MAP_PAGE_ORDER;
+    for (order=KMEM_MAP_PAGE_ORDER+1; !hdr && order<=zone_max_order; order++) {
+	addr_t offset = any_offset & ~((1ULL << order)-1);
+	if ((offset >> KMEM_MAP_PAGE_ORDER) == last_page) {
+	    continue;
+	}
+	last_page = offset >> KMEM_MAP_PAGE_ORDER;
+	hdr = kmem_map_search(reg->kmem_map, zone_base + offset, 0);
+    }
+
+    // must exist and must be allocated from the user's perspective
+    if (!hdr || (hdr->flags & KMEM_FLAG_CACHED)) {
+	return 0;
+    }
+
+    return hdr;
+}
+
+int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags)
+{
     struct mem_region *reg;
+    struct kmem_block_hdr *hdr;
 
     if (!(reg = kmem_get_region_by_addr((addr_t)any_addr))) {
 	// not in any region we manage
@@ -837,26 +1241,50 @@ int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, ui
 	return 0;
     }
 
-    zone_base = reg->mm_state->base_addr;
-    zone_min_order = reg->mm_state->min_order;
-    zone_max_order = reg->mm_state->pool_order;
+    if (!(hdr = kmem_find_containing_hdr(reg, any_addr))) {
+	return -1;
+    }
 
-    any_offset = (addr_t)any_addr - (addr_t)zone_base;
-    
-    for (order=zone_min_order;order<=zone_max_order;order++) {
-	addr_t mask = ~((1ULL << order)-1);
-	void *search_addr = (void*)(zone_base + (any_offset & mask));
-	struct kmem_block_hdr *hdr = block_hash_find_entry(search_addr);
-	// must exist and must be allocated
-	if (hdr && hdr->order>=MIN_ORDER) { 
-	    *block_addr = search_addr;
-	    *block_size = 0x1ULL<<hdr->order;
-	    *flags = hdr->flags;
-	    return 0;
-	    
+    *block_addr = hdr->addr;
+    *block_size = 0x1ULL<<hdr->order;
+    *flags = hdr->flags;
+
+    return 0;
+}
+
+// find the block containing any_addr and atomically set flag on it
+int  kmem_find_and_mark_block(void *any_addr, uint64_t flag, void **block_addr, uint64_t *block_size)
+{
+    struct mem_region *reg;
+    struct kmem_block_hdr *hdr;
+    volatile uint64_t *flagp;
+
+    if (!(reg = kmem_get_region_by_addr((addr_t)any_addr))) {
+	return -1;
+    }
+
+    flag &= ~KMEM_FLAGS_INTERNAL;
+
+    if (any_addr>=boot_start && any_addr<boot_end) { 
+	*block_addr = boot_start;
+	*block_size = boot_end-boot_start;
+	flagp = &boot_flags;
+    } else {
+	if (!(hdr = kmem_find_containing_hdr(reg, any_addr))) {
+	    return -1;
 	}
+	*block_addr = hdr->addr;
+	*block_size = 0x1ULL<<hdr->order;
+	// the header is packed, but flags is naturally aligned
+	flagp = (volatile uint64_t *)((void*)hdr + offsetof(struct kmem_block_hdr, flags));
+    }
+
+    if (*flagp & flag) {
+	// cheap check that avoids a locked operation on the common path
+	return 1;
     }
-    return -1;
+
+    return (__sync_fetch_and_or(flagp, flag) & flag) ? 1 : 0;
 }
 
 
@@ -869,62 +1297,92 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
 
     } else {
 
-	struct kmem_block_hdr *h =  block_hash_find_entry(block_addr);
+	struct kmem_block_hdr *h =  kmem_find_hdr(block_addr);
 	
-	if (!h || h->order<MIN_ORDER) { 
+	if (!h || h->order<MIN_ORDER || (h->flags & KMEM_FLAG_CACHED)) { 
 	    return -1;
 	} else {
-	    h->flags = flags;
+	    h->flags = flags & ~KMEM_FLAGS_INTERNAL;
 	    return 0;
 	}
     }
 }
 
+struct kmem_mask_state {
+    uint64_t mask;
+    int      or;
+};
+
+static void mask_hdr(struct kmem_block_hdr *hdr, void *state)
+{
+    struct kmem_mask_state *s = (struct kmem_mask_state *)state;
+
+    if (s->or) {
+	hdr->flags |= s->mask;
+    } else {
+	hdr->flags &= s->mask;
+    }
+}
+
 // applies only to allocated blocks
 int  kmem_mask_all_blocks_flags(uint64_t mask, int or)
 {
-    uint64_t i;
+    struct kmem_mask_state s = { .mask = mask, .or = or };
 
+    // kmem's internal flags are never affected
     if (!or) { 
-	boot_flags &= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags &= mask;
-	    }
-	}
+	s.mask |= KMEM_FLAGS_INTERNAL;
+	boot_flags &= s.mask;
     } else {
-	boot_flags |= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags |= mask;
-	    }
-	}
+	s.mask &= ~KMEM_FLAGS_INTERNAL;
+	boot_flags |= s.mask;
     }
 
+    kmem_map_for_each_hdr(mask_hdr, &s);
+
     return 0;
 }
+
+struct kmem_apply_state {
+    uint64_t mask;
+    uint64_t flags;
+    int    (*func)(void *block, void *state);
+    void    *state;
+    int      rc;
+};
+
+static void apply_hdr(struct kmem_block_hdr *hdr, void *state)
+{
+    struct kmem_apply_state *s = (struct kmem_apply_state *)state;
+
+    if (!s->rc && (hdr->flags & s->mask) == s->flags) {
+	if (s->func(hdr->addr,s->state)) {
+	    s->rc = -1;
+	}
+    }
+}
     
-int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state)
+int  kmem_apply_to_matching_blocks_part(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state, uint64_t part, uint64_t num_parts)
 {
-    uint64_t i;
+    // cached blocks are free from the user's perspective, so
+    // they never match
+    struct kmem_apply_state s = { .mask = mask | KMEM_FLAGS_INTERNAL, 
+				  .flags = flags, .func = func, .state = state, .rc = 0 };
     
-    if (((boot_flags & mask) == flags)) {
+    if (!part && ((boot_flags & mask) == flags)) {
 	if (func(boot_start,state)) { 
 	    return -1;
 	}
     }
 
-    for (i=0;i<block_hash_num_entries;i++) { 
-	if (block_hash_entries[i].order>=MIN_ORDER) { 
-	    if ((block_hash_entries[i].flags & mask) == flags) {
-		if (func(block_hash_entries[i].addr,state)) { 
-		    return -1;
-		}
-	    }
-	}
-    } 
+    kmem_map_for_each_hdr_part(apply_hdr, &s, part, num_parts);
     
-    return 0;
+    return s.rc;
+}
+
+int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state)
+{
+    return kmem_apply_to_matching_blocks_part(mask,flags,func,state,0,1);
 }
     
 
@@ -1007,6 +1465,39 @@ handle_meminfo (char * buf, void * priv)
     nk_vc_printf("%lu pools %lu blks free %lu bytes free\n", s->total_num_pools, s->total_blocks_free, s->total_bytes_free);
     nk_vc_printf("  %lu bytes min %lu bytes max\n", s->min_alloc_size, s->max_alloc_size);
 
+    if (strstr(buf,"detail")) {
+	struct mem_region *reg;
+	// racy, but these are only statistics
+	list_for_each_entry(reg, &glob_zone_list, glob_link) {
+	    if (reg->kmem_map) {
+		nk_vc_printf("zone %p: %lu of %lu block headers in use, %lu pages mapped\n",
+			     reg->kmem_map->base, reg->kmem_map->used_hdrs,
+			     reg->kmem_map->num_hdrs, reg->kmem_map->num_pages);
+	    }
+	}
+    }
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    if (strstr(buf,"detail")) {
+	struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+	uint64_t c, o;
+	// racy, but these are only statistics
+	for (c=0;c<sys->num_cpus;c++) {
+	    struct kmem_cache_magazine *m = sys->cpus[c]->kmem.cache;
+	    if (!m) {
+		continue;
+	    }
+	    for (o=0;o<KMEM_CACHE_NUM_CLASSES;o++) {
+		if (m[o].hits || m[o].misses) {
+		    nk_vc_printf("cpu %lu cache %lu bytes: %lu cached %lu hits %lu misses %lu refills %lu drains\n",
+				 c, 1UL<<(o+MIN_ORDER), m[o].count, m[o].hits, m[o].misses,
+				 m[o].refills, m[o].drains);
+		}
+	    }
+	}
+    }
+#endif
+
     free(s);
 
     return 0;
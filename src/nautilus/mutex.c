@@ -0,0 +1,152 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:  Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/mutex.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("mutex: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("mutex: " fmt, ##args)
+
+// upper bound on the spin phase even if the owner stays on its cpu,
+// which is roughly the cost of a sleep and wakeup
+#define MUTEX_SPIN_LIMIT 4096
+
+//
+// The state word follows the classic three-state futex mutex.  A
+// contender that decides to sleep first moves the state to 2, so the
+// owner knows at unlock that it must wake someone.   A woken thread
+// takes the lock in state 2 as well, since it cannot know whether
+// others are still asleep, which at worst costs one spurious wakeup.
+//
+
+static uint64_t count=0;
+
+int nk_mutex_init(nk_mutex_t *m)
+{
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
+
+    m->state = 0;
+    m->owner = 0;
+
+    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"mutex%lu-wait",__sync_fetch_and_add(&count,1));
+
+    if (!(m->wait_queue = nk_wait_queue_create(buf))) {
+	ERROR("Failed to allocate wait queue\n");
+	return -1;
+    }
+
+    DEBUG("init %p\n",m);
+
+    return 0;
+}
+
+int nk_mutex_deinit(nk_mutex_t *m)
+{
+    if (m->state) {
+	ERROR("deinit of held mutex %p\n",m);
+	return -1;
+    }
+
+    nk_wait_queue_destroy(m->wait_queue);
+    m->wait_queue = 0;
+
+    DEBUG("deinit %p\n",m);
+
+    return 0;
+}
+
+// worth spinning on: the owner is on another cpu right now, or has
+// just taken the lock and not yet recorded itself
+static inline int owner_running(nk_mutex_t *m)
+{
+    struct nk_thread *o = m->owner;
+
+    return !o || (o->status==NK_THR_RUNNING && o->current_cpu!=my_cpu_id());
+}
+
+static int no_sleep_needed(void *state)
+{
+    return ((nk_mutex_t *)state)->state != 2;
+}
+
+void nk_mutex_lock(nk_mutex_t *m)
+{
+    uint32_t c;
+    uint64_t spins;
+    int can_sleep;
+
+    if (likely(__sync_bool_compare_and_swap(&m->state,0,1))) {
+	goto out;
+    }
+
+    can_sleep = !in_interrupt_context() && !preempt_is_disabled();
+
+    for (spins=0; ; spins++) {
+	if (!m->state && __sync_bool_compare_and_swap(&m->state,0,1)) {
+	    goto out;
+	}
+	if (can_sleep && (spins>=MUTEX_SPIN_LIMIT || !owner_running(m))) {
+	    break;
+	}
+	__asm__ __volatile__ ("pause" : : : "memory");
+    }
+
+    DEBUG("lock %p sleeping after %lu spins\n",m,spins);
+
+    c = __sync_lock_test_and_set(&m->state,2);
+    while (c) {
+	nk_wait_queue_sleep_extended(m->wait_queue,no_sleep_needed,m);
+	c = __sync_lock_test_and_set(&m->state,2);
+    }
+
+ out:
+    m->owner = get_cur_thread();
+}
+
+int nk_mutex_try_lock(nk_mutex_t *m)
+{
+    if (__sync_bool_compare_and_swap(&m->state,0,1)) {
+	m->owner = get_cur_thread();
+	return 0;
+    }
+    return -1;
+}
+
+void nk_mutex_unlock(nk_mutex_t *m)
+{
+    m->owner = 0;
+
+    if (unlikely(__sync_fetch_and_sub(&m->state,1)!=1)) {
+	// there may be sleepers
+	m->state = 0;
+	__asm__ __volatile__ ("mfence" : : : "memory");
+	nk_wait_queue_wake_one(m->wait_queue);
+    }
+}
@@ -24,6 +24,9 @@
 #include <nautilus/naut_string.h>
 #include <nautilus/naut_types.h>
 #include <nautilus/mm.h>
+#include <nautilus/nautilus.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/cpu_state.h>
 
 unsigned char _ctype[] = {
 _C,_C,_C,_C,_C,_C,_C,_C,			/* 0-7 */
@@ -76,26 +79,255 @@ strnlen (const char * str, size_t max)
 }
 
 
+/*
+ * Block memory operations
+ *
+ * These are selected at boot (nk_string_init) based on what the
+ * processor advertises:
+ *
+ *   - small sizes (<= 64 bytes) use overlapping 8/4/2/1 byte
+ *     integer loads and stores, with no loop for <= 16 bytes
+ *   - with ERMS (enhanced rep movsb/stosb), mid and large sizes
+ *     use rep movsb/stosb, which the microcode turns into
+ *     cache-line sized operations
+ *   - without ERMS, rep movsq/stosq plus an integer tail
+ *   - sizes beyond about half of the LLC use SSE2 non-temporal
+ *     stores so that the copy does not flush the cache
+ *
+ * Before nk_string_init has run, only the integer and rep paths
+ * are used.   The SIMD path is also never taken in interrupt
+ * context, or if FPU state is not saved on context switches, since
+ * in those cases the XMM registers may belong to someone else.
+ * AVX is deliberately not used, since thread switches only
+ * fxsave, which does not preserve the upper halves of the YMM
+ * registers.
+ *
+ * memcpy is safe for overlapping regions where dst < src,
+ * which memmove relies on.
+ */
+
+#define STRING_ERMS 0x1   // enhanced rep movsb/stosb
+#define STRING_FSRM 0x2   // fast short rep movsb
+#define STRING_NT   0x4   // non-temporal SSE2 stores usable
+
+static uint32_t string_feats = 0;
+static size_t   string_nt_thresh = (size_t)-1;
+
+typedef uint64_t __attribute__((__may_alias__, aligned(1))) u64_ua_t;
+typedef uint32_t __attribute__((__may_alias__, aligned(1))) u32_ua_t;
+typedef uint16_t __attribute__((__may_alias__, aligned(1))) u16_ua_t;
+
+static inline int
+string_simd_ok (void)
+{
+#ifdef NAUT_CONFIG_FPU_SAVE
+    return (string_feats & STRING_NT) && !in_interrupt_context();
+#else
+    return 0;
+#endif
+}
+
+static inline void
+rep_movsb (void * dst, const void * src, size_t n)
+{
+    asm volatile ("rep movsb"
+                  : "+D"(dst), "+S"(src), "+c"(n)
+                  :
+                  : "memory");
+}
+
+static inline void
+rep_stosb (void * dst, uint8_t c, size_t n)
+{
+    asm volatile ("rep stosb"
+                  : "+D"(dst), "+c"(n)
+                  : "a"(c)
+                  : "memory");
+}
+
+// n <= 16; all loads are done before any store
+static inline void
+copy_small (uint8_t * d, const uint8_t * s, size_t n)
+{
+    if (n >= 8) {
+        uint64_t a = *(const u64_ua_t *)s;
+        uint64_t b = *(const u64_ua_t *)(s + n - 8);
+        *(u64_ua_t *)d = a;
+        *(u64_ua_t *)(d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const u32_ua_t *)s;
+        uint32_t b = *(const u32_ua_t *)(s + n - 4);
+        *(u32_ua_t *)d = a;
+        *(u32_ua_t *)(d + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(const u16_ua_t *)s;
+        uint16_t b = *(const u16_ua_t *)(s + n - 2);
+        *(u16_ua_t *)d = a;
+        *(u16_ua_t *)(d + n - 2) = b;
+    } else if (n) {
+        *d = *s;
+    }
+}
+
+// 16 < n <= 64
+static inline void
+copy_medium (uint8_t * d, const uint8_t * s, size_t n)
+{
+    // the tail is loaded first in case dst overlaps below src
+    uint64_t tail = *(const u64_ua_t *)(s + n - 8);
+    size_t i;
+
+    for (i = 0; i + 8 < n; i += 8) {
+        *(u64_ua_t *)(d + i) = *(const u64_ua_t *)(s + i);
+    }
+
+    *(u64_ua_t *)(d + n - 8) = tail;
+}
+
+static void
+copy_rep (uint8_t * d, const uint8_t * s, size_t n)
+{
+    if (string_feats & STRING_ERMS) {
+        rep_movsb(d, s, n);
+    } else {
+        size_t words = n >> 3;
+        asm volatile ("rep movsq"
+                      : "+D"(d), "+S"(s), "+c"(words)
+                      :
+                      : "memory");
+        // d and s have been advanced past the words
+        copy_small(d, s, n & 7);
+    }
+}
+
+static void
+copy_nt (uint8_t * d, const uint8_t * s, size_t n)
+{
+    size_t head = (16 - ((uint64_t)d & 15)) & 15;
+
+    rep_movsb(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 64) {
+        asm volatile ("movdqu    (%1), %%xmm0 ;"
+                      "movdqu  16(%1), %%xmm1 ;"
+                      "movdqu  32(%1), %%xmm2 ;"
+                      "movdqu  48(%1), %%xmm3 ;"
+                      "movntdq %%xmm0,   (%0) ;"
+                      "movntdq %%xmm1, 16(%0) ;"
+                      "movntdq %%xmm2, 32(%0) ;"
+                      "movntdq %%xmm3, 48(%0) ;"
+                      :
+                      : "r"(d), "r"(s)
+                      : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+        d += 64;
+        s += 64;
+        n -= 64;
+    }
+
+    asm volatile ("sfence" : : : "memory");
+
+    rep_movsb(d, s, n);
+}
+
+
 void *
 memcpy (void * dst, const void * src, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    unsigned char * s = (unsigned char *)src;
+    uint8_t * d = (uint8_t *)dst;
+    const uint8_t * s = (const uint8_t *)src;
 
-    while (n--) {
-        *d++ = *s++;
+    if (n <= 16) {
+        copy_small(d, s, n);
+    } else if (n <= 64) {
+        copy_medium(d, s, n);
+    } else if (n >= string_nt_thresh && string_simd_ok()) {
+        copy_nt(d, s, n);
+    } else {
+        copy_rep(d, s, n);
     }
 
     return dst;
 }
 
 
+static inline void
+set_small (uint8_t * d, uint64_t v, size_t n)
+{
+    if (n >= 8) {
+        *(u64_ua_t *)d = v;
+        *(u64_ua_t *)(d + n - 8) = v;
+    } else if (n >= 4) {
+        *(u32_ua_t *)d = (uint32_t)v;
+        *(u32_ua_t *)(d + n - 4) = (uint32_t)v;
+    } else if (n >= 2) {
+        *(u16_ua_t *)d = (uint16_t)v;
+        *(u16_ua_t *)(d + n - 2) = (uint16_t)v;
+    } else if (n) {
+        *d = (uint8_t)v;
+    }
+}
+
+static void
+set_nt (uint8_t * d, uint64_t v, size_t n)
+{
+    size_t head = (16 - ((uint64_t)d & 15)) & 15;
+
+    set_small(d, v, head);
+    d += head;
+    n -= head;
+
+    asm volatile ("movq       %0, %%xmm0 ;"
+                  "punpcklqdq %%xmm0, %%xmm0 ;"
+                  :
+                  : "r"(v)
+                  : "xmm0");
+
+    while (n >= 64) {
+        asm volatile ("movntdq %%xmm0,   (%0) ;"
+                      "movntdq %%xmm0, 16(%0) ;"
+                      "movntdq %%xmm0, 32(%0) ;"
+                      "movntdq %%xmm0, 48(%0) ;"
+                      :
+                      : "r"(d)
+                      : "memory");
+        d += 64;
+        n -= 64;
+    }
+
+    asm volatile ("sfence" : : : "memory");
+
+    rep_stosb(d, (uint8_t)v, n);
+}
+
+
 void * 
 memset (void * dst, char c, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    while (n--) {
-        *d++ = c;
+    uint8_t * d = (uint8_t *)dst;
+    uint64_t v = 0x0101010101010101ULL * (uint8_t)c;
+
+    if (n <= 16) {
+        set_small(d, v, n);
+    } else if (n <= 64) {
+        size_t i;
+        for (i = 0; i + 8 < n; i += 8) {
+            *(u64_ua_t *)(d + i) = v;
+        }
+        *(u64_ua_t *)(d + n - 8) = v;
+    } else if (n >= string_nt_thresh && string_simd_ok()) {
+        set_nt(d, v, n);
+    } else if (string_feats & STRING_ERMS) {
+        rep_stosb(d, (uint8_t)c, n);
+    } else {
+        size_t words = n >> 3;
+        asm volatile ("rep stosq"
+                      : "+D"(d), "+c"(words)
+                      : "a"(v)
+                      : "memory");
+        set_small(d, v, n & 7);
     }
 
     return dst;
@@ -109,10 +341,14 @@ memmove (void * dst, const void * src, size_t n)
     unsigned long int srcp = (long int) src;
 
     /* This test makes the forward copying code be used whenever possible.
-       Reduces the working set.  */
+       Reduces the working set.  memcpy copies forward, so it also
+       handles the case where dst overlaps below src.  */
     if (dstp - srcp >= n) {
         /* Copy from the beginning to the end.  */
         dst = memcpy (dst, src, n);
+    } else if (n <= 16) {
+        /* Small copies load everything before storing.  */
+        copy_small ((uint8_t *)dst, (const uint8_t *)src, n);
     } else {
         /* Copy from the end to the beginning.  */
         srcp += n;
@@ -147,8 +383,26 @@ memmove (void * dst, const void * src, size_t n)
 int 
 memcmp (const void * s1_, const void * s2_, size_t n) 
 {
-    const char * s1 = s1_;
-    const char * s2 = s2_;
+    const uint8_t * s1 = s1_;
+    const uint8_t * s2 = s2_;
+
+    // compare a word at a time; on a mismatch, byte swapping
+    // puts the first differing byte in the most significant
+    // position so that an integer compare gives the answer
+    while (n >= 8) {
+        uint64_t a = *(const u64_ua_t *)s1;
+        uint64_t b = *(const u64_ua_t *)s2;
+
+        if (a != b) {
+            a = __builtin_bswap64(a);
+            b = __builtin_bswap64(b);
+            return a < b ? -1 : 1;
+        }
+
+        s1 += 8;
+        s2 += 8;
+        n  -= 8;
+    }
 
     while (n > 0) {
 
@@ -391,6 +645,53 @@ strrchr (const char * s, int c)
 
 #endif  /* USE_NAUT_BUILTINS */
 
+
+/*
+ * Select block memory strategies based on the processor's
+ * features.   Must be called after fpu_init.
+ */
+void
+nk_string_init (void)
+{
+#ifdef NAUT_CONFIG_USE_NAUT_BUILTINS
+    struct cpuid_ext_feat_flags_ebx ebx;
+    cpuid_ret_t ret;
+    uint64_t llc;
+    uint32_t feats = 0;
+
+    if (cpuid_leaf_max() >= CPUID_LEAF_EXT_FEATS) {
+        cpuid_sub(CPUID_LEAF_EXT_FEATS, 0, &ret);
+        ebx.val = ret.b;
+        if (ebx.erms) {
+            feats |= STRING_ERMS;
+        }
+        // FSRM is EDX bit 4
+        if (ret.d & 0x10) {
+            feats |= STRING_FSRM;
+        }
+    }
+
+    // SSE2 is architectural in long mode
+    feats |= STRING_NT;
+
+    llc = cpuid_get_llc_size();
+    string_nt_thresh = llc ? llc / 2 : 0x100000;
+
+    string_feats = feats;
+
+    INFO_PRINT("string: memcpy/memset using %s%s, non-temporal above %lu bytes%s\n",
+               feats & STRING_ERMS ? "rep movsb/stosb" : "rep movsq/stosq",
+               feats & STRING_FSRM ? " (fast short)" : "",
+               string_nt_thresh,
+#ifdef NAUT_CONFIG_FPU_SAVE
+               ""
+#else
+               " (disabled, no FPU save)"
+#endif
+               );
+#endif
+}
+
 int 
 atoi (const char * buf) 
 {
@@ -183,6 +183,58 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
     }
 }
 
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev, 
+			      struct nk_net_dev_sg *sg,
+			      uint64_t count,
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status, void *state),
+			      void *state)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    DEBUG("send gathered packet on %s (count=%lu, type=%lx)\n", d->name,count,type);
+    if (!di->post_send_sg || !count || count>NK_NET_DEV_MAX_SG) { 
+	DEBUG("gathered packet send not possible\n");
+	return -1;
+    }
+    switch (type) {
+    case NK_DEV_REQ_CALLBACK:
+	return di->post_send_sg(d->state,sg,count,callback,state);
+	break;
+    case NK_DEV_REQ_NONBLOCKING:
+	if (di->post_send_sg(d->state,sg,count,0,0)) { 
+	    ERROR("Failed to launch send\n");
+	    return -1;
+	} else {
+	    DEBUG("Packet launch started\n");
+	    return 0;
+	}
+	break;
+    case NK_DEV_REQ_BLOCKING: {
+	volatile struct op o;
+
+	o.completed = 0;
+	o.status = 0;
+	o.dev = dev;
+
+	if (di->post_send_sg(d->state,sg,count,generic_send_callback,(void*)&o)) { 
+	    ERROR("Failed to launch send\n");
+	    return -1;
+	} else {
+	    DEBUG("Packet launch started, waiting for completion\n");
+	    while (!o.completed) {
+		nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&o);
+	    }
+	    DEBUG("Packet launch completed\n");
+	    return o.status;
+	}
+    }
+	break;
+    default:
+	return -1;
+    }
+}
+
 int nk_net_dev_receive_packet(struct nk_net_dev *dev, 
 			      uint8_t *dest, 
 			      uint64_t len, 
@@ -242,3 +294,59 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 	return -1;
     }
 }
+
+int nk_net_dev_send_burst(struct nk_net_dev *dev,
+			  struct nk_net_dev_burst *b,
+			  uint64_t count)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    uint64_t i;
+
+    DEBUG("send burst on %s (count=%lu)\n", d->name,count);
+
+    if (di->post_send_burst) {
+	return di->post_send_burst(d->state,b,count);
+    }
+
+    if (!di->post_send) {
+	DEBUG("packet send not possible\n");
+	return -1;
+    }
+
+    for (i=0;i<count;i++) {
+	if (di->post_send(d->state,b[i].buf,b[i].len,b[i].callback,b[i].context)) {
+	    break;
+	}
+    }
+
+    return i;
+}
+
+int nk_net_dev_receive_burst(struct nk_net_dev *dev,
+			     struct nk_net_dev_burst *b,
+			     uint64_t count)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    uint64_t i;
+
+    DEBUG("receive burst on %s (count=%lu)\n", d->name,count);
+
+    if (di->post_receive_burst) {
+	return di->post_receive_burst(d->state,b,count);
+    }
+
+    if (!di->post_receive) {
+	DEBUG("packet receive not possible\n");
+	return -1;
+    }
+
+    for (i=0;i<count;i++) {
+	if (di->post_receive(d->state,b[i].buf,b[i].len,b[i].callback,b[i].context)) {
+	    break;
+	}
+    }
+
+    return i;
+}
@@ -70,9 +70,18 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
     STATE_LOCK_CONF;
     struct partition_state *s = (struct partition_state *)state;
     
+    struct nk_block_dev_characteristics under;
+
+    // what requests may look like is up to the underlying device
+    if (nk_block_dev_get_characteristics(s->underlying_blkdev, &under)) {
+        return -1;
+    }
+
     STATE_LOCK(s);
     c->block_size = s->block_size;
     c->num_blocks = s->num_blocks;
+    c->caps = under.caps;
+    c->max_iov = under.max_iov;
     STATE_UNLOCK(s);
     return 0;
 }
@@ -91,7 +100,7 @@ static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *
     uint64_t real_offset = s->ILBA + blocknum + count;
     struct nk_block_dev_characteristics blk_dev_chars;
     nk_block_dev_get_characteristics(s->underlying_blkdev, &blk_dev_chars);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	    STATE_UNLOCK(s);
 	    ERROR("Illegal access past end of partition\n");
 	    return -1;
@@ -121,7 +130,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
     uint64_t real_offset = s->ILBA + blocknum + count;
     struct nk_block_dev_characteristics blk_dev_chars;
     nk_block_dev_get_characteristics(s->underlying_blkdev, &blk_dev_chars);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	    STATE_UNLOCK(s);
 	    ERROR("Illegal access past end of partition\n");
 	    return -1;
@@ -141,11 +150,75 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 
 
 
+// requests are translated to the underlying device a batch at a time
+#define PART_SUBMIT_BATCH 32
+
+static int submit(void *state, struct nk_block_dev_req *reqs, uint64_t count)
+{
+    struct partition_state *s = (struct partition_state *)state;
+    struct nk_block_dev_req batch[PART_SUBMIT_BATCH];
+    uint64_t i, n, done = 0;
+    int rc, err = 0;
+
+    DEBUG("submit of %lu requests on device %s\n", count, s->blkdev->dev.name);
+
+    while (done < count) {
+        n = count - done < PART_SUBMIT_BATCH ? count - done : PART_SUBMIT_BATCH;
+        for (i=0;i<n;i++) {
+            batch[i] = reqs[done+i];
+            if (batch[i].op == NK_BLOCK_DEV_OP_FLUSH) {
+                continue;
+            }
+            if (batch[i].blocknum+batch[i].count > s->num_blocks) {
+                ERROR("Illegal access past end of partition\n");
+                err = 1;
+                n = i;
+                break;
+            }
+            batch[i].blocknum += s->ILBA;
+        }
+        if (!n) {
+            break;
+        }
+        rc = nk_block_dev_submit(s->underlying_blkdev, batch, n);
+        if (rc < 0) {
+            err = 1;
+            break;
+        }
+        done += rc;
+        if (rc < n) {
+            break;
+        }
+    }
+
+    return (err && !done) ? -1 : done;
+}
+
+static void poll(void *state)
+{
+    nk_block_dev_poll(((struct partition_state *)state)->underlying_blkdev);
+}
+
+static int map(void *state, uint64_t blocknum, uint64_t count, void **addr)
+{
+    struct partition_state *s = (struct partition_state *)state;
+
+    if (blocknum+count > s->num_blocks) {
+        ERROR("Illegal map past end of partition\n");
+        return -1;
+    }
+
+    return nk_block_dev_map(s->underlying_blkdev, blocknum+s->ILBA, count, addr);
+}
+
 static struct nk_block_dev_int inter = 
 {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .submit = submit,
+    .poll = poll,
+    .map = map,
 };
 
 static int nk_generate_partition_name(int partition_num, char *blk_name, char **new_name)
@@ -230,7 +303,7 @@ int nk_ebr_enumeration(struct nk_block_dev *blockdev,
         }
 
         // Register new partition
-        ps->blkdev = nk_block_dev_register(*new_name, 0, &inter, ps);
+        ps->blkdev = nk_block_dev_register(*new_name, NK_BLOCK_DEV_FLAG_NO_CACHE, &inter, ps);
         free(*new_name);
         
         if (!ps->blkdev) {
@@ -283,7 +356,7 @@ int nk_mbr_enumeration(struct nk_block_dev *blockdev, nk_part_modern_mbr_t *MBR,
         }
 
         // Register new partition
-        ps->blkdev = nk_block_dev_register(*new_name, 0, &inter, ps);
+        ps->blkdev = nk_block_dev_register(*new_name, NK_BLOCK_DEV_FLAG_NO_CACHE, &inter, ps);
         free(*new_name);
         
         if (!ps->blkdev) {
@@ -381,7 +454,7 @@ int nk_gpt_enumeration(struct nk_block_dev *blockdev, nk_part_modern_mbr_t *MBR,
         }
 
         // Register new partition
-        ps->blkdev = nk_block_dev_register(*new_name, 0, &inter, ps);
+        ps->blkdev = nk_block_dev_register(*new_name, NK_BLOCK_DEV_FLAG_NO_CACHE, &inter, ps);
         free(*new_name);
 
         if (!ps->blkdev) {
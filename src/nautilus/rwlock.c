@@ -26,6 +26,7 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/cpu.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SYNCH
 #undef DEBUG_PRINT
@@ -90,7 +91,9 @@ nk_rwlock_wr_lock (nk_rwlock_t * l)
             break;
         } else { 
             spin_unlock(&l->lock);
-            /* TODO: we should yield if we're not spread across cores */
+            if (!in_interrupt_context() && !preempt_is_disabled()) {
+                nk_yield();
+            }
         }
     }
 
@@ -143,6 +146,173 @@ nk_rwlock_wr_unlock_irq_restore (nk_rwlock_t * l, uint8_t flags)
 }
 
 
+/*
+ * Reader-biased rwlock
+ *
+ * The fast path is Dekker-style: a reader bumps its slot and then
+ * checks the bias, while a writer clears the bias and then checks
+ * the slots, so one of them always sees the other.  The locked
+ * increment is a full barrier on x86.
+ */
+
+// how long bias stays off, as a multiple of the revocation cost
+#define BRWLOCK_INHIBIT_MULT 9
+// spins before a waiter that is allowed to yield does so
+#define BRWLOCK_SPIN_LIMIT   1024
+
+static inline void
+brwlock_backoff (uint64_t * spins)
+{
+    if (++*spins < BRWLOCK_SPIN_LIMIT || in_interrupt_context() || preempt_is_disabled()) {
+        __asm__ __volatile__ ("pause" : : : "memory");
+    } else {
+        nk_yield();
+    }
+}
+
+
+int
+nk_brwlock_init (nk_brwlock_t * l)
+{
+    DEBUG_PRINT("brwlock init (%p)\n", (void*)l);
+
+    memset(l, 0, sizeof(*l));
+    spinlock_init(&l->lock);
+
+    l->nslots = nk_get_num_cpus();
+    l->slots = malloc(sizeof(struct nk_brwlock_slot)*l->nslots);
+
+    if (!l->slots) {
+        ERROR_PRINT("Could not allocate brwlock reader slots\n");
+        return -1;
+    }
+
+    memset(l->slots, 0, sizeof(struct nk_brwlock_slot)*l->nslots);
+    l->rbias = 1;
+
+    return 0;
+}
+
+
+int
+nk_brwlock_deinit (nk_brwlock_t * l)
+{
+    DEBUG_PRINT("brwlock deinit (%p)\n", (void*)l);
+    free(l->slots);
+    l->slots = 0;
+    spinlock_deinit(&l->lock);
+    return 0;
+}
+
+
+int
+nk_brwlock_rd_lock (nk_brwlock_t * l)
+{
+    uint64_t spins = 0;
+    uint8_t flags;
+    int cpu;
+
+    NK_PROFILE_ENTRY();
+
+    if (likely(l->rbias)) {
+        cpu = my_cpu_id();
+        __sync_fetch_and_add(&l->slots[cpu].readers, 1);
+        if (likely(l->rbias)) {
+            NK_PROFILE_EXIT();
+            return cpu;
+        }
+        // lost the race with a writer
+        __sync_fetch_and_sub(&l->slots[cpu].readers, 1);
+    }
+
+    while (1) {
+        flags = spin_lock_irq_save(&l->lock);
+        if (!l->writer) {
+            __sync_fetch_and_add(&l->readers, 1);
+            if (!l->rbias && rdtsc() >= l->inhibit_until) {
+                l->rbias = 1;
+            }
+            spin_unlock_irq_restore(&l->lock, flags);
+            break;
+        }
+        spin_unlock_irq_restore(&l->lock, flags);
+        while (l->writer) {
+            brwlock_backoff(&spins);
+        }
+    }
+
+    NK_PROFILE_EXIT();
+    return -1;
+}
+
+
+void
+nk_brwlock_rd_unlock (nk_brwlock_t * l, int ticket)
+{
+    NK_PROFILE_ENTRY();
+    if (ticket >= 0) {
+        __sync_fetch_and_sub(&l->slots[ticket].readers, 1);
+    } else {
+        __sync_fetch_and_sub(&l->readers, 1);
+    }
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brwlock_wr_lock (nk_brwlock_t * l)
+{
+    uint64_t spins = 0;
+    uint64_t start, end, i;
+    uint8_t flags;
+
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brwlock write lock: %p\n", (void*)l);
+
+    // claim the lock, which holds off new slow-path readers
+    while (1) {
+        flags = spin_lock_irq_save(&l->lock);
+        if (!l->writer) {
+            l->writer = 1;
+            spin_unlock_irq_restore(&l->lock, flags);
+            break;
+        }
+        spin_unlock_irq_restore(&l->lock, flags);
+        brwlock_backoff(&spins);
+    }
+
+    while (l->readers) {
+        brwlock_backoff(&spins);
+    }
+
+    if (l->rbias) {
+        start = rdtsc();
+        l->rbias = 0;
+        __asm__ __volatile__ ("mfence" : : : "memory");
+        for (i = 0; i < l->nslots; i++) {
+            while (l->slots[i].readers) {
+                brwlock_backoff(&spins);
+            }
+        }
+        end = rdtsc();
+        l->inhibit_until = end + (end - start) * BRWLOCK_INHIBIT_MULT;
+    }
+
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brwlock_wr_unlock (nk_brwlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brwlock write unlock: %p\n", (void*)l);
+    __asm__ __volatile__ ("" : : : "memory");
+    l->writer = 0;
+    NK_PROFILE_EXIT();
+}
+
+
 static void 
 reader1 (void * in, void ** out) 
 {
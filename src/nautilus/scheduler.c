@@ -62,6 +62,8 @@
 #include <nautilus/backtrace.h>
 #include <nautilus/shell.h>
 #include <nautilus/topo.h>
+#include <nautilus/wsdeque.h>
+#include <nautilus/mwait.h>
 #include <dev/apic.h>
 #include <dev/gpio.h>
 
@@ -90,7 +92,11 @@
 #define GRANULARITY 2000
 
 
+#ifdef NAUT_CONFIG_INSTRUMENT_SCHED
+#define INSTRUMENT    1
+#else
 #define INSTRUMENT    0
+#endif
 
 #define SANITY_CHECKS 0
 
@@ -131,6 +137,14 @@
 // Maximum number of threads within a priority queue or queue
 #define MAX_QUEUE (NAUT_CONFIG_MAX_THREADS)
 
+// Dead threads are parked in per-cpu caches for reanimation, by
+// stack size class.  Class c holds stacks of at least PAGE_SIZE<<c
+// bytes (4KB through 2MB, the last class also holding larger ones)
+#define NUM_STACK_CLASSES 10
+// How far reanimation looks into a class for a thread that is
+// completely dead (off its stack, and with no references left)
+#define DEAD_CACHE_SCAN   4
+
 
 #define GLOBAL_LOCK_CONF uint8_t _global_flags=0
 #define GLOBAL_LOCK() _global_flags = spin_lock_irq_save(&global_sched_state.lock)
@@ -140,6 +154,10 @@
 #define LOCAL_LOCK(s) _local_flags = spin_lock_irq_save(&((s)->lock))
 #define LOCAL_UNLOCK(s) spin_unlock_irq_restore(&((s)->lock),_local_flags)
 
+#define DEAD_LOCK_CONF uint8_t _dead_flags=0
+#define DEAD_LOCK(s) _dead_flags = spin_lock_irq_save(&((s)->dead_lock))
+#define DEAD_UNLOCK(s) spin_unlock_irq_restore(&((s)->dead_lock),_dead_flags)
+
 #define TASK_LOCK_CONF uint8_t _task_flags=0
 #define TASK_LOCK(t) _task_flags = spin_lock_irq_save(&((t)->lock))
 #define TASK_TRY_LOCK(t) spin_try_lock_irq_save(&((t)->lock),&_task_flags)
@@ -194,6 +212,11 @@ static volatile uint64_t     stopping;
 static nk_counting_barrier_t stop_barrier;
 // flags storage for the the core initiating the world stop
 static volatile uint8_t      stop_flags;
+// work the world stopper has asked the stopped cores to do
+static void                  (*volatile stop_work)(void *state);
+static void                  *volatile stop_work_state;
+static volatile uint64_t     stop_work_gen;
+static volatile uint64_t     stop_work_done;
 
 
 static struct nk_sched_global_state global_sched_state;
@@ -272,6 +295,32 @@ static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *
 static int        rt_priority_queue_empty(rt_priority_queue *queue);
 static void       rt_priority_queue_dump(rt_priority_queue *queue, char *pre);
 
+#if NAUT_CONFIG_APERIODIC_LOTTERY
+//
+// Lottery queue specific to scheduler
+//
+// Threads are kept densely packed in an array, and a Fenwick tree
+// over the array holds the prefix sums of their tickets (priorities),
+// so drawing the winner, adding a thread, and removing a thread are
+// all logarithmic.   Removal fills the hole with the last thread, so
+// the array is in no particular order.
+//
+typedef struct rt_lottery {
+    queue_type type;
+    uint64_t   size;
+    uint64_t   total;               // total tickets in the queue
+    rt_thread *threads[MAX_QUEUE];
+    uint64_t   tree[MAX_QUEUE+1];   // Fenwick tree of tickets, 1-based
+} rt_lottery;
+
+static int        rt_lottery_enqueue(rt_lottery *queue, rt_thread *thread);
+static rt_thread* rt_lottery_draw(rt_lottery *queue);
+static rt_thread* rt_lottery_peek(rt_lottery *queue, uint64_t pos);
+static rt_thread* rt_lottery_remove(rt_lottery *queue, rt_thread *thread);
+static int        rt_lottery_empty(rt_lottery *queue);
+static void       rt_lottery_dump(rt_lottery *queue, char *pre);
+#endif
+
 //
 // Per-CPU scheduler state - hangs off off global cpu struct
 //
@@ -293,7 +342,12 @@ typedef struct nk_sched_task_state {
     struct list_head   sized_queue;      // tasks with known sizes
     uint64_t           unsized_enqueued; // number of unsized tasks enqueud
     uint64_t           unsized_dequeued; //   and dequeued (locally or remotely)
-    struct list_head   unsized_queue;    // tasks with unknown sizes;
+    struct list_head   unsized_queue;    // tasks with unknown sizes pushed from
+                                         // other cpus, or when the deque is full
+    uint64_t           stolen;           // number of tasks this cpu has stolen
+    int               *victims;          // other cpus, closest first (built lazily)
+    nk_wsdeque_t       deque;            // unsized tasks pushed by this cpu; the owner
+                                         // operates on it with interrupts off
 } task_info;
 
 typedef struct nk_sched_percpu_state {
@@ -306,8 +360,7 @@ typedef struct nk_sched_percpu_state {
     rt_queue          aperiodic;   // Aperiodic threads that are runnable
 #endif
 #if NAUT_CONFIG_APERIODIC_LOTTERY
-    uint64_t          total_prob;  // total probability in the queue
-    rt_queue          aperiodic;   // Aperiodic threads that are runnable
+    rt_lottery        aperiodic;   // Aperiodic threads that are runnable
 #endif
 #if NAUT_CONFIG_APERIODIC_DYNAMIC_LIFETIME || NAUT_CONFIG_APERIODIC_DYNAMIC_QUANTUM
     rt_priority_queue aperiodic;   // Aperiodic threads that are runnable
@@ -323,6 +376,29 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t reinject_count;  // how many timer/kick interrupts I've had to reinject
 
+    uint64_t load_avg;     // average runnable aperiodic threads (LOAD_ONE units)
+    uint64_t load_stamp;   // when load_avg was last decayed
+    uint64_t last_balance; // when this cpu last balanced
+    uint64_t lb_pulls;     // threads pulled here by the balancer
+    uint64_t lb_pushes;    // threads pushed away by the balancer
+
+#if NAUT_CONFIG_IDLE_MWAIT
+    // The idle thread monitors this line while in mwait, and other
+    // cpus that would kick it write it instead of sending an IPI
+    struct {
+	volatile uint64_t waiting;   // idle thread is in, or entering, mwait
+	volatile uint64_t wake;      // written to wake it
+    } __attribute__((aligned(64))) idle;
+    uint64_t idle_waits;    // times the idle thread waited in mwait
+    uint64_t kicks_elided;  // kicks that were writes instead of IPIs
+#endif
+
+    // threads that exited on this cpu, newest first, by stack size class
+    spinlock_t dead_lock;
+    rt_thread *dead[NUM_STACK_CLASSES];
+    rt_thread *dead_tail[NUM_STACK_CLASSES];
+    uint64_t   num_dead[NUM_STACK_CLASSES];
+
 #if INSTRUMENT
     uint64_t resched_fast_num;
     uint64_t resched_fast_sum;
@@ -395,22 +471,26 @@ typedef struct nk_sched_percpu_state {
 #define GET_NEXT_APERIODIC(s) round_robin_get_next_aperiodic(s)
 #define PUT_APERIODIC(s,t) round_robin_put_aperiodic(s,t)
 #define REMOVE_APERIODIC(s,t) round_robin_remove_aperiodic(s,t)
+#define HAVE_APERIODIC(s) (!rt_queue_empty(&(s)->aperiodic))
+#define PEEK_APERIODIC(s,k) rt_queue_peek(&(s)->aperiodic,k)
+#define QUEUE_DUMP(q,p) rt_queue_dump(q,p)
 #else  // NAUT_CONFIG_APERIODIC_LOTTERY
 #define GET_NEXT_APERIODIC(s) lottery_get_next_aperiodic(s)
 #define PUT_APERIODIC(s,t) lottery_put_aperiodic(s,t)
 #define REMOVE_APERIODIC(s,t) lottery_remove_aperiodic(s,t)
+#define HAVE_APERIODIC(s) (!rt_lottery_empty(&(s)->aperiodic))
+#define PEEK_APERIODIC(s,k) rt_lottery_peek(&(s)->aperiodic,k)
+#define QUEUE_DUMP(q,p) rt_lottery_dump(q,p)
 #endif
-#define HAVE_APERIODIC(s) (!rt_queue_empty(&(s)->aperiodic))
 #ifdef NAUT_CONFIG_DEBUG_SCHED
 #if DUMP_SCHED_STATE
-#define DUMP_APERIODIC(s,p) rt_queue_dump(&(s)->aperiodic,p)
+#define DUMP_APERIODIC(s,p) QUEUE_DUMP(&(s)->aperiodic,p)
 #else
 #define DUMP_APERIODIC(s,p) 
 #endif
 #else
 #define DUMP_APERIODIC(s,p) 
 #endif
-#define PEEK_APERIODIC(s,k) rt_queue_peek(&(s)->aperiodic,k)
 #define SIZE_APERIODIC(s) ((s)->aperiodic.size)
 #else
 #define GET_NEXT_APERIODIC(s) rt_priority_queue_dequeue(&(s)->aperiodic)
@@ -488,6 +568,8 @@ typedef struct nk_sched_thread_state {
     rt_status status;
     // which queue the thread is currently on
     queue_type q_type;
+    // and where it is in that queue (priority queues and lottery only)
+    uint64_t   q_index;
     
     int      is_intr;      // this is an interrupt thread
     int      is_task;      // this is a task thread
@@ -517,6 +599,11 @@ typedef struct nk_sched_thread_state {
     // the thread node in a thread list (the global thread list)
     struct rt_node   *list; 
 
+    // links in a cpu's dead thread cache
+    struct nk_sched_thread_state *dead_next;
+    struct nk_sched_thread_state *dead_prev;
+    volatile int      dead_cpu;   // cpu whose cache holds the thread, or -1
+
 } rt_thread ;
 
 static void       rt_thread_dump(rt_thread *thread, char *prefix);
@@ -617,6 +704,7 @@ static void print_thread(rt_thread *r, void *priv)
 
 static uint64_t   reap_count;
 static rt_thread *reap_pool[MAX_QUEUE];
+static int        reap_cpu[MAX_QUEUE];
 
 static void pre_reap_thread(rt_thread *r, void *priv)
 {
@@ -624,10 +712,19 @@ static void pre_reap_thread(rt_thread *r, void *priv)
     ASSERT(r->thread);
 
     nk_thread_t  * t = r->thread;
-    rt_node      * temp;
+    int            evict = (int)(uint64_t)priv;
+    int            cpu;
+
+    // reanimation marks a thread unreapable before it takes it out
+    // of its cache, so check where it is first
+    cpu = r->dead_cpu;
+    __sync_synchronize();
 
-    if (reap_count<MAX_QUEUE && !t->refcount && t->status==NK_THR_EXITED && r->status==REAPABLE) {
+    // cached threads are left for reanimation unless we are short
+    if (reap_count<MAX_QUEUE && !t->refcount && t->status==NK_THR_EXITED && r->status==REAPABLE &&
+	(cpu<0 || evict)) {
 	DEBUG("Reaping tid %llu (%s)\n",t->tid,t->name);
+	reap_cpu[reap_count] = cpu;
 	reap_pool[reap_count++] = r;
     }
 }
@@ -662,7 +759,7 @@ void nk_sched_dump_cores(int cpu_arg)
 
 	    s = sys->cpus[cpu]->sched_state;
 	    LOCAL_LOCK(s);
-	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic) [%s]\n",
+	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd %lutst) (%luapic) [%s]\n",
 		     cpu, 
 		     intr_model,
 		     sys->cpus[cpu]->interrupt_nesting_level,
@@ -695,18 +792,12 @@ void nk_sched_dump_cores(int cpu_arg)
 		     s->cfg.aperiodic_quantum, s->cfg.aperiodic_default_priority,
 		     s->tasks.sized_enqueued, s->tasks.sized_dequeued,
 		     s->tasks.unsized_enqueued, s->tasks.unsized_dequeued,
+		     s->tasks.stolen,
 		     apic->timer_count,
 		     aspace ? aspace->name : "default");
-#if INSTRUMENT
-	    char buf2[256];
-            INST_DUMP(s,buf2,256);
-#endif
 	    LOCAL_UNLOCK(s);
 
 	    nk_vc_printf(buf);
-#if INSTRUMENT
-	    nk_vc_printf(buf2);
-#endif
 	}
     }
 }
@@ -731,6 +822,12 @@ void nk_sched_dump_time(int cpu_arg)
 			 tsc->sync_time, tsc->sync_time_cycles,
 			 tsc->sync_time - tsc0->sync_time,
 			 tsc->sync_time_cycles - tsc0->sync_time_cycles);
+#if INSTRUMENT
+	    // per-pass scheduler overhead, in cycles
+	    char buf[384];
+	    INST_DUMP(sys->cpus[cpu]->sched_state,buf,384);
+	    nk_vc_printf(buf);
+#endif
 	}
     }
 }
@@ -910,10 +1007,8 @@ void nk_sched_stop_world()
     }
 
     
-    uint64_t num_cpus = nk_get_num_cpus();
     uint64_t my_cpu_id = my_cpu_id();
     uint64_t stopper = my_cpu_id+1;
-    uint64_t i;
 
 
     
@@ -931,17 +1026,38 @@ void nk_sched_stop_world()
     preempt_enable();  // interrupts are still off - scheduler is not going to preempt us
     
     // kick everyone else to get them to stop
-    for (i=0;i<num_cpus;i++) { 
-	if (i!=my_cpu_id) {
-	    nk_sched_kick_cpu(i);
-	}
-    }
+    nk_sched_kick_others();
 
     // wait for them all to stop
     nk_counting_barrier(&stop_barrier);
 
 }
 
+// Run func on every core while the world is stopped, including
+// the caller, which must be the world stopper.  Returns once all
+// cores have finished, or -1 without running anything if the
+// caller has not stopped the world
+int nk_sched_stopped_world_run(void (*func)(void *state), void *state)
+{
+    if (!scheduler_ready || stopping != my_cpu_id()+1) {
+	return -1;
+    }
+
+    stop_work = func;
+    stop_work_state = state;
+    stop_work_done = 0;
+    __sync_synchronize();
+    stop_work_gen++;
+
+    func(state);
+
+    PAUSE_WHILE(stop_work_done != nk_get_num_cpus()-1);
+
+    stop_work = 0;
+
+    return 0;
+}
+
 void nk_sched_start_world()
 {
     if (!scheduler_ready) {
@@ -994,12 +1110,107 @@ struct nk_thread *nk_find_thread_by_tid(uint64_t tid)
     return q.thread;
 }
 
+static inline int stack_class(nk_stack_size_t size, int round_up)
+{
+    int c = 0;
+
+    while (c < NUM_STACK_CLASSES-1 &&
+	   (round_up ? ((uint64_t)PAGE_SIZE<<c) < size : ((uint64_t)PAGE_SIZE<<(c+1)) <= size)) {
+	c++;
+    }
+
+    return c;
+}
+
+static inline int dead_thread_ready(rt_thread *r, nk_stack_size_t min_stack_size)
+{
+    return r->status == REAPABLE &&
+	r->thread->status == NK_THR_EXITED &&
+	!r->thread->refcount &&
+	r->thread->stack_size >= min_stack_size;
+}
+
+// caller holds the dead lock
+static void dead_cache_unlink(rt_scheduler *s, rt_thread *r)
+{
+    int c = stack_class(r->thread->stack_size,0);
+
+    if (r->dead_prev) {
+	r->dead_prev->dead_next = r->dead_next;
+    } else {
+	s->dead[c] = r->dead_next;
+    }
+    if (r->dead_next) {
+	r->dead_next->dead_prev = r->dead_prev;
+    } else {
+	s->dead_tail[c] = r->dead_prev;
+    }
+    r->dead_next = r->dead_prev = 0;
+    s->num_dead[c]--;
+    r->dead_cpu = -1;
+}
+
+//
+// Park an exiting thread in this cpu's cache.  It is not usable
+// until it is off its stack (REAPABLE) and unreferenced, which
+// reanimation checks for.   Beyond the watermark, the oldest thread
+// of the class is handed to the global reaper instead.
+//
+static void dead_cache_put(rt_scheduler *s, rt_thread *r, int cpu)
+{
+    int c = stack_class(r->thread->stack_size,0);
+    DEAD_LOCK_CONF;
+
+    if (!NAUT_CONFIG_THREAD_CACHE_SIZE) {
+	return;
+    }
+
+    DEAD_LOCK(s);
+
+    if (s->num_dead[c] >= NAUT_CONFIG_THREAD_CACHE_SIZE) {
+	dead_cache_unlink(s,s->dead_tail[c]);
+    }
+
+    r->dead_prev = 0;
+    r->dead_next = s->dead[c];
+    if (r->dead_next) {
+	r->dead_next->dead_prev = r;
+    } else {
+	s->dead_tail[c] = r;
+    }
+    s->dead[c] = r;
+    s->num_dead[c]++;
+    r->dead_cpu = cpu;
+
+    DEAD_UNLOCK(s);
+}
+
+// take a thread out of the given cpu's cache for destruction,
+// unless it has been reanimated (or moved) since the caller found it
+static int dead_cache_claim(rt_thread *r, int cpu, int must_be_dead)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s = sys->cpus[cpu]->sched_state;
+    int rc = -1;
+    DEAD_LOCK_CONF;
+
+    DEAD_LOCK(s);
+    if (r->dead_cpu == cpu && (!must_be_dead || dead_thread_ready(r,0))) {
+	dead_cache_unlink(s,r);
+	rc = 0;
+    }
+    DEAD_UNLOCK(s);
+
+    return rc;
+}
+
 void nk_sched_reap(int uncond)
 {
     DEBUG("Executing Reap (%s)\n", uncond? "UNCOND": "cond");
     
     GLOBAL_LOCK_CONF;
     uint64_t i;
+    int evict;
 
     if (in_interrupt_context()) {
 	// never reap in interrupt context, even unconditionally
@@ -1030,6 +1241,10 @@ void nk_sched_reap(int uncond)
 
     DEBUG("Reap begins (%lu threads)\n", global_sched_state.num_threads);
 
+    // when we are close to the thread limit, empty the dead thread
+    // caches as well
+    evict = global_sched_state.num_threads >= ((NAUT_CONFIG_MAX_THREADS * 95)/100);
+
     GLOBAL_LOCK();
 
     reap_count = 0;
@@ -1037,10 +1252,17 @@ void nk_sched_reap(int uncond)
     // We need to do this in two phases since
     // destroy thread also needs the global lock
     // first phase, collect
-    rt_list_map(global_sched_state.thread_list,pre_reap_thread,0);
+    rt_list_map(global_sched_state.thread_list,pre_reap_thread,(void*)(uint64_t)evict);
 
     GLOBAL_UNLOCK();
 
+    // cached threads may have been reanimated since we found them
+    for (i=0;i<reap_count;i++) {
+	if (reap_cpu[i]>=0 && dead_cache_claim(reap_pool[i],reap_cpu[i],1)) {
+	    reap_pool[i] = 0;
+	}
+    }
+
     // Now reap
     // We are still holding global_sched_state.reaping, so
     // we must have exclusive access to the reap_pool built
@@ -1048,6 +1270,9 @@ void nk_sched_reap(int uncond)
     if (reap_count!=0) { 
 	// reverse order to potentially improve frees
 	for (i=reap_count;i>0;i--) { 
+	    if (!reap_pool[i-1]) {
+		continue;
+	    }
 	    DEBUG("Reaping thread %lu\n", reap_pool[i-1]->thread->tid);
 	    // thread destruction calls back to pre_destory, which
 	    // will acquire the global lock when it removes the thread from
@@ -1064,13 +1289,11 @@ void nk_sched_reap(int uncond)
 }
 
 //
-// The current implementation is essentially a specialized reaping pass,
-// looking in reverse order on the logic that recent threads will be similar
-// to the requested thread
-//
-// Eventually, we will move threads to separate per-cpu queues and perhaps
-// do a smarter search for ones with the required constraints
-//
+// Reanimation takes a dead thread from the cache of the cpu the new
+// thread will be placed on (or of this cpu), looking only at the most
+// recent few in the stack size class the request rounds up to.  The
+// thread stays on the global thread list, so neither this nor the
+// following nk_sched_thread_post_create() touches global state.
 //
 struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
 				     int             placement_cpu)
@@ -1078,60 +1301,47 @@ struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
     DEBUG("Reanimation request for a thread of stack minimum size %lu for CPU %d\n",
 	 min_stack_size, placement_cpu);
     
-    GLOBAL_LOCK_CONF;
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s;
+    rt_thread *r;
+    int n;
+    DEAD_LOCK_CONF;
 
     if (in_interrupt_context()) {
 	DEBUG("Reanimation request while in interrupt context ignored\n");
 	return 0;
     }
 
-    // We are currently overloaded with reaping, so we will wait until
-    // we are the sole "reaper"
-    while (!__sync_bool_compare_and_swap(&global_sched_state.reaping,0,1)) {
+    if (placement_cpu >= (int)sys->num_cpus) {
+	return 0;
     }
-    DEBUG("Reanimation search begins (%lu threads)\n", global_sched_state.num_threads);
 
-    GLOBAL_LOCK();
+    s = sys->cpus[placement_cpu<0 ? my_cpu_id() : placement_cpu]->sched_state;
 
-    // start search from the oldest thread
-    rt_node *cur = global_sched_state.thread_list->head;
+    DEAD_LOCK(s);
 
-    uint64_t count = 0;
-    
-    while (cur &&
-	   !(cur->thread->status == REAPABLE &&
-	     cur->thread->thread->status==NK_THR_EXITED &&
-	     !cur->thread->thread->refcount &&
-	     cur->thread->thread->stack_size >= min_stack_size &&
-	     (placement_cpu<0 || cur->thread->thread->placement_cpu==placement_cpu))) {
-	
-	//DEBUG("Skipping thread %p (%lu) \"%s\"\n", cur->thread->thread, cur->thread->thread->tid,
-	//      cur->thread->thread->is_idle ? "*idle*" ::q!
-	//      cur->thread->thread->name[0] ? cur->thread->thread->name : "(no name)");
-	cur=cur->next;
-	count++;
+    for (r=s->dead[stack_class(min_stack_size,1)], n=0;
+	 r && n<DEAD_CACHE_SCAN;
+	 r=r->dead_next, n++) {
+	if (dead_thread_ready(r,min_stack_size)) {
+	    break;
+	}
     }
-    
-    
-    rt_thread *rt = 0;
-    
-    
-    if (cur) {
-	rt = rt_list_remove(global_sched_state.thread_list, cur);
-	global_sched_state.num_threads--;
-	DEBUG("Examined %lu threads before finding a matching one\n", count+1); 
+
+    if (r && n<DEAD_CACHE_SCAN) {
+	// the reaper must no longer consider it
+	r->status = ARRIVED;
+	__sync_synchronize();
+	dead_cache_unlink(s,r);
     } else {
-	DEBUG("Examined %lu threads without finding a matching one\n", count);
+	r = 0;
     }
-    
-    GLOBAL_UNLOCK();
 
-    // done with "reaping" - another core can now go
-    __sync_fetch_and_and(&global_sched_state.reaping,0);
-    
-    if (rt) {
-	DEBUG("Reanimation successful - returning thread %p (sched state %p name \"%s\")\n", rt->thread, rt, rt->thread->name);
-	return rt->thread;
+    DEAD_UNLOCK(s);
+
+    if (r) {
+	DEBUG("Reanimation successful - returning thread %p (sched state %p name \"%s\")\n", r->thread, r, r->thread->name);
+	return r->thread;
     } else {
 	DEBUG("Reanimation attempt failed\n");
 	return 0;
@@ -1162,10 +1372,13 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
 							 struct nk_sched_constraints *constraints)
 {
     struct nk_sched_thread_state *t;
+    rt_node *list = 0;
     
     if (thread->sched_state) {
-	// this is a reanimated thread, so no allocation is done
+	// this is a reanimated thread, so no allocation is done,
+	// and it is still on the global thread list
 	t = (struct nk_sched_thread_state *)thread->sched_state;
+	list = t->list;
     } else {
 	t = (struct nk_sched_thread_state *)MALLOC_SPECIFIC(sizeof(struct nk_sched_thread_state),thread->current_cpu);
     }
@@ -1184,6 +1397,9 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
 
     ZERO(t);
 
+    t->list = list;
+    t->dead_cpu = -1;
+
     if (!constraints) { 
 	constraints = &default_constraints;
     }
@@ -1210,16 +1426,219 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
     return t;
 }
 
+#if NAUT_CONFIG_LOAD_BALANCE
+
+//
+// Load balancing
+//
+// Each cpu keeps a decaying average of its runnable aperiodic
+// threads (its aperiodic queue, which holds the idle thread whenever
+// something else is running).   At every balancing interval, a cpu
+// pulls a thread from the busiest cpu at the nearest topological
+// level that is sufficiently busier than it, or, if it has too many
+// threads itself, pushes one to the least loaded cpu nearby.
+// Placement of unbound threads and work stealing use the same loads.
+//
+
+#define LOAD_ONE        1024
+#define LOAD_PERIOD_NS  10000000ULL   // the average decays by 1/LOAD_DECAY per period
+#define LOAD_DECAY      4
+#define LOAD_IMBALANCE  (LOAD_ONE + LOAD_ONE/2)
+
+// 0 = SMT sibling, 1 = same socket, 2 = same NUMA domain, 3 = elsewhere
+#define LB_LEVELS 4
+
+#define LB_MOVABLE(t) ((t) && !(t)->thread->is_idle && !(t)->is_intr && !(t)->is_task && \
+		       (t)->thread->bound_cpu<0 && (t)->constraints.type==APERIODIC)
+
+// caller holds the scheduler's lock
+static void update_load(rt_scheduler *s, uint64_t now)
+{
+    uint64_t cur = SIZE_APERIODIC(s) * LOAD_ONE;
+    int n;
+
+    if (!s->load_stamp) {
+	s->load_stamp = now;
+    }
+
+    for (n=0; now - s->load_stamp >= LOAD_PERIOD_NS && n<16; n++) {
+	s->load_avg = (s->load_avg*(LOAD_DECAY-1) + cur) / LOAD_DECAY;
+	s->load_stamp += LOAD_PERIOD_NS;
+    }
+
+    if (n==16) {
+	// long gap; the average has converged anyway
+	s->load_stamp = now;
+    }
+}
+
+// threads that just arrived count before the average catches up
+static inline uint64_t cpu_load(rt_scheduler *s)
+{
+    return MAX(s->load_avg, SIZE_APERIODIC(s) * LOAD_ONE);
+}
+
+static int lb_distance(struct cpu *a, struct cpu *b)
+{
+    if (a->coord && b->coord) {
+	if (nk_topo_cpus_share_phys_core(a,b)) {
+	    return 0;
+	}
+	if (nk_topo_cpus_share_socket(a,b)) {
+	    return 1;
+	}
+    }
+    if (a->domain && a->domain==b->domain) {
+	return 2;
+    }
+    return 3;
+}
+
+// the busiest cpu at the nearest level whose load exceeds ours by
+// the threshold (more for each level further away), or -1
+static int lb_find_busiest(int me, uint64_t threshold)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t my_load = cpu_load(sys->cpus[me]->sched_state);
+    uint64_t best_load[LB_LEVELS] = {0};
+    int best[LB_LEVELS] = {-1,-1,-1,-1};
+    uint64_t load;
+    int i, d;
+
+    for (i=0;i<sys->num_cpus;i++) {
+	if (i==me || !sys->cpus[i]->sched_state) {
+	    continue;
+	}
+	load = cpu_load(sys->cpus[i]->sched_state);
+	d = lb_distance(sys->cpus[me],sys->cpus[i]);
+	if (load > best_load[d]) {
+	    best_load[d] = load;
+	    best[d] = i;
+	}
+    }
+
+    for (d=0;d<LB_LEVELS;d++) {
+	if (best[d]>=0 && best_load[d] >= my_load + threshold + d*(LOAD_ONE/2)) {
+	    return best[d];
+	}
+    }
+
+    return -1;
+}
+
+// the least loaded cpu, including us, where a nearer cpu wins unless
+// a further one is a quarter thread per level less loaded
+static int lb_find_idlest(int me, uint64_t *load)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t key, best_key = -1ULL;
+    int i, best = me;
+
+    for (i=0;i<sys->num_cpus;i++) {
+	if (!sys->cpus[i]->sched_state) {
+	    continue;
+	}
+	key = cpu_load(sys->cpus[i]->sched_state) +
+	    (i==me ? 0 : lb_distance(sys->cpus[me],sys->cpus[i]) * (LOAD_ONE/4));
+	if (key < best_key) {
+	    best_key = key;
+	    best = i;
+	}
+    }
+
+    if (load) {
+	*load = sys->cpus[best]->sched_state ? cpu_load(sys->cpus[best]->sched_state) : 0;
+    }
+
+    return best;
+}
+
+static void lb_push(rt_scheduler *s, int me)
+{
+    LOCAL_LOCK_CONF;
+    rt_thread *t = 0;
+    uint64_t i, load;
+    int target;
+
+    target = lb_find_idlest(me,&load);
+
+    if (target==me || load + LOAD_IMBALANCE > cpu_load(s)) {
+	return;
+    }
+
+    LOCAL_LOCK(s);
+    for (i=0;i<SIZE_APERIODIC(s);i++) {
+	t = PEEK_APERIODIC(s,i);
+	if (LB_MOVABLE(t)) {
+	    break;
+	}
+	t = 0;
+    }
+    LOCAL_UNLOCK(s);
+
+    // this can fail if we race with our own scheduler, which is fine
+    if (t && !nk_sched_thread_move(t->thread,target,0)) {
+	DEBUG("Pushed thread %lu to cpu %d\n",t->thread->tid,target);
+	s->lb_pushes++;
+	nk_sched_kick_cpu(target);
+    }
+}
+
+// called from the timer interrupt without the scheduler's lock
+static void lb_balance(rt_scheduler *s, int me, uint64_t now)
+{
+    uint64_t n;
+    int victim;
+
+    if (now - s->last_balance < NAUT_CONFIG_LOAD_BALANCE_INTERVAL_MS*1000000ULL) {
+	return;
+    }
+
+    s->last_balance = now;
+
+    if ((victim = lb_find_busiest(me,LOAD_IMBALANCE)) >= 0) {
+	if (!nk_sched_cpu_mug(victim,1,&n)) {
+	    s->lb_pulls += n;
+	}
+	return;
+    }
+
+#if NAUT_CONFIG_TICKLESS
+    // idle cpus sleep without ticks, and so cannot pull for themselves
+    if (SIZE_APERIODIC(s) > 1) {
+	lb_push(s,me);
+    }
+#else
+    if (SIZE_APERIODIC(s) > NAUT_CONFIG_LOAD_BALANCE_PUSH_THRESHOLD) {
+	lb_push(s,me);
+    }
+#endif
+}
+
+int nk_sched_initial_placement()
+{
+    return lb_find_idlest(my_cpu_id(),0);
+}
+
+#else
+
 int nk_sched_initial_placement()
 {
     struct sys_info * sys = per_cpu_get(system);
     return (int)(get_random() % sys->num_cpus);
 }
 
+#endif
+
 int nk_sched_thread_post_create(nk_thread_t * t)
 {
     GLOBAL_LOCK_CONF;
 
+    if (t->sched_state->list) {
+	// a reanimated thread never left the global thread list
+	return 0;
+    }
+
     nk_sched_reap(0); // conditional reap to make room for new thread
 
     // the caller is expected to have already set current_cpu!
@@ -1273,7 +1692,13 @@ int nk_sched_thread_post_create(nk_thread_t * t)
 int nk_sched_thread_pre_destroy(nk_thread_t * t)
 {
     rt_thread *r;
+    int cpu = t->sched_state->dead_cpu;
     GLOBAL_LOCK_CONF;
+
+    // a thread destroyed other than by the reaper may still be cached
+    if (cpu >= 0) {
+	dead_cache_claim(t->sched_state,cpu,0);
+    }
     
     GLOBAL_LOCK();
 
@@ -1329,100 +1754,18 @@ static inline uint64_t get_random()
 
 static inline int lottery_put_aperiodic(rt_scheduler *s, rt_thread *t)
 {
-    int rc = rt_queue_enqueue(&s->aperiodic,t);
-
-    if (!rc) { 
-	s->total_prob += t->constraints.aperiodic.priority;
-    }
-    
-    //    printk("LO: put %p (%s), now with total prob=%lu\n",t->thread->tid,t->thread->name,s->total_prob);
-    return rc;
-    
+    return rt_lottery_enqueue(&s->aperiodic,t);
 }
 
 
 static inline rt_thread *lottery_get_next_aperiodic(rt_scheduler *s)
 {
-    // this is the dumb, obvious algorithm (linear in # threads in queue)
-    rt_thread *t=NULL;
-    uint64_t cur;
-    uint64_t pos;
-    rt_queue *q=&s->aperiodic;
-    uint64_t target_prob;
-    uint64_t cum_prob;
-
-    ASSERT(s->total_prob);
-    ASSERT(q->size);
-
-    target_prob = get_random() % s->total_prob;
-
-    for (cur=0, cum_prob=0;
-	 cur<q->size;
-	 cur++) {
-	pos = (q->tail + cur) % MAX_QUEUE;
-	cum_prob += q->threads[pos]->constraints.aperiodic.priority;
-	if (cum_prob>=target_prob) {
-	    // don't pick the idle thread if it can be avoided
-	    if (q->threads[pos]->thread->is_idle && q->size>1) { 
-		// there is at least one other thread
-		if (cur<(q->size-1)) {
-		    // pick the very next one if possible
-		    cur++;
-		} else {
-		    // pick the previous one if not
-		    // cur must be >0
-		    cur--;
-		}
-		// update position
-		pos = (q->tail + cur) % MAX_QUEUE;
-	    }
-	    break;
-	}
-    }
-
-    if (cur==q->size) { 
-	panic("Cannot find thread in lottery scheduler\n");
-	return 0;
-    }
-
-    // grab the thread we will return
-    t = q->threads[pos];
-
-
-    // cur => position within the queue (0=oldest, ...)
-    // pos => position within the array
-    // We now need to "copy down" everything above this position
-
-    uint64_t i, p, n;
-    for (i=cur;
-	 i<(q->size-1);
-	 i++) {
-	
-	p = (q->tail + i) % MAX_QUEUE;
-	n = (q->tail + i + 1 ) % MAX_QUEUE;
-	q->threads[p] = q->threads[n];
-    }
-
-    // decrement head
-    q->head = (q->head + MAX_QUEUE - 1) % MAX_QUEUE;
-    
-    q->size--;
-
-    s->total_prob -= t->constraints.aperiodic.priority;
-
-
-    return t;
+    return rt_lottery_draw(&s->aperiodic);
 }
 
 static inline rt_thread *lottery_remove_aperiodic(rt_scheduler *s, rt_thread *t)
 {
-    rt_thread *r = rt_queue_remove(&s->aperiodic,t);
-
-    if (r) { 
-	s->total_prob -= t->constraints.aperiodic.priority;
-    }
-
-    return r;
+    return rt_lottery_remove(&s->aperiodic,t);
 }
 
 #endif
@@ -1494,6 +1837,17 @@ static int    _sched_make_runnable(struct nk_thread *thread, int cpu, int admit,
     }
     return -1;
  out_good:
+#if NAUT_CONFIG_TICKLESS
+    if (s == per_cpu_get(sched_state) && !in_interrupt_context()) {
+	// our timer may be off, as we may have been the only
+	// runnable thread, so make sure the newcomer gets its chance
+	// (interrupts get a scheduling pass on the way out anyway)
+	apic_update_oneshot_timer_ns(per_cpu_get(apic),
+				     t->constraints.type==APERIODIC ? s->cfg.aperiodic_quantum :
+				     t->deadline > cur_time() ? t->deadline - cur_time() : 0,
+				     IF_EARLIER);
+    }
+#endif
     if (!have_lock) { 
 	LOCAL_UNLOCK(s);
     }
@@ -1795,6 +2149,52 @@ static void rt_priority_queue_dump(rt_priority_queue *queue, char *pre)
     DEBUG("======%s==END=====\n",pre);
 }
 
+//
+// The heap is indexed: each thread records its position in
+// q_index, so a thread can be removed without searching for it
+//
+static inline void rt_priority_queue_place(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    queue->threads[pos] = thread;
+    thread->q_index = pos;
+}
+
+// put thread into the hole at pos, moving it toward the root
+static void rt_priority_queue_sift_up(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    while (pos && queue->threads[parent(pos)]->deadline > thread->deadline) {
+	rt_priority_queue_place(queue,pos,queue->threads[parent(pos)]);
+	pos = parent(pos);
+    }
+
+    rt_priority_queue_place(queue,pos,thread);
+}
+
+// put thread into the hole at pos, moving it toward the leaves
+static void rt_priority_queue_sift_down(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    uint64_t child;
+
+    while (left_child(pos) < queue->size) {
+
+	child = left_child(pos);
+
+	if (right_child(pos) < queue->size &&
+	    queue->threads[right_child(pos)]->deadline < queue->threads[child]->deadline) {
+	    child = right_child(pos);
+	}
+
+	if (thread->deadline > queue->threads[child]->deadline) {
+	    rt_priority_queue_place(queue,pos,queue->threads[child]);
+	    pos = child;
+	} else {
+	    break;
+	}
+    }
+
+    rt_priority_queue_place(queue,pos,thread);
+}
+
 static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread)
 {
     if (queue->size == MAX_QUEUE)        {
@@ -1806,19 +2206,9 @@ static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread
 	return -1;
     }
         
-    uint64_t pos = queue->size++;
-    queue->threads[pos] = thread;
-
-    // update heap
-    while (queue->threads[parent(pos)]->deadline > thread->deadline 
-	   && pos != parent(pos))  {
-	queue->threads[pos] = queue->threads[parent(pos)];
-	pos = parent(pos);
-    }
-
     thread->q_type = queue->type;
-    queue->threads[pos] = thread;
 
+    rt_priority_queue_sift_up(queue,queue->size++,thread);
 
     return 0;
 }
@@ -1848,64 +2238,172 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
     }
     
     rt_thread *min, *last;
-    int now, child;
     
     // Get the entry we are about to remove (min)
     min = queue->threads[0];
     last = queue->threads[--queue->size];
         
     // update the heap
-    for (now = 0; left_child(now) < queue->size; now = child) {
-	
-	child = left_child(now);
-
-	if (child < queue->size && 
-	    queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)  {
-	    
-	    child = right_child(now);
-	}
-            
-	if (last->deadline > queue->threads[child]->deadline) {
-	    queue->threads[now] = queue->threads[child];
-	} else {
-	    break;
-	}
+    if (queue->size) {
+	rt_priority_queue_sift_down(queue,0,last);
     }
         
-    queue->threads[now] = last;
-        
     return min;
 
 }
 
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread)
 {
-    // this is currently hideous beyond belief
+    uint64_t pos = thread->q_index;
+    rt_thread *last;
 
-    rt_priority_queue temp = *queue;
-    rt_thread *cur;
-    int found=0;
+    // the handle is stale if the thread is not on this queue
+    if (pos >= queue->size || queue->threads[pos] != thread) {
+	return 0;
+    }
 
-    queue->size=0;
+    last = queue->threads[--queue->size];
 
-    while (!rt_priority_queue_empty(&temp)) {
-	cur=rt_priority_queue_dequeue(&temp);
-	if (cur && cur!=thread) {
-	    if (rt_priority_queue_enqueue(queue,cur)) { 
-		ERROR("Failed to re-enqueue in removal process...\n");
-	    } 
+    // fill the hole with the last entry, which can belong
+    // either above or below it
+    if (last != thread) {
+	if (pos && queue->threads[parent(pos)]->deadline > last->deadline) {
+	    rt_priority_queue_sift_up(queue,pos,last);
 	} else {
-	    found = 1;
+	    rt_priority_queue_sift_down(queue,pos,last);
 	}
     }
-    if (!found) { 
+
+    return thread;
+}
+
+static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
+{
+    if (pos>=queue->size) { 
 	return 0;
     } else {
-	return thread;
+	return queue->threads[pos];
     }
 }
 
-static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
+static int rt_priority_queue_empty(rt_priority_queue *queue)
+{
+    return queue->size==0;
+}
+
+#if NAUT_CONFIG_APERIODIC_LOTTERY
+
+// largest power of two no bigger than MAX_QUEUE
+#define LOTTERY_TOP (1ULL << (63 - __builtin_clzll(MAX_QUEUE)))
+
+// add delta (possibly "negative") to the tickets at pos
+static inline void rt_lottery_add(rt_lottery *queue, uint64_t pos, uint64_t delta)
+{
+    for (pos++; pos <= MAX_QUEUE; pos += pos & -pos) {
+	queue->tree[pos] += delta;
+    }
+}
+
+// position of the thread holding ticket number target (< total)
+static inline uint64_t rt_lottery_find(rt_lottery *queue, uint64_t target)
+{
+    uint64_t pos = 0, step;
+
+    for (step = LOTTERY_TOP; step; step >>= 1) {
+	if (pos + step <= MAX_QUEUE && queue->tree[pos + step] <= target) {
+	    pos += step;
+	    target -= queue->tree[pos];
+	}
+    }
+
+    return pos;
+}
+
+static inline void rt_lottery_place(rt_lottery *queue, uint64_t pos, rt_thread *thread)
+{
+    queue->threads[pos] = thread;
+    thread->q_index = pos;
+}
+
+static int rt_lottery_enqueue(rt_lottery *queue, rt_thread *thread)
+{
+    if (queue->size == MAX_QUEUE) {
+	ERROR("Too many threads for lottery queue\n");
+	return -1;
+    }
+
+    thread->q_type = queue->type;
+
+    rt_lottery_place(queue,queue->size,thread);
+    rt_lottery_add(queue,queue->size,thread->constraints.aperiodic.priority);
+    queue->total += thread->constraints.aperiodic.priority;
+    queue->size++;
+
+    return 0;
+}
+
+static void rt_lottery_take(rt_lottery *queue, uint64_t pos)
+{
+    rt_thread *thread = queue->threads[pos];
+    rt_thread *last = queue->threads[--queue->size];
+    uint64_t tickets = thread->constraints.aperiodic.priority;
+    uint64_t last_tickets = last->constraints.aperiodic.priority;
+
+    if (pos != queue->size) {
+	// the last thread moves into the hole
+	rt_lottery_place(queue,pos,last);
+	rt_lottery_add(queue,pos,last_tickets - tickets);
+	rt_lottery_add(queue,queue->size,-last_tickets);
+    } else {
+	rt_lottery_add(queue,pos,-tickets);
+    }
+
+    queue->total -= tickets;
+}
+
+static rt_thread* rt_lottery_draw(rt_lottery *queue)
+{
+    rt_thread *thread;
+    uint64_t pos;
+
+    ASSERT(queue->total);
+    ASSERT(queue->size);
+
+    pos = rt_lottery_find(queue, get_random() % queue->total);
+
+    if (pos >= queue->size) {
+	panic("Cannot find thread in lottery scheduler\n");
+	return 0;
+    }
+
+    // don't pick the idle thread if it can be avoided
+    if (queue->threads[pos]->thread->is_idle && queue->size>1) {
+	// pick the very next one if possible, the previous one if not
+	pos = pos<queue->size-1 ? pos+1 : pos-1;
+    }
+
+    thread = queue->threads[pos];
+
+    rt_lottery_take(queue,pos);
+
+    return thread;
+}
+
+static rt_thread* rt_lottery_remove(rt_lottery *queue, rt_thread *thread)
+{
+    uint64_t pos = thread->q_index;
+
+    // the handle is stale if the thread is not on this queue
+    if (pos >= queue->size || queue->threads[pos] != thread) {
+	return 0;
+    }
+
+    rt_lottery_take(queue,pos);
+
+    return thread;
+}
+
+static rt_thread *rt_lottery_peek(rt_lottery *queue, uint64_t pos)
 {
     if (pos>=queue->size) { 
 	return 0;
@@ -1914,10 +2412,25 @@ static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
     }
 }
 
-static int rt_priority_queue_empty(rt_priority_queue *queue)
-{
-    return queue->size==0;
-}
+static int rt_lottery_empty(rt_lottery *queue)
+{
+    return queue->size==0;
+}
+
+static void rt_lottery_dump(rt_lottery *queue, char *pre)
+{
+    int now;
+    DEBUG("======%s==BEGIN=====\n",pre);
+    for (now=0;now<queue->size;now++) { 
+	DEBUG("   %llu %s (%llu tickets)\n",queue->threads[now]->thread->tid,
+	      queue->threads[now]->thread->is_idle ? "*idle*" : 
+	      queue->threads[now]->thread->name[0] ? queue->threads[now]->thread->name : "(no name)" ,
+	      queue->threads[now]->constraints.aperiodic.priority);
+    }
+    DEBUG("======%s==END=====\n",pre);
+}
+
+#endif
 
 static void rt_thread_dump(rt_thread *thread, char *pre)
 {
@@ -1934,6 +2447,16 @@ static void rt_thread_dump(rt_thread *thread, char *pre)
 }
 
 
+#if NAUT_CONFIG_TICKLESS
+// nothing other than the idle thread is waiting to run
+static inline int nothing_else_runnable(rt_scheduler *s)
+{
+    return !HAVE_RT(s) &&
+	(SIZE_APERIODIC(s)==0 ||
+	 (SIZE_APERIODIC(s)==1 && PEEK_APERIODIC(s,0)->thread->is_idle));
+}
+#endif
+
 static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 {
     struct sys_info *sys = per_cpu_get(system);
@@ -1941,6 +2464,7 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 
     uint64_t next_arrival = -1; //big num
     uint64_t next_preempt = -1; //big num
+    uint64_t next_timer = nk_timer_next_deadline();
 
     if (HAVE_RT_PENDING(scheduler)) { 
 	// the current deadline is the next arrival
@@ -1951,6 +2475,12 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 	uint64_t remaining_time;
 	switch (thread->constraints.type) { 
 	case APERIODIC:
+#if NAUT_CONFIG_TICKLESS
+	    if (nothing_else_runnable(scheduler)) {
+		// there is nothing to preempt it for, so no tick
+		break;
+	    }
+#endif
 	    next_preempt = now + scheduler->cfg.aperiodic_quantum;
 	    break;
 	case SPORADIC:
@@ -1968,37 +2498,38 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
     }
 
 
-    // set timer to the minimum of the next arrival and the timeout
-    // of the current thread, adding slack for scheduler overhead
+    // set timer to the minimum of the next arrival, the timeout
+    // of the current thread, and the next timer on this cpu, adding
+    // slack for scheduler overhead
 
     scheduler->tsc.start_time = now;
-    scheduler->tsc.set_time = MIN(next_arrival,next_preempt);
+    scheduler->tsc.set_time = MIN(MIN(next_arrival,next_preempt),next_timer);
     
   
     // the set time has been computed based on the "now" argument
     // which is the start of the scheduling pass.   We need to set
-    // the cycle counter delay based on the set time relative 
+    // the timer delay based on the set time relative 
     // to the *current time*
-    uint32_t ticks = apic_realtime_to_ticks(apic,  
-					    scheduler->tsc.set_time - cur_time() + scheduler->slack);
-
-    
-    if (cur_time() >= scheduler->tsc.set_time) {
+    uint64_t cur = cur_time();
+    uint64_t delay_ns;
+
+    if (scheduler->tsc.set_time == -1ULL) {
+	// nothing will need the scheduler, which is tickless
+	// operation if the timer is in TSC-deadline mode
+	delay_ns = -1ULL;
+    } else if (cur >= scheduler->tsc.set_time) {
 	DEBUG("Time of next clock has already passed (cur_time=%llu, set_time=%llu)\n",
-	      cur_time(), scheduler->tsc.set_time);
-	ticks = 1;
-    }
-
-    if (ticks & 0x80000000) { 
-	ERROR("Ticks is unlikely, probably overflow\n");
+	      cur, scheduler->tsc.set_time);
+	delay_ns = 0;
+    } else {
+	delay_ns = scheduler->tsc.set_time - cur + scheduler->slack;
     }
 
-    //    DEBUG("Setting timer to at most %llu ns (%llu ticks)\n",scheduler->tsc.set_time - now + scheduler->slack,
-    //	  apic_realtime_to_ticks(apic, scheduler->tsc.set_time - now + scheduler->slack));
+    //    DEBUG("Setting timer to at most %llu ns\n",delay_ns);
 
-    apic_update_oneshot_timer(apic, 
-			      ticks,
-			      IF_EARLIER);
+    apic_update_oneshot_timer_ns(apic, 
+				 delay_ns,
+				 IF_EARLIER);
 			      
 
 }
@@ -2075,6 +2606,11 @@ static int pump_sized_tasks(rt_scheduler *scheduler, rt_thread *next)
     // next time the scheduler will be invoked for any reason, including RT arrivals
     uint64_t next_time = scheduler->tsc.set_time;
     uint64_t current_time;
+
+    if (next_time == -1ULL) {
+	// tickless, so budget as if for one quantum
+	next_time = cur_time() + scheduler->cfg.aperiodic_quantum;
+    }
     uint64_t avail_time;
     uint64_t count=0;
     
@@ -2155,12 +2691,23 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	    return 0;
 	} else {
 	    uint64_t num_cpus = nk_get_num_cpus();
+	    // any work requested from here on is new to us
+	    uint64_t work_gen = stop_work_gen;
 	    DEBUG("World stop signalled\n");
 	    // We now wait for everyone else to stop
 	    nk_counting_barrier(&stop_barrier);
 	    // everyone's stopped... we are now waiting for
-	    // the world stopper to restart us all
-	    PAUSE_WHILE(stopping);
+	    // the world stopper to restart us all, doing
+	    // any work it hands us in the meantime
+	    while (stopping) {
+		if (stop_work_gen != work_gen) {
+		    work_gen = stop_work_gen;
+		    stop_work(stop_work_state);
+		    __sync_fetch_and_add(&stop_work_done,1);
+		} else {
+		    __asm__ __volatile__ ("pause");
+		}
+	    }
 	    // we've been restarted - we'll now wait for everyone
 	    nk_counting_barrier(&stop_barrier);
 	    // everyone's now restarted
@@ -2190,9 +2737,9 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 		DEBUG("Reinjecting timer: in_timer=%d, in_kick=%d\n", 
 		      a->in_timer_interrupt, a->in_kick_interrupt);
 		//BACKTRACE(DEBUG,3);
-		apic_update_oneshot_timer(a, 
-					  apic_realtime_to_ticks(a, NAUT_CONFIG_INTERRUPT_REINJECTION_DELAY_NS),
-					  IF_EARLIER);
+		apic_update_oneshot_timer_ns(a, 
+					     NAUT_CONFIG_INTERRUPT_REINJECTION_DELAY_NS,
+					     IF_EARLIER);
 		per_cpu_get(system)->cpus[my_cpu_id()]->sched_state->reinject_count++;
 	    }
 	    // do not context switch
@@ -2214,10 +2761,27 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
     // optional
     stack_check(rt_c,1);
 
+#if NAUT_CONFIG_LOAD_BALANCE
+    if (!have_lock && apic->in_timer_interrupt) {
+	lb_balance(scheduler,my_cpu_id(),now);
+    }
+#endif
+
     if (!have_lock) {
 	LOCAL_LOCK(scheduler);
     }
 
+#if NAUT_CONFIG_IDLE_MWAIT
+    // from here on, kicks must be IPIs, as we may not return to idle
+    if (scheduler->idle.waiting) {
+	scheduler->idle.waiting = 0;
+    }
+#endif
+
+#if NAUT_CONFIG_LOAD_BALANCE
+    update_load(scheduler,now);
+#endif
+
     scheduler->tsc.end_time = now;
 
     rt_c->run_time += now - rt_c->start_time;
@@ -2993,6 +3557,10 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 
 static int select_victim(int new_cpu)
 {
+#if NAUT_CONFIG_LOAD_BALANCE
+    // the busiest nearby cpu with at least one more thread than us
+    return lb_find_busiest(new_cpu,LOAD_ONE);
+#else
     int a,b;
     struct sys_info *sys = per_cpu_get(system);
  
@@ -3007,7 +3575,7 @@ static int select_victim(int new_cpu)
 
     return (sys->cpus[a]->sched_state->aperiodic.size  >
 	    sys->cpus[b]->sched_state->aperiodic.size) ? a : b;
-
+#endif
 }
 
 uint64_t nk_sched_get_runtime(struct nk_thread *t)
@@ -3032,6 +3600,10 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
     if (old_cpu==-1) { 
 	old_cpu = select_victim(new_cpu);
+	if (old_cpu<0) {
+	    DEBUG("Work stealing: no cpu worth stealing from\n");
+	    return 0;
+	}
     }
 
     if (old_cpu==new_cpu) {
@@ -3101,10 +3673,30 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 }
 
 
+// one shorthand IPI instead of one per cpu
+void    nk_sched_kick_others()
+{
+#ifdef NAUT_CONFIG_KICK_SCHEDULE
+    apic_bcast_ipi(per_cpu_get(apic), APIC_NULL_KICK_VEC);
+#endif
+}
+
 void    nk_sched_kick_cpu(int cpu)
 {
 #ifdef NAUT_CONFIG_KICK_SCHEDULE
     if (cpu != my_cpu_id()) {
+#if NAUT_CONFIG_IDLE_MWAIT
+	rt_scheduler *s = nk_get_nautilus_info()->sys.cpus[cpu]->sched_state;
+	// order whatever the caller did for the cpu (e.g., queueing
+	// a thread) before the check, see nk_sched_idle_wait()
+	__sync_synchronize();
+	if (s->idle.waiting) {
+	    // it is idle in mwait, and this write is enough to wake it
+	    s->idle.wake++;
+	    __sync_fetch_and_add(&s->kicks_elided,1);
+	    return;
+	}
+#endif
         apic_ipi(per_cpu_get(apic),
 		 nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id,
 		 APIC_NULL_KICK_VEC);
@@ -3115,6 +3707,47 @@ void    nk_sched_kick_cpu(int cpu)
 #endif
 }
 
+#if NAUT_CONFIG_IDLE_MWAIT
+// the idle thread consumes these itself, see idle.c
+#define HAVE_TASKS(ti) ((ti)->unsized_enqueued != (ti)->unsized_dequeued || \
+			(ti)->sized_enqueued != (ti)->sized_dequeued)
+
+int nk_sched_idle_wait(void)
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    if (!nk_mwait_available()) {
+	return -1;
+    }
+
+    // A waker queues work for us and then checks whether we are
+    // waiting, while we announce that we are waiting and then check
+    // for work, so at least one side sees the other.  If we miss the
+    // work, the monitor was armed before the waker wrote the line.
+    cli();
+    s->idle.waiting = 1;
+    nk_monitor((addr_t)&s->idle.wake,0,0);
+    __sync_synchronize();
+
+    if (!HAVE_APERIODIC(s) && !HAVE_RT(s)
+#if NAUT_CONFIG_TASK_IN_IDLE
+	&& !HAVE_TASKS(&s->tasks)
+#endif
+	) {
+	s->idle_waits++;
+	// sti shadow: an interrupt cannot arrive before the mwait, and
+	// one that arrives during it ends it
+	nk_sti_mwait(0,0);
+    } else {
+	sti();
+    }
+
+    s->idle.waiting = 0;
+
+    return 0;
+}
+#endif
+
 extern void nk_thread_switch(nk_thread_t *new);
 extern void nk_thread_switch_exit_helper(nk_thread_t *new, rt_status *statusp, rt_status newval);
 
@@ -3219,6 +3852,8 @@ static void handle_special_switch(rt_status what, int have_lock, uint8_t flags,
     preempt_reset();
 
     if (what==EXITING) {
+	// Park the thread for reanimation
+	dead_cache_put(s,c->sched_state,my_cpu_id());
 	// We need to make the exit transition extremely cleanly as we can
 	// race with the reaper - this invokes an assembly snippet that does this
 	// correctly, and also avoids any state save costs for this now dead
@@ -3720,10 +4355,72 @@ static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queu
     return min_period;
 }
 
-static int task_initial_placement()
+// 0 = same physical core, 1 = same socket, 2 = elsewhere
+static int task_topo_distance(struct cpu *a, struct cpu *b)
+{
+    if (!a->coord || !b->coord) {
+	return 2;
+    }
+    if (nk_topo_cpus_share_phys_core(a,b)) {
+	return 0;
+    }
+    if (nk_topo_cpus_share_socket(a,b)) {
+	return 1;
+    }
+    return 2;
+}
+
+// order the other cpus by topological distance from us, rotating
+// within each distance class so that thieves do not all pile onto
+// the same victim; must be called with interrupts off
+static int *task_victims(task_info *ti)
 {
     struct sys_info * sys = per_cpu_get(system);
-    return (int)(get_random() % sys->num_cpus);
+    int me = my_cpu_id();
+    int n = sys->num_cpus;
+    int *v;
+    int dist, i, j, k = 0;
+
+    if (ti->victims || n < 2) {
+	return ti->victims;
+    }
+
+    v = malloc_specific(sizeof(int)*(n-1), me);
+
+    if (!v) {
+	return 0;
+    }
+
+    for (dist=0;dist<3;dist++) {
+	for (i=1;i<n;i++) {
+	    j = (me + i) % n;
+	    if (task_topo_distance(sys->cpus[me],sys->cpus[j])==dist) {
+		v[k++] = j;
+	    }
+	}
+    }
+
+    ti->victims = v;
+
+    return v;
+}
+
+// if we have more work than we can do ourselves, nudge our closest
+// neighbor's task thread so that it can come and steal some
+static void task_wake_neighbor(task_info *ti, int *victims)
+{
+    struct sys_info * sys = per_cpu_get(system);
+
+    if (victims && nk_wsdeque_size(&ti->deque) > 1 &&
+	sys->cpus[victims[0]]->sched_state) {
+	nk_wait_queue_wake_all(sys->cpus[victims[0]]->sched_state->tasks.waitq);
+    }
+}
+
+static int task_initial_placement()
+{
+    // tasks start out local and are spread by stealing
+    return my_cpu_id();
 }
 
 
@@ -3755,6 +4452,20 @@ struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), vo
     struct sys_info * sys = per_cpu_get(system);
     task_info *ti = &sys->cpus[placement_cpu]->sched_state->tasks;
 
+    if (!t->stats.size_ns) {
+	// unsized tasks for this cpu go onto our own deque if possible
+	uint8_t irq = irq_disable_save();
+	int pushed = placement_cpu==my_cpu_id() && !nk_wsdeque_push(&ti->deque,t);
+	int *victims = pushed ? task_victims(ti) : 0;
+	irq_enable_restore(irq);
+	if (pushed) {
+	    __sync_fetch_and_add(&ti->unsized_enqueued,1);
+	    nk_wait_queue_wake_all(ti->waitq);
+	    task_wake_neighbor(ti,victims);
+	    return t;
+	}
+    }
+
     // own the target scheduler's task queue
     TASK_LOCK(ti);
     if (t->stats.size_ns) {
@@ -3762,13 +4473,21 @@ struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), vo
 	ti->sized_enqueued++;
     } else {
 	list_add_tail(&t->queue_node, &ti->unsized_queue);
-	ti->unsized_enqueued++;
+	__sync_fetch_and_add(&ti->unsized_enqueued,1);
     }
     TASK_UNLOCK(ti);
 
     // kick any waitqueue
     nk_wait_queue_wake_all(ti->waitq);
 
+#if NAUT_CONFIG_TASK_IN_IDLE && NAUT_CONFIG_IDLE_MWAIT
+    // the idle thread there may be waiting in mwait for something
+    // to run, and nothing else will wake it for a task
+    if (placement_cpu != my_cpu_id()) {
+	nk_sched_kick_cpu(placement_cpu);
+    }
+#endif
+
     return t;
 }
 
@@ -3778,16 +4497,11 @@ static int task_cpu_selection()
     return (int)(get_random() % sys->num_cpus);
 }
 
-// dequeue a task, typically used internally
-// dequeuing a task does not execute it.
-static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+// dequeue a task from the locked lists of the given cpu
+static struct nk_task *task_list_consume(task_info *ti, uint64_t size_ns, uint64_t search_limit, int try)
 {
     TASK_LOCK_CONF;
     
-    int source_cpu = cpu>=0 ? cpu : task_cpu_selection();
-
-    struct sys_info * sys = per_cpu_get(system);
-    task_info *ti = &sys->cpus[source_cpu]->sched_state->tasks;
     struct nk_task *t = 0;
     struct list_head *cur;
 
@@ -3823,7 +4537,7 @@ static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t sear
 	    cur = ti->unsized_queue.next;
 	    t = list_entry(cur,struct nk_task, queue_node);
 	    list_del_init(cur);
-	    ti->unsized_dequeued++;
+	    __sync_fetch_and_add(&ti->unsized_dequeued,1);
 	} else if (!list_empty(&ti->sized_queue)) {
 	    cur = ti->sized_queue.next;
 	    t = list_entry(cur,struct nk_task, queue_node);
@@ -3836,6 +4550,94 @@ static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t sear
 
     TASK_UNLOCK(ti);
 
+    return t;
+}
+
+// steal an unsized task from the closest cpu that has one
+static struct nk_task *task_steal(task_info *me, int try)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_task *t = 0;
+    int *victims;
+    int i;
+
+    uint8_t irq = irq_disable_save();
+    victims = task_victims(me);
+    irq_enable_restore(irq);
+
+    if (!victims) {
+	return 0;
+    }
+
+    for (i=0;i<sys->num_cpus-1 && !t;i++) {
+	if (!sys->cpus[victims[i]]->sched_state) {
+	    // not up yet
+	    continue;
+	}
+	task_info *ti = &sys->cpus[victims[i]]->sched_state->tasks;
+	if ((t = (struct nk_task *)nk_wsdeque_steal(&ti->deque))) {
+	    __sync_fetch_and_add(&ti->unsized_dequeued,1);
+	} else if (ti->unsized_enqueued != ti->unsized_dequeued || 
+		   ti->sized_enqueued != ti->sized_dequeued) {
+	    t = task_list_consume(ti,0,0,try);
+	}
+    }
+
+    if (t) {
+	__sync_fetch_and_add(&me->stolen,1);
+	// pass the word along if our victim still has more
+	task_wake_neighbor(&sys->cpus[victims[i-1]]->sched_state->tasks,victims);
+    }
+
+    return t;
+}
+
+// dequeue a task, typically used internally
+// dequeuing a task does not execute it.
+static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_task *t = 0;
+    uint8_t irq;
+    int me;
+
+    if (size_ns) {
+	// sized tasks live only on the locked lists
+	int source_cpu = cpu>=0 ? cpu : task_cpu_selection();
+	t = task_list_consume(&sys->cpus[source_cpu]->sched_state->tasks,size_ns,search_limit,try);
+	goto out;
+    }
+
+    // we must not migrate while we act as the owner of our deque
+    irq = irq_disable_save();
+    me = my_cpu_id();
+    if (cpu==me) {
+	t = (struct nk_task *)nk_wsdeque_pop(&sys->cpus[me]->sched_state->tasks.deque);
+    }
+    irq_enable_restore(irq);
+
+    if (cpu==me) {
+	// our own deque (newest first), then what others have sent us
+	task_info *ti = &sys->cpus[me]->sched_state->tasks;
+	if (t) {
+	    __sync_fetch_and_add(&ti->unsized_dequeued,1);
+	} else {
+	    t = task_list_consume(ti,0,0,try);
+	}
+    } else if (cpu<0) {
+	// steal from others, oldest first, closest first
+	t = task_steal(&sys->cpus[me]->sched_state->tasks,try);
+    } else {
+	// steal from a specific cpu
+	task_info *ti = &sys->cpus[cpu]->sched_state->tasks;
+	if ((t = (struct nk_task *)nk_wsdeque_steal(&ti->deque))) {
+	    __sync_fetch_and_add(&ti->unsized_dequeued,1);
+	} else {
+	    t = task_list_consume(ti,0,0,try);
+	}
+    }
+
+ out:
     if (t) {
 	t->stats.dequeue_time_ns = cur_time();
     }
@@ -3953,6 +4755,7 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
     }
     
     spinlock_init(&state->lock);
+    spinlock_init(&state->dead_lock);
 
     spinlock_init(&state->tasks.lock);
     INIT_LIST_HEAD(&state->tasks.sized_queue);
@@ -4029,11 +4832,33 @@ static int start_interrupt_thread_for_this_cpu()
 
 #if NAUT_CONFIG_TASK_THREAD
 
+static int task_pending(task_info *ti)
+{
+    return (ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued);
+}
+
 static int await_task(void *p)
 {
     task_info *ti = (task_info *) p;
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
 
-    return (ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued);
+    if (task_pending(ti)) {
+	return 1;
+    }
+
+    // or work that we could steal
+    for (i=0;i<sys->num_cpus;i++) {
+	if (!sys->cpus[i]->sched_state) {
+	    continue;
+	}
+	task_info *other = &sys->cpus[i]->sched_state->tasks;
+	if (nk_wsdeque_size(&other->deque) > 1) {
+	    return 1;
+	}
+    }
+
+    return 0;
 }
 
 static void task(void *in, void **out)
@@ -4513,6 +5338,149 @@ static struct shell_cmd_impl threads_impl = {
 };
 nk_register_shell_cmd(threads_impl);
 
+#if NAUT_CONFIG_LOAD_BALANCE
+static int
+handle_loads (char * buf, void * priv)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int cpu;
+    rt_scheduler *s;
+
+    // load is in hundredths of a runnable thread
+    for (cpu=0;cpu<sys->num_cpus;cpu++) { 
+        s = sys->cpus[cpu]->sched_state;
+        nk_vc_printf("%d: load %lu queued %lu pulls %lu pushes %lu\n", cpu,
+                     s->load_avg*100/LOAD_ONE, SIZE_APERIODIC(s), s->lb_pulls, s->lb_pushes);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl loads_impl = {
+    .cmd      = "loads",
+    .help_str = "loads",
+    .handler  = handle_loads,
+};
+nk_register_shell_cmd(loads_impl);
+#endif
+
+//
+// wakelat cpu [count]
+//
+// Wakes a thread sleeping on cpu (which should otherwise be idle)
+// count times from this cpu, and reports how long it took from the
+// wakeup to the thread running, along with how many timer interrupts
+// cpu took meanwhile
+//
+struct wakelat_state {
+    nk_wait_queue_t   *waitq;
+    volatile uint64_t  posted;   // cycle count of the wakeup, 0 if none
+    volatile int       done;
+    uint64_t           count, sum, min, max;
+};
+
+static int wakelat_posted(void *state)
+{
+    return ((struct wakelat_state *)state)->posted != 0;
+}
+
+static void wakelat_sleeper(void *in, void **out)
+{
+    struct wakelat_state *w = (struct wakelat_state *)in;
+    uint64_t lat;
+
+    while (1) {
+	nk_wait_queue_sleep_extended(w->waitq, wakelat_posted, w);
+	if (w->done) {
+	    return;
+	}
+	lat = rdtsc() - w->posted;
+	w->count++;
+	w->sum += lat;
+	w->min = MIN(w->min,lat);
+	w->max = MAX(w->max,lat);
+	w->posted = 0;
+    }
+}
+
+static int
+handle_wakelat (char * buf, void * priv)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct wakelat_state w;
+    nk_thread_id_t tid;
+    uint64_t count = 1000, i, timers;
+    int cpu;
+#if NAUT_CONFIG_IDLE_MWAIT
+    uint64_t waits, elided;
+#endif
+
+    if (sscanf(buf, "wakelat %d %lu", &cpu, &count) < 1 ||
+	cpu < 0 || cpu >= sys->num_cpus || cpu == my_cpu_id() || !count) {
+	nk_vc_printf("Don't understand %s\n", buf);
+	return 0;
+    }
+
+    memset(&w,0,sizeof(w));
+    w.min = -1ULL;
+
+    if (!(w.waitq = nk_wait_queue_create("wakelat"))) {
+	nk_vc_printf("Cannot create wait queue\n");
+	return 0;
+    }
+
+    if (nk_thread_start(wakelat_sleeper, &w, 0, 0, TSTACK_DEFAULT, &tid, cpu)) {
+	nk_vc_printf("Cannot start sleeper on cpu %d\n", cpu);
+	nk_wait_queue_destroy(w.waitq);
+	return 0;
+    }
+
+    timers = sys->cpus[cpu]->apic->timer_count;
+#if NAUT_CONFIG_IDLE_MWAIT
+    waits = sys->cpus[cpu]->sched_state->idle_waits;
+    elided = sys->cpus[cpu]->sched_state->kicks_elided;
+#endif
+
+    for (i=0;i<count;i++) {
+	// give the sleeper time to go back to sleep, and cpu to go idle
+	udelay(1000);
+	w.posted = rdtsc();
+	nk_wait_queue_wake_all(w.waitq);
+	while (w.posted) {
+	    nk_yield();
+	}
+    }
+
+    timers = sys->cpus[cpu]->apic->timer_count - timers;
+#if NAUT_CONFIG_IDLE_MWAIT
+    waits = sys->cpus[cpu]->sched_state->idle_waits - waits;
+    elided = sys->cpus[cpu]->sched_state->kicks_elided - elided;
+#endif
+
+    w.done = 1;
+    w.posted = rdtsc();
+    nk_wait_queue_wake_all(w.waitq);
+    nk_join(tid,0);
+    nk_wait_queue_destroy(w.waitq);
+
+    nk_vc_printf("cpu %d: %lu wakeups, latency avg %lu min %lu max %lu cycles (avg %lu ns)\n",
+		 cpu, w.count, w.sum/w.count, w.min, w.max,
+		 apic_cycles_to_realtime(sys->cpus[cpu]->apic, w.sum/w.count));
+    nk_vc_printf("cpu %d: %lu timer interrupts\n", cpu, timers);
+#if NAUT_CONFIG_IDLE_MWAIT
+    nk_vc_printf("cpu %d: %lu idle waits in mwait, %lu kicks without IPIs\n", cpu, waits, elided);
+#endif
+
+    return 0;
+}
+
+static struct shell_cmd_impl wakelat_impl = {
+    .cmd      = "wakelat",
+    .help_str = "wakelat cpu [count]",
+    .handler  = handle_wakelat,
+};
+nk_register_shell_cmd(wakelat_impl);
+
 static int
 handle_reap (char * buf, void * priv)
 {
@@ -4607,7 +5575,7 @@ burner (void * in, void ** out)
         dur = end - start;
         //	nk_vc_printf("%s (tid %llu) start=%llu, end=%llu left=%llu\n",a->name,get_cur_thread()->tid, start, end,a->size_ns);
         if (dur >= a->size_ns) { 
-            nk_vc_printf("%s (tid %llu) done - exiting\n",a->name,get_cur_thread()->tid);
+            nk_vc_printf("%s (tid %llu) done on cpu %d - exiting\n",a->name,get_cur_thread()->tid,my_cpu_id());
             free(in);
             return;
         } else {
@@ -4648,6 +5616,53 @@ launch_aperiodic_burner (char * name,
     }
 }
 
+#if NAUT_CONFIG_LOAD_BALANCE
+// start count aperiodic burners all on the given cpu, but not bound
+// to it, so the load balancer can spread them out
+static int 
+launch_imbalanced_burners (char * name, 
+                           uint64_t size_ns, 
+                           uint32_t tpr, 
+                           uint64_t priority,
+                           uint64_t count,
+                           int cpu)
+{
+    nk_thread_id_t tid;
+    struct burner_args *a;
+    uint64_t i;
+
+    for (i=0;i<count;i++) { 
+        a = malloc(sizeof(struct burner_args));
+
+        if (!a) { 
+            return -1;
+        }
+
+        snprintf(a->name,SHELL_MAX_CMD,"%s-%lu",name,i);
+
+        a->vc                                   = get_cur_thread()->vc;
+        a->size_ns                              = size_ns;
+        a->constraints.type                     = APERIODIC;
+        a->constraints.interrupt_priority_class = (uint8_t) tpr;
+        a->constraints.aperiodic.priority       = priority;
+
+        if (nk_thread_create(burner, (void*)a, NULL, 1, PAGE_SIZE_4KB, &tid, cpu)) { 
+            free(a);
+            return -1;
+        }
+
+        // placed on cpu, but free to move
+        ((nk_thread_t*)tid)->bound_cpu = -1;
+
+        if (nk_thread_run(tid)) { 
+            return -1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
 static int 
 launch_sporadic_burner (char * name, 
                         uint64_t size_ns, 
@@ -4735,6 +5750,22 @@ handle_burn (char * buf, void * priv)
         return 0;
     }
 
+#if NAUT_CONFIG_LOAD_BALANCE
+    uint64_t count;
+    int cpu;
+
+    if (sscanf(buf, "burn m %s %llu %u %llu %llu %d", name, &size_ns, &tpr, &priority, &count, &cpu) == 6) { 
+        if (cpu<0 || cpu>=nk_get_num_cpus()) { 
+            nk_vc_printf("No cpu %d\n", cpu);
+            return 0;
+        }
+        nk_vc_printf("Starting %llu aperiodic burners %s on cpu %d with tpr %u, size %llu ms and priority %llu\n", count, name, cpu, tpr, size_ns, priority);
+        size_ns *= 1000000;
+        launch_imbalanced_burners(name,size_ns,tpr,priority,count,cpu);
+        return 0;
+    }
+#endif
+
     if (sscanf(buf,"burn s %s %llu %u %llu %llu %llu %llu", name, &size_ns, &tpr, &phase, &size, &deadline, &priority) == 7) { 
 
         nk_vc_printf("Starting sporadic burner %s with size %llu ms tpr %u phase %llu from now size %llu ms deadline %llu ms from now and priority %lu\n",name,size_ns,tpr,phase,size,deadline,priority);
@@ -4782,7 +5813,11 @@ static struct shell_cmd_impl burn_impl = {
     .cmd      = "burn",
     .help_str = "burn a name size_ms tpr priority\n" 
                 "  burn s name size_ms tpr phase size deadline priority\n" 
-                "  burn p name size_ms tpr phase period slice",
+                "  burn p name size_ms tpr phase period slice"
+#if NAUT_CONFIG_LOAD_BALANCE
+                "\n  burn m name size_ms tpr priority count cpu"
+#endif
+    ,
     .handler  = handle_burn,
 };
 nk_register_shell_cmd(burn_impl);
@@ -274,12 +274,22 @@ static int xcall_handler(excp_entry_t * e, excp_vec_t v, void *state);
 static int
 smp_xcall_init_queue (struct cpu * core)
 {
-    core->xcall_q = nk_queue_create();
-    if (!core->xcall_q) {
-        ERROR_PRINT("Could not allocate xcall queue on cpu %u\n", core->id);
+    struct nk_xcall_ring * r = malloc(sizeof(struct nk_xcall_ring));
+    uint64_t i;
+
+    if (!r) {
+        ERROR_PRINT("Could not allocate xcall ring on cpu %u\n", core->id);
         return -1;
     }
 
+    memset(r, 0, sizeof(*r));
+
+    for (i = 0; i < NK_XCALL_RING_SIZE; i++) {
+        r->slot[i].seq = i;
+    }
+
+    core->xcall_ring = r;
+
     return 0;
 }
 
@@ -456,76 +466,179 @@ nk_get_num_cpus (void)
     return sys->num_cpus;
 }
 
+/*
+ * The xcall ring is a bounded multi-producer queue (after Vyukov).
+ * Each slot's sequence number says whether it is free for the
+ * producer claiming position seq, or filled for the consumer at
+ * position seq-1.  Producers and consumers claim positions with a
+ * CAS on tail and head respectively, so several cpus can post
+ * at once, and a cpu can drain its own ring from a nested context.
+ */
+static int
+xcall_ring_put (struct nk_xcall_ring * r, 
+                nk_xcall_func_t fun, 
+                void * data, 
+                volatile uint64_t * done)
+{
+    struct nk_xcall * x;
+    uint64_t pos = r->tail;
+    sint64_t diff;
+
+    while (1) {
+        x = &r->slot[pos & (NK_XCALL_RING_SIZE-1)];
+        diff = (sint64_t)(x->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&r->tail, pos, pos+1)) {
+                break;
+            }
+            pos = r->tail;
+        } else if (diff < 0) {
+            // full
+            return -1;
+        } else {
+            pos = r->tail;
+        }
+    }
+
+    x->fun  = fun;
+    x->data = data;
+    x->done = done;
+    __sync_synchronize();
+    x->seq  = pos + 1;
+
+    return 0;
+}
+
+
+static int
+xcall_ring_get (struct nk_xcall_ring * r, 
+                nk_xcall_func_t * fun, 
+                void ** data, 
+                volatile uint64_t ** done)
+{
+    struct nk_xcall * x;
+    uint64_t pos = r->head;
+    sint64_t diff;
+
+    while (1) {
+        x = &r->slot[pos & (NK_XCALL_RING_SIZE-1)];
+        diff = (sint64_t)(x->seq - (pos+1));
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&r->head, pos, pos+1)) {
+                break;
+            }
+            pos = r->head;
+        } else if (diff < 0) {
+            // empty
+            return 0;
+        } else {
+            pos = r->head;
+        }
+    }
+
+    *fun  = x->fun;
+    *data = x->data;
+    *done = x->done;
+    __sync_synchronize();
+    x->seq = pos + NK_XCALL_RING_SIZE;
+
+    return 1;
+}
+
+
+// run everything on the ring - interrupts must be off
 static void
-init_xcall (struct nk_xcall * x, void * arg, nk_xcall_func_t fun, int wait)
+xcall_drain (struct nk_xcall_ring * r)
 {
-    x->data       = arg;
-    x->fun        = fun;
-    x->xcall_done = 0;
-    x->has_waiter = wait;
+    nk_xcall_func_t fun;
+    void * data;
+    volatile uint64_t * done;
+
+    // anything posted after this will send a new IPI
+    r->kicked = 0;
+    __sync_synchronize();
+
+    while (xcall_ring_get(r, &fun, &data, &done)) {
+        fun(data);
+        if (done) {
+            __sync_fetch_and_add(done, 1);
+        }
+    }
 }
 
 
-static inline void
-wait_xcall (struct nk_xcall * x)
+// run any xcalls pending for this cpu, so that two cpus
+// waiting on each other cannot deadlock
+static void
+xcall_poll (void)
 {
+    uint8_t flags = irq_disable_save();
+    struct nk_xcall_ring * r = per_cpu_get(xcall_ring);
 
-    while (atomic_cmpswap(x->xcall_done, 1, 0) != 1) {
-        asm volatile ("pause");
+    if (r && r->head != r->tail) {
+        xcall_drain(r);
     }
+
+    irq_enable_restore(flags);
 }
 
 
 static inline void
-mark_xcall_done (struct nk_xcall * x) 
+wait_xcall (volatile uint64_t * done, uint64_t count)
 {
-    atomic_cmpswap(x->xcall_done, 0, 1);
+    while (*done < count) {
+        xcall_poll();
+        asm volatile ("pause");
+    }
 }
 
 
+// queue an xcall for a remote cpu
+// returns 1 if the caller must send it an IPI, 0 if not, -1 on error
 static int
-xcall_handler (excp_entry_t * e, excp_vec_t v, void *state) 
+post_xcall (cpu_id_t cpu_id, 
+            nk_xcall_func_t fun, 
+            void * arg, 
+            volatile uint64_t * done)
 {
-    nk_queue_t * xcq = per_cpu_get(xcall_q); 
-    struct nk_xcall * x = NULL;
-    nk_queue_entry_t * elm = NULL;
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_xcall_ring * r = sys->cpus[cpu_id]->xcall_ring;
 
-    if (!xcq) {
-        ERROR_PRINT("Badness: no xcall queue on core %u\n", my_cpu_id());
-        goto out_err;
+    if (!r) {
+        ERROR_PRINT("Attempt by cpu %u to initiate xcall on invalid xcall ring (for cpu %u)\n", 
+                    my_cpu_id(),
+                    cpu_id);
+        return -1;
     }
 
-    elm = nk_dequeue_first_atomic(xcq);
-    x = container_of(elm, struct nk_xcall, xcall_node);
-    if (!x) {
-        ERROR_PRINT("No XCALL request found on core %u\n", my_cpu_id());
-        goto out_err;
+    while (xcall_ring_put(r, fun, arg, done)) {
+        // full, so the target is busy - perhaps waiting on us
+        xcall_poll();
+        asm volatile ("pause");
     }
 
-    if (x->fun) {
+    // the IPI already in flight will pick this up
+    return !__sync_lock_test_and_set(&r->kicked, 1);
+}
 
-        // we ack the IPI before calling the handler funciton,
-        // because it may end up blocking (e.g. core barrier)
-        IRQ_HANDLER_END(); 
 
-        x->fun(x->data);
+static int
+xcall_handler (excp_entry_t * e, excp_vec_t v, void *state) 
+{
+    struct nk_xcall_ring * r = per_cpu_get(xcall_ring);
 
-        /* we need to notify the waiter we're done */
-        if (x->has_waiter) {
-            mark_xcall_done(x);
-        }
+    // we ack the IPI before calling the handler functions,
+    // because they may end up blocking (e.g. core barrier)
+    IRQ_HANDLER_END(); 
 
-    } else {
-        ERROR_PRINT("No XCALL function found on core %u\n", my_cpu_id());
-        goto out_err;
+    if (!r) {
+        ERROR_PRINT("Badness: no xcall ring on core %u\n", my_cpu_id());
+        return -1;
     }
 
+    xcall_drain(r);
 
     return 0;
-
-out_err:
-    IRQ_HANDLER_END();
-    return -1;
 }
 
 
@@ -548,13 +661,11 @@ smp_xcall (cpu_id_t cpu_id,
            uint8_t wait)
 {
     struct sys_info * sys = per_cpu_get(system);
-    nk_queue_t * xcq  = NULL;
-    struct nk_xcall x;
     uint8_t flags;
 
     SMP_DEBUG("Initiating SMP XCALL from core %u to core %u\n", my_cpu_id(), cpu_id);
 
-    if (cpu_id > nk_get_num_cpus()) {
+    if (cpu_id >= nk_get_num_cpus()) {
         ERROR_PRINT("Attempt to execute xcall on invalid cpu (%u)\n", cpu_id);
         return -1;
     }
@@ -566,43 +677,139 @@ smp_xcall (cpu_id_t cpu_id,
         irq_enable_restore(flags);
 
     } else {
-        struct nk_xcall * xc = &x;
+        volatile uint64_t done = 0;
+        int ipi;
 
-        if (!wait) {
-            xc = &(sys->cpus[cpu_id]->xcall_nowait_info);
-        }
+        flags = irq_disable_save();
 
-        init_xcall(xc, arg, fun, wait);
+        ipi = post_xcall(cpu_id, fun, arg, wait ? &done : 0);
 
-        xcq = sys->cpus[cpu_id]->xcall_q;
-        if (!xcq) {
-            ERROR_PRINT("Attempt by cpu %u to initiate xcall on invalid xcall queue (for cpu %u)\n", 
-                        my_cpu_id(),
-                        cpu_id);
-            return -1;
+        if (ipi > 0) {
+            apic_ipi(per_cpu_get(apic), sys->cpus[cpu_id]->apic->id, IPI_VEC_XCALL);
         }
 
-        flags = irq_disable_save();
+        irq_enable_restore(flags);
 
-        if (!nk_queue_empty_atomic(xcq)) {
-            ERROR_PRINT("XCALL queue for core %u is not empty, bailing\n", cpu_id);
-            irq_enable_restore(flags);
+        if (ipi < 0) {
             return -1;
         }
 
-        nk_enqueue_entry_atomic(xcq, &(xc->xcall_node));
+        if (wait) {
+            wait_xcall(&done, 1);
+        }
 
-        irq_enable_restore(flags);
+    }
+
+    return 0;
+}
 
-        struct apic_dev * apic = per_cpu_get(apic);
 
-        apic_ipi(apic, sys->cpus[cpu_id]->apic->id, IPI_VEC_XCALL);
+// mask==0 means every cpu other than us
+static int
+xcall_many (nk_cpu_mask_t * mask, 
+            nk_xcall_func_t fun,
+            void * arg,
+            uint8_t wait)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct apic_dev * apic;
+    volatile uint64_t done = 0;
+    uint64_t posted = 0;
+    cpu_id_t i, me, num_cpus = nk_get_num_cpus();
+    int all_others = 1;
+    int need_bcast = 0;
+    int self = 0;
+    int ipi, rc = 0;
+    uint8_t flags;
 
-        if (wait) {
-            wait_xcall(xc);
+    flags = irq_disable_save();
+
+    me = my_cpu_id();
+    apic = per_cpu_get(apic);
+
+    if (mask) {
+        for (i = 0; i < num_cpus; i++) {
+            if (i != me && !nk_cpu_mask_test(mask, i)) {
+                all_others = 0;
+                break;
+            }
         }
+        self = nk_cpu_mask_test(mask, me);
+    }
 
+    for (i = 0; i < num_cpus; i++) {
+        if (i == me || (mask && !nk_cpu_mask_test(mask, i))) {
+            continue;
+        }
+        ipi = post_xcall(i, fun, arg, wait ? &done : 0);
+        if (ipi < 0) {
+            rc = -1;
+            continue;
+        }
+        posted++;
+        if (ipi) {
+            if (all_others) {
+                // one shorthand IPI covers everyone after the loop
+                need_bcast = 1;
+            } else {
+                apic_ipi(apic, sys->cpus[i]->apic->id, IPI_VEC_XCALL);
+            }
+        }
     }
 
-    return 0;
+    if (need_bcast) {
+        apic_bcast_ipi(apic, IPI_VEC_XCALL);
+    }
+
+    // others run concurrently with our local invocation
+    if (self) {
+        fun(arg);
+    }
+
+    irq_enable_restore(flags);
+
+    if (wait) {
+        wait_xcall(&done, posted);
+    }
+
+    return rc;
+}
+
+
+/*
+ * smp_xcall_mask
+ *
+ * initiate a cross-core call on a set of cpus.  Completion of
+ * all the targets is tracked with a single counter, and when the
+ * set is all other cpus, a single broadcast IPI is sent.
+ *
+ * @mask: the cpus to execute the call on (may include the caller)
+ * @fun: the function to invoke
+ * @arg: the argument to the function
+ * @wait: this function should block until all recievers finish
+ *        executing the function
+ *
+ */
+int
+smp_xcall_mask (nk_cpu_mask_t * mask,
+                nk_xcall_func_t fun,
+                void * arg,
+                uint8_t wait)
+{
+    return xcall_many(mask, fun, arg, wait);
+}
+
+
+/*
+ * smp_xcall_broadcast
+ *
+ * as smp_xcall_mask, on every cpu other than the caller
+ *
+ */
+int
+smp_xcall_broadcast (nk_xcall_func_t fun,
+                     void * arg,
+                     uint8_t wait)
+{
+    return xcall_many(0, fun, arg, wait);
 }
@@ -162,6 +162,7 @@ _nk_thread_init (nk_thread_t * t,
     t->bound_cpu  = bound_cpu;
     t->placement_cpu = placement_cpu;
     t->current_cpu = placement_cpu;
+    t->blk_plug   = 0;
     t->fpu_state_offset = offsetof(struct nk_thread, fpu_state);
 
     INIT_LIST_HEAD(&(t->children));
@@ -320,6 +321,7 @@ nk_thread_create (nk_thread_fun_t fun,
     nk_thread_t * t = NULL;
     int placement_cpu = bound_cpu<0 ? nk_sched_initial_placement() : bound_cpu;
     nk_stack_size_t required_stack_size = stack_size ? stack_size: PAGE_SIZE;
+    int reanimated = 0;
 
     // First try to get a thread from the scheduler's pools
     if ((t=nk_sched_reanimate(required_stack_size,
@@ -329,6 +331,7 @@ nk_thread_create (nk_thread_fun_t fun,
 	// nk_thread_destroy() would otherwise have done
 
 	nk_thread_brain_wipe(t);
+	reanimated = 1;
 
 	
     } else {
@@ -399,6 +402,10 @@ out_err:
 	nk_wait_queue_destroy(t->waitq);
     }
     if (t->sched_state) { 
+	if (reanimated) {
+	    // it is still on the scheduler's global thread list
+	    nk_sched_thread_pre_destroy(t);
+	}
 	nk_sched_thread_state_deinit(t);
     }
 
@@ -689,8 +696,9 @@ static void nk_thread_brain_wipe(nk_thread_t *t)
 
     THREAD_DEBUG("Brain-wiping thread (%p, tid=%lu)\n", (void*)thethread, thethread->tid);
 
-    // no pre-destroy is done as nk_sched_reanimate has already
-    // removed it from the relevant scheduler thread lists/queues
+    // no pre-destroy is done as the thread stays on the scheduler's
+    // global thread list, and nk_sched_reanimate has already
+    // removed it from its dead thread cache
 
     // If we are on any wait list at this point, it is an error
     if (thethread->num_wait) {
@@ -33,6 +33,7 @@
 #include <nautilus/scheduler.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/shell.h>
+#include <dev/apic.h>
 
 #include <stddef.h>
 
@@ -53,15 +54,45 @@ static spinlock_t state_lock;
 #define STATE_TRY_LOCK()  spin_try_lock_irq_save(&state_lock,&_state_lock_flags)
 #define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
 
-// guards list of active timers
-static spinlock_t active_lock;
-#define ACTIVE_LOCK_CONF uint8_t _active_lock_flags
-#define ACTIVE_LOCK() _active_lock_flags = spin_lock_irq_save(&active_lock)
-#define ACTIVE_TRY_LOCK()  spin_try_lock_irq_save(&active_lock,&_active_lock_flags)
-#define ACTIVE_UNLOCK() spin_unlock_irq_restore(&active_lock, _active_lock_flags);
-
 static struct list_head timer_list;
-static struct list_head active_timer_list;
+
+//
+// Active timers live in a hierarchical timing wheel on the cpu
+// that started them, and they expire there.   Level l of a wheel
+// has 64 slots of 64^l ticks each.   A timer is placed at the
+// lowest level whose span covers its remaining time, and as the
+// wheel's current tick crosses a level-l boundary, the slot for
+// the new period is cascaded into the lower levels.   Insertion
+// and cancellation are O(1), and expiry touches only slots that
+// are due.   Per-level bitmaps of non-empty slots let us jump
+// over idle stretches and find the next deadline without
+// looking at individual timers.
+//
+#define WHEEL_GRAN_SHIFT  16   // ~65 us per tick
+#define WHEEL_SLOT_BITS   6
+#define WHEEL_SLOTS       (1ULL<<WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK   (WHEEL_SLOTS-1)
+#define WHEEL_LEVELS      5    // 2^46 ns, ~19.5 hours
+#define WHEEL_SHIFT(l)    ((l)*WHEEL_SLOT_BITS)
+#define WHEEL_SPAN        (1ULL<<WHEEL_SHIFT(WHEEL_LEVELS))
+#define WHEEL_TICK(ns)    ((ns)>>WHEEL_GRAN_SHIFT)
+#define WHEEL_EXPIRING    WHEEL_LEVELS   // level of a timer the handler has taken
+
+struct timer_wheel {
+    spinlock_t        lock;
+    uint64_t          cur;       // timers before this tick have expired
+    volatile uint64_t next_ns;   // no timer expires before this time
+    uint64_t          count;     // active timers
+    uint64_t          bitmap[WHEEL_LEVELS]; // non-empty slots
+    struct list_head  slot[WHEEL_LEVELS][WHEEL_SLOTS];
+} __attribute__((aligned(64)));
+
+static struct timer_wheel wheels[NAUT_CONFIG_MAX_CPUS];
+
+// irqs must be off for all of the following, which keeps us on the
+// same cpu and avoids deadlock with the timer interrupt
+#define WHEEL_LOCK(w)   spin_lock(&(w)->lock)
+#define WHEEL_UNLOCK(w) spin_unlock(&(w)->lock)
 
 static uint64_t count=0;
 
@@ -197,21 +228,241 @@ int nk_timer_reset(nk_timer_t *t,
     return 0;
 }
 
+static void wheel_insert(struct timer_wheel *w, nk_timer_t *t)
+{
+    uint64_t exp = WHEEL_TICK(t->time_ns);
+    uint64_t delta;
+    int level, idx;
+
+    if (exp < w->cur) {
+	// already due, handle at the current tick
+	exp = w->cur;
+    }
+
+    delta = exp - w->cur;
+
+    if (delta >= WHEEL_SPAN) {
+	// beyond the wheel, so park it at the far end - when it
+	// cascades down, it will be reinserted
+	delta = WHEEL_SPAN - 1;
+	exp = w->cur + delta;
+    }
+
+    for (level=0; level<WHEEL_LEVELS-1; level++) {
+	if (delta < (1ULL<<WHEEL_SHIFT(level+1))) {
+	    break;
+	}
+    }
+
+    idx = (exp >> WHEEL_SHIFT(level)) & WHEEL_SLOT_MASK;
+
+    t->wheel_level = level;
+    t->wheel_slot = idx;
+    list_add_tail(&t->active_node, &w->slot[level][idx]);
+    w->bitmap[level] |= 1ULL<<idx;
+}
+
+static void wheel_remove(struct timer_wheel *w, nk_timer_t *t)
+{
+    list_del_init(&t->active_node);
+    if (t->wheel_level == WHEEL_EXPIRING) {
+	return;
+    }
+    w->count--;
+    if (list_empty(&w->slot[t->wheel_level][t->wheel_slot])) {
+	w->bitmap[t->wheel_level] &= ~(1ULL<<t->wheel_slot);
+    }
+}
+
+// move the timers in the level's slot for the current period down
+static void wheel_cascade(struct timer_wheel *w, int level)
+{
+    int idx = (w->cur >> WHEEL_SHIFT(level)) & WHEEL_SLOT_MASK;
+    struct list_head todo;
+    nk_timer_t *cur, *temp;
+
+    if (!(w->bitmap[level] & (1ULL<<idx))) {
+	return;
+    }
+
+    INIT_LIST_HEAD(&todo);
+    list_splice_init(&w->slot[level][idx],&todo);
+    w->bitmap[level] &= ~(1ULL<<idx);
+
+    list_for_each_entry_safe(cur, temp, &todo, active_node) {
+	list_del_init(&cur->active_node);
+	wheel_insert(w,cur);
+    }
+}
+
+// the first tick after the current one at which some slot needs
+// attention, or -1 if the wheel is empty (the current level 0 slot
+// is not considered)
+static uint64_t wheel_next_tick(struct timer_wheel *w)
+{
+    uint64_t best = -1;
+    uint64_t bits, above, pos, unit, tick;
+    int level;
+
+    for (level=0; level<WHEEL_LEVELS; level++) {
+	bits = w->bitmap[level];
+	if (!bits) {
+	    continue;
+	}
+	pos = (w->cur >> WHEEL_SHIFT(level)) & WHEEL_SLOT_MASK;
+	above = pos==WHEEL_SLOT_MASK ? 0 : bits & (~0ULL << (pos+1));
+	unit = (w->cur >> WHEEL_SHIFT(level)) & ~WHEEL_SLOT_MASK;
+	if (above) {
+	    unit += __builtin_ctzl(above);
+	} else {
+	    // slots at or before pos belong to the next revolution
+	    unit += WHEEL_SLOTS + __builtin_ctzl(bits);
+	}
+	tick = unit << WHEEL_SHIFT(level);
+	if (tick < best) {
+	    best = tick;
+	}
+    }
+
+    return best;
+}
+
+// pull expired timers out of the current level 0 slot
+static void wheel_expire_slot(struct timer_wheel *w, uint64_t now, struct list_head *expired)
+{
+    int idx = w->cur & WHEEL_SLOT_MASK;
+    struct list_head todo;
+    nk_timer_t *cur, *temp;
+
+    if (!(w->bitmap[0] & (1ULL<<idx))) {
+	return;
+    }
+
+    INIT_LIST_HEAD(&todo);
+    list_splice_init(&w->slot[0][idx],&todo);
+    w->bitmap[0] &= ~(1ULL<<idx);
+
+    list_for_each_entry_safe(cur, temp, &todo, active_node) {
+	list_del_init(&cur->active_node);
+	if (now >= cur->time_ns) {
+	    // stays active until the handler takes it off the
+	    // expired list, so it cannot be restarted under us
+	    cur->wheel_level = WHEEL_EXPIRING;
+	    w->count--;
+	    list_add_tail(&cur->active_node, expired);
+	} else {
+	    // later in this tick, or parked beyond the wheel's span
+	    wheel_insert(w,cur);
+	}
+    }
+}
+
+// bring the wheel up to now, collecting expired timers
+static void wheel_advance(struct timer_wheel *w, uint64_t now, struct list_head *expired)
+{
+    uint64_t target = WHEEL_TICK(now);
+    uint64_t next;
+    int level;
+
+    while (1) {
+	wheel_expire_slot(w, now, expired);
+
+	if (w->cur >= target) {
+	    break;
+	}
+
+	// skip ticks where nothing happens
+	next = wheel_next_tick(w);
+	if (next > target) {
+	    next = target;
+	}
+	w->cur = next;
+
+	for (level=1;
+	     level<WHEEL_LEVELS && !(w->cur & ((1ULL<<WHEEL_SHIFT(level))-1));
+	     level++) {
+	    wheel_cascade(w,level);
+	}
+    }
+}
+
+// earliest time at which the wheel needs attention
+static uint64_t wheel_deadline(struct timer_wheel *w)
+{
+    int idx = w->cur & WHEEL_SLOT_MASK;
+    uint64_t next = -1;
+    uint64_t tick;
+    nk_timer_t *cur;
+
+    if (w->bitmap[0] & (1ULL<<idx)) {
+	list_for_each_entry(cur, &w->slot[0][idx], active_node) {
+	    if (cur->time_ns < next) {
+		next = cur->time_ns;
+	    }
+	}
+    }
+
+    tick = wheel_next_tick(w);
+
+    if (tick != -1ULL && (tick << WHEEL_GRAN_SHIFT) < next) {
+	next = tick << WHEEL_GRAN_SHIFT;
+    }
+
+    return next;
+}
+
+// pull the local timer interrupt in if it is set later than "when"
+static void wheel_kick(uint64_t when)
+{
+    struct apic_dev *apic = per_cpu_get(apic);
+    uint64_t now;
+
+    if (!apic || !apic->timer_set || !apic->ps_per_tick || in_interrupt_context()) {
+	// the timer interrupt is not yet running, or we are
+	// in it, and it will recompute the deadline on its way out
+	return;
+    }
+
+    now = nk_sched_get_realtime();
+
+    apic_update_oneshot_timer_ns(apic,
+				 when > now ? when-now : 0,
+				 IF_EARLIER);
+}
+
 int nk_timer_start(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    struct timer_wheel *w;
+    uint8_t flags;
     int was_active=0;
-    
-    ACTIVE_LOCK();
+    int kick=0;
+
+    flags = irq_disable_save();
+
+    w = &wheels[my_cpu_id()];
+
+    WHEEL_LOCK(w);
     if (t->state == NK_TIMER_ACTIVE) {
 	// do not add it again if it's already been started...
 	was_active = 1;
     } else {
 	t->state = NK_TIMER_ACTIVE;
-	list_add_tail(&t->active_node, &active_timer_list);
+	t->wheel_cpu = my_cpu_id();
+	wheel_insert(w,t);
+	w->count++;
+	if (t->time_ns < w->next_ns) {
+	    w->next_ns = t->time_ns;
+	    kick = 1;
+	}
 	was_active = 0;
     }
-    ACTIVE_UNLOCK();
+    WHEEL_UNLOCK(w);
+
+    if (kick) {
+	wheel_kick(t->time_ns);
+    }
+
+    irq_enable_restore(flags);
 
     if (was_active) { 
 	ERROR("Weird:  started already active timer %s\n",t->name);
@@ -224,17 +475,30 @@ int nk_timer_start(nk_timer_t *t)
 
 int nk_timer_cancel(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    struct timer_wheel *w;
+    uint8_t flags;
     int was_active=0;
 
-    ACTIVE_LOCK();
-    // we may not be active - only delete if we are
-    if (t->state == NK_TIMER_ACTIVE) { 
-	list_del_init(&t->active_node);
-	was_active=1;
+    flags = irq_disable_save();
+    while (1) {
+	w = &wheels[t->wheel_cpu];
+	WHEEL_LOCK(w);
+	if (t->state == NK_TIMER_ACTIVE && w != &wheels[t->wheel_cpu]) {
+	    // restarted elsewhere while we were looking
+	    WHEEL_UNLOCK(w);
+	    continue;
+	}
+	// we may not be active - only delete if we are
+	if (t->state == NK_TIMER_ACTIVE) { 
+	    wheel_remove(w,t);
+	    was_active=1;
+	}
+	t->state = was_active ? NK_TIMER_SIGNALLED : NK_TIMER_INACTIVE;
+	WHEEL_UNLOCK(w);
+	break;
     }
-    t->state = was_active ? NK_TIMER_SIGNALLED : NK_TIMER_INACTIVE;
-    ACTIVE_UNLOCK();
+    irq_enable_restore(flags);
+
     // now do handling that does not require the lock
     if (was_active) { 
 	DEBUG("canceling %s\n",t->name);
@@ -255,6 +519,11 @@ int nk_timer_cancel(nk_timer_t *t)
     }
 }
 
+uint64_t nk_timer_next_deadline(void)
+{
+    return wheels[my_cpu_id()].next_ns;
+}
+
 static int check(void *state)
 {
     nk_timer_t *t = state;
@@ -343,8 +612,7 @@ int nk_sleep(uint64_t ns) { return _sleep(ns,0); }
 int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 
 //
-// Currently, the timer handler only makes sense on cpu 0
-//
+// Every cpu runs the handler against its own wheel
 //
 // Note that debug output here is often a bad idea since
 // timers are used in places for efficient debug output
@@ -353,39 +621,33 @@ int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 uint64_t nk_timer_handler (void)
 {
     uint32_t my_cpu = my_cpu_id();
-    
-    if (my_cpu!=0) {
-	//DEBUG("update: cpu %d - ignored/infinity\n",my_cpu);
-	return -1;  // infinitely far in the future
-    }
-
-    ACTIVE_LOCK_CONF;
-    nk_timer_t *cur, *temp;
+    struct timer_wheel *w = &wheels[my_cpu];
+    nk_timer_t *cur;
     uint64_t now = nk_sched_get_realtime();
-    uint64_t earliest = -1;
+    uint64_t earliest;
     struct list_head expired_list;
     INIT_LIST_HEAD(&expired_list);
 
-    ACTIVE_LOCK();
-    
-    // first, find expired timers with lock held
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("considering %s\n",cur->name);
-	if (now >= cur->time_ns) { 
-	    //DEBUG("found expired timer %s\n",cur->name);
-	    cur->state = NK_TIMER_SIGNALLED;
-	    list_del_init(&cur->active_node);
-	    list_add_tail(&cur->active_node, &expired_list);
-	}
-	    
-    }
-    ACTIVE_UNLOCK();
+    // we are called with interrupts off
+    WHEEL_LOCK(w);
+    wheel_advance(w, now, &expired_list);
+    WHEEL_UNLOCK(w);
 
     // now handle expired timers without holding the lock
     // so that callbacks/etc can restart the timer if desired
-    list_for_each_entry_safe(cur, temp, &expired_list, active_node) {
-	//DEBUG("handle expired timer %s\n",cur->name);
+    // a concurrent cancel may take a timer off the list first
+    while (1) {
+	WHEEL_LOCK(w);
+	if (list_empty(&expired_list)) {
+	    WHEEL_UNLOCK(w);
+	    break;
+	}
+	cur = list_first_entry(&expired_list, nk_timer_t, active_node);
 	list_del_init(&cur->active_node);
+	cur->state = NK_TIMER_SIGNALLED;
+	WHEEL_UNLOCK(w);
+
+	//DEBUG("handle expired timer %s\n",cur->name);
 	
 	if (cur->flags & NK_TIMER_WAIT_ONE) {
 	    
@@ -399,43 +661,33 @@ uint64_t nk_timer_handler (void)
 	    
 	} else if (cur->flags & NK_TIMER_CALLBACK) {
 	    
-	    uint32_t cur_cpu, min_cpu, max_cpu;
 	    int wait = !!(cur->flags & NK_TIMER_CALLBACK_WAIT);
 	    
 	    if (cur->cpu == NK_TIMER_CALLBACK_ALL_CPUS) {
-		min_cpu = 0;
-		max_cpu = nk_get_num_cpus() - 1;
+		// everyone else at once, then us
+		smp_xcall_broadcast(cur->callback,
+				    cur->priv,
+				    wait);
+		cur->callback(cur->priv);
+	    } else if ((cur->cpu == my_cpu) && (cur->flags & NK_TIMER_CALLBACK_LOCAL_SYNC)) {
+		cur->callback(cur->priv);
 	    } else {
-		min_cpu = cur->cpu;
-		max_cpu = cur->cpu;
-	    }
-	    
-	    for (cur_cpu=min_cpu; cur_cpu<= max_cpu; cur_cpu++) {
-		
-		if ((cur_cpu == my_cpu) && (cur->flags & NK_TIMER_CALLBACK_LOCAL_SYNC)) {
-		    cur->callback(cur->priv);
-		} else {
-		    smp_xcall(cur_cpu,
-			      cur->callback,
-			      cur->priv,
-			      wait);
-		}
+		smp_xcall(cur->cpu,
+			  cur->callback,
+			  cur->priv,
+			  wait);
 	    }
 	} else {
 	    //ERROR("unsupported 0x%lx\n", cur->flags);
 	}
     }
 
-    // Now we need to scan for the earliest given that the callbacks
+    // Now find the earliest given that the callbacks
     // may have started new timers, with lock held
-    ACTIVE_LOCK();
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("check timer %s\n",cur->name);
-	if (cur->time_ns < earliest) { 
-	    earliest = cur->time_ns;
-	}
-    }
-    ACTIVE_UNLOCK();
+    WHEEL_LOCK(w);
+    earliest = wheel_deadline(w);
+    w->next_ns = earliest;
+    WHEEL_UNLOCK(w);
 
     //DEBUG("update: earliest is %llu\n",earliest);
 
@@ -447,10 +699,24 @@ uint64_t nk_timer_handler (void)
 
 int nk_timer_init()
 {
+    int i, l, j;
+
     spinlock_init(&state_lock);
-    spinlock_init(&active_lock);
     INIT_LIST_HEAD(&timer_list);
-    INIT_LIST_HEAD(&active_timer_list);
+
+    for (i=0;i<NAUT_CONFIG_MAX_CPUS;i++) {
+	struct timer_wheel *w = &wheels[i];
+	spinlock_init(&w->lock);
+	w->cur = 0;
+	w->next_ns = -1;
+	w->count = 0;
+	for (l=0;l<WHEEL_LEVELS;l++) {
+	    w->bitmap[l] = 0;
+	    for (j=0;j<WHEEL_SLOTS;j++) {
+		INIT_LIST_HEAD(&w->slot[l][j]);
+	    }
+	}
+    }
 
     INFO("Timers inited\n");
     return 0;
@@ -467,6 +733,7 @@ void nk_timer_dump_timers()
 {
     struct list_head *cur;
     nk_timer_t *t=0;
+    int i;
 
     STATE_LOCK_CONF;
     
@@ -488,6 +755,11 @@ void nk_timer_dump_timers()
 		     t->time_ns, t->flags, t->cpu, t->callback);
     }
     STATE_UNLOCK();
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	nk_vc_printf("cpu %d: %lu active, tick %lu, next %luns\n",
+		     i, wheels[i].count, wheels[i].cur, wheels[i].next_ns);
+    }
 }
 
 static int
@@ -24,12 +24,26 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/rwlock.h>
 #include <nautilus/netdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/vc.h>
 #include <net/ethernet/ethernet_packet.h>
 #include <net/ethernet/ethernet_agent.h>
 
-// right now this is a trivial implementation that just has a single pool
-// in the future, this could expand to a per-cpu pool
+// Received frames are matched to agent devices first through a hash
+// table of ethertypes, then by trying the custom filters in order.
+// With NAUT_CONFIG_NET_ETHERNET_AGENT_RSS, the receive completion
+// only hashes the flow and queues the frame for a per-cpu thread,
+// which does the matching and delivery.  Frames of one flow stay in
+// order on one cpu, and different flows are spread across cpus.
+//
+// The ethertype table and filter list change only when devices are
+// registered, so matching reads them under a reader-biased lock, and
+// each receive queue keeps its own demux counters.  Readers run with
+// preemption off, and writers with interrupts off, so that a reader
+// in interrupt context never waits on a writer it has interrupted.
 
 
 #define MAX_AGENT_NAME 32
@@ -37,6 +51,13 @@
 // number of received packets that match to store
 #define MAX_DEV_RECEIVE_QUEUE 64
 
+// buckets in the ethertype table (power of two)
+#define TYPE_HASH_SIZE 64
+#define TYPE_HASH(t) (((t) ^ ((t)>>8)) & (TYPE_HASH_SIZE-1))
+
+// received packets a per-cpu receive queue may hold
+#define MAX_RX_QUEUE 512
+
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_AGENT
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...) 
@@ -54,10 +75,22 @@
 #define AGENT_LOCK(a) _agent_lock_flags = spin_lock_irq_save(&a->lock)
 #define AGENT_UNLOCK(a) spin_unlock_irq_restore(&a->lock, _agent_lock_flags)
 
+#define DEVS_READ_LOCK_CONF int _devs_ticket
+#define DEVS_READ_LOCK(a) preempt_disable(); _devs_ticket = nk_brwlock_rd_lock(&a->devs_lock)
+#define DEVS_READ_UNLOCK(a) nk_brwlock_rd_unlock(&a->devs_lock, _devs_ticket); preempt_enable()
+
+#define DEVS_WRITE_LOCK_CONF uint8_t _devs_lock_flags
+#define DEVS_WRITE_LOCK(a) _devs_lock_flags = irq_disable_save(); preempt_disable(); nk_brwlock_wr_lock(&a->devs_lock)
+#define DEVS_WRITE_UNLOCK(a) nk_brwlock_wr_unlock(&a->devs_lock); preempt_enable(); irq_enable_restore(_devs_lock_flags)
+
 #define DEV_LOCK_CONF uint8_t _dev_lock_flags
 #define DEV_LOCK(d) _dev_lock_flags = spin_lock_irq_save(&d->lock)
 #define DEV_UNLOCK(d) spin_unlock_irq_restore(&d->lock, _dev_lock_flags)
 
+#define RXQ_LOCK_CONF uint8_t _rxq_lock_flags
+#define RXQ_LOCK(q) _rxq_lock_flags = spin_lock_irq_save(&q->lock)
+#define RXQ_UNLOCK(q) spin_unlock_irq_restore(&q->lock, _rxq_lock_flags)
+
 #define OP_FREE_LIST_LOCK_CONF uint8_t _op_free_list_lock_flags
 #define OP_FREE_LIST_LOCK() _op_free_list_lock_flags = spin_lock_irq_save(&op_free_list_lock)
 #define OP_FREE_LIST_UNLOCK() spin_unlock_irq_restore(&op_free_list_lock, _op_free_list_lock_flags)
@@ -65,15 +98,26 @@
 
 
 
+struct demux_stats {
+    uint64_t           packets;
+    uint64_t           cycles;
+    uint64_t           misses;
+};
+
 struct nk_net_ethernet_agent {
     spinlock_t         lock;
     struct list_head   node; // for agent list
 
-    enum { STOPPED=0, RUNNING} state;
+    enum { STOPPED=0, STARTING, RUNNING} state;
 
     char               name[MAX_AGENT_NAME];
     struct nk_net_dev *netdev;
 
+    // protects type_hash and dev_list
+    nk_brwlock_t       devs_lock;
+    // devices registered for a single ethertype, newest first in each bucket
+    struct list_head   type_hash[TYPE_HASH_SIZE];
+    // devices with custom filters, newest first, tried when no type matches
     struct list_head   dev_list;
 
     uint64_t           send_queue_size;
@@ -83,9 +127,32 @@ struct nk_net_ethernet_agent {
     uint64_t           send_queue_num;
     uint64_t           recv_queue_num;
 
-    // eventually this will have a hash table for faster match by type
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+    // one per cpu, created when the agent is first started
+    uint64_t           num_rxq;
+    struct rx_queue    *rxq;
+#endif
+
+    // for frames matched in the receive completion itself
+    struct demux_stats demux;
 };
 
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+struct rx_queue {
+    spinlock_t                    lock;
+    struct list_head              packets;
+    uint64_t                      count;
+    nk_wait_queue_t              *wait;
+    struct nk_net_ethernet_agent *agent;
+    volatile int                  stop;     // only if start fails
+    volatile int                  exited;
+
+    uint64_t                      handled;
+    uint64_t                      dropped;
+    struct demux_stats            demux;    // only touched by the thread
+} __attribute__((aligned(64)));
+#endif
+
 static spinlock_t       agent_list_lock;
 static struct list_head agent_list;
 
@@ -163,6 +230,7 @@ struct nk_net_ethernet_agent_net_dev {
     struct nk_net_ethernet_agent *agent;
     struct list_head            devnode; // within the agent
 
+    uint16_t                    type;    // for devices in the type table
     int                         (*filter)(nk_ethernet_packet_t *packet, void *state);
     void                        *filter_state;
 };
@@ -170,6 +238,7 @@ struct nk_net_ethernet_agent_net_dev {
 struct nk_net_ethernet_agent *nk_net_ethernet_agent_create(struct nk_net_dev *dev, char *name, uint64_t send_queue_size, uint64_t receive_queue_size)
 {
     AGENT_LIST_LOCK_CONF;
+    uint64_t i;
 
     if (!dev) {
 	ERROR("Cannot find net device with name %s\n",name);
@@ -185,10 +254,19 @@ struct nk_net_ethernet_agent *nk_net_ethernet_agent_create(struct nk_net_dev *de
 
     memset(a,0,sizeof(*a));
 
+    if (nk_brwlock_init(&a->devs_lock)) {
+	ERROR("Cannot initialize device lock\n");
+	free(a);
+	return 0;
+    }
+
     spinlock_init(&a->lock);
     strncpy(a->name,name,MAX_AGENT_NAME); a->name[MAX_AGENT_NAME-1]=0;
     a->netdev = dev;
 
+    for (i=0;i<TYPE_HASH_SIZE;i++) {
+	INIT_LIST_HEAD(&a->type_hash[i]);
+    }
     INIT_LIST_HEAD(&a->dev_list);
     a->send_queue_size = send_queue_size;
     a->recv_queue_size = receive_queue_size;
@@ -214,9 +292,10 @@ struct nk_net_ethernet_agent *nk_net_ethernet_agent_find(char *name)
     AGENT_LIST_LOCK();
     list_for_each(cur,&agent_list) {
 	a = list_entry(cur,struct nk_net_ethernet_agent,node);
-	if (a) {
+	if (!strncmp(a->name,name,MAX_AGENT_NAME)) {
 	    break;
 	}
+	a = 0;
     }
     AGENT_LIST_UNLOCK();
 
@@ -228,29 +307,51 @@ struct nk_net_ethernet_agent *nk_net_ethernet_agent_find(char *name)
 static void recv_callback(nk_net_dev_status_t status, void *state);
 
 
+// receive buffers are handed to the NIC in bursts of up to this many
+#define RECV_BURST 32
+
+// and only once this many are missing, so that each refill is a burst
+#define RECV_REFILL(a) ((a)->recv_queue_size/4 ? (a)->recv_queue_size/4 : 1)
+
 // called with agent lock held
 static void queue_receives(struct nk_net_ethernet_agent *a)
 {
+    struct nk_net_dev_burst b[RECV_BURST];
+    uint64_t want, n, i;
+    int posted;
+
     while (a->recv_queue_num < a->recv_queue_size) {
-	nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
-	if (!p) {
-	    ERROR("Starting agent with fewer receives queued than desired\n");
-	    break;
+	want = a->recv_queue_size - a->recv_queue_num;
+	if (want > RECV_BURST) {
+	    want = RECV_BURST;
 	}
 
-	p->metadata = a;
+	for (n=0;n<want;n++) {
+	    nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
+	    if (!p) {
+		break;
+	    }
+	    p->metadata = a;
+	    b[n].buf = p->raw;
+	    b[n].len = MAX_ETHERNET_PACKET_LEN;
+	    b[n].callback = recv_callback;
+	    b[n].context = p;
+	}
 
-	if (nk_net_dev_receive_packet(a->netdev,
-				      p->raw,
-				      MAX_ETHERNET_PACKET_LEN,
-				      NK_DEV_REQ_CALLBACK,
-				      recv_callback,
-				      p)) {
-	    ERROR("Failed to queue receive - agent started with fewer receives queued than desired..\n");
-	    nk_net_ethernet_release_packet(p);
+	posted = n ? nk_net_dev_receive_burst(a->netdev,b,n) : 0;
+	if (posted < 0) {
+	    posted = 0;
+	}
+
+	__sync_fetch_and_add(&a->recv_queue_num,posted);
+
+	for (i=posted;i<n;i++) {
+	    nk_net_ethernet_release_packet((nk_ethernet_packet_t *)b[i].context);
+	}
+
+	if (posted < want) {
+	    ERROR("Failed to queue receives - agent has fewer receives queued than desired..\n");
 	    break;
-	} else {
-	    a->recv_queue_num++;
 	}
     }
 }
@@ -262,11 +363,19 @@ static int type_filter(nk_ethernet_packet_t *p, void *state)
     return ntohs(p->header.type)==type;
 }
 
-// assumes agent is locked
+// assumes agent's devices are read-locked
 static struct nk_net_ethernet_agent_net_dev *match_device(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p)
 {
     struct list_head *cur=0;
     struct nk_net_ethernet_agent_net_dev *d;
+    uint16_t type = ntohs(p->header.type);
+
+    list_for_each(cur,&a->type_hash[TYPE_HASH(type)]) {
+	d = list_entry(cur,struct nk_net_ethernet_agent_net_dev, devnode);
+	if (d->type==type) {
+	    return d;
+	}
+    }
 
     list_for_each(cur,&a->dev_list) {
 	d = list_entry(cur,struct nk_net_ethernet_agent_net_dev, devnode);
@@ -275,7 +384,6 @@ static struct nk_net_ethernet_agent_net_dev *match_device(struct nk_net_ethernet
 	}
     }
     return 0;
-
 }
 
 static int complete_receive(struct nk_net_ethernet_agent_net_dev *d, nk_ethernet_packet_t *p)
@@ -327,6 +435,192 @@ static int complete_receive(struct nk_net_ethernet_agent_net_dev *d, nk_ethernet
     }
 }
 
+// match a received packet to a device and hand it over, counting
+// in stats, which is the caller's own, or, if null, the agent's
+static void dispatch(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p, struct demux_stats *stats)
+{
+    struct nk_net_ethernet_agent_net_dev *d = 0;
+    uint64_t start, cycles;
+    DEVS_READ_LOCK_CONF;
+
+    if (a->state==RUNNING) {
+	start = rdtsc();
+	DEVS_READ_LOCK(a);
+	d = match_device(a,p);
+	DEVS_READ_UNLOCK(a);
+	cycles = rdtsc() - start;
+	if (stats) {
+	    stats->cycles += cycles;
+	    stats->packets++;
+	    stats->misses += !d;
+	} else {
+	    __sync_fetch_and_add(&a->demux.cycles,cycles);
+	    __sync_fetch_and_add(&a->demux.packets,1);
+	    __sync_fetch_and_add(&a->demux.misses,!d);
+	}
+    }
+
+    if (!d) {
+	// no device found or we are not running, so just discard packet
+	DEBUG("dropping packet of type 0x%x\n",ntohs(p->header.type));
+	nk_net_ethernet_release_packet(p);
+    } else {
+	DEBUG("matched packet of type 0x%x to device %s\n",ntohs(p->header.type),d->netdev->dev.name);
+	if (complete_receive(d,p)) {
+	    DEBUG("Failed to complete receive on matched packet... dropping packet\n");
+	}
+	// up to receiver to release packet when they are done wit it
+    }
+}
+
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+// RSS-style hash of the addresses, protocol and ports of an IPv4
+// packet, or just of the ethertype for anything else
+static uint32_t flow_hash(nk_ethernet_packet_t *p)
+{
+    uint16_t type = ntohs(p->header.type);
+    uint8_t *ip = p->data;
+    uint32_t h = type;
+
+    if (type==0x0800 && (ip[0]>>4)==4) {
+	uint32_t ihl = (ip[0] & 0xf)*4;
+	uint8_t proto = ip[9];
+	h = *(uint32_t*)(ip+12);
+	h = h*0x9e3779b1 ^ *(uint32_t*)(ip+16);
+	h = h*0x9e3779b1 ^ proto;
+	// ports, unless this is a later fragment
+	if ((proto==0x06 || proto==0x11) && ihl>=20 && !(ntohs(*(uint16_t*)(ip+6)) & 0x1fff)) {
+	    h = h*0x9e3779b1 ^ *(uint32_t*)(ip+ihl);
+	}
+    }
+
+    h *= 0x9e3779b1;
+    return h ^ (h>>16);
+}
+
+static int rx_queue_ready(void *state)
+{
+    struct rx_queue *q = (struct rx_queue *)state;
+
+    return q->count>0 || q->stop;
+}
+
+static void rx_thread(void *in, void **out)
+{
+    struct rx_queue *q = (struct rx_queue *)in;
+    struct list_head batch, *cur, *tmp;
+    RXQ_LOCK_CONF;
+
+    INIT_LIST_HEAD(&batch);
+
+    while (1) {
+	nk_wait_queue_sleep_extended(q->wait, rx_queue_ready, q);
+
+	if (q->stop) {
+	    break;
+	}
+
+	RXQ_LOCK(q);
+	list_splice_init(&q->packets,&batch);
+	q->count = 0;
+	RXQ_UNLOCK(q);
+
+	list_for_each_safe(cur,tmp,&batch) {
+	    nk_ethernet_packet_t *p = list_entry(cur,nk_ethernet_packet_t,node);
+	    list_del_init(cur);
+	    dispatch(q->agent,p,&q->demux);
+	    q->handled++;
+	}
+    }
+
+    // we are off the wait queue, and this is our last touch of q
+    __sync_synchronize();
+    q->exited = 1;
+}
+
+// queue the packet for the cpu that handles its flow
+static void steer(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p)
+{
+    struct rx_queue *q = &a->rxq[flow_hash(p) % a->num_rxq];
+    uint64_t count;
+    RXQ_LOCK_CONF;
+
+    RXQ_LOCK(q);
+    count = q->count;
+    if (count < MAX_RX_QUEUE) {
+	list_add_tail(&p->node,&q->packets);
+	q->count++;
+    }
+    RXQ_UNLOCK(q);
+
+    if (count >= MAX_RX_QUEUE) {
+	DEBUG("receive queue full - dropping packet\n");
+	__sync_fetch_and_add(&q->dropped,1);
+	nk_net_ethernet_release_packet(p);
+    } else if (!count) {
+	// the thread only sleeps once it sees an empty queue
+	nk_wait_queue_wake_all(q->wait);
+    }
+}
+
+// Builds the receive queues and their threads, which the caller
+// publishes in the agent.  On failure, nothing is left behind.
+static int start_rx_threads(struct nk_net_ethernet_agent *a, struct rx_queue **rxq_out, uint64_t *num_out)
+{
+    char name[32];
+    nk_thread_id_t tid;
+    struct rx_queue *rxq;
+    uint64_t num = nk_get_num_cpus();
+    uint64_t i, j;
+
+    if (!(rxq = malloc(sizeof(struct rx_queue)*num))) {
+	ERROR("Cannot allocate receive queues\n");
+	return -1;
+    }
+
+    memset(rxq,0,sizeof(struct rx_queue)*num);
+
+    for (i=0;i<num;i++) {
+	struct rx_queue *q = &rxq[i];
+	spinlock_init(&q->lock);
+	INIT_LIST_HEAD(&q->packets);
+	q->agent = a;
+	snprintf(name,32,"%s-rx%lu",a->name,i);
+	if (!(q->wait = nk_wait_queue_create(name))) {
+	    ERROR("Cannot create wait queue for receive queue %lu\n",i);
+	    goto out_bad;
+	}
+	if (nk_thread_start(rx_thread,q,0,1,TSTACK_DEFAULT,&tid,i)) {
+	    ERROR("Cannot start receive thread for cpu %lu\n",i);
+	    nk_wait_queue_destroy(q->wait);
+	    goto out_bad;
+	}
+	nk_thread_name(tid,name);
+    }
+
+    *rxq_out = rxq;
+    *num_out = num;
+
+    return 0;
+
+ out_bad:
+    // stop the threads we started, and wait for them to leave their
+    // queues before tearing those down
+    for (j=0;j<i;j++) {
+	rxq[j].stop = 1;
+	nk_wait_queue_wake_all(rxq[j].wait);
+    }
+    for (j=0;j<i;j++) {
+	while (!rxq[j].exited) {
+	    nk_yield();
+	}
+	nk_wait_queue_destroy(rxq[j].wait);
+    }
+    free(rxq);
+    return -1;
+}
+#endif
+
 // A receive callback is generic for all ethernet packets since
 // we need to demux them to the caller.   Hence receives are handed
 // the packet that was just received with its metadata being the
@@ -336,41 +630,32 @@ static void recv_callback(nk_net_dev_status_t status,
 {
     nk_ethernet_packet_t *p = (nk_ethernet_packet_t*)state;
     struct nk_net_ethernet_agent *a = (struct nk_net_ethernet_agent *) p->metadata;
-    struct nk_net_ethernet_agent_net_dev *d = 0;
+    uint64_t num;
     AGENT_LOCK_CONF;
     
     if (status!=NK_NET_DEV_STATUS_SUCCESS) {
 	// uhoh
 	ERROR("Receive failure for packet %p\n", p);
+	nk_net_ethernet_release_packet(p);
     } else {
-
-	AGENT_LOCK(a);
-	if (a->state==RUNNING) {
-	    d = match_device(a,p);
-	} else {
-	    d = 0;
-	}
-	AGENT_UNLOCK(a);
-
-	if (!d) {
-	    // no device found or we are not running, so just discard packet
-	    DEBUG("dropping packet of type 0x%x\n",ntohs(p->header.type));
-	    nk_net_ethernet_release_packet(p);
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+	if (a->rxq) {
+	    steer(a,p);
 	} else {
-	    DEBUG("matched packet of type 0x%x to device %s\n",ntohs(p->header.type),d->netdev->dev.name);
-	    if (complete_receive(d,p)) {
-		DEBUG("Failed to complete receive on matched packet... dropping packet\n");
-	    }
-	    // up to receiver to release packet when they are done wit it
+	    dispatch(a,p,0);
 	}
+#else
+	dispatch(a,p,0);
+#endif
     }
 
-
-    // and queue more receives
-    AGENT_LOCK(a);
-    a->recv_queue_num--;
-    queue_receives(a);
-    AGENT_UNLOCK(a);
+    // and queue more receives once enough are missing
+    num = __sync_sub_and_fetch(&a->recv_queue_num,1);
+    if (a->recv_queue_size - num >= RECV_REFILL(a)) {
+	AGENT_LOCK(a);
+	queue_receives(a);
+	AGENT_UNLOCK(a);
+    }
 }
 
 // Sends are multiplexed before this, so a send callback is handed the original op 
@@ -385,7 +670,10 @@ static void send_callback(nk_net_dev_status_t status,
     // The network op is not in any list at this point
 
     if (o->interface==BUFFER) {
-	nk_net_ethernet_release_packet(p);
+	if (p) {
+	    // gathered sends that went straight to the device have no packet
+	    nk_net_ethernet_release_packet(p);
+	}
 	if (o->callback) {
 	    o->callback(status,o->context);
 	}
@@ -398,6 +686,8 @@ static void send_callback(nk_net_dev_status_t status,
 	    nk_net_ethernet_release_packet(p);
 	}
     }
+
+    free_op(o);
 }
 
 
@@ -426,6 +716,7 @@ static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (
 
     o->interface = BUFFER;
     o->type = recv ? RECEIVE : SEND;
+    o->dev = d;
     o->buf = buf;
     o->len = len;
     o->packet = 0;
@@ -483,6 +774,62 @@ static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callbac
 }
 
 
+// Gathered sends go straight through to the device if it can gather,
+// otherwise we assemble the packet here
+static int post_send_sg(void *state, struct nk_net_dev_sg *sg, uint64_t count, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    struct nk_net_ethernet_agent_net_dev *d =  (struct nk_net_ethernet_agent_net_dev *) state;
+    void *dev_state = d->agent->netdev->dev.state;
+    struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) d->agent->netdev->dev.interface;
+    struct netdev_op *o = alloc_op();
+    uint64_t i, len;
+
+    if (!o) {
+	return -1;
+    }
+
+    o->interface = BUFFER;
+    o->type = SEND;
+    o->dev = d;
+    o->buf = 0;
+    o->len = 0;
+    o->packet = 0;
+    o->callback=callback;
+    o->callback_packet=0;
+    o->context = context;
+
+    if (dev_int->post_send_sg) {
+	if (dev_int->post_send_sg(dev_state, sg, count, send_callback, o)) {
+	    free_op(o);
+	    return -1;
+	}
+	return 0;
+    }
+
+    for (i=0, len=0; i<count; i++) {
+	len += sg[i].len;
+    }
+
+    if (len > MAX_ETHERNET_PACKET_LEN || !(o->packet = nk_net_ethernet_alloc_packet(-1))) {
+	free_op(o);
+	return -1;
+    }
+
+    for (i=0, len=0; i<count; i++) {
+	memcpy(o->packet->raw+len,sg[i].addr,sg[i].len);
+	len += sg[i].len;
+    }
+    o->packet->len = len;
+
+    if (dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o)) {
+	nk_net_ethernet_release_packet(o->packet);
+	free_op(o);
+	return -1;
+    }
+
+    return 0;
+}
+
 static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packet, void (*callback)(nk_net_dev_status_t status, nk_ethernet_packet_t *packet, void *context), void *context, int recv)
 {
     DEV_LOCK_CONF;
@@ -496,6 +843,7 @@ static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packe
 
     o->interface = PACKET;
     o->type = recv ? RECEIVE : SEND;
+    o->dev = d;
     o->buf = 0;
     o->len = 0;
     o->packet = recv ? 0 : packet;
@@ -563,7 +911,8 @@ static struct nk_net_ethernet_agent_net_dev_int ops = {
     .netdev_int = {
 	.get_characteristics = get_characteristics,
 	.post_receive = post_receive,
-	.post_send = post_send
+	.post_send = post_send,
+	.post_send_sg = post_send_sg
     },
     .post_receive_packet = post_receive_packet,
     .post_send_packet = post_send_packet
@@ -573,7 +922,7 @@ static struct nk_net_ethernet_agent_net_dev_int ops = {
 
 struct nk_net_dev *nk_net_ethernet_agent_register_filter(struct nk_net_ethernet_agent *agent, int (*filter)(nk_ethernet_packet_t *packet, void *state), void *state)
 {
-    AGENT_LOCK_CONF;
+    DEVS_WRITE_LOCK_CONF;
     char name[DEV_NAME_LEN];
 
     struct nk_net_ethernet_agent_net_dev *d = malloc(sizeof(*d));
@@ -608,9 +957,14 @@ struct nk_net_dev *nk_net_ethernet_agent_register_filter(struct nk_net_ethernet_
 	return 0;
     }
     
-    AGENT_LOCK(agent);
-    list_add(&d->devnode,&agent->dev_list);
-    AGENT_UNLOCK(agent);
+    DEVS_WRITE_LOCK(agent);
+    if (filter==type_filter) {
+	d->type = (uint16_t)(uint64_t)state;
+	list_add(&d->devnode,&agent->type_hash[TYPE_HASH(d->type)]);
+    } else {
+	list_add(&d->devnode,&agent->dev_list);
+    }
+    DEVS_WRITE_UNLOCK(agent);
 
     return d->netdev;
 
@@ -625,14 +979,14 @@ struct nk_net_dev *nk_net_ethernet_agent_register_type(struct nk_net_ethernet_ag
 
 int                nk_net_ethernet_agent_unregister(struct nk_net_dev *dev)
 {
-    AGENT_LOCK_CONF;
+    DEVS_WRITE_LOCK_CONF;
 
     struct nk_net_ethernet_agent_net_dev *netdev = dev->dev.state;
     struct nk_net_ethernet_agent *agent = netdev->agent;
 
-    AGENT_LOCK(agent);
+    DEVS_WRITE_LOCK(agent);
     list_del_init(&netdev->devnode);
-    AGENT_UNLOCK(agent);
+    DEVS_WRITE_UNLOCK(agent);
 
     // now we have exclusive access to this device (no lock needed)
     // so clear out the queues
@@ -656,12 +1010,13 @@ int                nk_net_ethernet_agent_unregister(struct nk_net_dev *dev)
 	free(op);
     }
 
+    // this frees dev
     if (nk_net_dev_unregister(netdev->netdev)) {
 	ERROR("Failed to unregister underlying netdev\n");
-	free(dev);
+	free(netdev);
 	return -1;
     } else {
-	free(dev);
+	free(netdev);
 	return 0;
     }
 }
@@ -845,6 +1200,31 @@ int nk_net_ethernet_agent_start(struct nk_net_ethernet_agent *a)
 	return -1;
     }
 
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+    if (!a->rxq) {
+	struct rx_queue *rxq;
+	uint64_t num;
+	int rc;
+
+	// the threads cannot be created with the lock held, so
+	// hold off other starts and stops meanwhile
+	a->state=STARTING;
+	AGENT_UNLOCK(a);
+	rc = start_rx_threads(a,&rxq,&num);
+	AGENT_LOCK(a);
+	if (rc) {
+	    ERROR("Failed to start receive threads\n");
+	    a->state=STOPPED;
+	    AGENT_UNLOCK(a);
+	    return -1;
+	}
+	// steer() may see the queues as soon as rxq is set
+	a->num_rxq = num;
+	__sync_synchronize();
+	a->rxq = rxq;
+    }
+#endif
+
     queue_receives(a);
 
     a->state=RUNNING;
@@ -878,6 +1258,43 @@ struct nk_net_dev *nk_net_ethernet_agent_get_underlying_device(struct nk_net_eth
     return agent->netdev;
 }
 
+struct nk_net_dev *nk_net_ethernet_agent_match(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p)
+{
+    struct nk_net_ethernet_agent_net_dev *d;
+    DEVS_READ_LOCK_CONF;
+
+    DEVS_READ_LOCK(a);
+    d = match_device(a,p);
+    DEVS_READ_UNLOCK(a);
+
+    return d ? d->netdev : 0;
+}
+
+void nk_net_ethernet_agent_dump_stats(struct nk_net_ethernet_agent *a)
+{
+    struct demux_stats s = a->demux;
+
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+    uint64_t i;
+    for (i=0;a->rxq && i<a->num_rxq;i++) {
+	s.packets += a->rxq[i].demux.packets;
+	s.cycles += a->rxq[i].demux.cycles;
+	s.misses += a->rxq[i].demux.misses;
+    }
+#endif
+
+    nk_vc_printf("agent %s: %lu packets demuxed (%lu unmatched), %lu cycles per demux\n",
+		 a->name, s.packets, s.misses, s.packets ? s.cycles/s.packets : 0);
+    nk_vc_printf("agent %s: %lu of %lu receives posted\n",
+		 a->name, a->recv_queue_num, a->recv_queue_size);
+#ifdef NAUT_CONFIG_NET_ETHERNET_AGENT_RSS
+    for (i=0;a->rxq && i<a->num_rxq;i++) {
+	nk_vc_printf("  cpu %lu: %lu handled, %lu queued, %lu dropped, %lu demuxed\n",
+		     i, a->rxq[i].handled, a->rxq[i].count, a->rxq[i].dropped, a->rxq[i].demux.packets);
+    }
+#endif
+}
+
 int  nk_net_ethernet_agent_init()
 {
     uint64_t i;
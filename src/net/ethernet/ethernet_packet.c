@@ -24,21 +24,28 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/percpu.h>
+#include <nautilus/vc.h>
 #include <nautilus/netdev.h>
 #include <net/ethernet/ethernet_packet.h>
 
-// right now this is a trivial implementation that just has a single pool
-// in the future, this could expand to a per-cpu pool
+// Packets are kept in per-cpu caches that need no lock, only
+// interrupts off, since receive completions allocate and release
+// from interrupt context.  A cache that runs dry takes a batch of
+// packets from a shared depot, and a cache that overflows gives
+// its coldest batch back, so the depot lock is taken once per
+// CACHE_BATCH packets.  New packets are allocated in batches from
+// memory local to the requested cpu.
 
 
 // not currently a Kconfig option
 #define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
 
-#define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
+#define CACHE_BATCH  32
+#define CACHE_SIZE   (2*CACHE_BATCH)
 
-#define POOL_INIT_START  (NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE)
-#define POOL_INIT_LOW    (POOL_INIT_START/2)
-#define POOL_INIT_HIGH   (POOL_INIT_LOW*3)
+// beyond this, packets returned to the depot are freed
+#define DEPOT_SIZE   (NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE*8)
 
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_PACKET
 #undef DEBUG_PRINT
@@ -49,69 +56,121 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("ethernet_packet: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("ethernet_packet: " fmt, ##args)
 
-static spinlock_t       lock;
-static struct list_head free_list;
-// the invariant here is that high=2*low
-static uint64_t         free_list_len, free_list_low, free_list_high;
+struct cache {
+    uint64_t              count;
+    nk_ethernet_packet_t *pkts[CACHE_SIZE];   // pkts[count-1] is the hottest
+
+    uint64_t              allocs;
+    uint64_t              releases;
+    uint64_t              depot_gets;
+    uint64_t              depot_puts;
+} __attribute__((aligned(64)));
+
+static struct cache caches[NAUT_CONFIG_MAX_CPUS];
+
+static spinlock_t            depot_lock;
+static uint64_t              depot_len;
+static nk_ethernet_packet_t *depot[DEPOT_SIZE];
 
-// called with lock held
-static void try_grow_if_needed()
+// packets in existence, and how many were ever created and destroyed
+static uint64_t total, grows, shrinks;
+
+
+// called with interrupts off
+static void grow(struct cache *c, int cpu)
 {
-    if (free_list_len<free_list_low) {
-	// We will set a new midpoint at double the old midpoint
-	// and we will double the upper and lower control thresholds
-	uint64_t needed = ((2*free_list_high-2*free_list_low)/2)-free_list_len;
-	uint64_t i;
-
-	for (i=0;i<needed;i++) {
-	    nk_ethernet_packet_t *p = malloc(sizeof(nk_ethernet_packet_t));
-	    if (!p) {
-		break;
-	    }
-	    INIT_LIST_HEAD(&p->node);
-	    list_add_tail(&p->node,&free_list);
-	    p->alloc_cpu = -1;
-	    p->refcount = 0;
-	    free_list_len++;
+    uint64_t i;
+
+    for (i=0;i<CACHE_BATCH && c->count<CACHE_SIZE;i++) {
+	nk_ethernet_packet_t *p = (nk_ethernet_packet_t *)malloc_specific(sizeof(nk_ethernet_packet_t),cpu);
+	if (!p) {
+	    break;
 	}
+	INIT_LIST_HEAD(&p->node);
+	p->alloc_cpu = cpu;
+	p->refcount = 0;
+	c->pkts[c->count++] = p;
+    }
+
+    __sync_fetch_and_add(&total,i);
+    __sync_fetch_and_add(&grows,i);
+
+    DEBUG("grew pool by %lu packets for cpu %d\n",i,cpu);
+}
+
+// called with interrupts off
+static void refill(struct cache *c, int cpu)
+{
+    uint64_t n;
+
+    spin_lock(&depot_lock);
+    n = depot_len < CACHE_BATCH ? depot_len : CACHE_BATCH;
+    depot_len -= n;
+    memcpy(c->pkts,&depot[depot_len],n*sizeof(nk_ethernet_packet_t *));
+    spin_unlock(&depot_lock);
+
+    c->count = n;
 
-	// we may not be able to allocate that many...
-	// i now contains the number we actually allocated, so now update
-	// the control thresholds to match
+    if (n) {
+	c->depot_gets++;
+    } else {
+	grow(c,cpu);
+    }
+}
+
+// give the coldest batch of a full cache to the depot
+// called with interrupts off
+static void flush(struct cache *c)
+{
+    uint64_t n, i;
+
+    spin_lock(&depot_lock);
+    n = DEPOT_SIZE - depot_len;
+    if (n > CACHE_BATCH) {
+	n = CACHE_BATCH;
+    }
+    memcpy(&depot[depot_len],c->pkts,n*sizeof(nk_ethernet_packet_t *));
+    depot_len += n;
+    spin_unlock(&depot_lock);
+
+    if (n) {
+	c->depot_puts++;
+    }
 
-	free_list_low = free_list_len/2;
-	free_list_high = free_list_len*2;
+    // the depot is full, so we already have too many packets
+    for (i=n;i<CACHE_BATCH;i++) {
+	free(c->pkts[i]);
+    }
+    if (n<CACHE_BATCH) {
+	__sync_fetch_and_sub(&total,CACHE_BATCH-n);
+	__sync_fetch_and_add(&shrinks,CACHE_BATCH-n);
     }
+
+    memmove(c->pkts,&c->pkts[CACHE_BATCH],(c->count-CACHE_BATCH)*sizeof(nk_ethernet_packet_t *));
+    c->count -= CACHE_BATCH;
 }
 	
 nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
 {
-    struct list_head *cur=0;
     nk_ethernet_packet_t *p=0;
-    int first=1;
-
- retry:
-    spin_lock(&lock);
-    if (!list_empty(&free_list)) {
-	cur = free_list.next;
-	list_del_init(cur);
-	free_list_len--;
+    struct cache *c;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+
+    c = &caches[my_cpu_id()];
+
+    if (!c->count) {
+	refill(c, cpu<0 ? my_cpu_id() : cpu);
     }
-    try_grow_if_needed();
-    spin_unlock(&lock);
-    
-    if (!cur) {
-	if (first) {
-	    first=0;
-	    goto retry;
-	} else {
-	    ERROR("Failed to grow packet pool?!\n");
-	    p = (nk_ethernet_packet_t *)malloc_specific(sizeof(nk_ethernet_packet_t),cpu);
-	}
-    } else {
-	p = list_entry(cur,nk_ethernet_packet_t, node);
+
+    if (c->count) {
+	p = c->pkts[--c->count];
+	c->allocs++;
     }
 
+    irq_enable_restore(flags);
+
     if (!p) {
 	ERROR("Failed to allocate packet!\n");
 	return p;
@@ -131,57 +190,112 @@ void nk_net_ethernet_acquire_packet(nk_ethernet_packet_t *p)
 
 void nk_net_ethernet_release_packet(nk_ethernet_packet_t *p)
 {
+    struct cache *c;
+    uint8_t flags;
+
     if (__sync_fetch_and_sub(&p->refcount,1)==1) {
 	// the packet is now ready to be freed
-	spin_lock(&lock);
-	if (free_list_len<free_list_high) {
-	    // add it to the front of the list since it's probably all in
-	    // cache now, and so the next allocator will be able to take advantage
-	    list_add(&p->node,&free_list);
-	    free_list_len++;
-	    spin_unlock(&lock);
-	} else {
-	    spin_unlock(&lock);
-	    // just free it - we already have too many packets
-	    free(p);
-	    // we would possibly shrink the pool here...
+	flags = irq_disable_save();
+
+	c = &caches[my_cpu_id()];
+
+	if (c->count==CACHE_SIZE) {
+	    flush(c);
 	}
+
+	// it goes on top since it's probably all in cache now, and so
+	// the next allocator on this cpu will be able to take advantage
+	c->pkts[c->count++] = p;
+	c->releases++;
+
+	irq_enable_restore(flags);
     }
 }
-	
 
+void nk_net_ethernet_packet_get_stats(struct nk_net_ethernet_packet_stats *s)
+{
+    int i;
+
+    memset(s,0,sizeof(*s));
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	s->cached += caches[i].count;
+	s->allocs += caches[i].allocs;
+	s->releases += caches[i].releases;
+	s->depot_gets += caches[i].depot_gets;
+	s->depot_puts += caches[i].depot_puts;
+    }
+
+    s->depot = depot_len;
+    s->total = total;
+    s->grows = grows;
+    s->shrinks = shrinks;
+    s->in_use = s->total > s->cached + s->depot ? s->total - s->cached - s->depot : 0;
+}
 
+void nk_net_ethernet_packet_dump_stats()
+{
+    struct nk_net_ethernet_packet_stats s;
+    int i;
+
+    nk_net_ethernet_packet_get_stats(&s);
+
+    nk_vc_printf("packets: %lu total, %lu in use, %lu in depot, %lu in cpu caches\n",
+		 s.total, s.in_use, s.depot, s.cached);
+    nk_vc_printf("packets: %lu allocs, %lu releases, %lu depot gets, %lu depot puts, %lu created, %lu destroyed\n",
+		 s.allocs, s.releases, s.depot_gets, s.depot_puts, s.grows, s.shrinks);
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	if (caches[i].allocs || caches[i].releases) {
+	    nk_vc_printf("  cpu %d: %lu cached, %lu allocs, %lu releases\n",
+			 i, caches[i].count, caches[i].allocs, caches[i].releases);
+	}
+    }
+}
 
 
 int  nk_net_ethernet_packet_init()
 {
+    struct cache seed;
     uint64_t i;
 
-    spinlock_init(&lock);
-    INIT_LIST_HEAD(&free_list);
+    spinlock_init(&depot_lock);
+    depot_len = 0;
+    memset(caches,0,sizeof(caches));
 
-    free_list_len = 0;
-    free_list_low = POOL_INIT_LOW;
-    free_list_high = POOL_INIT_HIGH;
-
-    try_grow_if_needed();
+    // seed the depot
+    for (i=0;i<NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE;i+=CACHE_BATCH) {
+	seed.count = 0;
+	grow(&seed,-1);
+	memcpy(&depot[depot_len],seed.pkts,seed.count*sizeof(nk_ethernet_packet_t *));
+	depot_len += seed.count;
+	if (seed.count<CACHE_BATCH) {
+	    break;
+	}
+    }
     
-    INFO("inited and seeded with %lu packets of size %lu (low=%lu, high=%lu)\n",free_list_len, MAX_ETHERNET_PACKET_LEN, free_list_low, free_list_high);
+    INFO("inited and seeded with %lu packets of size %lu (cpu cache=%lu, batch=%lu, depot=%lu)\n",depot_len, MAX_ETHERNET_PACKET_LEN, CACHE_SIZE, CACHE_BATCH, DEPOT_SIZE);
 
     return 0;
 }
 
 void nk_net_ethernet_packet_deinit()
 {
-    spin_lock(&lock);
-    struct list_head *cur, *tmp;
+    uint64_t i, j;
 
-    list_for_each_safe(cur,tmp,&free_list) {
-	nk_ethernet_packet_t *p= list_entry(cur,nk_ethernet_packet_t,node);
-	list_del_init(cur);
-	free(p);
+    spin_lock(&depot_lock);
+    for (i=0;i<depot_len;i++) {
+	free(depot[i]);
     }
-    INFO("deinited\n");
-}
+    depot_len = 0;
+    spin_unlock(&depot_lock);
 
+    for (i=0;i<NAUT_CONFIG_MAX_CPUS;i++) {
+	for (j=0;j<caches[i].count;j++) {
+	    free(caches[i].pkts[j]);
+	}
+	caches[i].count = 0;
+    }
 
+    INFO("deinited\n");
+}
@@ -0,0 +1,67 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+/*
+  Throughput test for the stack and the network device underneath it.
+
+  This starts lwiperf, an iperf 2 compatible TCP server, on port 5001.
+  From a peer, for example the host of a QEMU guest using a tap
+  device or user networking with -netdev user,hostfwd=tcp::5001-:5001,
+  run
+
+     iperf -c <guest address> -t 10
+
+  Each completed test is reported on the console.
+*/
+
+#include <nautilus/nautilus.h>
+#include <nautilus/vc.h>
+
+#include "lwip/tcpip.h"
+#include "lwip/apps/lwiperf.h"
+
+static void *session = 0;
+
+static void report(void *arg, enum lwiperf_report_type report_type,
+		   const ip_addr_t* local_addr, u16_t local_port, 
+		   const ip_addr_t* remote_addr, u16_t remote_port,
+		   u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec)
+{
+    nk_vc_printf("iperf: %s %s:%u: %u bytes in %u ms = %u kbit/s\n",
+		 report_type==LWIPERF_TCP_DONE_SERVER ? "done" : "aborted",
+		 ipaddr_ntoa(remote_addr), remote_port,
+		 bytes_transferred, ms_duration, bandwidth_kbitpsec);
+}
+
+void iperf_init()
+{
+    LOCK_TCPIP_CORE();
+    if (!session) {
+	session = lwiperf_start_tcp_server_default(report, 0);
+    }
+    UNLOCK_TCPIP_CORE();
+
+    if (!session) {
+	nk_vc_printf("iperf: failed to start server\n");
+    }
+}
@@ -78,6 +78,18 @@ struct ethernetif {
     char *name;
 };
 
+/**
+ * A received packet as seen by the stack.  The pbuf refers to the
+ * ethernet packet, and the packet is released when the stack frees
+ * the pbuf.
+ */
+struct rx_pbuf {
+    struct pbuf_custom    p;
+    nk_ethernet_packet_t *pk;
+};
+
+LWIP_MEMPOOL_DECLARE(RX_PBUF, ETHERNETIF_RX_PBUFS, sizeof(struct rx_pbuf), "ethernetif RX pbufs");
+
 /* Forward declarations. */
 static void  ethernetif_input(struct netif *netif, nk_ethernet_packet_t *pk);
 
@@ -124,8 +136,7 @@ static void recv_callback(nk_net_dev_status_t status,
 	goto launch_receive;
     }
     //DEBUG("recv callback ipdev: %p\n", ethernetif->device);	
-    ethernetif_input(netif, packet);
-    nk_net_ethernet_release_packet(packet);//realse packet
+    ethernetif_input(netif, packet); // consumes the packet
 
 launch_receive:
 
@@ -157,6 +168,12 @@ low_level_init(struct netif *netif)
 
     snprintf(agent_name,32,"%s-agent-lwip",name);
 
+    static int rx_pool_inited = 0;
+    if (!rx_pool_inited) {
+	LWIP_MEMPOOL_INIT(RX_PBUF);
+	rx_pool_inited = 1;
+    }
+
     //printk("Looking for device named %s which will get agent %s\n", name, agent_name);
     
     netDevice = nk_net_dev_find(name);
@@ -205,6 +222,13 @@ low_level_init(struct netif *netif)
   /* Do whatever else is needed to initialize interface. */
 }
 
+static void
+send_done(nk_net_dev_status_t status, void *context)
+{
+    /* the device is done with the pbuf chain */
+    pbuf_free((struct pbuf *)context);
+}
+
 /**
  * This function should do the actual transmission of the packet. The packet is
  * contained in the pbuf that is passed to the function. This pbuf
@@ -233,23 +257,64 @@ low_level_output(struct netif *netif, struct pbuf *p)
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
-  
-    nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
-    u32_t len = 0;
-    
-  for (q = p; q != NULL; q = q->next) {
-    /* Send the data from the pbuf to the interface, one pbuf at a
-       time. The size of the data in each pbuf is kept in the ->len
-       variable. */
-    //send data from(q->payload, q->len);
-      memcpy(pk->raw+len, q->payload, q->len);
-      len+=q->len;
-  }
-    pk->len = len;
 
-    if(nk_net_ethernet_agent_device_send_packet(ethernetif->device, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
-	ERROR("Fail to send a packet\n");
-    	return ERR_MEM;	
+    struct nk_net_dev_sg sg[NK_NET_DEV_MAX_SG];
+    u32_t n = 0;
+
+    /* Hand the pbuf chain to the device as is.   The device reads the
+       pbufs after we return, so we hold a reference until the send
+       completes.  TCP will not touch a segment while we do. */
+    for (q = p; q != NULL && n < NK_NET_DEV_MAX_SG; q = q->next) {
+	if (q->len) {
+	    sg[n].addr = q->payload;
+	    sg[n].len = q->len;
+	    n++;
+	}
+    }
+
+    if (!q && n) {
+	pbuf_ref(p);
+	if (nk_net_dev_send_packet_sg(ethernetif->device, sg, n, NK_DEV_REQ_CALLBACK, send_done, p)) {
+	    ERROR("Fail to send a packet\n");
+	    pbuf_free(p);
+#if ETH_PAD_SIZE
+	    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+	    return ERR_MEM;
+	}
+    } else {
+	/* too many pieces - copy them into a packet */
+	nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
+	u32_t len = 0;
+
+	if (!pk || p->tot_len > MAX_ETHERNET_PACKET_LEN) {
+	    ERROR("Cannot allocate packet to send\n");
+	    if (pk) {
+		nk_net_ethernet_release_packet(pk);
+	    }
+#if ETH_PAD_SIZE
+	    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+	    return ERR_MEM;
+	}
+
+	for (q = p; q != NULL; q = q->next) {
+	    /* Send the data from the pbuf to the interface, one pbuf at a
+	       time. The size of the data in each pbuf is kept in the ->len
+	       variable. */
+	    memcpy(pk->raw+len, q->payload, q->len);
+	    len+=q->len;
+	}
+	pk->len = len;
+
+	if(nk_net_ethernet_agent_device_send_packet(ethernetif->device, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
+	    ERROR("Fail to send a packet\n");
+	    nk_net_ethernet_release_packet(pk);
+#if ETH_PAD_SIZE
+	    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+	    return ERR_MEM;	
+	}
     }
 
   //signal that packet should be sent();
@@ -272,9 +337,21 @@ low_level_output(struct netif *netif, struct pbuf *p)
   return ERR_OK;
 }
 
+/* called when the stack is done with a received packet */
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  struct rx_pbuf *r = (struct rx_pbuf *)p;
+
+  nk_net_ethernet_release_packet(r->pk);
+  LWIP_MEMPOOL_FREE(RX_PBUF, r);
+}
+
 /**
  * Should allocate a pbuf and transfer the bytes of the incoming
- * packet from the interface into the pbuf.
+ * packet from the interface into the pbuf.  Here the pbuf normally
+ * refers to the packet, which it then owns.  In any case, the packet
+ * is consumed.
  *
  * @param netif the lwip network interface structure for this ethernetif
  * @return a pbuf filled with the received packet (including MAC header)
@@ -292,6 +369,31 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
      variable. */
 
   len = pk->len;
+
+#if !ETH_PAD_SIZE
+  /* Wrap the packet in a pbuf that refers to it.   If we are out of
+     wrappers, we fall back to copying. */
+  struct rx_pbuf *r = (struct rx_pbuf *)LWIP_MEMPOOL_ALLOC(RX_PBUF);
+
+  if (r) {
+    r->p.custom_free_function = rx_pbuf_free;
+    r->pk = pk;
+    p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &r->p, pk->raw, MAX_ETHERNET_PACKET_LEN);
+    if (p) {
+      MIB2_STATS_NETIF_ADD(netif, ifinoctets, p->tot_len);
+      if (((u8_t*)p->payload)[0] & 1) {
+        /* broadcast or multicast packet*/
+        MIB2_STATS_NETIF_INC(netif, ifinnucastpkts);
+      } else {
+        /* unicast packet*/
+        MIB2_STATS_NETIF_INC(netif, ifinucastpkts);
+      }
+      LINK_STATS_INC(link.recv);
+      return p;
+    }
+    LWIP_MEMPOOL_FREE(RX_PBUF, r);
+  }
+#endif
   /*u32_t i;
   DEBUG("\n");
   for (i=0; i<len; i++){
@@ -346,6 +448,7 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
     LINK_STATS_INC(link.recv);
   } else {
     //drop packet();
+    nk_net_ethernet_release_packet(pk);
     LINK_STATS_INC(link.memerr);
     LINK_STATS_INC(link.drop);
     MIB2_STATS_NETIF_INC(netif, ifindiscards);
@@ -24,6 +24,7 @@
 #include <nautilus/shell.h>
 
 #ifdef NAUT_CONFIG_NET_ETHERNET
+#include <net/ethernet/ethernet_packet.h>
 #include <net/ethernet/ethernet_agent.h>
 #include <net/ethernet/ethernet_arp.h>
 #endif
@@ -44,6 +45,11 @@ handle_net (char * buf, void * priv)
     int defaults=0;
 
 #ifdef NAUT_CONFIG_NET_ETHERNET
+    if (!strcasecmp(buf,"net packets")) {
+        nk_net_ethernet_packet_dump_stats();
+        return 0;
+    }
+
     if (sscanf(buf,"net agent create %s %s",agentname, intname)==2) {
         nk_vc_printf("Attempt to create ethernet agent %s for device %s\n",agentname, intname);
         struct nk_net_dev *netdev = nk_net_dev_find(intname);
@@ -83,6 +89,16 @@ handle_net (char * buf, void * priv)
         return 0;
     }
 
+    if (sscanf(buf,"net agent stats %s",agentname)==1) {
+        struct nk_net_ethernet_agent *agent = nk_net_ethernet_agent_find(agentname);
+        if (!agent) {
+            nk_vc_printf("Cannot find agent %s\n", agentname);
+            return 0;
+        }
+        nk_net_ethernet_agent_dump_stats(agent);
+        return 0;
+    }
+
     if (sscanf(buf,"net agent s%s %s",buf,agentname)==2) {
         struct nk_net_ethernet_agent *agent = nk_net_ethernet_agent_find(agentname);
         if (!agent) {
@@ -271,6 +287,15 @@ handle_net (char * buf, void * priv)
     }
 #endif
 
+#ifdef NAUT_CONFIG_NET_LWIP_APP_LWIPERF
+    if (!strcasecmp(buf,"net lwip iperf")) {
+        void iperf_init();
+        nk_vc_printf("Starting iperf server (port 5001)\n");
+        iperf_init();
+        return 0;
+    }
+#endif
+
 #endif
 
     nk_vc_printf("No relevant network functionality is configured or bad command\n");
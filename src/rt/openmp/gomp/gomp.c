@@ -24,6 +24,8 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/smp.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/wsdeque.h>
 #include <rt/openmp/gomp/gomp.h>
 
 
@@ -37,6 +39,21 @@
 #define INFO(fmt, args...) INFO_PRINT("gomp: " fmt, ##args)
 
 
+struct omp_team;
+struct omp_ws;
+
+// an explicit task (GOMP_task) or the implicit task of a team member
+struct omp_task
+{
+    void     (*f)(void *);
+    void     *in;
+    struct omp_task *parent;
+    // one reference for running plus one per live child; an
+    // explicit task is freed when this drops to zero
+    volatile long refs;
+    int       is_explicit;
+};
+
 // this is hanging off the "input" argument
 // for a nautilus thread and it supplies the metadata
 // that would be usually kept in TLS in a pthread implementation
@@ -53,12 +70,37 @@ struct omp_thread
     void     (*f)(void *); // func;
     void     *in;
     int      thread_num;
-    void     *cur_single;
-    struct omp_thread *team_leader;
-    nk_counting_barrier_t team_barrier;
     struct nk_thread  *thread;
+
+    struct omp_team *cur_team;    // team we are currently a member of
+    struct omp_task *cur_task;    // task we are currently running
+    struct omp_task  implicit;    // our implicit task in cur_team
+
+    // worksharing state within cur_team
+    uint64_t  ws_gen;             // worksharing constructs we have entered
+    uint64_t  single_gen;         // single constructs we have encountered
+    struct omp_ws *ws;            // current worksharing construct
+    long      lo, hi;             // current chunk, in normalized iterations
+    long      trip;               // chunks handed to us so far (static)
+    long      ord_cur;            // next iteration of ours to enter ordered
+
+    // everything above here is saved and restored around a
+    // parallel region in which this thread is the master
+
+    nk_wsdeque_t tasks;           // explicit tasks we have queued
 };
 
+#define OMP_SAVED_STATE __builtin_offsetof(struct omp_thread, tasks)
+
+// run-sched-var, used by schedule(runtime) loops
+#define OMP_SCHED_STATIC  1
+#define OMP_SCHED_DYNAMIC 2
+#define OMP_SCHED_GUIDED  3
+#define OMP_SCHED_AUTO    4
+
+static int omp_run_sched = OMP_SCHED_STATIC;
+static int omp_run_chunk = 0;
+
 
 // nesting level for the active parallel blocks, 
 // which enclose the calling call
@@ -236,11 +278,10 @@ omp_proc_bind_t omp_get_proc_bind(void)
 //  chunk_size, is set to the chunk size.
 void omp_get_schedule(omp_sched_t *kind, int *chunk_size)
 {
-    DEBUG("comp_get_schedule()=sched_static?, chunk_size=1?\n");
-    *kind = 0;
-    *chunk_size = 1 ; //?
+    DEBUG("omp_get_schedule()=%d, chunk_size=%d\n", omp_run_sched, omp_run_chunk);
+    *kind = (omp_sched_t)(uint64_t)omp_run_sched;
+    *chunk_size = omp_run_chunk;
 }
-
 // Returns the team number of the calling thread.
 int omp_get_team_num(void)
 {
@@ -287,8 +328,10 @@ int omp_get_thread_num(void)
 //  counterparts.
 int omp_in_parallel(void)
 {
-    DEBUG("omp_in_parallel()=0 UNIMPLEMENTED\n");
-    return 0;
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+    int rc = o && o->cookie==OMP_COOKIE && o->cur_team && o->num_threads_in_team>1;
+    DEBUG("omp_in_parallel()=%d\n",rc);
+    return rc;
 }
 
 
@@ -378,10 +421,11 @@ void omp_set_num_threads(int num_threads)
 // ignored.
 void omp_set_schedule(omp_sched_t kind, int chunk_size)
 {
-    DEBUG("omp_set_schedule(kind=%d, chunk_size=%d) => IGNORED FOR NOW\n", kind, chunk_size);
+    DEBUG("omp_set_schedule(kind=%d, chunk_size=%d)\n", (int)(uint64_t)kind, chunk_size);
+    omp_run_sched = (int)(uint64_t)kind;
+    omp_run_chunk = chunk_size;
 }
 
-
 // Initialize a simple lock. After initialization, the lock is in an
 // unlocked state.
 void omp_init_lock(omp_lock_t *lock)
@@ -529,44 +573,345 @@ double omp_get_wtime(void)
 // https://github.com/rose-compiler/rose-develop/tree/master/src/midend/programTransformation/ompLowering
 //
 
-static void parallel_start_wrapper(void *in, void **out)
+//
+// Teams and the worker pool
+//
+// A parallel region is run by a team.  Member 0 is the thread that
+// encountered the region (the master), and the other members come
+// from a pool of persistent worker threads, one per cpu, which spin
+// briefly and then park on their own wait queue between regions.
+// Forking a team is therefore just handing each worker the team and
+// bumping its generation, and joining is waiting for a count.
+//
+// The pool is used by one team at a time.  Nested regions, and
+// regions started concurrently by unrelated threads, fall back to
+// creating fresh (detached) threads for the team.
+//
+
+// how long an idle worker spins before parking
+#define OMP_SPIN_NS        1000000ULL
+// worksharing constructs that can be in flight at once (nowait)
+#define OMP_WS_SLOTS       8
+
+struct omp_ws
 {
-    struct omp_thread *o = (struct omp_thread *)in;
+    volatile uint64_t gen;        // construct number this slot holds
+    volatile long     left;       // members that have not yet left it
+    long              start;
+    long              incr;
+    long              n;          // iteration count
+    long              chunk;
+    int               sched;
+    int               ordered;
+    volatile long     next;       // next unclaimed iteration (dynamic/guided)
+    volatile long     ord_next;   // next iteration allowed into ordered
+} __attribute__((aligned(64)));
+
+struct omp_team
+{
+    int               nthreads;
+    void              (*f)(void *);
+    void              *in;
+    int               pooled;     // members 1.. are pool workers
+
+    nk_counting_barrier_t barrier;
+    spinlock_t        lock;       // worksharing slot setup
+
+    volatile uint64_t single_gen; // single constructs claimed so far
+    void              *copyprivate;
+
+    volatile long     tasks_outstanding;
+    volatile int      go;         // fallback members may start
+    volatile int      done;       // members other than the master that are done
+
+    char              saved[OMP_SAVED_STATE]; // master's state outside the region
+
+    struct omp_ws     ws[OMP_WS_SLOTS];
+
+    struct omp_thread *spare;     // fallback member state
+    struct omp_thread *members[];
+};
+
+struct omp_worker
+{
+    struct omp_thread  omp;       // must be first
+    int                id;
+    volatile uint64_t  gen;       // bumped for each team we are given
+    volatile int       sleeping;
+    struct omp_team    *team;
+    nk_wait_queue_t    *waitq;
+};
+
+static struct {
+    spinlock_t         lock;
+    int                in_use;
+    int                num_workers;
+    struct omp_worker  **workers;
+} omp_pool;
+
+static spinlock_t gomp_global_lock=0;
+static spinlock_t gomp_atomic_lock=0;
+
+
+static inline struct omp_thread *omp_self()
+{
+    return (struct omp_thread *)(get_cur_thread()->input);
+}
+
+static inline void omp_task_release(struct omp_task *t)
+{
+    if (!__sync_sub_and_fetch(&t->refs,1) && t->is_explicit) {
+	free(t);
+    }
+}
+
+static void omp_task_run(struct omp_thread *o, struct omp_task *t)
+{
+    struct omp_task *prev = o->cur_task;
+    struct omp_team *team = o->cur_team;
+
+    o->cur_task = t;
+    t->f(t->in);
+    o->cur_task = prev;
+
+    if (t->parent) {
+	omp_task_release(t->parent);
+    }
+    omp_task_release(t);
+
+    __sync_fetch_and_sub(&team->tasks_outstanding,1);
+}
+
+// run one queued task of the team, preferring our own
+static int omp_task_run_one(struct omp_thread *o)
+{
+    struct omp_team *team = o->cur_team;
+    struct omp_task *t;
+    int i;
+
+    if (!team->tasks_outstanding) {
+	return 0;
+    }
+
+    t = (struct omp_task *)nk_wsdeque_pop(&o->tasks);
+
+    for (i=1; !t && i<team->nthreads; i++) {
+	struct omp_thread *victim = team->members[(o->thread_num+i) % team->nthreads];
+	t = (struct omp_task *)nk_wsdeque_steal(&victim->tasks);
+    }
+
+    if (t) {
+	omp_task_run(o,t);
+	return 1;
+    }
+
+    return 0;
+}
+
+static void omp_task_drain(struct omp_thread *o)
+{
+    while (o->cur_team->tasks_outstanding) {
+	if (!omp_task_run_one(o)) {
+	    __asm__ __volatile__ ("pause");
+	}
+    }
+}
+
+static void omp_team_barrier(struct omp_thread *o)
+{
+    // all tasks generated so far must complete before anyone leaves
+    omp_task_drain(o);
+    nk_counting_barrier(&o->cur_team->barrier);
+}
+
+static void omp_member_setup(struct omp_team *team, struct omp_thread *o, int num, struct omp_thread *p)
+{
+    o->cookie = OMP_COOKIE;
+    o->team = p->team;
+    if (o!=p) {
+	o->max_threads_in_team = p->max_threads_in_team;
+    }
+    o->num_threads_in_team = team->nthreads;
+    o->num_threads_in_level = team->nthreads;
+    o->thread_num_in_team = num;
+    o->thread_num = num;
+    o->level = p->level+1;
+    o->f = team->f;
+
+    o->cur_team = team;
+    memset(&o->implicit,0,sizeof(o->implicit));
+    o->implicit.refs = 1;
+    o->cur_task = &o->implicit;
+
+    o->ws_gen = 0;
+    o->single_gen = 0;
+    o->ws = 0;
+
+    team->members[num] = o;
+}
+
+// body of a team member other than the master
+static void omp_member_run(struct omp_thread *o)
+{
+    struct omp_team *team = o->cur_team;
+
+    DEBUG("Launch - team=%p, thread_num=%d, level=%d, f=%p, in=%p, thread=%p\n", team, o->thread_num, o->level, team->f, team->in, o->thread);
+
+    team->f(team->in);
+
+    DEBUG("Finish - team=%p, thread_num=%d\n", team, o->thread_num);
+
+    omp_task_drain(o);
+
+    o->cur_team = 0;
+
+    // the team may be freed as soon as this is visible
+    __sync_fetch_and_add(&team->done,1);
+}
+
+static int omp_worker_ready(void *state)
+{
+    struct omp_worker *w = (struct omp_worker *)state;
+    return w->team != 0;
+}
+
+static void omp_worker(void *in, void **out)
+{
+    struct omp_worker *w = (struct omp_worker *)in;
     char buf[32];
 
-    o->thread = get_cur_thread();
-    
-    o->thread->vc = o->thread->parent->vc;
+    snprintf(buf,32,"omp-worker-%d",w->id);
+    nk_thread_name(get_cur_thread(),buf);
 
-    snprintf(buf,32,"omp-%d-%d-%d",o->team,o->level,o->thread_num_in_team);
+    while (1) {
+	uint64_t start = nk_sched_get_realtime();
 
-    nk_thread_name(o->thread,buf);
-    
+	while (!w->team) {
+	    if (nk_sched_get_realtime() - start > OMP_SPIN_NS) {
+		w->sleeping = 1;
+		__sync_synchronize();
+		nk_wait_queue_sleep_extended(w->waitq, omp_worker_ready, w);
+		w->sleeping = 0;
+	    } else {
+		__asm__ __volatile__ ("pause");
+	    }
+	}
 
-    DEBUG("Launch - thread cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
+	w->team = 0;
+	omp_member_run(&w->omp);
+    }
+}
 
-    o->f(o->in);
+static struct omp_worker *omp_worker_create(int id, int cpu)
+{
+    struct omp_worker *w = (struct omp_worker *)malloc(sizeof(*w));
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
 
-    DEBUG("Finish - thread cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
+    if (!w) {
+	ERROR("Failed to allocate worker\n");
+	return 0;
+    }
 
-    free(o);
+    memset(w,0,sizeof(*w));
+
+    w->id = id;
+    w->omp.cookie = OMP_COOKIE;
+    nk_wsdeque_init(&w->omp.tasks);
+
+    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"omp-worker-%d",id);
+    w->waitq = nk_wait_queue_create(buf);
+
+    if (!w->waitq) {
+	ERROR("Failed to allocate worker wait queue\n");
+	free(w);
+	return 0;
+    }
+
+    if (nk_thread_start(omp_worker,w,0,1,TSTACK_DEFAULT,(nk_thread_id_t*)&w->omp.thread,cpu)) {
+	ERROR("Failed to start worker %d\n",id);
+	nk_wait_queue_destroy(w->waitq);
+	free(w);
+	return 0;
+    }
+
+    return w;
 }
 
-void GOMP_parallel_start(void (*f)(void*), void *d, unsigned numthreads)
+// claim the pool for a team needing num workers, growing it if needed
+// returns the number of workers available, or -1 if the pool is busy
+static int omp_pool_acquire(int num)
 {
-    DEBUG("GOMP_parallel_start(f=%p,d=%p,numthreads=%u)\n", f, d, numthreads);
+    int i, n, cpus = nk_get_num_cpus();
+
+    spin_lock(&omp_pool.lock);
+    if (omp_pool.in_use) {
+	spin_unlock(&omp_pool.lock);
+	return -1;
+    }
+    omp_pool.in_use = 1;
+    spin_unlock(&omp_pool.lock);
+
+    if (num > omp_pool.num_workers) {
+	struct omp_worker **nw = (struct omp_worker **)malloc(sizeof(struct omp_worker *)*num);
+	if (nw) {
+	    if (omp_pool.workers) {
+		memcpy(nw,omp_pool.workers,sizeof(struct omp_worker *)*omp_pool.num_workers);
+		free(omp_pool.workers);
+	    }
+	    omp_pool.workers = nw;
+	    // spread workers over the cpus other than our own
+	    for (i=omp_pool.num_workers;i<num;i++) {
+		if (!(nw[i] = omp_worker_create(i+1,(my_cpu_id()+i+1) % cpus))) {
+		    break;
+		}
+		omp_pool.num_workers = i+1;
+	    }
+	}
+    }
 
-    struct omp_thread *p = (struct omp_thread*)(get_cur_thread()->input);
+    n = omp_pool.num_workers < num ? omp_pool.num_workers : num;
+
+    return n;
+}
+
+static void omp_pool_release()
+{
+    __sync_synchronize();
+    omp_pool.in_use = 0;
+}
+
+static void omp_fallback_member(void *in, void **out)
+{
+    struct omp_thread *o = (struct omp_thread *)in;
+    struct omp_team *team = o->cur_team;
+    char buf[32];
+
+    o->thread = get_cur_thread();
+    o->thread->vc = o->thread->parent->vc;
+
+    while (!team->go) {
+	__asm__ __volatile__ ("pause");
+    }
+
+    snprintf(buf,32,"omp-%d-%d-%d",o->team,o->level,o->thread_num_in_team);
+    nk_thread_name(o->thread,buf);
+
+    omp_member_run(o);
+}
+
+// start a team of up to numthreads with the caller as its master
+static void omp_team_fork(void (*f)(void*), void *d, unsigned numthreads, int ws_sched, long start, long end, long incr, long chunk)
+{
+    struct omp_thread *p = omp_self();
+    struct omp_team *team;
+    int i, n;
 
-    
     if (!p || (p->cookie != OMP_COOKIE)) {
 	ERROR("GOMP_parallel_start() from thread that is not an OMP thread\n");
 	return;
     }
 
-    unsigned i;
-
-    if (!numthreads) { 
+    if (!numthreads) {
 	if (p->max_threads_in_team) {
 	    numthreads = p->max_threads_in_team;
 	} else {
@@ -574,65 +919,152 @@ void GOMP_parallel_start(void (*f)(void*), void *d, unsigned numthreads)
 	}
     }
 
-    // configure myself
+    team = (struct omp_team *)malloc(sizeof(*team) + sizeof(struct omp_thread *)*numthreads);
 
-    p->num_threads_in_team = numthreads;
-    p->num_threads_in_level = numthreads; // wrong
-    p->thread_num_in_team = 0; // wrong
-    p->thread_num = 0; //wrong?
-    p->team_leader = p;
+    if (!team) {
+	ERROR("Failed to allocate team - running as a team of one\n");
+	numthreads = 1;
+	// we still need somewhere to keep the master's state...
+	team = (struct omp_team *)malloc(sizeof(*team) + sizeof(struct omp_thread *));
+	if (!team) {
+	    panic("Cannot allocate OMP team\n");
+	}
+    }
+
+    memset(team,0,sizeof(*team));
+    team->f = f;
+    team->in = d;
+    spinlock_init(&team->lock);
 
-    nk_counting_barrier_init(&p->team_barrier,p->num_threads_in_team);
+    memcpy(team->saved,p,OMP_SAVED_STATE);
 
+    n = 1;
 
-    for (i=1;i<numthreads;i++) { 
-	struct omp_thread *c = (struct omp_thread *) malloc(sizeof(*c));
-	if (!c) { 
-	    ERROR("Failed to allocate block - running as function\n");
-	    f(d);
+    if (numthreads > 1) {
+	int avail = omp_pool_acquire(numthreads-1);
+	if (avail >= 0) {
+	    team->pooled = 1;
+	    n += avail;
 	} else {
-	    memset(c,0,sizeof(*c));
-	    c->cookie=OMP_COOKIE;
-	    c->team = p->team;
-	    c->level = p->level+1;
-	    c->num_threads_in_team = numthreads; // wrong
-	    c->num_threads_in_level = numthreads; // wrong
-	    c->thread_num_in_team = i; // wrong
-	    c->thread_num = i; // wrong
-	    c->f=f;
-	    c->in=d;
-	    c->team_leader = p;
-	    DEBUG("thread %d: cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", i, c->cookie, c->team, c->num_threads_in_team, c->thread_num_in_team, c->level, c->num_threads_in_level, c->f, c->in, c->thread_num, c->thread);
-	    if (nk_thread_start(parallel_start_wrapper,
-				c,0,0,TSTACK_DEFAULT,0,-1)) {
-		DEBUG("failed to launch as thread, running as function\n");
-		free(c);
-		f(d);
+	    team->spare = (struct omp_thread *)malloc(sizeof(struct omp_thread)*(numthreads-1));
+	    if (!team->spare) {
+		ERROR("Failed to allocate team members - running as a team of one\n");
+	    } else {
+		for (i=1;i<numthreads;i++) {
+		    struct omp_thread *c = &team->spare[i-1];
+		    memset(c,0,sizeof(*c));
+		    nk_wsdeque_init(&c->tasks);
+		    c->cur_team = team;
+		    if (nk_thread_start(omp_fallback_member,c,0,1,TSTACK_DEFAULT,0,-1)) {
+			ERROR("Failed to launch team member %d\n",i);
+			break;
+		    }
+		    n++;
+		}
+	    }
+	}
+    }
+
+    team->nthreads = n;
+    nk_counting_barrier_init(&team->barrier,n);
+
+    if (ws_sched) {
+	// combined parallel loop or sections, so the first worksharing
+	// construct is set up before anyone starts
+	struct omp_ws *ws = &team->ws[1];
+	ws->start = start;
+	ws->incr = incr;
+	ws->n = incr>0 ? (end - start + incr - 1) / incr : (start - end - incr - 1) / -incr;
+	if (ws->n < 0) {
+	    ws->n = 0;
+	}
+	ws->chunk = chunk;
+	ws->sched = ws_sched;
+	ws->left = n;
+	ws->gen = 1;
+    }
+
+    omp_member_setup(team,p,0,p);
+
+    for (i=1;i<n;i++) {
+	struct omp_thread *c = team->pooled ? &omp_pool.workers[i-1]->omp : &team->spare[i-1];
+	omp_member_setup(team,c,i,p);
+	if (ws_sched) {
+	    c->ws_gen = 1;
+	    c->ws = &team->ws[1];
+	    c->trip = 0;
+	    c->lo = c->hi = 0;
+	}
+    }
+
+    if (ws_sched) {
+	p->ws_gen = 1;
+	p->ws = &team->ws[1];
+	p->trip = 0;
+	p->lo = p->hi = 0;
+    }
+
+    __sync_synchronize();
+
+    if (team->pooled) {
+	for (i=1;i<n;i++) {
+	    struct omp_worker *w = omp_pool.workers[i-1];
+	    w->omp.thread->vc = get_cur_thread()->vc;
+	    w->team = team;
+	    __sync_synchronize();
+	    if (w->sleeping) {
+		nk_wait_queue_wake_all(w->waitq);
 	    }
 	}
+    } else {
+	team->go = 1;
     }
+
+    DEBUG("forked team %p of %d threads (%s)\n", team, n, team->pooled ? "pool" : "fresh threads");
 }
 
-void GOMP_parallel_end()
+// finish the team the caller is master of
+static void omp_team_join()
 {
-    DEBUG("GOMP_parallel_end()\n");
-    nk_join_all_children(0);
-    DEBUG("GOMP_parallel_end() complete\n");
-}
+    struct omp_thread *p = omp_self();
+    struct omp_team *team = p->cur_team;
 
+    if (!team) {
+	ERROR("GOMP_parallel_end() outside of a team\n");
+	return;
+    }
 
-// this is "any" - we will make it simply be the first thread in the team
-int GOMP_single_start()
-{
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    omp_task_drain(p);
 
-    if (o->thread_num_in_team==0) { 
-	DEBUG("GOMP_single_start() => 1 (first thread in team)\n");
-	return 1;
-    } else {
-	DEBUG("GOMP_single_start() => 0 (not first thread in team)\n");
-	return 0;
+    while (team->done != team->nthreads-1) {
+	__asm__ __volatile__ ("pause");
+    }
+
+    if (team->pooled) {
+	omp_pool_release();
+    }
+
+    memcpy(p,team->saved,OMP_SAVED_STATE);
+
+    if (team->spare) {
+	free(team->spare);
     }
+    free(team);
+
+    DEBUG("joined team %p\n", team);
+}
+
+void GOMP_parallel_start(void (*f)(void*), void *d, unsigned numthreads)
+{
+    DEBUG("GOMP_parallel_start(f=%p,d=%p,numthreads=%u)\n", f, d, numthreads);
+    omp_team_fork(f,d,numthreads,0,0,0,0,0);
+}
+
+void GOMP_parallel_end()
+{
+    DEBUG("GOMP_parallel_end()\n");
+    omp_team_join();
+    DEBUG("GOMP_parallel_end() complete\n");
 }
 
 void GOMP_parallel(void (*f)(void*), void *d, unsigned numthreads, unsigned flags)
@@ -645,44 +1077,68 @@ void GOMP_parallel(void (*f)(void*), void *d, unsigned numthreads, unsigned flag
 }
 
 
-// this is "any" - we will make it simply be the first thread in the team
-// other threads wait
+// the first thread of the team to get here runs the single
+int GOMP_single_start()
+{
+    struct omp_thread *o = omp_self();
+
+    if (!o->cur_team) {
+	return 1;
+    }
+
+    uint64_t gen = ++o->single_gen;
+    int rc = __sync_bool_compare_and_swap(&o->cur_team->single_gen,gen-1,gen);
+
+    DEBUG("GOMP_single_start() => %d\n",rc);
+
+    return rc;
+}
+
+// the first thread of the team to get here runs the single (returns 0)
+// the others wait for it and get its copyprivate data
 void *GOMP_single_copy_start()
 {
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_thread *o = omp_self();
 
-    if (o->thread_num_in_team==0) { 
-	o->cur_single=0;
+    if (GOMP_single_start()) {
 	DEBUG("GOMP_single_copy_start() => 0 (first thread in team)\n");
 	return 0;
     } else {
+	void *data;
 	DEBUG("GOMP_single_copy_start() [Waiting]\n");
-        nk_counting_barrier(&o->team_leader->team_barrier);
+        omp_team_barrier(o);
+        data = o->cur_team->copyprivate;
+        // nobody may start the next single until everyone has the data
+        omp_team_barrier(o);
 	DEBUG("GOMP_single_copy_start() [Done]\n");
-        return o->team_leader->cur_single;
+        return data;
     }
 }
 
 void GOMP_single_copy_end(void *data)
 {
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_thread *o = omp_self();
     DEBUG("GOMP_single_copy_end(%p) (start)\n",data);
-    o->cur_single = data;
-    nk_counting_barrier(&o->team_barrier);
+    if (o->cur_team) {
+	o->cur_team->copyprivate = data;
+	omp_team_barrier(o);
+	omp_team_barrier(o);
+    }
     DEBUG("GOMP_single_copy_end(%p) (end)\n",data);
 }
     
 void GOMP_barrier()
 { 
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_thread *o = omp_self();
     DEBUG("GOMP_barrier (start)\n");
-    nk_counting_barrier(&o->team_leader->team_barrier);
+    if (o->cur_team) {
+	omp_team_barrier(o);
+    }
     DEBUG("GOMP_barrier (end)\n");
 }
 
 
-static spinlock_t gomp_global_lock=0;
-
+// unnamed critical sections are all the same critical section
 void GOMP_critical_start(void)
 {
     DEBUG("GOMP_critical_start (start)\n");
@@ -696,25 +1152,459 @@ void GOMP_critical_end(void)
     spin_unlock(&gomp_global_lock);
 }
 
+// a named critical section gets a pointer-sized zeroed variable of
+// its own, which is big enough to be the lock itself
+void GOMP_critical_name_start(void **pptr)
+{
+    DEBUG("GOMP_critical_name_start(%p)\n",pptr);
+    spin_lock((spinlock_t *)pptr);
+}
+
+void GOMP_critical_name_end(void **pptr)
+{
+    DEBUG("GOMP_critical_name_end(%p)\n",pptr);
+    spin_unlock((spinlock_t *)pptr);
+}
+
+// atomics the compiler could not do natively
+void GOMP_atomic_start(void)
+{
+    spin_lock(&gomp_atomic_lock);
+}
+
+void GOMP_atomic_end(void)
+{
+    spin_unlock(&gomp_atomic_lock);
+}
+
+
+//
+// Worksharing loops
+//
+// Loops are handled in a normalized iteration space [0,n), where
+// iteration i is start+i*incr.  Each worksharing construct a member
+// encounters gets the next of a small ring of slots in the team; the
+// first member to arrive sets it up, and the slot is not reused until
+// every member has left it, which allows for nowait.
+//
+
+static void omp_ws_enter(struct omp_thread *o, long start, long end, long incr, long chunk, int sched, int ordered)
+{
+    struct omp_team *team = o->cur_team;
+    uint64_t gen = ++o->ws_gen;
+    struct omp_ws *ws = &team->ws[gen % OMP_WS_SLOTS];
+
+    while (ws->gen != gen) {
+	spin_lock(&team->lock);
+	if (ws->gen != gen && !ws->left) {
+	    ws->start = start;
+	    ws->incr = incr;
+	    ws->n = incr>0 ? (end - start + incr - 1) / incr : (start - end - incr - 1) / -incr;
+	    if (ws->n < 0) {
+		ws->n = 0;
+	    }
+	    ws->chunk = chunk;
+	    ws->sched = sched;
+	    ws->ordered = ordered;
+	    ws->next = 0;
+	    ws->ord_next = 0;
+	    ws->left = team->nthreads;
+	    __sync_synchronize();
+	    ws->gen = gen;
+	}
+	spin_unlock(&team->lock);
+	if (ws->gen != gen) {
+	    // a slow teammate is still in the construct that used this slot
+	    __asm__ __volatile__ ("pause");
+	}
+    }
+
+    o->ws = ws;
+    o->trip = 0;
+    o->lo = o->hi = 0;
+}
+
+// hand the ordered token on past the rest of our current chunk
+static void omp_ws_ordered_release(struct omp_thread *o)
+{
+    struct omp_ws *ws = o->ws;
+
+    if (ws->ordered && o->hi > o->lo) {
+	while (ws->ord_next != o->ord_cur) {
+	    __asm__ __volatile__ ("pause");
+	}
+	ws->ord_next = o->hi;
+    }
+}
+
+static int omp_ws_next(struct omp_thread *o, long *istart, long *iend)
+{
+    struct omp_ws *ws = o->ws;
+    int nth = o->cur_team->nthreads;
+    int sched;
+    long lo, hi, chunk;
+
+    if (!ws) {
+	return 0;
+    }
+
+    sched = ws->sched;
+    chunk = ws->chunk;
+
+    omp_ws_ordered_release(o);
+
+    if (sched==OMP_SCHED_AUTO) {
+	sched = OMP_SCHED_STATIC;
+    }
+
+    switch (sched) {
+    case OMP_SCHED_DYNAMIC:
+	if (chunk < 1) {
+	    chunk = 1;
+	}
+	lo = __sync_fetch_and_add(&ws->next,chunk);
+	if (lo >= ws->n) {
+	    goto none;
+	}
+	hi = lo + chunk > ws->n ? ws->n : lo + chunk;
+	break;
+
+    case OMP_SCHED_GUIDED:
+	if (chunk < 1) {
+	    chunk = 1;
+	}
+	do {
+	    lo = ws->next;
+	    if (lo >= ws->n) {
+		goto none;
+	    }
+	    long q = (ws->n - lo + nth - 1) / nth;
+	    if (q < chunk) {
+		q = chunk;
+	    }
+	    hi = lo + q > ws->n ? ws->n : lo + q;
+	} while (!__sync_bool_compare_and_swap(&ws->next,lo,hi));
+	break;
+
+    default:
+	if (chunk < 1) {
+	    // one contiguous block per member
+	    long q = ws->n / nth;
+	    long r = ws->n % nth;
+	    long t = o->thread_num;
+	    if (o->trip++) {
+		goto none;
+	    }
+	    lo = t*q + (t < r ? t : r);
+	    hi = lo + q + (t < r);
+	} else {
+	    // round-robin chunks
+	    lo = (o->trip*nth + o->thread_num) * chunk;
+	    o->trip++;
+	    if (lo >= ws->n) {
+		goto none;
+	    }
+	    hi = lo + chunk > ws->n ? ws->n : lo + chunk;
+	}
+	if (lo >= hi) {
+	    goto none;
+	}
+	break;
+    }
+
+    o->lo = lo;
+    o->hi = hi;
+    o->ord_cur = lo;
+
+    *istart = ws->start + lo*ws->incr;
+    *iend = ws->start + hi*ws->incr;
+
+    return 1;
+
+ none:
+    o->lo = o->hi = 0;
+    return 0;
+}
+
+static void omp_ws_leave(struct omp_thread *o)
+{
+    if (o->ws) {
+	omp_ws_ordered_release(o);
+	__sync_fetch_and_sub(&o->ws->left,1);
+	o->ws = 0;
+    }
+}
+
+static int omp_loop_start(long start, long end, long incr, long chunk, int sched, int ordered, long *istart, long *iend)
+{
+    struct omp_thread *o = omp_self();
+
+    if (sched==0) {
+	// runtime
+	sched = omp_run_sched;
+	chunk = omp_run_chunk;
+    }
+
+    if (!o->cur_team) {
+	// orphaned loop outside of any parallel region runs entirely here
+	*istart = start;
+	*iend = end;
+	return start != end;
+    }
+
+    omp_ws_enter(o,start,end,incr,chunk,sched,ordered);
+
+    return omp_ws_next(o,istart,iend);
+}
+
+static int omp_loop_next(long *istart, long *iend)
+{
+    struct omp_thread *o = omp_self();
+
+    if (!o->cur_team) {
+	return 0;
+    }
+
+    return omp_ws_next(o,istart,iend);
+}
+
+int GOMP_loop_static_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_STATIC,0,istart,iend);
+}
+
+int GOMP_loop_dynamic_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_DYNAMIC,0,istart,iend);
+}
+
+int GOMP_loop_guided_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_GUIDED,0,istart,iend);
+}
+
+int GOMP_loop_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,0,0,0,istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_dynamic_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return GOMP_loop_dynamic_start(start,end,incr,chunk,istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_guided_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return GOMP_loop_guided_start(start,end,incr,chunk,istart,iend);
+}
+
+int GOMP_loop_ordered_static_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_STATIC,1,istart,iend);
+}
+
+int GOMP_loop_ordered_dynamic_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_DYNAMIC,1,istart,iend);
+}
+
+int GOMP_loop_ordered_guided_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,chunk,OMP_SCHED_GUIDED,1,istart,iend);
+}
+
+int GOMP_loop_ordered_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    return omp_loop_start(start,end,incr,0,0,1,istart,iend);
+}
+
+int GOMP_loop_static_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_dynamic_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_guided_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_runtime_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_dynamic_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_guided_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_ordered_static_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_ordered_dynamic_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_ordered_guided_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+int GOMP_loop_ordered_runtime_next(long *istart, long *iend)
+{
+    return omp_loop_next(istart,iend);
+}
+
+void GOMP_loop_end_nowait(void)
+{
+    struct omp_thread *o = omp_self();
+    DEBUG("GOMP_loop_end_nowait()\n");
+    if (o->cur_team) {
+	omp_ws_leave(o);
+    }
+}
+
+void GOMP_loop_end(void)
+{
+    struct omp_thread *o = omp_self();
+    DEBUG("GOMP_loop_end()\n");
+    if (o->cur_team) {
+	omp_ws_leave(o);
+	omp_team_barrier(o);
+    }
+}
+
+// combined parallel loops: the loop is set up as part of the fork
+// and each member (including us) starts with GOMP_loop_*_next
+static void omp_parallel_loop(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, int sched)
+{
+    if (sched==0) {
+	sched = omp_run_sched;
+	chunk = omp_run_chunk;
+    }
+    omp_team_fork(f,d,numthreads,sched,start,end,incr,chunk);
+    f(d);
+    omp_team_join();
+}
+
+void GOMP_parallel_loop_static(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,chunk,OMP_SCHED_STATIC);
+}
+
+void GOMP_parallel_loop_dynamic(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,chunk,OMP_SCHED_DYNAMIC);
+}
+
+void GOMP_parallel_loop_guided(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,chunk,OMP_SCHED_GUIDED);
+}
+
+void GOMP_parallel_loop_runtime(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,0,0);
+}
+
+void GOMP_parallel_loop_nonmonotonic_dynamic(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,chunk,OMP_SCHED_DYNAMIC);
+}
+
+void GOMP_parallel_loop_nonmonotonic_guided(void (*f)(void*), void *d, unsigned numthreads, long start, long end, long incr, long chunk, unsigned flags)
+{
+    omp_parallel_loop(f,d,numthreads,start,end,incr,chunk,OMP_SCHED_GUIDED);
+}
+
+
+// ordered sections within an ordered loop run in iteration order
+void GOMP_ordered_start(void)
+{
+    struct omp_thread *o = omp_self();
+    DEBUG("GOMP_ordered_start()\n");
+    if (o->cur_team && o->ws) {
+	while (o->ws->ord_next != o->ord_cur) {
+	    __asm__ __volatile__ ("pause");
+	}
+    }
+}
+
+void GOMP_ordered_end(void)
+{
+    struct omp_thread *o = omp_self();
+    DEBUG("GOMP_ordered_end()\n");
+    if (o->cur_team && o->ws) {
+	o->ord_cur++;
+	__sync_synchronize();
+	o->ws->ord_next = o->ord_cur;
+    }
+}
+
+
+// sections are a dynamic loop over section numbers 1..count
+unsigned GOMP_sections_start(unsigned count)
+{
+    long s, e;
+    DEBUG("GOMP_sections_start(%u)\n",count);
+    if (omp_loop_start(1,count+1,1,1,OMP_SCHED_DYNAMIC,0,&s,&e)) {
+	return s;
+    }
+    return 0;
+}
+
+unsigned GOMP_sections_next(void)
+{
+    long s, e;
+    if (omp_loop_next(&s,&e)) {
+	return s;
+    }
+    return 0;
+}
+
+void GOMP_sections_end(void)
+{
+    GOMP_loop_end();
+}
+
+void GOMP_sections_end_nowait(void)
+{
+    GOMP_loop_end_nowait();
+}
 
-/*
-SYNCBENCH
+void GOMP_parallel_sections(void (*f)(void*), void *d, unsigned numthreads, unsigned count, unsigned flags)
+{
+    omp_team_fork(f,d,numthreads,OMP_SCHED_DYNAMIC,1,count+1,1,1);
+    f(d);
+    omp_team_join();
+}
 
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_loop_ordered_static_start'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_ordered_start'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_ordered_end'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:214: undefined reference to `GOMP_loop_ordered_static_next'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:214: undefined reference to `GOMP_loop_end_nowait'
-make: *** [nautilus.bin] Error 1
-*/
 
-/*
-   TASKBENCH
-src/built-in.o: In function `testParallelTaskGeneration._omp_fn.0':
-/home/pdinda/test/nautilus/src/test/ompbench/taskbench.c:116: undefined reference to `GOMP_task'
-ence to `GOMP_taskwait'
-*/
+//
+// Tasks
+//
+// Deferred tasks go onto the creating member's deque, from which
+// it pops newest first, and from which idle teammates steal oldest
+// first.  Tasks with dependences are run immediately, which trivially
+// satisfies them.
+//
 
+#define GOMP_TASK_FLAG_UNTIED  1
+#define GOMP_TASK_FLAG_FINAL   2
+#define GOMP_TASK_FLAG_DEPEND  8
 
 void GOMP_task (void (*fn) (void *), 
 		void *data, 
@@ -724,57 +1614,87 @@ void GOMP_task (void (*fn) (void *),
 		int if_clause,
 		unsigned flags,
 		void **depend, 
-		int priority)
+		int priority,
+		void *detach)
 {
-    struct omp_thread *p = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_thread *o = omp_self();
+    struct omp_task *t;
+    
     DEBUG("GOMP_task(fn=%p, data=%p, cpy=%p, arg_size=%ld arg_align=%ld if=%d flags=0x%x depend=%p priority=%d\n",
 	  fn, data, cpyfn, arg_size, arg_align, if_clause, flags, depend, priority);
 
-    struct omp_thread *c = (struct omp_thread *) malloc(sizeof(*c));
-    if (!c) { 
-	ERROR("Failed to allocate block\n");
-    } else {
-	memset(c,0,sizeof(*c));
-	
-	c->cookie=OMP_COOKIE;
-	c->team = p->team;
-	c->level = p->level+1;
-	c->num_threads_in_team = 1; // wrong
-	c->num_threads_in_level = 1; // wrong
-	c->thread_num_in_team = 0; // wrong
-	c->thread_num = 0; // wrong
-	c->f=fn;
-	c->in=data;
-	c->team_leader = p;
-	
-	DEBUG("thread: cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", c->cookie, c->team, c->num_threads_in_team, c->thread_num_in_team, c->level, c->num_threads_in_level, c->f, c->in, c->thread_num, c->thread);
-	if (nk_thread_start(parallel_start_wrapper,
-			    c,0,0,TSTACK_DEFAULT,0,-1)) {
-	    ERROR("Failed to start thread for task, running as function\n");
+    if (arg_align < 1) {
+	arg_align = 1;
+    }
+
+    if (!o->cur_team || o->cur_team->nthreads==1 || !if_clause || (flags & (GOMP_TASK_FLAG_DEPEND | GOMP_TASK_FLAG_FINAL))) {
+	// undeferred
+	if (cpyfn) {
+	    char *buf = malloc(arg_size + arg_align - 1);
+	    if (!buf) {
+		ERROR("Failed to allocate task arguments\n");
+		return;
+	    }
+	    char *arg = (char *)(((uint64_t)buf + arg_align - 1) & ~(arg_align - 1));
+	    cpyfn(arg,data);
+	    fn(arg);
+	    free(buf);
+	} else {
 	    fn(data);
 	}
+	return;
+    }
+
+    t = (struct omp_task *)malloc(sizeof(*t) + arg_size + arg_align - 1);
+
+    if (!t) {
+	ERROR("Failed to allocate task, running it now\n");
+	fn(data);
+	return;
+    }
+
+    char *arg = (char *)(((uint64_t)(t+1) + arg_align - 1) & ~(arg_align - 1));
+
+    if (cpyfn) {
+	cpyfn(arg,data);
+    } else {
+	memcpy(arg,data,arg_size);
+    }
+
+    t->f = fn;
+    t->in = arg;
+    t->is_explicit = 1;
+    t->refs = 1;
+    t->parent = o->cur_task;
+
+    __sync_fetch_and_add(&t->parent->refs,1);
+    __sync_fetch_and_add(&o->cur_team->tasks_outstanding,1);
+
+    if (nk_wsdeque_push(&o->tasks,t)) {
+	// our deque is full
+	omp_task_run(o,t);
     }
 }
 
+// wait for the children of the current task
 void GOMP_taskwait()
 {
+    struct omp_thread *o = omp_self();
     DEBUG("GOMP_taskwait() [begin]\n");
-    nk_join_all_children(0);
+    if (o->cur_team) {
+	while (o->cur_task->refs > 1) {
+	    if (!omp_task_run_one(o)) {
+		__asm__ __volatile__ ("pause");
+	    }
+	}
+    }
     DEBUG("GOMP_taskwait() [end]\n");
 }
 
-/*
-  SCHEDBENCH
-src/built-in.o: In function `testdynamicn._omp_fn.2':
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:118: undefined reference to `GOMP_loop_dynamic_next'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:118: undefined reference to `GOMP_loop_end'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:122: undefined reference to `GOMP_loop_dynamic_start'
-src/built-in.o: In function `testguidedn._omp_fn.3':
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:131: undefined reference to `GOMP_loop_guided_next'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:131: undefined reference to `GOMP_loop_end'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:135: undefined reference to `GOMP_loop_guided_start'
-make: *** [nautilus.bin] Error 1
-*/
+void GOMP_taskyield()
+{
+    // tasks are tied to the member that starts them
+}
 
 
 int nk_openmp_thread_init()
@@ -806,12 +1726,13 @@ int nk_openmp_thread_init()
     o->thread_num = 0;
     o->f=0;
     o->in=t->input; // stash
+    o->thread=t;
 
-    t->input = o;
-
-    o->team_leader = o;
+    o->implicit.refs = 1;
+    o->cur_task = &o->implicit;
+    nk_wsdeque_init(&o->tasks);
 
-    nk_counting_barrier_init(&o->team_barrier,1);
+    t->input = o;
 
     DEBUG("nk_openmp_init(): cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
 
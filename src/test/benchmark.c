@@ -46,6 +46,8 @@
 #include <nautilus/thread.h>
 #include <nautilus/condvar.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/mutex.h>
+#include <nautilus/rwlock.h>
 #include <nautilus/percpu.h>
 #include <nautilus/numa.h>
 #include <nautilus/nemo.h>
@@ -500,6 +502,226 @@ void time_spinlock (void)
             max);
 }
 
+#ifdef __USER
+#define NUM_CPUS() sysconf(_SC_NPROCESSORS_ONLN)
+#else
+#define NUM_CPUS() nk_get_num_cpus()
+#endif
+
+/* multi-cpu benchmarks sweep 1, 2, 4, ... up to this many cpus */
+#define MAX_BENCH_CPUS 64
+
+typedef FUNC_TYPE (*on_cpus_func_t) FUNC_HDR;
+
+static volatile int on_cpus_go;
+
+/* drivers started by time_on_cpus call this before doing their work */
+static inline void
+wait_on_cpus_go (void)
+{
+	while (!on_cpus_go) {
+		YIELD();
+	}
+}
+
+/*
+ * start func on cpus 0..cpus-1, with its cpu as the input, release all
+ * of them at once, and return the cycles until all have finished, or
+ * 0 if they could not all be started
+ */
+static uint64_t
+time_on_cpus (on_cpus_func_t func, long cpus)
+{
+	THREAD_T t[MAX_BENCH_CPUS];
+	uint64_t start, end;
+	long j, started;
+	int rc = 0;
+
+	on_cpus_go = 0;
+
+	for (started = 0; started < cpus && started < MAX_BENCH_CPUS; started++) {
+#ifdef __USER
+		pthread_attr_t attr;
+		cpu_set_t cpuset;
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpuset);
+		CPU_SET(started, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+		rc = pthread_create(&t[started], &attr, func, (void*)started);
+#else
+		rc = nk_thread_start(func, (void*)started, NULL, 0, TSTACK_DEFAULT, &t[started], started);
+#endif
+		if (rc) {
+			PRINT("Cannot start benchmark thread on cpu %ld\n", started);
+			break;
+		}
+	}
+
+	rdtscll(start);
+
+	// the ones we did start still need to run to completion
+	on_cpus_go = 1;
+
+	for (j = 0; j < started; j++) {
+		JOIN_FUNC(t[j], NULL);
+	}
+
+	rdtscll(end);
+
+	return (rc || started < cpus) ? 0 : end - start;
+}
+
+#ifndef __USER
+
+#define CONTENTION_OPS 10000
+
+enum { C_SPINLOCK, C_MUTEX, C_RWLOCK, C_BRWLOCK, C_NUM_KINDS };
+
+static const char * contention_names[C_NUM_KINDS] = { "spinlock", "mutex", "rwlock", "brwlock" };
+static const unsigned contention_read_pcts[] = { 100, 99, 90, 50, 0 };
+
+static struct {
+    int          kind;
+    unsigned     read_pct;
+    spinlock_t   spin;
+    nk_mutex_t   mutex;
+    nk_rwlock_t  rw;
+    nk_brwlock_t brw;
+    // the protected data
+    volatile uint64_t data[4];
+    volatile uint64_t writes;
+    // per driver
+    uint64_t     driver_writes[MAX_BENCH_CPUS];
+} contention;
+
+/* each driver does a mix of reads and writes of the protected data */
+static FUNC_TYPE
+contention_func FUNC_HDR
+{
+	uint64_t seed = 0x2545f4914f6cdd1dULL + (uint64_t)in;
+	uint64_t i, writes = 0, sink = 0;
+	int ticket;
+	uint8_t flags;
+
+	wait_on_cpus_go();
+
+	for (i = 0; i < CONTENTION_OPS; i++) {
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+
+		if (seed % 100 < contention.read_pct) {
+			switch (contention.kind) {
+			case C_SPINLOCK:
+				spin_lock(&contention.spin);
+				sink += contention.data[0] + contention.data[3];
+				spin_unlock(&contention.spin);
+				break;
+			case C_MUTEX:
+				nk_mutex_lock(&contention.mutex);
+				sink += contention.data[0] + contention.data[3];
+				nk_mutex_unlock(&contention.mutex);
+				break;
+			case C_RWLOCK:
+				nk_rwlock_rd_lock(&contention.rw);
+				sink += contention.data[0] + contention.data[3];
+				nk_rwlock_rd_unlock(&contention.rw);
+				break;
+			case C_BRWLOCK:
+				ticket = nk_brwlock_rd_lock(&contention.brw);
+				sink += contention.data[0] + contention.data[3];
+				nk_brwlock_rd_unlock(&contention.brw, ticket);
+				break;
+			}
+		} else {
+			switch (contention.kind) {
+			case C_SPINLOCK:
+				spin_lock(&contention.spin);
+				contention.data[0]++; contention.data[3]++; contention.writes++;
+				spin_unlock(&contention.spin);
+				break;
+			case C_MUTEX:
+				nk_mutex_lock(&contention.mutex);
+				contention.data[0]++; contention.data[3]++; contention.writes++;
+				nk_mutex_unlock(&contention.mutex);
+				break;
+			case C_RWLOCK:
+				flags = nk_rwlock_wr_lock_irq_save(&contention.rw);
+				contention.data[0]++; contention.data[3]++; contention.writes++;
+				nk_rwlock_wr_unlock_irq_restore(&contention.rw, flags);
+				break;
+			case C_BRWLOCK:
+				nk_brwlock_wr_lock(&contention.brw);
+				contention.data[0]++; contention.data[3]++; contention.writes++;
+				nk_brwlock_wr_unlock(&contention.brw);
+				break;
+			}
+			writes++;
+		}
+	}
+
+	contention.driver_writes[(uint64_t)in] = writes;
+
+	(void)sink;
+
+	RETURN;
+}
+
+/*
+ * lock throughput with 1, 2, 4, ... 64 cpus hammering one lock, for
+ * each lock type and mix of reads.   The exclusive locks take reads
+ * exclusively too.
+ */
+void time_lock_contention (void);
+void
+time_lock_contention (void)
+{
+	long cpus, j;
+	unsigned r;
+	uint64_t cycles, ops, writes;
+
+	spinlock_init(&contention.spin);
+	nk_rwlock_init(&contention.rw);
+
+	if (nk_mutex_init(&contention.mutex) || nk_brwlock_init(&contention.brw)) {
+		PRINT("LOCK contention: cannot initialize locks\n");
+		return;
+	}
+
+	for (contention.kind = 0; contention.kind < C_NUM_KINDS; contention.kind++) {
+		for (r = 0; r < sizeof(contention_read_pcts)/sizeof(contention_read_pcts[0]); r++) {
+			for (cpus = 1; cpus <= MAX_BENCH_CPUS && cpus <= NUM_CPUS(); cpus *= 2) {
+
+				contention.read_pct = contention_read_pcts[r];
+				contention.writes = 0;
+				memset(contention.driver_writes, 0, sizeof(contention.driver_writes));
+
+				if (!(cycles = time_on_cpus(contention_func, cpus))) {
+					PRINT("LOCK %s %ld cpus: failed to start threads\n",
+					      contention_names[contention.kind], cpus);
+					goto out;
+				}
+
+				for (j = 0, writes = 0; j < cpus; j++) {
+					writes += contention.driver_writes[j];
+				}
+
+				ops = cpus * CONTENTION_OPS;
+
+				PRINT("LOCK %s %u%% reads %ld cpus %llu ops %llu cycles (%llu cycles/op)%s\n",
+				      contention_names[contention.kind], contention.read_pct, cpus, ops,
+				      cycles, cycles/ops,
+				      contention.writes != writes ? " (LOST UPDATES)" : "");
+			}
+		}
+	}
+
+ out:
+	nk_brwlock_deinit(&contention.brw);
+	nk_mutex_deinit(&contention.mutex);
+	spinlock_deinit(&contention.spin);
+}
+
+#endif
+
 
 static FUNC_TYPE
 create_test_func FUNC_HDR
@@ -643,6 +865,63 @@ time_thread_run (void)
 	}
 }
 
+#define CREATE_JOIN_OPS 1000
+
+static volatile int create_join_failed;
+
+/* each driver creates and joins children on its own cpu */
+static FUNC_TYPE
+create_join_func FUNC_HDR
+{
+	THREAD_T t;
+	int i, rc;
+#ifndef __USER
+	long cpu = (long)in;
+#endif
+
+	wait_on_cpus_go();
+
+	for (i = 0; i < CREATE_JOIN_OPS; i++) {
+#ifdef __USER
+		rc = pthread_create(&t, NULL, create_test_func, NULL);
+#else
+		rc = nk_thread_start(create_test_func, NULL, NULL, 0, TSTACK_DEFAULT, &t, cpu);
+#endif
+		if (rc) {
+			create_join_failed = 1;
+			break;
+		}
+		JOIN_FUNC(t, NULL);
+	}
+
+	RETURN;
+}
+
+/* create/join throughput with 1, 2, 4, ... 64 cpus creating at once */
+static void
+time_thread_create_join (void)
+{
+	long cpus;
+	uint64_t cycles, ops;
+
+	for (cpus = 1; cpus <= MAX_BENCH_CPUS && cpus <= NUM_CPUS(); cpus *= 2) {
+
+		create_join_failed = 0;
+
+		cycles = time_on_cpus(create_join_func, cpus);
+
+		if (!cycles || create_join_failed) {
+			PRINT("CREATE/JOIN %ld cpus: failed to start threads\n", cpus);
+			return;
+		}
+
+		ops = cpus * CREATE_JOIN_OPS;
+
+		PRINT("CREATE/JOIN %ld cpus %llu ops %llu cycles (%llu cycles/op, %llu ops/Mcycle)\n",
+		      cpus, ops, cycles, cycles/ops, ops*1000000/cycles);
+	}
+}
+
 /* this includes both the create and the latency for the thread to actually run */
 void time_thread_both(void);
 void
@@ -680,6 +959,8 @@ time_thread_both (void)
 
 		PRINT("TRIAL %u %llu cycles\n", i, end-start);
 	}
+
+	time_thread_create_join();
 }
 
 
@@ -1100,6 +1381,210 @@ malloc_test (void)
 
 }
 
+
+#define KMEM_LOOKUP_MAX_BLOCKS 65536
+#define KMEM_LOOKUP_PROBES     10000
+
+/* 
+ * cost of finding the enclosing block of an address (as the GC and
+ * kmem_free do) as the number of live blocks in the heap grows 
+ */
+void time_kmem_lookup(void);
+void
+time_kmem_lookup (void)
+{
+	void ** blocks = kmem_malloc(sizeof(void*)*KMEM_LOOKUP_MAX_BLOCKS);
+	uint64_t n = 0, target, i, seed = 0x5eed;
+	uint64_t start, end, total;
+
+	if (!blocks) {
+		PRINT("Failed to allocate block array\n");
+		return;
+	}
+
+	for (target = 256; target <= KMEM_LOOKUP_MAX_BLOCKS; target *= 4) {
+
+		/* sizes cycle through 32 bytes to 4 KB */
+		for (; n < target; n++) {
+			blocks[n] = kmem_malloc(32UL << (n % 8));
+			if (!blocks[n]) {
+				break;
+			}
+		}
+
+		if (n < target) {
+			PRINT("Out of memory at %lu blocks\n", n);
+			break;
+		}
+
+		total = 0;
+
+		for (i = 0; i < KMEM_LOOKUP_PROBES; i++) {
+			void * block_addr;
+			uint64_t block_size, flags;
+
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+			/* an interior pointer into a random live block */
+			void * p = blocks[(seed >> 33) % n] + ((seed >> 13) % 32);
+
+			rdtscll(start);
+			kmem_find_block(p, &block_addr, &block_size, &flags);
+			rdtscll(end);
+
+			total += end - start;
+		}
+
+		PRINT("KMEM LOOKUP %lu live blocks: %lu cycles/lookup\n", n, total / KMEM_LOOKUP_PROBES);
+	}
+
+	for (i = 0; i < n; i++) {
+		kmem_free(blocks[i]);
+	}
+
+	kmem_free(blocks);
+}
+
+static int
+handle_kmem_lookup (char * buf, void * priv)
+{
+	time_kmem_lookup();
+	return 0;
+}
+
+static struct shell_cmd_impl kmem_lookup_impl = {
+	.cmd      = "kmembench",
+	.help_str = "kmembench",
+	.handler  = handle_kmem_lookup,
+};
+nk_register_shell_cmd(kmem_lookup_impl);
+
+
+#define MEMBENCH_MAX_SIZE   (64UL * 1024 * 1024)
+#define MEMBENCH_MIN_BYTES  (16UL * 1024 * 1024)
+
+static inline uint64_t
+membench_bw (uint64_t bytes, uint64_t ns)
+{
+	/* MB/s */
+	return ns ? (bytes * 1000) / ns : 0;
+}
+
+/* 
+ * bandwidth of the block memory operations from 8 bytes to 64 MB
+ * (each size is repeated until at least 16 MB have been moved)
+ */
+void time_memcpy_bandwidth(void);
+void
+time_memcpy_bandwidth (void)
+{
+	uint8_t * src = kmem_malloc(MEMBENCH_MAX_SIZE);
+	uint8_t * dst = kmem_malloc(MEMBENCH_MAX_SIZE);
+	volatile int sink = 0;
+	uint64_t size, reps, i;
+	uint64_t start, t_cpy, t_set, t_mov, t_cmp;
+
+	if (!src || !dst) {
+		PRINT("Failed to allocate buffers\n");
+		kmem_free(src);
+		kmem_free(dst);
+		return;
+	}
+
+	memset(src, 0xa5, MEMBENCH_MAX_SIZE);
+	memset(dst, 0xa5, MEMBENCH_MAX_SIZE);
+
+	PRINT("MEMBENCH size: memcpy memset memmove memcmp (MB/s)\n");
+
+	for (size = 8; size <= MEMBENCH_MAX_SIZE; size *= 4) {
+
+		reps = size >= MEMBENCH_MIN_BYTES ? 1 : MEMBENCH_MIN_BYTES / size;
+
+		start = nk_sched_get_realtime();
+		for (i = 0; i < reps; i++) {
+			memcpy(dst, src, size);
+		}
+		t_cpy = nk_sched_get_realtime() - start;
+
+		start = nk_sched_get_realtime();
+		for (i = 0; i < reps; i++) {
+			memset(dst, (char)i, size);
+		}
+		t_set = nk_sched_get_realtime() - start;
+
+		/* overlapping, forward */
+		start = nk_sched_get_realtime();
+		for (i = 0; i < reps; i++) {
+			memmove(dst, dst + 1, size - 1);
+		}
+		t_mov = nk_sched_get_realtime() - start;
+
+		memcpy(dst, src, size);
+
+		/* equal buffers, so the whole length is compared */
+		start = nk_sched_get_realtime();
+		for (i = 0; i < reps; i++) {
+			sink += memcmp(dst, src, size);
+		}
+		t_cmp = nk_sched_get_realtime() - start;
+
+		PRINT("MEMBENCH %lu bytes: %lu %lu %lu %lu\n", size,
+		      membench_bw(size * reps, t_cpy),
+		      membench_bw(size * reps, t_set),
+		      membench_bw((size - 1) * reps, t_mov),
+		      membench_bw(size * reps, t_cmp));
+	}
+
+	if (sink) {
+		PRINT("MEMBENCH memcmp mismatch\n");
+	}
+
+	kmem_free(src);
+	kmem_free(dst);
+}
+
+static int
+handle_membench (char * buf, void * priv)
+{
+	time_memcpy_bandwidth();
+	return 0;
+}
+
+static struct shell_cmd_impl membench_impl = {
+	.cmd      = "membench",
+	.help_str = "membench",
+	.handler  = handle_membench,
+};
+nk_register_shell_cmd(membench_impl);
+
+static int
+handle_threadbench (char * buf, void * priv)
+{
+	time_thread_both();
+	return 0;
+}
+
+static struct shell_cmd_impl threadbench_impl = {
+	.cmd      = "threadbench",
+	.help_str = "threadbench",
+	.handler  = handle_threadbench,
+};
+nk_register_shell_cmd(threadbench_impl);
+
+static int
+handle_lockbench (char * buf, void * priv)
+{
+	time_lock_contention();
+	return 0;
+}
+
+static struct shell_cmd_impl lockbench_impl = {
+	.cmd      = "lockbench",
+	.help_str = "lockbench",
+	.handler  = handle_lockbench,
+};
+nk_register_shell_cmd(lockbench_impl);
+
 #endif
 
 void run_benchmarks(void);
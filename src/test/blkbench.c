@@ -0,0 +1,130 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// blkbench dev seq|rand count [blocks]
+//
+// Issues count blocking reads of the given number of blocks each,
+// either sequentially from block 0 or at random offsets, and reports
+// throughput and how the block cache fared.   Run it twice to see
+// the warm cache.
+//
+
+static uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static int
+handle_blkbench (char * buf, void * priv)
+{
+    char name[32], mode[16];
+    uint64_t count, blocks = 1;
+    uint64_t i, block, span, seed = 0x2545f4914f6cdd1dULL;
+    uint64_t start, end, bytes, hits, misses;
+    struct nk_block_dev *d;
+    struct nk_block_dev_characteristics c;
+    struct nk_block_cache_stats before, after;
+    uint8_t *data;
+    int rand;
+
+    if (sscanf(buf,"blkbench %31s %15s %lu %lu",name,mode,&count,&blocks)<3 ||
+	(strcmp(mode,"seq") && strcmp(mode,"rand")) || !blocks) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    rand = !strcmp(mode,"rand");
+
+    if (!(d=nk_block_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (nk_block_dev_get_characteristics(d,&c) || c.num_blocks<blocks) {
+	nk_vc_printf("Can't get usable characteristics of %s\n",name);
+	return -1;
+    }
+
+    if (!(data = malloc(blocks*c.block_size))) {
+	nk_vc_printf("Can't allocate buffer\n");
+	return -1;
+    }
+
+    span = c.num_blocks - blocks + 1;
+
+    nk_block_cache_get_stats(&before);
+    start = nk_sched_get_realtime();
+
+    for (i=0, block=0; i<count; i++) {
+	if (rand) {
+	    block = xorshift(&seed) % span;
+	} else if (block >= span) {
+	    block = 0;
+	}
+	if (nk_block_dev_read(d,block,blocks,data,NK_DEV_REQ_BLOCKING,0,0)) {
+	    nk_vc_printf("Failed to read block %lu\n",block);
+	    free(data);
+	    return -1;
+	}
+	if (!rand) {
+	    block += blocks;
+	}
+    }
+
+    end = nk_sched_get_realtime();
+    nk_block_cache_get_stats(&after);
+
+    free(data);
+
+    bytes = count*blocks*c.block_size;
+    hits = after.hits - before.hits;
+    misses = after.misses - before.misses;
+
+    nk_vc_printf("%s %s: %lu reads of %lu blocks in %lu ns (%lu MB/s)\n",
+		 name, mode, count, blocks, end-start,
+		 end>start ? bytes*1000/(end-start) : 0);
+    nk_vc_printf("cache: %lu hits %lu misses (hit rate %lu%%) readahead %lu\n",
+		 hits, misses, (hits+misses) ? hits*100/(hits+misses) : 0,
+		 after.readahead - before.readahead);
+
+    return 0;
+}
+
+static struct shell_cmd_impl blkbench_impl = {
+    .cmd      = "blkbench",
+    .help_str = "blkbench dev seq|rand count [blocks]",
+    .handler  = handle_blkbench,
+};
+nk_register_shell_cmd(blkbench_impl);
@@ -0,0 +1,200 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/blkring.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// blkring dev seq|rand qd blocks count [poll]
+//
+// Reads count requests of the given number of blocks through a block
+// ring, keeping qd of them in flight, each spread over two segments
+// when it is more than one block.   Reports IOPS, bandwidth, and the
+// mean time from submission to completion.   With poll, completions
+// are polled for rather than slept on.
+//
+
+#define RING_MAX_QD 256
+
+struct ring_slot {
+    struct nk_block_dev_iov iov[2];
+    uint64_t                start;
+};
+
+static uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static int
+handle_blkring (char * buf, void * priv)
+{
+    char name[32], mode[16], poll[16] = "";
+    uint64_t qd, blocks, count;
+    uint64_t issued = 0, done = 0, span, block = 0, seed = 0x2545f4914f6cdd1dULL;
+    uint64_t i, start, end, latency = 0;
+    struct nk_block_dev *d;
+    struct nk_block_dev_characteristics c;
+    struct nk_block_ring *r;
+    struct nk_block_ring_cqe cqes[RING_MAX_QD];
+    struct ring_slot *slots;
+    uint64_t *free_slots, nfree;
+    uint8_t *data;
+    int rand, n, rc = 0;
+
+    if (sscanf(buf,"blkring %31s %15s %lu %lu %lu %15s",name,mode,&qd,&blocks,&count,poll)<5 ||
+	(strcmp(mode,"seq") && strcmp(mode,"rand")) ||
+	!qd || qd>RING_MAX_QD || !blocks || !count) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    rand = !strcmp(mode,"rand");
+
+    if (!(d=nk_block_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (nk_block_dev_get_characteristics(d,&c) || c.num_blocks<blocks) {
+	nk_vc_printf("Can't get usable characteristics of %s\n",name);
+	return -1;
+    }
+
+    if (!(r = nk_block_ring_create(d,qd,!strcmp(poll,"poll") ? NK_BLOCK_RING_POLL : 0))) {
+	nk_vc_printf("Can't create ring\n");
+	return -1;
+    }
+
+    slots = malloc(sizeof(struct ring_slot)*qd);
+    free_slots = malloc(sizeof(uint64_t)*qd);
+    data = malloc(qd*blocks*c.block_size);
+
+    if (!slots || !free_slots || !data) {
+	nk_vc_printf("Can't allocate buffers\n");
+	rc = -1;
+	goto out;
+    }
+
+    // a request of more than one block is read as two segments
+    for (i=0;i<qd;i++) {
+	uint8_t *b = data + i*blocks*c.block_size;
+	uint64_t first = blocks > 1 ? blocks/2 : 1;
+	slots[i].iov[0].addr = b;
+	slots[i].iov[0].len = first*c.block_size;
+	slots[i].iov[1].addr = b + first*c.block_size;
+	slots[i].iov[1].len = (blocks-first)*c.block_size;
+	free_slots[i] = i;
+    }
+    nfree = qd;
+
+    span = c.num_blocks - blocks + 1;
+
+    start = nk_sched_get_realtime();
+
+    while (done < count) {
+	// queue a request for every free slot, and submit them together
+	while (nfree && issued < count) {
+	    i = free_slots[--nfree];
+	    if (rand) {
+		block = xorshift(&seed) % span;
+	    } else if (block >= span) {
+		block = 0;
+	    }
+	    slots[i].start = nk_sched_get_realtime();
+	    nk_block_ring_prep_readv(r,block,blocks,slots[i].iov,blocks>1 ? 2 : 1,i);
+	    if (!rand) {
+		block += blocks;
+	    }
+	    issued++;
+	}
+
+	if (nk_block_ring_submit(r)<0) {
+	    nk_vc_printf("Submission failed\n");
+	    rc = -1;
+	    break;
+	}
+
+	if ((n = nk_block_ring_wait(r,cqes,1,qd)) < 0) {
+	    nk_vc_printf("Wait failed\n");
+	    rc = -1;
+	    break;
+	}
+
+	end = nk_sched_get_realtime();
+
+	for (i=0;i<(uint64_t)n;i++) {
+	    if (cqes[i].status) {
+		nk_vc_printf("Request failed\n");
+		rc = -1;
+	    }
+	    latency += end - slots[cqes[i].tag].start;
+	    free_slots[nfree++] = cqes[i].tag;
+	}
+
+	done += n;
+
+	if (rc) {
+	    break;
+	}
+    }
+
+    end = nk_sched_get_realtime();
+
+    // let whatever is still in flight land
+    while (nk_block_ring_inflight(r)) {
+	nk_block_ring_submit(r);
+	nk_block_ring_wait(r,cqes,1,qd);
+    }
+
+    if (!rc) {
+	nk_vc_printf("%s %s qd %lu%s: %lu reads of %lu blocks in %lu ns: %lu IOPS, %lu MB/s, %lu ns mean latency\n",
+		     name, mode, qd, !strcmp(poll,"poll") ? " (polled)" : "", done, blocks, end-start,
+		     end>start ? done*1000000000ULL/(end-start) : 0,
+		     end>start ? done*blocks*c.block_size*1000/(end-start) : 0,
+		     done ? latency/done : 0);
+    }
+
+ out:
+    nk_block_ring_destroy(r);
+    free(slots);
+    free(free_slots);
+    free(data);
+
+    return rc;
+}
+
+static struct shell_cmd_impl blkring_impl = {
+    .cmd      = "blkring",
+    .help_str = "blkring dev seq|rand qd blocks count [poll]",
+    .handler  = handle_blkring,
+};
+nk_register_shell_cmd(blkring_impl);
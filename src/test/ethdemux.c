@@ -0,0 +1,166 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/netdev.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+#include <net/ethernet/ethernet_packet.h>
+#include <net/ethernet/ethernet_agent.h>
+
+//
+// ethdemux nic types count
+//
+// Measures the cost of matching received frames to agent devices
+// with the given number of devices registered, first as ethertype
+// devices (hash table) and then as equivalent custom filters
+// (linear scan).  Uses a stopped agent named demux-bench on nic,
+// so no traffic is involved.
+//
+
+#define BENCH_AGENT "demux-bench"
+#define BENCH_TYPE_BASE 0x9000
+#define BENCH_MAX_TYPES 1024
+
+static int bench_filter(nk_ethernet_packet_t *p, void *state)
+{
+    return ntohs(p->header.type)==(uint16_t)(uint64_t)state;
+}
+
+static uint64_t time_matches(struct nk_net_ethernet_agent *a, struct nk_net_dev **devs,
+			     uint64_t types, uint64_t count, nk_ethernet_packet_t *p, int *bad)
+{
+    uint64_t i, t, start, end, seed = 0x2545f4914f6cdd1dULL;
+
+    start = rdtsc();
+    for (i=0;i<count;i++) {
+	seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+	t = seed % types;
+	p->header.type = htons(BENCH_TYPE_BASE + t);
+	if (nk_net_ethernet_agent_match(a,p)!=devs[t]) {
+	    *bad = 1;
+	}
+    }
+    end = rdtsc();
+
+    return (end-start)/count;
+}
+
+static int register_all(struct nk_net_ethernet_agent *a, struct nk_net_dev **devs, uint64_t types, int filters)
+{
+    uint64_t i;
+
+    for (i=0;i<types;i++) {
+	devs[i] = filters ?
+	    nk_net_ethernet_agent_register_filter(a,bench_filter,(void*)(uint64_t)(BENCH_TYPE_BASE+i)) :
+	    nk_net_ethernet_agent_register_type(a,BENCH_TYPE_BASE+i);
+	if (!devs[i]) {
+	    nk_vc_printf("Failed to register device %lu\n",i);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static void unregister_all(struct nk_net_dev **devs, uint64_t types)
+{
+    uint64_t i;
+
+    for (i=0;i<types;i++) {
+	if (devs[i]) {
+	    nk_net_ethernet_agent_unregister(devs[i]);
+	    devs[i] = 0;
+	}
+    }
+}
+
+static int
+handle_ethdemux (char * buf, void * priv)
+{
+    char name[32];
+    uint64_t types, count, hash_cycles, filter_cycles;
+    struct nk_net_dev *nic, **devs;
+    struct nk_net_ethernet_agent *a;
+    nk_ethernet_packet_t *p;
+    int bad = 0;
+
+    if (sscanf(buf,"ethdemux %31s %lu %lu",name,&types,&count)!=3 ||
+	!types || types>BENCH_MAX_TYPES || !count) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (!(nic=nk_net_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (!(a = nk_net_ethernet_agent_find(BENCH_AGENT)) &&
+	!(a = nk_net_ethernet_agent_create(nic,BENCH_AGENT,0,0))) {
+	nk_vc_printf("Can't create agent\n");
+	return -1;
+    }
+
+    devs = malloc(sizeof(struct nk_net_dev *)*types);
+    p = nk_net_ethernet_alloc_packet(-1);
+
+    if (!devs || !p) {
+	nk_vc_printf("Can't allocate state\n");
+	free(devs);
+	if (p) {
+	    nk_net_ethernet_release_packet(p);
+	}
+	return -1;
+    }
+
+    memset(devs,0,sizeof(struct nk_net_dev *)*types);
+    memset(p->raw,0,ETHERNET_HEADER_LEN);
+
+    if (register_all(a,devs,types,0)) {
+	goto out;
+    }
+    hash_cycles = time_matches(a,devs,types,count,p,&bad);
+    unregister_all(devs,types);
+
+    if (register_all(a,devs,types,1)) {
+	goto out;
+    }
+    filter_cycles = time_matches(a,devs,types,count,p,&bad);
+
+    nk_vc_printf("%lu devices, %lu matches: %lu cycles/match by type, %lu cycles/match by filter%s\n",
+		 types, count, hash_cycles, filter_cycles, bad ? " (MISMATCHES)" : "");
+
+ out:
+    unregister_all(devs,types);
+    nk_net_ethernet_release_packet(p);
+    free(devs);
+
+    return bad ? -1 : 0;
+}
+
+static struct shell_cmd_impl ethdemux_impl = {
+    .cmd      = "ethdemux",
+    .help_str = "ethdemux nic types count",
+    .handler  = handle_ethdemux,
+};
+nk_register_shell_cmd(ethdemux_impl);
@@ -406,6 +406,78 @@ void new_yield_2(void *i, void **o)
   nk_vc_printf("new_yield_2 finished.\n");
 }
 
+/* Fan-out/fan-in benchmark: a root fiber spawns n children and joins them */
+#define BENCH_TRIALS 8
+
+static volatile uint64_t bench_count;
+
+void fiber_bench_child(void *i, void **o)
+{
+  __sync_fetch_and_add(&bench_count, 1);
+}
+
+void fiber_bench_root(void *i, void **o)
+{
+  nk_fiber_set_vc(vc);
+  uint64_t sizes[] = { 1, 16, 256, 1024 };
+  uint64_t s, j, t, n, start, end, min, sum;
+  nk_fiber_t **kids;
+
+  for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+    n = sizes[s];
+    kids = malloc(sizeof(nk_fiber_t*)*n);
+    if (!kids) {
+      nk_vc_printf("fiber_bench_root() : Failed to allocate\n");
+      return;
+    }
+    min = -1;
+    sum = 0;
+    // first trial warms the fiber pools and is not counted
+    for (t = 0; t <= BENCH_TRIALS; t++) {
+      bench_count = 0;
+      start = rdtsc();
+      for (j = 0; j < n; j++) {
+        if (nk_fiber_start(fiber_bench_child, 0, 0, 0, F_CURR_CPU, &kids[j]) < 0) {
+          nk_vc_printf("fiber_bench_root() : Fiber failed to start\n");
+          free(kids);
+          return;
+        }
+      }
+      for (j = 0; j < n; j++) {
+        nk_fiber_join(kids[j]);
+      }
+      end = rdtsc();
+      if (bench_count != n) {
+        nk_vc_printf("fiber_bench_root() : only %lu of %lu children ran\n", bench_count, n);
+      }
+      if (t) {
+        sum += end - start;
+        if (end - start < min) {
+          min = end - start;
+        }
+      }
+    }
+    nk_vc_printf("fiberbench: fan-out %4lu : %lu cycles/fiber avg, %lu cycles/fiber min (spawn+join)\n",
+                 n, sum/(BENCH_TRIALS*n), min/n);
+    free(kids);
+  }
+}
+
+/* A lone fiber yielding in a loop passes through the idle fiber on
+   every yield, which must not put the fiber thread to sleep */
+#define LONE_YIELDS 1000
+
+static volatile uint64_t lone_count;
+
+void fiber_lone_yield(void *i, void **o)
+{
+  int a;
+  for (a = 0; a < LONE_YIELDS; a++) {
+    lone_count++;
+    nk_fiber_yield();
+  }
+}
+
 
 /******************* Test Wrappers *******************/
 
@@ -595,7 +667,41 @@ int test_fiber_lower(){
   nk_fiber_start(first_lower, 0, 0, 0, F_CURR_CPU, &first_l);
   return 0;
 }
+
+int test_fiber_bench()
+{
+  nk_fiber_t *root;
+  vc = get_cur_thread()->vc;
+  if (nk_fiber_start(fiber_bench_root, 0, 0, 0, F_CURR_CPU, &root) < 0) {
+    nk_vc_printf("test_fiber_bench() : Fiber failed to start\n");
+    return -1;
+  }
+  return 0;
+}
     
+int test_fiber_lone_yield()
+{
+  nk_fiber_t *lone;
+  uint64_t start;
+
+  lone_count = 0;
+  if (nk_fiber_start(fiber_lone_yield, 0, 0, 0, F_CURR_CPU, &lone) < 0) {
+    nk_vc_printf("test_fiber_lone_yield() : Fiber failed to start\n");
+    return -1;
+  }
+
+  // give it a second, which is far more than it needs
+  start = nk_sched_get_realtime();
+  while (lone_count < LONE_YIELDS && nk_sched_get_realtime() - start < 1000000000ULL) {
+    nk_yield();
+  }
+
+  nk_vc_printf("fiberlone: %lu of %d yields %s\n", lone_count, LONE_YIELDS,
+               lone_count == LONE_YIELDS ? "PASSED" : "FAILED (fiber stalled)");
+
+  return lone_count == LONE_YIELDS ? 0 : -1;
+}
+
 int test_new_yield(){
   nk_fiber_t *one;
   nk_fiber_t *two;
@@ -748,6 +854,16 @@ static int handle_fibers12 (char *buf, void *priv)
   return 0;
 }
 
+static int handle_fibers13 (char *buf, void *priv)
+{
+  test_fiber_bench();
+  return 0;
+}
+
+static int handle_fibers14 (char *buf, void *priv)
+{
+  return test_fiber_lone_yield();
+}
   
 /******************* Shell Structs ********************/
 
@@ -841,6 +957,18 @@ static struct shell_cmd_impl fibers_impl_new_yield = {
   .handler  = handle_fibers12,
 };
 
+static struct shell_cmd_impl fibers_impl_bench = {
+  .cmd      = "fiberbench",
+  .help_str = "fiberbench (fan-out spawn+join cost)",
+  .handler  = handle_fibers13,
+};
+
+static struct shell_cmd_impl fibers_impl_lone = {
+  .cmd      = "fiberlone",
+  .help_str = "fiberlone (lone fiber yielding in a loop)",
+  .handler  = handle_fibers14,
+};
+
 /******************* Shell Commands *******************/
 
 nk_register_shell_cmd(fibers_impl1);
@@ -858,3 +986,5 @@ nk_register_shell_cmd(fibers_impl_all);
 nk_register_shell_cmd(fibers_impl_all_1);
 nk_register_shell_cmd(fibers_impl_all_2);
 nk_register_shell_cmd(fibers_impl_new_yield);
+nk_register_shell_cmd(fibers_impl_bench);
+nk_register_shell_cmd(fibers_impl_lone);
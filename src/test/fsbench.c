@@ -0,0 +1,149 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/fs.h>
+#include <nautilus/blkcache.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// fsbench path opens [chunk]
+//
+// Opens and closes path the given number of times, reporting the
+// time per open and, with the block cache, how many blocks the opens
+// looked up (none, once the filesystem's own caches are warm).   Then
+// reads the whole file sequentially, chunk bytes (default 1 MB) per
+// read, and reports the bandwidth.   Finally, if the file can be
+// accessed in place (nk_fs_map), reports how many extents it maps to.
+//
+
+#define FSBENCH_EXTENTS 16
+
+#define FSBENCH_MAX_CHUNK (64*1024*1024)
+
+static int
+handle_fsbench (char * buf, void * priv)
+{
+    char path[256];
+    uint64_t opens, chunk = 1024*1024;
+    uint64_t i, start, end, bytes = 0;
+    ssize_t n;
+    uint64_t extents = 0;
+    struct nk_fs_extent ext[FSBENCH_EXTENTS];
+    nk_fs_fd_t fd;
+    uint8_t *data;
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    struct nk_block_cache_stats before, after;
+#endif
+
+    if (sscanf(buf,"fsbench %255s %lu %lu",path,&opens,&chunk)<2 ||
+	!opens || !chunk || chunk>FSBENCH_MAX_CHUNK) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    nk_block_cache_get_stats(&before);
+#endif
+    start = nk_sched_get_realtime();
+
+    for (i=0;i<opens;i++) {
+	fd = nk_fs_open(path,O_RDONLY,0);
+	if (FS_FD_ERR(fd)) {
+	    nk_vc_printf("Can't open %s\n",path);
+	    return -1;
+	}
+	nk_fs_close(fd);
+    }
+
+    end = nk_sched_get_realtime();
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    nk_block_cache_get_stats(&after);
+#endif
+
+    nk_vc_printf("%s: %lu opens in %lu ns (%lu ns/open)\n", path, opens, end-start, (end-start)/opens);
+#ifdef NAUT_CONFIG_BLOCK_CACHE
+    nk_vc_printf("block lookups during opens: %lu\n",
+		 (after.hits+after.misses)-(before.hits+before.misses));
+#endif
+
+    if (!(data = malloc(chunk))) {
+	nk_vc_printf("Can't allocate buffer\n");
+	return -1;
+    }
+
+    fd = nk_fs_open(path,O_RDONLY,0);
+    if (FS_FD_ERR(fd)) {
+	nk_vc_printf("Can't open %s\n",path);
+	free(data);
+	return -1;
+    }
+
+    start = nk_sched_get_realtime();
+
+    while ((n = nk_fs_read(fd,data,chunk)) > 0) {
+	bytes += n;
+    }
+
+    end = nk_sched_get_realtime();
+
+    free(data);
+
+    if (n < 0) {
+	nk_vc_printf("Read failed after %lu bytes\n",bytes);
+	nk_fs_close(fd);
+	return -1;
+    }
+
+    nk_vc_printf("%s: read %lu bytes in %lu ns (%lu MB/s)\n", path, bytes, end-start,
+		 end>start ? bytes*1000/(end-start) : 0);
+
+    start = nk_sched_get_realtime();
+
+    for (bytes=0; (n = nk_fs_map(fd,bytes,-1UL,ext,FSBENCH_EXTENTS)) > 0; extents += n) {
+	for (i=0;i<(uint64_t)n;i++) {
+	    bytes += ext[i].len;
+	}
+    }
+
+    end = nk_sched_get_realtime();
+
+    nk_fs_close(fd);
+
+    if (n < 0) {
+	nk_vc_printf("%s: cannot be accessed in place\n", path);
+    } else {
+	nk_vc_printf("%s: mapped %lu bytes as %lu extents in %lu ns\n", path, bytes, extents, end-start);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl fsbench_impl = {
+    .cmd      = "fsbench",
+    .help_str = "fsbench path opens [chunk]",
+    .handler  = handle_fsbench,
+};
+nk_register_shell_cmd(fsbench_impl);
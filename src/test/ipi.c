@@ -884,3 +884,77 @@ static struct nk_test_impl ipitest_test_impl = {
 };
 
 nk_register_test(ipitest_test_impl);
+
+
+//
+// xcall costs: one waited xcall per cpu in turn versus a single
+// waited broadcast, and a burst of unwaited xcalls to one cpu
+// that are all outstanding at once
+//
+#define XCALL_BURST 64
+
+static void xcall_nop (void * arg)
+{
+    __sync_fetch_and_add((volatile uint64_t *)arg, 1);
+}
+
+static int
+handle_xcalltest (char * buf, void * priv)
+{
+    uint32_t trials = 100, t, i;
+    uint32_t num_cpus = nk_get_num_cpus();
+    volatile uint64_t count = 0;
+    uint64_t start, end;
+    uint64_t serial = 0, bcast = 0, burst = 0;
+    cpu_id_t target;
+
+    sscanf(buf, "xcalltest %u", &trials);
+
+    if (num_cpus < 2 || !trials) {
+        nk_vc_printf("Need at least two cpus and one trial\n");
+        return 0;
+    }
+
+    for (t = 0; t < trials; t++) {
+
+        rdtscll(start);
+        for (i = 0; i < num_cpus; i++) {
+            if (i != my_cpu_id()) {
+                smp_xcall(i, xcall_nop, (void*)&count, 1);
+            }
+        }
+        rdtscll(end);
+        serial += end - start;
+
+        rdtscll(start);
+        smp_xcall_broadcast(xcall_nop, (void*)&count, 1);
+        rdtscll(end);
+        bcast += end - start;
+
+        target = my_cpu_id() ? 0 : 1;
+        rdtscll(start);
+        for (i = 0; i < XCALL_BURST - 1; i++) {
+            smp_xcall(target, xcall_nop, (void*)&count, 0);
+        }
+        // the ring is in order, so this completes last
+        smp_xcall(target, xcall_nop, (void*)&count, 1);
+        rdtscll(end);
+        burst += end - start;
+    }
+
+    nk_vc_printf("xcall to %u cpus, %u trials (cycles)\n", num_cpus - 1, trials);
+    nk_vc_printf("  serial unicast wait: %lu\n", serial / trials);
+    nk_vc_printf("  broadcast wait:      %lu\n", bcast / trials);
+    nk_vc_printf("  burst of %u to one:  %lu (%lu per call)\n",
+                 XCALL_BURST, burst / trials, burst / trials / XCALL_BURST);
+    nk_vc_printf("  calls completed:     %lu\n", count);
+
+    return 0;
+}
+
+static struct shell_cmd_impl xcalltest_impl = {
+    .cmd      = "xcalltest",
+    .help_str = "xcalltest [trials]",
+    .handler  = handle_xcalltest,
+};
+nk_register_shell_cmd(xcalltest_impl);
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/numa.h>
+#include <nautilus/mm.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// kmemaff [size]
+//
+// Checks that an allocation made for another cpu comes from a zone
+// in that cpu's closest domain, even when the calling cpu has
+// cached blocks of the same size that it could hand out instead.
+//
+
+#define KMEMAFF_DEFAULT_SIZE 64
+
+static struct mem_region *closest_zone(int cpu)
+{
+    struct kmem_data *k = &(nk_get_nautilus_info()->sys.cpus[cpu]->kmem);
+    struct mem_reg_entry *e;
+
+    if (list_empty(&k->ordered_regions)) {
+	return 0;
+    }
+
+    e = list_first_entry(&k->ordered_regions, struct mem_reg_entry, mem_ent);
+
+    return e->mem;
+}
+
+static int handle_kmemaff(char *buf, void *priv)
+{
+    uint64_t size = KMEMAFF_DEFAULT_SIZE;
+    int cpu, num_cpus = nk_get_num_cpus();
+    int bad = 0, remote = 0;
+    struct mem_region *want, *got;
+    void *p;
+
+    sscanf(buf,"kmemaff %lu",&size);
+
+    for (cpu=0;cpu<num_cpus;cpu++) {
+	// leave a block of this size in the caller's cache
+	p = malloc(size);
+	free(p);
+
+	if (!(p = malloc_specific(size,cpu))) {
+	    nk_vc_printf("cpu %d: allocation failed\n",cpu);
+	    bad++;
+	    continue;
+	}
+
+	want = closest_zone(cpu);
+	got = kmem_get_region_by_addr((addr_t)p);
+
+	if (!want || !got || got->domain_id != want->domain_id) {
+	    nk_vc_printf("cpu %d: block %p from domain %d instead of domain %d\n",
+			 cpu, p, got ? (int)got->domain_id : -1, want ? (int)want->domain_id : -1);
+	    bad++;
+	}
+
+	if (want && closest_zone(my_cpu_id()) &&
+	    want->domain_id != closest_zone(my_cpu_id())->domain_id) {
+	    remote++;
+	}
+
+	free(p);
+    }
+
+    nk_vc_printf("kmemaff %lu: %d cpus (%d in other domains) %s\n",
+		 size, num_cpus, remote, bad ? "FAILED" : "PASSED");
+
+    return bad ? -1 : 0;
+}
+
+static struct shell_cmd_impl kmemaff_impl = {
+    .cmd      = "kmemaff",
+    .help_str = "kmemaff [size]",
+    .handler  = handle_kmemaff,
+};
+nk_register_shell_cmd(kmemaff_impl);
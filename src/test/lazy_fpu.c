@@ -185,7 +185,7 @@ void test_X87(float *result, float *inp1, float *inp2, int number_of_elements) {
 #endif
 }
 
-int benchmark(char *name, void (*test)(float *, float *, float *, int),
+static int benchmark(char *name, void (*test)(float *, float *, float *, int),
   int array_length) {
   float *input1 = malloc(array_length * sizeof(float));
   float *input2 = malloc(array_length * sizeof(float));
@@ -202,7 +202,7 @@ int benchmark(char *name, void (*test)(float *, float *, float *, int),
   return failed;
 }
 
-int parse_args(char *buf) {
+static int parse_args(char *buf) {
   // DEFAULT
   int time_sec = 5;
 
@@ -0,0 +1,290 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/netdev.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// udpblast nic dstip count [size [burst [threads]]]
+//
+// Sends count UDP datagrams of the given payload size to dstip:9
+// (discard) from each of threads threads, the i-th bound to cpu i,
+// handing the NIC burst frames at a time.  Frames are broadcast at
+// the ethernet level, so no ARP is needed.   Reports packets per
+// second.  With a multiqueue NIC, each thread gets its own queue.
+//
+
+#define BLAST_SRC_IP    0x0a0a0a03   // 10.10.10.3, as in udpecho
+#define BLAST_SRC_PORT  5001
+#define BLAST_DST_PORT  9
+#define BLAST_MAX_BURST 256
+#define BLAST_MAX_SIZE  1472         // largest payload in one frame
+
+#define HDR_LEN (14+20+8)
+
+struct blast {
+    struct nk_net_dev *dev;
+    uint8_t            mac[ETHER_MAC_LEN];
+    uint32_t           dst_ip;
+    uint64_t           count;
+    uint64_t           size;
+    uint64_t           burst;
+
+    // per-thread results
+    uint64_t           sent;
+    uint64_t           ns;
+    int                failed;
+};
+
+struct frame {
+    uint8_t           data[HDR_LEN+BLAST_MAX_SIZE];
+    volatile int      busy;
+    volatile uint64_t *done;
+};
+
+static inline uint16_t be16(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint32_t be32(uint32_t x) { return __builtin_bswap32(x); }
+
+static uint16_t ip_checksum(uint8_t *p, uint32_t len)
+{
+    uint32_t sum = 0;
+    uint32_t i;
+
+    for (i=0;i+1<len;i+=2) {
+	sum += ((uint32_t)p[i] << 8) | p[i+1];
+    }
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return be16(~sum & 0xffff);
+}
+
+static void build_frame(struct blast *b, uint8_t *f, uint16_t id)
+{
+    uint16_t iplen = 20 + 8 + b->size;
+
+    // ethernet
+    memset(f,0xff,6);
+    memcpy(f+6,b->mac,6);
+    *(uint16_t*)(f+12) = be16(0x0800);
+
+    // ipv4, no options, don't fragment, no checksum offload
+    uint8_t *ip = f+14;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    *(uint16_t*)(ip+2) = be16(iplen);
+    *(uint16_t*)(ip+4) = be16(id);
+    *(uint16_t*)(ip+6) = be16(0x4000);
+    ip[8] = 64;
+    ip[9] = 0x11;
+    *(uint16_t*)(ip+10) = 0;
+    *(uint32_t*)(ip+12) = be32(BLAST_SRC_IP);
+    *(uint32_t*)(ip+16) = be32(b->dst_ip);
+    *(uint16_t*)(ip+10) = ip_checksum(ip,20);
+
+    // udp, checksum zero (none)
+    uint8_t *udp = ip+20;
+    *(uint16_t*)(udp+0) = be16(BLAST_SRC_PORT);
+    *(uint16_t*)(udp+2) = be16(BLAST_DST_PORT);
+    *(uint16_t*)(udp+4) = be16(8+b->size);
+    *(uint16_t*)(udp+6) = 0;
+
+    memset(udp+8,0xa5,b->size);
+}
+
+static void sent(nk_net_dev_status_t status, void *context)
+{
+    struct frame *f = (struct frame *)context;
+
+    __sync_fetch_and_add(f->done,1);
+    f->busy = 0;
+}
+
+static void blaster(void *in, void **out)
+{
+    struct blast *b = (struct blast *)in;
+    struct nk_net_dev_burst burst[BLAST_MAX_BURST];
+    struct frame *frames;
+    volatile uint64_t done = 0;
+    uint64_t posted = 0, start, end, i, n;
+    int rc;
+
+    if (!(frames = malloc(sizeof(struct frame)*b->burst))) {
+	nk_vc_printf("Cannot allocate frames\n");
+	b->failed = 1;
+	return;
+    }
+
+    for (i=0;i<b->burst;i++) {
+	build_frame(b,frames[i].data,i);
+	frames[i].busy = 0;
+	frames[i].done = &done;
+    }
+
+    start = nk_sched_get_realtime();
+
+    while (posted < b->count) {
+	// gather whatever frames the NIC has given back
+	for (i=0, n=0; i<b->burst && posted+n<b->count; i++) {
+	    if (!frames[i].busy) {
+		frames[i].busy = 1;
+		burst[n].buf = frames[i].data;
+		burst[n].len = HDR_LEN + b->size;
+		burst[n].callback = sent;
+		burst[n].context = &frames[i];
+		n++;
+	    }
+	}
+
+	rc = n ? nk_net_dev_send_burst(b->dev,burst,n) : 0;
+
+	if (rc < 0) {
+	    nk_vc_printf("Send failed\n");
+	    b->failed = 1;
+	    rc = 0;
+	}
+
+	// hand back what the NIC did not take
+	for (i=rc;i<n;i++) {
+	    ((struct frame *)burst[i].context)->busy = 0;
+	}
+
+	posted += rc;
+
+	if (b->failed) {
+	    break;
+	}
+
+	if ((uint64_t)rc < n || !n) {
+	    nk_yield();
+	}
+    }
+
+    while (done < posted) {
+	nk_yield();
+    }
+
+    end = nk_sched_get_realtime();
+
+    b->sent = posted;
+    b->ns = end - start;
+
+    free(frames);
+}
+
+static int
+handle_udpblast (char * buf, void * priv)
+{
+    char name[32];
+    uint32_t ip[4];
+    uint64_t count, size = 18, burst = 32, threads = 1;
+    uint64_t i, total = 0, ns = 0;
+    struct nk_net_dev *dev;
+    struct nk_net_dev_characteristics c;
+    struct blast *b;
+    nk_thread_id_t *tids;
+
+    if (sscanf(buf,"udpblast %31s %u.%u.%u.%u %lu %lu %lu %lu",name,
+	       &ip[0],&ip[1],&ip[2],&ip[3],&count,&size,&burst,&threads)<6 ||
+	ip[0]>255 || ip[1]>255 || ip[2]>255 || ip[3]>255 ||
+	size>BLAST_MAX_SIZE || !burst || burst>BLAST_MAX_BURST ||
+	!threads || threads>nk_get_num_cpus()) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (!(dev=nk_net_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (nk_net_dev_get_characteristics(dev,&c)) {
+	nk_vc_printf("Can't get characteristics of %s\n",name);
+	return -1;
+    }
+
+    // ethernet minimum frame, less the CRC the NIC adds
+    if (HDR_LEN + size < 60) {
+	size = 60 - HDR_LEN;
+    }
+
+    b = malloc(sizeof(struct blast)*threads);
+    tids = malloc(sizeof(nk_thread_id_t)*threads);
+
+    if (!b || !tids) {
+	nk_vc_printf("Can't allocate state\n");
+	free(b);
+	free(tids);
+	return -1;
+    }
+
+    memset(b,0,sizeof(struct blast)*threads);
+
+    for (i=0;i<threads;i++) {
+	b[i].dev = dev;
+	memcpy(b[i].mac,c.mac,ETHER_MAC_LEN);
+	b[i].dst_ip = (ip[0]<<24) | (ip[1]<<16) | (ip[2]<<8) | ip[3];
+	b[i].count = count;
+	b[i].size = size;
+	b[i].burst = burst;
+	if (nk_thread_start(blaster, &b[i], 0, 0, TSTACK_DEFAULT, &tids[i], i)) {
+	    nk_vc_printf("Can't start blaster on cpu %lu\n",i);
+	    threads = i;
+	    break;
+	}
+    }
+
+    for (i=0;i<threads;i++) {
+	nk_join(tids[i],0);
+	if (b[i].failed) {
+	    nk_vc_printf("cpu %lu: failed after %lu packets\n",i,b[i].sent);
+	}
+	nk_vc_printf("cpu %lu: %lu packets in %lu ns (%lu pps)\n", i,
+		     b[i].sent, b[i].ns, b[i].ns ? b[i].sent*1000000000ULL/b[i].ns : 0);
+	total += b[i].sent;
+	if (b[i].ns > ns) {
+	    ns = b[i].ns;
+	}
+    }
+
+    nk_vc_printf("%s: %lu packets of %lu bytes in %lu ns: %lu pps, %lu Mbit/s\n",
+		 name, total, HDR_LEN+size, ns,
+		 ns ? total*1000000000ULL/ns : 0,
+		 ns ? total*(HDR_LEN+size)*8*1000/ns : 0);
+
+    free(b);
+    free(tids);
+
+    return 0;
+}
+
+static struct shell_cmd_impl udpblast_impl = {
+    .cmd      = "udpblast",
+    .help_str = "udpblast nic dstip count [size [burst [threads]]]",
+    .handler  = handle_udpblast,
+};
+nk_register_shell_cmd(udpblast_impl);
@@ -327,7 +327,9 @@ void benchmark(char *name, void (*test)(void))
 // For the Cray compiler on HECToR we need to turn off optimisation 
 // for the delay and array_delay functions. Other compilers should
 // not be afffected. 
+#ifdef _CRAYC
 #pragma _CRI noopt
+#endif
 void delay(int delaylength) {
 
     int i;
@@ -351,7 +353,9 @@ void array_delay(int delaylength, double a[1]) {
 
 }
 // Re-enable optimisation for remainder of source. 
+#ifdef _CRAYC
 #pragma _CRI opt
+#endif
 
 double getclock() {
     double time;
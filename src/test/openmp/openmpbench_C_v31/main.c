@@ -19,21 +19,16 @@ int test_ompbench()
 
     args[1] = 0;
 
-#if 0
     args[0]="arraybench";
     arraybench_main(1, args);
-#endif
 
     args[0]="taskbench";
     taskbench_main(1, args);
 
-
-#if 0
     args[0]="schedbench";
     schedbench_main(1, args);
     args[0]="syncbench";
     syncbench_main(1, args);
-#endif
 
     nk_openmp_thread_deinit();
 
@@ -0,0 +1,101 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/libccompat.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// stdiobench path [bufsize]
+//
+// Counts the lines of a file with fgets, first through a fully
+// buffered stream (with the given buffer size, default 4096), and
+// then through an unbuffered one, and reports the throughput of each.
+//
+
+#define MAX_LINE 1024
+
+static int count_lines(char *path, int mode, size_t bufsize, const char *what)
+{
+    char line[MAX_LINE];
+    uint64_t lines = 0, bytes = 0, start, end;
+    FILE *f;
+
+    if (!(f = fopen(path,(FILE*)"r"))) {
+	nk_vc_printf("Can't open %s\n",path);
+	return -1;
+    }
+
+    if (setvbuf(f,0,mode,bufsize)) {
+	nk_vc_printf("Can't set buffering\n");
+	fclose(f);
+	return -1;
+    }
+
+    start = nk_sched_get_realtime();
+    while (fgets(line,MAX_LINE,f)) {
+	bytes += strlen(line);
+	lines++;
+    }
+    end = nk_sched_get_realtime();
+
+    if (ferror(f)) {
+	nk_vc_printf("Error reading %s\n",path);
+    }
+
+    fclose(f);
+
+    nk_vc_printf("%s: %lu lines, %lu bytes in %lu ns (%lu MB/s)\n",
+		 what, lines, bytes, end-start,
+		 end>start ? bytes*1000/(end-start) : 0);
+
+    return 0;
+}
+
+static int
+handle_stdiobench (char * buf, void * priv)
+{
+    char path[80];
+    uint64_t bufsize = 4096;
+
+    if (sscanf(buf,"stdiobench %79s %lu",path,&bufsize)<1 || !bufsize) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (count_lines(path,_IOFBF,bufsize,"buffered") ||
+	count_lines(path,_IONBF,0,"unbuffered")) {
+	return -1;
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl stdiobench_impl = {
+    .cmd      = "stdiobench",
+    .help_str = "stdiobench path [bufsize]",
+    .handler  = handle_stdiobench,
+};
+nk_register_shell_cmd(stdiobench_impl);
@@ -189,6 +189,106 @@ int test_tasks()
 }
 
 
+#define BENCH_TASKS  4096
+#define BENCH_PASSES 8
+#define BENCH_DEPTH  12
+
+static void *bench_nop(void *in)
+{
+    return in;
+}
+
+static void *bench_tree(void *in)
+{
+    uint64_t depth = (uint64_t) in;
+    struct nk_task *left, *right;
+
+    if (depth==BENCH_DEPTH) {
+	return 0;
+    }
+
+    left = nk_task_produce(-1, 0, bench_tree, (void*)(depth+1), 0);
+    right = nk_task_produce(-1, 0, bench_tree, (void*)(depth+1), 0);
+
+    if (left) {
+	nk_task_wait(left,0,0);
+    }
+    if (right) {
+	nk_task_wait(right,0,0);
+    }
+
+    return 0;
+}
+
+// throughput and latency of the task system
+//   - produce a batch of tasks from this cpu and wait for all of them
+//   - produce and wait on a single task at a time
+//   - a binary fork/join tree that depends on stealing to spread out
+static int bench_tasks()
+{
+    int i,j;
+    uint64_t start, end;
+    uint64_t queue_s=0;
+    struct nk_task_stats stats;
+
+    for (i=0;i<BENCH_PASSES;i++) {
+	start = nk_sched_get_realtime();
+	for (j=0;j<BENCH_TASKS;j++) {
+	    if (!(tasks[j % NUM_TASKS] = nk_task_produce(-1,0,bench_nop,0,0))) {
+		nk_vc_printf("Failed to launch task %d\n", j);
+		return -1;
+	    }
+	    if ((j % NUM_TASKS) == NUM_TASKS-1) {
+		int k;
+		for (k=0;k<NUM_TASKS;k++) {
+		    nk_task_wait(tasks[k],0,&stats);
+		    queue_s += stats.dequeue_time_ns - stats.enqueue_time_ns;
+		}
+	    }
+	}
+	end = nk_sched_get_realtime();
+	nk_vc_printf("taskbench batch pass %d: %lu tasks in %lu ns (%lu ns/task, queue avg %lu ns)\n",
+		     i, BENCH_TASKS, end-start, (end-start)/BENCH_TASKS, queue_s/BENCH_TASKS);
+	queue_s = 0;
+    }
+
+    start = nk_sched_get_realtime();
+    for (j=0;j<BENCH_TASKS;j++) {
+	struct nk_task *t = nk_task_produce(-1,0,bench_nop,0,0);
+	if (!t) {
+	    nk_vc_printf("Failed to launch task %d\n", j);
+	    return -1;
+	}
+	nk_task_wait(t,0,0);
+    }
+    end = nk_sched_get_realtime();
+    nk_vc_printf("taskbench round trip: %lu ns/task\n", (end-start)/BENCH_TASKS);
+
+    for (i=0;i<BENCH_PASSES;i++) {
+	start = nk_sched_get_realtime();
+	bench_tree(0);
+	end = nk_sched_get_realtime();
+	nk_vc_printf("taskbench fork/join tree pass %d: %lu tasks in %lu ns\n",
+		     i, (2UL<<BENCH_DEPTH)-2, end-start);
+    }
+
+    return 0;
+}
+
+static int
+handle_taskbench (char * buf, void * priv)
+{
+    return bench_tasks();
+}
+
+static struct shell_cmd_impl taskbench_impl = {
+    .cmd      = "taskbench",
+    .help_str = "taskbench",
+    .handler  = handle_taskbench,
+};
+nk_register_shell_cmd(taskbench_impl);
+
+
 static int
 handle_tasks (char * buf, void * priv)
 {